@@ -1,5 +1,7 @@
 ﻿#include "includes.h"
 #include "Commands.h"
+#include <fcntl.h>
+#include <io.h>
 
 
 /*
@@ -29,10 +31,28 @@ PrintHelp()
     printf("\t> login <username> <password>\r\n");
     printf("\t> logout\r\n");
     printf("\t> store <source file path> <submission name>\r\n");
+    printf("\t> store - <submission name>   (the lines that follow, up to the end of the input)\r\n");
     printf("\t> retrieve <submission name> <destination file path>\r\n");
+    printf("\t> watch <directory path> <submission prefix>   (stores changed files in the background)\r\n");
+    printf("\t> unwatch\r\n");
     printf("\t> exit\r\n");
 }
 
+static BOOLEAN
+ReadStandardInput(
+    void* Context,
+    void* Buffer,
+    uint32_t Length,
+    uint32_t* BytesRead
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    // Through the C runtime, so that input scanf has already buffered is not lost
+    *BytesRead = (uint32_t)fread(Buffer, 1, Length, stdin);
+    return *BytesRead > 0 || !ferror(stdin);
+}
+
 int CDECL
 main()
 {
@@ -51,7 +71,11 @@ main()
     do
     {
         printf("Enter your command: \r\n");
-        scanf("%s", command);
+        if (scanf("%s", command) != 1)
+        {
+            // End of the input, e.g. of a script piped in
+            break;
+        }
 
         if (memcmp(command, "register", sizeof("register")) == 0)
         {
@@ -80,7 +104,28 @@ main()
             scanf("%s", arg2);    // submission name
 
             printf("store with source file path [%s] submission name [%s] \r\n", arg1, arg2);
-            SafeStorageHandleStore(arg2, (uint16_t)strlen(arg2), arg1, (uint16_t)strlen(arg1));
+            if (strcmp(arg1, "-") == 0)
+            {
+                // The data starts on the line after the command and is read unmodified until the end of the input
+                int c = 0;
+                while ((c = getchar()) != EOF && c != '\n')
+                {
+                }
+
+                int mode = _setmode(_fileno(stdin), _O_BINARY);
+                SafeStorageHandleStoreStream(arg2, (uint16_t)strlen(arg2), ReadStandardInput, NULL);
+                if (mode != -1)
+                {
+                    _setmode(_fileno(stdin), mode);
+                }
+
+                // After Ctrl+Z the console can be read from again; a pipe stays at its end and the loop exits
+                clearerr(stdin);
+            }
+            else
+            {
+                SafeStorageHandleStore(arg2, (uint16_t)strlen(arg2), arg1, (uint16_t)strlen(arg1));
+            }
         }
         else if (memcmp(command, "retrieve", sizeof("retrieve")) == 0)
         {
@@ -90,6 +135,19 @@ main()
             printf("retrieve with submission name [%s] destination file path [%s] \r\n", arg1, arg2);
             SafeStorageHandleRetrieve(arg1, (uint16_t)strlen(arg1), arg2, (uint16_t)strlen(arg2));
         }
+        else if (memcmp(command, "watch", sizeof("watch")) == 0)
+        {
+            scanf("%s", arg1);    // directory path
+            scanf("%s", arg2);    // submission prefix
+
+            printf("watch with directory path [%s] submission prefix [%s] \r\n", arg1, arg2);
+            SafeStorageStartWatch(arg2, (uint16_t)strlen(arg2), arg1, (uint16_t)strlen(arg1), 0);
+        }
+        else if (memcmp(command, "unwatch", sizeof("unwatch")) == 0)
+        {
+            printf("unwatch \r\n");
+            SafeStorageStopWatch();
+        }
         else if (memcmp(command, "exit", sizeof("exit")) == 0)
         {
             printf("Bye Bye! \r\n");
@@ -0,0 +1,271 @@
+#include "includes.h"
+#include "ThreadPool.h"
+
+
+/*
+ * @brief       Micro-benchmarks of the SafeStorageLib work-stealing pool.
+ *
+ *              Usage: SafeStorageBenchmarks.exe [worker count] [pin]
+ *
+ *              - task throughput: empty range tasks, split by the pool, and single tasks submitted one by one
+ *              - steal latency: time until a task queued by a busy worker is picked up by another thread
+ *              - uneven load: a parallel loop where a few iterations are much more expensive than the rest
+ */
+
+
+#define THROUGHPUT_RANGE_TASKS 10000000ULL
+#define THROUGHPUT_SINGLE_TASKS 1000000ULL
+#define STEAL_PROBES 1000
+#define STEAL_TIMEOUT_US 10000
+#define UNEVEN_ITERATIONS 4096
+#define UNEVEN_HEAVY_EVERY 64
+#define UNEVEN_HEAVY_US 2000
+#define UNEVEN_LIGHT_US 10
+
+
+typedef struct _STEAL_PROBE
+{
+    POOL_GROUP* Group;
+    volatile LONG ParentRunning;
+    LARGE_INTEGER Queued;
+    volatile LONG64 Started;                    // Counter value when the queued task started; 0 until then
+} STEAL_PROBE;
+
+
+static LARGE_INTEGER g_Frequency;
+
+
+static double
+MicrosecondsBetween(
+    _In_ LONGLONG Start,
+    _In_ LONGLONG End
+)
+{
+    return (double)(End - Start) * 1000000.0 / (double)g_Frequency.QuadPart;
+}
+
+
+static void
+Spin(
+    _In_ DWORD Microseconds
+)
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&start);
+    do
+    {
+        YieldProcessor();
+        QueryPerformanceCounter(&now);
+    } while (MicrosecondsBetween(start.QuadPart, now.QuadPart) < Microseconds);
+}
+
+
+static VOID
+CountTask(
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Index
+)
+{
+    UNREFERENCED_PARAMETER(Index);
+    InterlockedIncrement64((volatile LONG64*)Context);
+}
+
+
+static VOID
+EmptyTask(
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Index
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Index);
+}
+
+
+static VOID
+ProbeChild(
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Index
+)
+{
+    UNREFERENCED_PARAMETER(Index);
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    InterlockedExchange64(&((STEAL_PROBE*)Context)->Started, now.QuadPart);
+}
+
+
+static VOID
+ProbeParent(
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Index
+)
+{
+    UNREFERENCED_PARAMETER(Index);
+
+    STEAL_PROBE* probe = (STEAL_PROBE*)Context;
+    LARGE_INTEGER now;
+    InterlockedExchange(&probe->ParentRunning, TRUE);
+
+    // Queued on this worker's own deque; the worker stays busy, so another thread has to steal it
+    QueryPerformanceCounter(&probe->Queued);
+    PoolSubmit(probe->Group, ProbeChild, probe, 0, 1);
+
+    do
+    {
+        YieldProcessor();
+        QueryPerformanceCounter(&now);
+    } while (probe->Started == 0 && MicrosecondsBetween(probe->Queued.QuadPart, now.QuadPart) < STEAL_TIMEOUT_US);
+}
+
+
+static VOID
+UnevenTask(
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Index
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    Spin((Index % UNEVEN_HEAVY_EVERY == 0) ? UNEVEN_HEAVY_US : UNEVEN_LIGHT_US);
+}
+
+
+static int
+CompareDoubles(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    double left = *(const double*)Left;
+    double right = *(const double*)Right;
+    return (left > right) - (left < right);
+}
+
+
+static void
+BenchmarkThroughput()
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    volatile LONG64 counter = 0;
+
+    QueryPerformanceCounter(&start);
+    PoolParallelFor(CountTask, (PVOID)&counter, THROUGHPUT_RANGE_TASKS);
+    QueryPerformanceCounter(&end);
+
+    double seconds = MicrosecondsBetween(start.QuadPart, end.QuadPart) / 1000000.0;
+    printf("Range tasks:   %llu in %.3f s (%.1f M tasks/s)\r\n",
+           (uint64_t)counter, seconds, (double)counter / seconds / 1000000.0);
+
+    POOL_GROUP group = { 0 };
+    QueryPerformanceCounter(&start);
+    for (uint64_t i = 0; i < THROUGHPUT_SINGLE_TASKS; i++)
+    {
+        PoolSubmit(&group, EmptyTask, NULL, i, i + 1);
+    }
+    PoolWait(&group);
+    QueryPerformanceCounter(&end);
+
+    seconds = MicrosecondsBetween(start.QuadPart, end.QuadPart) / 1000000.0;
+    printf("Single tasks:  %llu in %.3f s (%.1f M tasks/s)\r\n",
+           THROUGHPUT_SINGLE_TASKS, seconds, (double)THROUGHPUT_SINGLE_TASKS / seconds / 1000000.0);
+}
+
+
+static void
+BenchmarkStealLatency()
+{
+    if (PoolGetWorkerCount() < 2)
+    {
+        printf("Steal latency: needs at least 2 workers\r\n");
+        return;
+    }
+
+    static double latencies[STEAL_PROBES];
+    DWORD stolen = 0;
+
+    for (DWORD i = 0; i < STEAL_PROBES; i++)
+    {
+        POOL_GROUP group = { 0 };
+        STEAL_PROBE probe = { 0 };
+        probe.Group = &group;
+
+        // Let a worker, not this thread, pick up the parent before helping in PoolWait
+        PoolSubmit(&group, ProbeParent, &probe, 0, 1);
+        while (!probe.ParentRunning)
+        {
+            YieldProcessor();
+        }
+        PoolWait(&group);
+
+        double latency = MicrosecondsBetween(probe.Queued.QuadPart, probe.Started);
+        if (latency < STEAL_TIMEOUT_US)
+        {
+            latencies[stolen++] = latency;
+        }
+    }
+
+    if (stolen == 0)
+    {
+        printf("Steal latency: no task was stolen within %u us\r\n", STEAL_TIMEOUT_US);
+        return;
+    }
+
+    qsort(latencies, stolen, sizeof(double), CompareDoubles);
+    printf("Steal latency: median %.1f us, p99 %.1f us, max %.1f us (%lu of %u stolen)\r\n",
+           latencies[stolen / 2], latencies[(stolen * 99) / 100], latencies[stolen - 1], stolen, STEAL_PROBES);
+}
+
+
+static void
+BenchmarkUnevenLoad()
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+
+    QueryPerformanceCounter(&start);
+    PoolParallelFor(UnevenTask, NULL, UNEVEN_ITERATIONS);
+    QueryPerformanceCounter(&end);
+
+    // The caller helps while it waits, hence one more thread than there are workers
+    uint64_t heavy = (UNEVEN_ITERATIONS + UNEVEN_HEAVY_EVERY - 1) / UNEVEN_HEAVY_EVERY;
+    double work = (double)(heavy * UNEVEN_HEAVY_US + (UNEVEN_ITERATIONS - heavy) * UNEVEN_LIGHT_US);
+    double ideal = work / (PoolGetWorkerCount() + 1);
+    double elapsed = MicrosecondsBetween(start.QuadPart, end.QuadPart);
+
+    printf("Uneven load:   %.1f ms (ideal %.1f ms, %.0f%% efficiency)\r\n",
+           elapsed / 1000.0, ideal / 1000.0, 100.0 * ideal / elapsed);
+}
+
+
+int CDECL
+main(
+    int argc,
+    char* argv[]
+)
+{
+    DWORD workerCount = (argc > 1) ? (DWORD)strtoul(argv[1], NULL, 10) : 0;
+    bool pinWorkers = (argc > 2) && (strcmp(argv[2], "pin") == 0);
+
+    QueryPerformanceFrequency(&g_Frequency);
+
+    if (!PoolInit(workerCount, pinWorkers))
+    {
+        return -1;
+    }
+    printf("Workers: %lu%s\r\n", PoolGetWorkerCount(), pinWorkers ? " (pinned)" : "");
+
+    BenchmarkThroughput();
+    BenchmarkStealLatency();
+    BenchmarkUnevenLoad();
+
+    POOL_STATS stats = { 0 };
+    PoolGetStats(&stats);
+    printf("Pool totals:   %llu tasks executed, %llu steals\r\n", stats.TasksExecuted, stats.Steals);
+
+    PoolDeinit();
+    return 0;
+}
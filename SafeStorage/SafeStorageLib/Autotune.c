@@ -0,0 +1,395 @@
+#include "Autotune.h"
+#include "FileIo.h"
+#include "IoBackend.h"
+#include "Transfer.h"
+#include <strsafe.h>
+
+
+#define AUTOTUNE_MOVE_COUNT 4                   // Neighbours of a setting: twice or half the span, twice or half the depth
+#define AUTOTUNE_VOLUME_CACHE_SIZE 16           // Volume serial numbers kept so that small transfers do not query them
+
+
+// Settings remembered for one pair of devices
+typedef struct _AUTOTUNE_ENTRY {
+    AUTOTUNE_KEY Key;
+    AUTOTUNE_SETTINGS Settings;
+    uint64_t BytesPerSecond;                    // Measured with Settings
+    uint64_t LastUsed;                          // g_AutotuneClock when the entry was last looked up
+} AUTOTUNE_ENTRY;
+
+
+// A volume mount point and its serial number
+typedef struct _AUTOTUNE_VOLUME {
+    char Path[MAX_PATH];
+    DWORD Serial;
+} AUTOTUNE_VOLUME;
+
+
+// Global static variables
+static SRWLOCK g_AutotuneLock = SRWLOCK_INIT;   // Guards everything below except the counters
+static char g_AutotuneAppDirectory[MAX_PATH] = { 0 };
+static AUTOTUNE_ENTRY g_AutotuneEntries[AUTOTUNE_MAX_DEVICES];
+static DWORD g_AutotuneCount = 0;
+static bool g_AutotuneLoaded = false;
+static uint64_t g_AutotuneClock = 0;
+static AUTOTUNE_SETTINGS g_AutotuneLastSettings = { 0 };
+static uint64_t g_AutotuneLastBytesPerSecond = 0;
+static AUTOTUNE_VOLUME g_AutotuneVolumes[AUTOTUNE_VOLUME_CACHE_SIZE];
+static DWORD g_AutotuneVolumeCount = 0;
+static volatile LONG g_AutotuneEnabled = TRUE;
+static volatile LONG64 g_AutotuneTunedTransfers = 0;
+static volatile LONG64 g_AutotuneProbeBatches = 0;
+
+
+/**
+ * @brief       Builds the path of the settings file.
+ */
+static bool AutotuneFilePath(_Out_writes_z_(MAX_PATH) char* path) {
+    return SUCCEEDED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", g_AutotuneAppDirectory, AUTOTUNE_FILE_NAME));
+}
+
+
+/**
+ * @brief       Returns the serial number of the volume a path is on, or 0 if it cannot be determined.
+ *              Called with the lock held exclusively.
+ */
+static DWORD VolumeSerialLocked(_In_z_ const char* path) {
+    char volume[MAX_PATH];
+    if (!GetVolumePathNameA(path, volume, MAX_PATH)) {
+        return 0;
+    }
+
+    for (DWORD i = 0; i < g_AutotuneVolumeCount; i++) {
+        if (_stricmp(g_AutotuneVolumes[i].Path, volume) == 0) {
+            return g_AutotuneVolumes[i].Serial;
+        }
+    }
+
+    DWORD serial = 0;
+    if (!GetVolumeInformationA(volume, NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+        return 0;
+    }
+
+    // Volumes are few; once the cache is full, new ones are simply queried every time
+    if (g_AutotuneVolumeCount < AUTOTUNE_VOLUME_CACHE_SIZE) {
+        StringCchCopyA(g_AutotuneVolumes[g_AutotuneVolumeCount].Path, MAX_PATH, volume);
+        g_AutotuneVolumes[g_AutotuneVolumeCount++].Serial = serial;
+    }
+    return serial;
+}
+
+
+/**
+ * @brief       Reads the settings file into the table, once. Lines that cannot be parsed are skipped.
+ *              Called with the lock held exclusively.
+ */
+static void LoadTableLocked(void) {
+    if (g_AutotuneLoaded) {
+        return;
+    }
+    g_AutotuneLoaded = true;
+
+    char path[MAX_PATH];
+    char* contents = NULL;
+    if (!AutotuneFilePath(path) || !IoReadFileContents(path, &contents, NULL)) {
+        return;
+    }
+
+    char* cursor = contents;
+    char* line = NULL;
+    while (g_AutotuneCount < AUTOTUNE_MAX_DEVICES && (line = IoTextNextLine(&cursor)) != NULL) {
+        AUTOTUNE_ENTRY entry = { 0 };
+        if (sscanf_s(line, "%15s %lx %lx %lu %lu %llu", entry.Key.Backend, (unsigned)sizeof(entry.Key.Backend),
+                     &entry.Key.SourceVolume, &entry.Key.DestinationVolume,
+                     &entry.Settings.SpanChunks, &entry.Settings.Depth, &entry.BytesPerSecond) == 6 &&
+            entry.Settings.SpanChunks > 0 && entry.Settings.SpanChunks <= AUTOTUNE_MAX_SPAN_CHUNKS &&
+            (entry.Settings.SpanChunks & (entry.Settings.SpanChunks - 1)) == 0 && entry.Settings.Depth > 0) {
+            g_AutotuneEntries[g_AutotuneCount++] = entry;
+        }
+    }
+
+    free(contents);
+}
+
+
+/**
+ * @brief       Replaces the settings file with the table. Called with the lock held.
+ */
+static void WriteTableLocked(void) {
+    char path[MAX_PATH];
+    char partialPath[MAX_PATH];
+    IO_TEXT text = { 0 };
+
+    if (!AutotuneFilePath(path) || FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", path, TRANSFER_PARTIAL_SUFFIX))) {
+        return;
+    }
+
+    bool result = true;
+    for (DWORD i = 0; result && i < g_AutotuneCount; i++) {
+        const AUTOTUNE_ENTRY* entry = &g_AutotuneEntries[i];
+        result = IoTextAppend(&text, "%s %08lx %08lx %lu %lu %llu\n", entry->Key.Backend,
+                              entry->Key.SourceVolume, entry->Key.DestinationVolume,
+                              entry->Settings.SpanChunks, entry->Settings.Depth, entry->BytesPerSecond);
+    }
+
+    // Only a hint for later transfers: losing it to a crash costs one probe, so it is not made durable
+    result = result && IoWriteFileContents(partialPath, text.Data, text.Length) && IoReplaceFile(partialPath, path);
+    if (!result) {
+        printf("Failed to remember the transfer settings: %lu\n", GetLastError());
+        IoDeleteFile(partialPath);
+    }
+    IoTextFree(&text);
+}
+
+
+/**
+ * @brief       Returns the entry of a pair of devices, or NULL if none is remembered. Called with the lock held.
+ */
+static AUTOTUNE_ENTRY* FindEntryLocked(_In_ const AUTOTUNE_KEY* key) {
+    for (DWORD i = 0; i < g_AutotuneCount; i++) {
+        if (memcmp(&g_AutotuneEntries[i].Key, key, sizeof(*key)) == 0) {
+            return &g_AutotuneEntries[i];
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief       Returns a neighbour of the best settings, or FALSE if the move leaves the allowed range.
+ */
+static bool Neighbour(_In_ const AUTOTUNE_SESSION* session, _In_ DWORD move, _Out_ AUTOTUNE_SETTINGS* settings) {
+    *settings = session->Best;
+    switch (move) {
+    case 0:
+        settings->SpanChunks *= 2;
+        break;
+    case 1:
+        settings->SpanChunks /= 2;
+        break;
+    case 2:
+        settings->Depth = min(settings->Depth * 2, session->MaxDepth);
+        break;
+    default:
+        settings->Depth /= 2;
+        break;
+    }
+
+    return settings->SpanChunks > 0 && settings->SpanChunks <= AUTOTUNE_MAX_SPAN_CHUNKS && settings->Depth > 0 &&
+           (settings->SpanChunks != session->Best.SpanChunks || settings->Depth != session->Best.Depth);
+}
+
+
+/**
+ * @brief       Sets the trial of the next probe batch: the next neighbour of the best settings that has not been
+ *              found slower. Ends probing once every neighbour has been.
+ */
+static void PickTrial(_Inout_ AUTOTUNE_SESSION* session) {
+    while (session->FailedMoves < AUTOTUNE_MOVE_COUNT) {
+        if (Neighbour(session, session->Move, &session->Trial)) {
+            return;
+        }
+        session->FailedMoves++;
+        session->Move = (session->Move + 1) % AUTOTUNE_MOVE_COUNT;
+    }
+
+    session->Probing = false;
+    session->Trial = session->Best;
+}
+
+
+VOID
+AutotuneInit(
+    _In_z_ const char* AppDirectory
+)
+{
+    AcquireSRWLockExclusive(&g_AutotuneLock);
+    StringCchCopyA(g_AutotuneAppDirectory, MAX_PATH, AppDirectory);
+    g_AutotuneCount = 0;
+    g_AutotuneLoaded = false;
+    ReleaseSRWLockExclusive(&g_AutotuneLock);
+}
+
+
+VOID
+AutotuneReset(
+    VOID
+)
+{
+    AcquireSRWLockExclusive(&g_AutotuneLock);
+    g_AutotuneCount = 0;
+    g_AutotuneLoaded = false;
+    ReleaseSRWLockExclusive(&g_AutotuneLock);
+}
+
+
+VOID
+AutotuneSetEnabled(
+    _In_ bool Enabled
+)
+{
+    InterlockedExchange(&g_AutotuneEnabled, Enabled ? TRUE : FALSE);
+}
+
+
+VOID
+AutotuneBegin(
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath,
+    _In_ uint64_t TransferSize,
+    _In_ DWORD MaxDepth,
+    _Out_ AUTOTUNE_SESSION* Session
+)
+{
+    memset(Session, 0, sizeof(*Session));
+    Session->MaxDepth = max(MaxDepth, 1);
+    Session->Best.SpanChunks = 1;
+    Session->Best.Depth = Session->MaxDepth;
+    Session->Trial = Session->Best;
+    if (!g_AutotuneEnabled) {
+        return;
+    }
+
+    StringCchCopyA(Session->Key.Backend, sizeof(Session->Key.Backend), IoGetBackend()->Name);
+
+    AcquireSRWLockExclusive(&g_AutotuneLock);
+    Session->Key.SourceVolume = VolumeSerialLocked(SourcePath);
+    Session->Key.DestinationVolume = VolumeSerialLocked(DestinationPath);
+
+    LoadTableLocked();
+    AUTOTUNE_ENTRY* entry = FindEntryLocked(&Session->Key);
+    if (entry != NULL) {
+        // The pool may have been resized since
+        Session->Best.SpanChunks = entry->Settings.SpanChunks;
+        Session->Best.Depth = min(entry->Settings.Depth, Session->MaxDepth);
+        entry->LastUsed = ++g_AutotuneClock;
+    }
+    ReleaseSRWLockExclusive(&g_AutotuneLock);
+
+    // Probing starts from the remembered settings, so they follow the device as its load changes
+    Session->Trial = Session->Best;
+    Session->Probing = TransferSize >= AUTOTUNE_MIN_PROBE_SIZE;
+    Session->ProbeBudget = TransferSize / AUTOTUNE_PROBE_FRACTION;
+}
+
+
+uint64_t
+AutotuneNextBatch(
+    _Inout_ AUTOTUNE_SESSION* Session,
+    _Out_ AUTOTUNE_SETTINGS* Settings
+)
+{
+    *Settings = Session->Trial;
+    if (!Session->Probing) {
+        return UINT64_MAX;
+    }
+
+    // Long enough for every lane to do a few I/Os, so that start-up costs do not decide
+    Session->BatchBytes = max((uint64_t)AUTOTUNE_PROBE_BATCH_SIZE, 4ULL * Settings->SpanChunks * CHUNK_SIZE * Settings->Depth);
+    return Session->BatchBytes;
+}
+
+
+VOID
+AutotuneEndBatch(
+    _Inout_ AUTOTUNE_SESSION* Session,
+    _In_ uint64_t Bytes,
+    _In_ uint64_t Microseconds
+)
+{
+    if (!Session->Probing) {
+        return;
+    }
+    InterlockedIncrement64(&g_AutotuneProbeBatches);
+    Session->ProbeBudget -= min(Session->ProbeBudget, Session->BatchBytes);
+
+    if (Bytes * 2 >= Session->BatchBytes) {
+        uint64_t bytesPerSecond = Bytes * 1000000ULL / max(Microseconds, 1);
+        Session->Measured = true;
+
+        if (Session->BestBytesPerSecond == 0) {
+            // The first batch measures the starting settings
+            Session->BestBytesPerSecond = bytesPerSecond;
+        }
+        else if (bytesPerSecond * 100 >= Session->BestBytesPerSecond * (100 + AUTOTUNE_MIN_GAIN_PERCENT)) {
+            // Keep moving in the same direction
+            Session->Best = Session->Trial;
+            Session->BestBytesPerSecond = bytesPerSecond;
+            Session->FailedMoves = 0;
+        }
+        else {
+            Session->FailedMoves++;
+            Session->Move = (Session->Move + 1) % AUTOTUNE_MOVE_COUNT;
+        }
+        PickTrial(Session);
+    }
+
+    if (Session->ProbeBudget == 0) {
+        Session->Probing = false;
+        Session->Trial = Session->Best;
+    }
+}
+
+
+VOID
+AutotuneEnd(
+    _Inout_ AUTOTUNE_SESSION* Session,
+    _In_ bool Succeeded
+)
+{
+    if (!Succeeded || !Session->Measured) {
+        return;
+    }
+    InterlockedIncrement64(&g_AutotuneTunedTransfers);
+
+    AcquireSRWLockExclusive(&g_AutotuneLock);
+    LoadTableLocked();
+
+    AUTOTUNE_ENTRY* entry = FindEntryLocked(&Session->Key);
+    bool changed = entry == NULL ||
+                   entry->Settings.SpanChunks != Session->Best.SpanChunks || entry->Settings.Depth != Session->Best.Depth;
+    if (entry == NULL) {
+        if (g_AutotuneCount < AUTOTUNE_MAX_DEVICES) {
+            entry = &g_AutotuneEntries[g_AutotuneCount++];
+        }
+        else {
+            entry = &g_AutotuneEntries[0];
+            for (DWORD i = 1; i < g_AutotuneCount; i++) {
+                if (g_AutotuneEntries[i].LastUsed < entry->LastUsed) {
+                    entry = &g_AutotuneEntries[i];
+                }
+            }
+        }
+        entry->Key = Session->Key;
+    }
+
+    entry->Settings = Session->Best;
+    entry->BytesPerSecond = Session->BestBytesPerSecond;
+    entry->LastUsed = ++g_AutotuneClock;
+    g_AutotuneLastSettings = Session->Best;
+    g_AutotuneLastBytesPerSecond = Session->BestBytesPerSecond;
+
+    // A confirmed setting is not written again
+    if (changed) {
+        WriteTableLocked();
+    }
+    ReleaseSRWLockExclusive(&g_AutotuneLock);
+}
+
+
+VOID
+AutotuneGetStats(
+    _Out_ SafeStorageTransferTuningStats* Stats
+)
+{
+    memset(Stats, 0, sizeof(*Stats));
+    Stats->TunedTransfers = (uint64_t)InterlockedCompareExchange64(&g_AutotuneTunedTransfers, 0, 0);
+    Stats->ProbeBatches = (uint64_t)InterlockedCompareExchange64(&g_AutotuneProbeBatches, 0, 0);
+
+    AcquireSRWLockShared(&g_AutotuneLock);
+    Stats->Devices = g_AutotuneCount;
+    Stats->LastSpanSize = (uint64_t)g_AutotuneLastSettings.SpanChunks * CHUNK_SIZE;
+    Stats->LastDepth = g_AutotuneLastSettings.Depth;
+    Stats->LastBytesPerSecond = g_AutotuneLastBytesPerSecond;
+    ReleaseSRWLockShared(&g_AutotuneLock);
+}
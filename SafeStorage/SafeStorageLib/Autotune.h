@@ -0,0 +1,151 @@
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define AUTOTUNE_FILE_NAME "transfer_tuning.txt"    // %APPDIR%\transfer_tuning.txt: the remembered settings, one device per line
+#define AUTOTUNE_MAX_DEVICES 64                 // Devices remembered; the least recently used one is forgotten
+#define AUTOTUNE_MAX_SPAN_CHUNKS 16             // Largest I/O of a transfer, in chunks (1 MB)
+#define AUTOTUNE_MIN_PROBE_SIZE (32 * 1024 * 1024)  // Smaller transfers use the remembered settings without probing
+#define AUTOTUNE_PROBE_FRACTION 4               // At most 1/4 of a transfer is spent probing
+#define AUTOTUNE_PROBE_BATCH_SIZE (4 * 1024 * 1024) // Least a probe moves before its throughput counts
+#define AUTOTUNE_MIN_GAIN_PERCENT 5             // A probe has to be this much faster to replace the best settings
+
+
+// How a transfer does its I/O
+typedef struct _AUTOTUNE_SETTINGS {
+    DWORD SpanChunks;                           // Consecutive chunks read and written by one I/O, a power of 2
+    DWORD Depth;                                // Spans of the transfer in flight at the same time
+} AUTOTUNE_SETTINGS;
+
+
+// The source and destination devices of a transfer; settings are remembered per pair
+typedef struct _AUTOTUNE_KEY {
+    char Backend[16];                           // Name of the I/O backend
+    DWORD SourceVolume;                         // Volume serial numbers
+    DWORD DestinationVolume;
+} AUTOTUNE_KEY;
+
+
+// The state of the hill climb during one transfer, see AutotuneBegin
+typedef struct _AUTOTUNE_SESSION {
+    AUTOTUNE_KEY Key;
+    AUTOTUNE_SETTINGS Best;                     // Fastest settings measured so far
+    AUTOTUNE_SETTINGS Trial;                    // Settings of the current batch
+    uint64_t BestBytesPerSecond;                // 0 until Best has been measured in this transfer
+    DWORD MaxDepth;
+    DWORD Move;                                 // Neighbour of Best tried next
+    DWORD FailedMoves;                          // Neighbours tried in a row that were not faster
+    uint64_t ProbeBudget;                       // Bytes still to be spent probing
+    uint64_t BatchBytes;                        // Bytes the current batch was planned to move
+    bool Probing;
+    bool Measured;                              // A batch moved enough data to be measured
+} AUTOTUNE_SESSION;
+
+
+/*
+ * @brief       Sets the application directory the settings are remembered in. Called from SafeStorageInit.
+ */
+VOID
+AutotuneInit(
+    _In_z_ const char* AppDirectory
+);
+
+
+/*
+ * @brief       Forgets the loaded settings, so that the next transfer loads them again, e.g. from another
+ *              I/O backend.
+ */
+VOID
+AutotuneReset(
+    VOID
+);
+
+
+/*
+ * @brief       Turns probing on or off. Without it every transfer uses one-chunk I/Os on every worker.
+ */
+VOID
+AutotuneSetEnabled(
+    _In_ bool Enabled
+);
+
+
+/*
+ * @brief       Starts tuning a transfer between two files.
+ *
+ * @details     The transfer starts with the settings remembered for the devices of the two paths (loaded from
+ *              AUTOTUNE_FILE_NAME on first use), or with one-chunk I/Os on every worker for devices not seen
+ *              before. Transfers of at least AUTOTUNE_MIN_PROBE_SIZE bytes then probe: the first
+ *              1/AUTOTUNE_PROBE_FRACTION of the transfer is moved in batches, each with a neighbour of the best
+ *              settings so far (twice or half the span, twice or half the depth), and a neighbour that is at
+ *              least AUTOTUNE_MIN_GAIN_PERCENT faster becomes the best. Probing stops once no neighbour is
+ *              faster or the budget is spent, and the rest of the transfer uses the best settings.
+ *
+ * @param[in]   SourcePath      - The file read.
+ * @param[in]   DestinationPath - The file written.
+ * @param[in]   TransferSize    - Bytes the transfer moves.
+ * @param[in]   MaxDepth        - Most spans the caller can run at the same time; at least 1.
+ * @param[out]  Session         - Receives the state of the hill climb.
+ */
+VOID
+AutotuneBegin(
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath,
+    _In_ uint64_t TransferSize,
+    _In_ DWORD MaxDepth,
+    _Out_ AUTOTUNE_SESSION* Session
+);
+
+
+/*
+ * @brief       Returns the settings and size of the next batch of a transfer.
+ *
+ * @return      The bytes the batch should move; UINT64_MAX once probing is over (the rest of the transfer).
+ */
+uint64_t
+AutotuneNextBatch(
+    _Inout_ AUTOTUNE_SESSION* Session,
+    _Out_ AUTOTUNE_SETTINGS* Settings
+);
+
+
+/*
+ * @brief       Reports the bytes a probe batch actually read and how long it took, and picks the next trial.
+ *              A batch that read much less than planned (holes, chunks of a resumed transfer) is not compared.
+ */
+VOID
+AutotuneEndBatch(
+    _Inout_ AUTOTUNE_SESSION* Session,
+    _In_ uint64_t Bytes,
+    _In_ uint64_t Microseconds
+);
+
+
+/*
+ * @brief       Remembers the best settings of a completed transfer for its devices and writes them to
+ *              AUTOTUNE_FILE_NAME. Nothing is remembered if the transfer failed or did not probe.
+ */
+VOID
+AutotuneEnd(
+    _Inout_ AUTOTUNE_SESSION* Session,
+    _In_ bool Succeeded
+);
+
+
+/*
+ * @brief       Returns the counters of the tuner and the settings it remembered last.
+ */
+VOID
+AutotuneGetStats(
+    _Out_ SafeStorageTransferTuningStats* Stats
+);
+
+
+EXTERN_C_END;
+#endif  //_AUTOTUNE_H_
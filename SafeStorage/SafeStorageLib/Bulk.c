@@ -0,0 +1,332 @@
+#include "Bulk.h"
+#include "FileIo.h"
+#include "ThreadPool.h"
+
+
+// Shared by all tasks of one bulk operation
+typedef struct _BULK_OPERATION {
+    POOL_GROUP Group;
+    const char* const* SourceRoots;
+    const char* DestinationRoot;
+    DWORD Flags;
+    bool CreateParents;                         // Files are nested and their destination directories may be missing
+    BULK_FILE_ROUTINE Routine;
+    PVOID Context;
+    SRWLOCK ResultLock;                         // Guards the results
+    SafeStorageBulkResult* Results;
+    uint32_t ResultCount;
+    uint32_t ResultCapacity;
+    uint32_t FailedCount;
+    volatile LONG Incomplete;                   // Out of memory: some files were neither handled nor reported
+} BULK_OPERATION;
+
+
+// A directory to list or a file to transfer. Owned by the task that handles it.
+typedef struct _BULK_TASK {
+    BULK_OPERATION* Operation;
+    DWORD Root;                                 // Index into SourceRoots
+    char RelativePath[MAX_PATH];                // "" for a root directory
+    char SourcePath[MAX_PATH];
+} BULK_TASK;
+
+
+/**
+ * @brief       Records the outcome of one file or directory.
+ */
+static void AddResult(_Inout_ BULK_OPERATION* operation, _In_z_ const char* relativePath, _In_ NTSTATUS status) {
+    AcquireSRWLockExclusive(&operation->ResultLock);
+
+    if (operation->ResultCount == operation->ResultCapacity) {
+        uint32_t capacity = (operation->ResultCapacity == 0) ? 64 : 2 * operation->ResultCapacity;
+        SafeStorageBulkResult* results = (SafeStorageBulkResult*)realloc(operation->Results, capacity * sizeof(SafeStorageBulkResult));
+        if (results == NULL) {
+            ReleaseSRWLockExclusive(&operation->ResultLock);
+            InterlockedExchange(&operation->Incomplete, TRUE);
+            return;
+        }
+        operation->Results = results;
+        operation->ResultCapacity = capacity;
+    }
+
+    SafeStorageBulkResult* result = &operation->Results[operation->ResultCount++];
+    StringCchCopyA(result->RelativePath, MAX_PATH, relativePath);
+    result->Status = status;
+    if (!NT_SUCCESS(status)) {
+        operation->FailedCount++;
+    }
+
+    ReleaseSRWLockExclusive(&operation->ResultLock);
+}
+
+
+/**
+ * @brief       Creates the directory a file is about to be written to.
+ */
+static bool CreateParentDirectory(_In_z_ const char* path) {
+    char directory[MAX_PATH];
+    if (FAILED(StringCchCopyA(directory, MAX_PATH, path))) {
+        return false;
+    }
+
+    char* separator = strrchr(directory, '\\');
+    if (separator == NULL) {
+        return true;
+    }
+    *separator = '\0';
+    return IoCreateDirectories(directory);
+}
+
+
+/**
+ * @brief       Thread pool routine. Transfers one file and records its status.
+ */
+static VOID TransferOneFile(_Inout_opt_ PVOID context, _In_ uint64_t index) {
+    UNREFERENCED_PARAMETER(index);
+
+    BULK_TASK* task = (BULK_TASK*)context;
+    BULK_OPERATION* operation = task->Operation;
+    char destinationPath[MAX_PATH];
+    char primaryPath[MAX_PATH];
+    IO_FILE_INFO primaryInfo = { 0 };
+
+    // Already handled by the walk of the first root
+    if (task->Root > 0 &&
+        SUCCEEDED(StringCchPrintfA(primaryPath, MAX_PATH, "%s\\%s", operation->SourceRoots[0], task->RelativePath)) &&
+        IoQueryFileInfo(primaryPath, &primaryInfo)) {
+        free(task);
+        return;
+    }
+
+    NTSTATUS status = STATUS_BUFFER_OVERFLOW;
+    if (SUCCEEDED(StringCchPrintfA(destinationPath, MAX_PATH, "%s\\%s", operation->DestinationRoot, task->RelativePath))) {
+        status = (operation->CreateParents && !CreateParentDirectory(destinationPath)) ?
+            STATUS_UNSUCCESSFUL :
+            operation->Routine(task->RelativePath, task->SourcePath, destinationPath, operation->Context);
+    }
+
+    AddResult(operation, task->RelativePath, status);
+    free(task);
+}
+
+
+static VOID ListOneDirectory(_Inout_opt_ PVOID context, _In_ uint64_t index);
+
+
+/**
+ * @brief       Queues a task for a directory or a file found by the walk.
+ */
+static void QueueTask(_Inout_ BULK_OPERATION* operation, _In_ DWORD root, _In_z_ const char* relativePath, _In_z_ const char* sourcePath, _In_ bool directory) {
+    BULK_TASK* task = (BULK_TASK*)calloc(1, sizeof(BULK_TASK));
+    if (task == NULL) {
+        InterlockedExchange(&operation->Incomplete, TRUE);
+        return;
+    }
+
+    task->Operation = operation;
+    task->Root = root;
+    if (FAILED(StringCchCopyA(task->RelativePath, MAX_PATH, relativePath)) ||
+        FAILED(StringCchCopyA(task->SourcePath, MAX_PATH, sourcePath))) {
+        AddResult(operation, relativePath, STATUS_BUFFER_OVERFLOW);
+        free(task);
+        return;
+    }
+
+    if (!PoolSubmit(&operation->Group, directory ? ListOneDirectory : TransferOneFile, task, 0, 1)) {
+        InterlockedExchange(&operation->Incomplete, TRUE);
+        free(task);
+    }
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Queues every entry of a directory as a task of its own.
+ */
+static IoEnumerateAction QueueEntry(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    BULK_TASK* parent = (BULK_TASK*)context;
+    BULK_OPERATION* operation = parent->Operation;
+    char relativePath[MAX_PATH];
+
+    if (FAILED(parent->RelativePath[0] == '\0' ?
+               StringCchCopyA(relativePath, MAX_PATH, name) :
+               StringCchPrintfA(relativePath, MAX_PATH, "%s\\%s", parent->RelativePath, name))) {
+        AddResult(operation, name, STATUS_BUFFER_OVERFLOW);
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    if (strchr(name, '~') != NULL) {
+        if ((operation->Flags & BULK_FLAG_SKIP_INTERNAL) == 0) {
+            AddResult(operation, relativePath, STATUS_OBJECT_NAME_INVALID);
+        }
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    QueueTask(operation, parent->Root, relativePath, path, info->IsDirectory);
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Thread pool routine. Creates the destination directory matching a source directory and
+ *              queues its entries.
+ */
+static VOID ListOneDirectory(_Inout_opt_ PVOID context, _In_ uint64_t index) {
+    UNREFERENCED_PARAMETER(index);
+
+    BULK_TASK* task = (BULK_TASK*)context;
+    BULK_OPERATION* operation = task->Operation;
+    char destinationDirectory[MAX_PATH];
+
+    HRESULT result = (task->RelativePath[0] == '\0') ?
+        StringCchCopyA(destinationDirectory, MAX_PATH, operation->DestinationRoot) :
+        StringCchPrintfA(destinationDirectory, MAX_PATH, "%s\\%s", operation->DestinationRoot, task->RelativePath);
+
+    // Created once here rather than before every file
+    if (FAILED(result) || !IoCreateDirectories(destinationDirectory)) {
+        AddResult(operation, task->RelativePath, FAILED(result) ? STATUS_BUFFER_OVERFLOW : STATUS_UNSUCCESSFUL);
+    }
+    else if (!IoEnumerateFiles(task->SourcePath, false, QueueEntry, task)) {
+        AddResult(operation, task->RelativePath, STATUS_UNSUCCESSFUL);
+    }
+
+    free(task);
+}
+
+
+/**
+ * @brief       Returns the file name part of a path, or NULL for a NULL path.
+ */
+static const char* FileName(_In_opt_z_ const char* path) {
+    const char* separator = (path != NULL) ? strrchr(path, '\\') : NULL;
+    return (separator != NULL) ? separator + 1 : path;
+}
+
+
+/**
+ * @brief       Waits for every task of the operation and hands its results over to the report.
+ */
+static bool FinishOperation(_Inout_ BULK_OPERATION* operation, _Out_ SafeStorageBulkReport* report) {
+    PoolWait(&operation->Group);
+
+    report->Results = operation->Results;
+    report->ResultCount = operation->ResultCount;
+    report->FailedCount = operation->FailedCount;
+    return !operation->Incomplete;
+}
+
+
+bool
+BulkTransferTree(
+    _In_reads_(RootCount) const char* const* SourceRoots,
+    _In_ DWORD RootCount,
+    _In_z_ const char* DestinationRoot,
+    _In_ DWORD Flags,
+    _In_ BULK_FILE_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _Out_ SafeStorageBulkReport* Report
+)
+{
+    BULK_OPERATION operation = { 0 };
+    operation.SourceRoots = SourceRoots;
+    operation.DestinationRoot = DestinationRoot;
+    operation.Flags = Flags;
+    operation.Routine = Routine;
+    operation.Context = Context;
+    InitializeSRWLock(&operation.ResultLock);
+
+    IO_FILE_INFO rootInfo = { 0 };
+    bool listed = RootCount > 0 && IoQueryFileInfo(SourceRoots[0], &rootInfo) && rootInfo.IsDirectory;
+
+    for (DWORD root = 0; listed && root < RootCount; root++) {
+        // Later roots are optional
+        if (root == 0 || (IoQueryFileInfo(SourceRoots[root], &rootInfo) && rootInfo.IsDirectory)) {
+            QueueTask(&operation, root, "", SourceRoots[root], true);
+        }
+    }
+
+    return FinishOperation(&operation, Report) && listed;
+}
+
+
+bool
+BulkTransferFiles(
+    _In_reads_(FileCount) const char* const* SourcePaths,
+    _In_ DWORD FileCount,
+    _In_z_ const char* DestinationRoot,
+    _In_ BULK_FILE_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _Out_ SafeStorageBulkReport* Report
+)
+{
+    BULK_OPERATION operation = { 0 };
+    operation.DestinationRoot = DestinationRoot;
+    operation.Routine = Routine;
+    operation.Context = Context;
+    InitializeSRWLock(&operation.ResultLock);
+
+    for (DWORD i = 0; i < FileCount; i++) {
+        const char* name = FileName(SourcePaths[i]);
+        if (name == NULL || name[0] == '\0') {
+            AddResult(&operation, (SourcePaths[i] != NULL) ? SourcePaths[i] : "", STATUS_INVALID_PARAMETER);
+            continue;
+        }
+
+        // Two files of the same name would race each other to the same destination
+        bool duplicate = false;
+        for (DWORD j = 0; j < i && !duplicate; j++) {
+            const char* earlierName = FileName(SourcePaths[j]);
+            duplicate = earlierName != NULL && _stricmp(earlierName, name) == 0;
+        }
+        if (duplicate) {
+            AddResult(&operation, name, STATUS_OBJECT_NAME_COLLISION);
+            continue;
+        }
+
+        QueueTask(&operation, 0, name, SourcePaths[i], false);
+    }
+
+    return FinishOperation(&operation, Report);
+}
+
+
+bool
+BulkTransferPaths(
+    _In_z_ const char* SourceRoot,
+    _In_reads_(FileCount) const char* const* RelativePaths,
+    _In_ DWORD FileCount,
+    _In_z_ const char* DestinationRoot,
+    _In_ BULK_FILE_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _Out_ SafeStorageBulkReport* Report
+)
+{
+    BULK_OPERATION operation = { 0 };
+    operation.DestinationRoot = DestinationRoot;
+    operation.CreateParents = true;
+    operation.Routine = Routine;
+    operation.Context = Context;
+    InitializeSRWLock(&operation.ResultLock);
+
+    for (DWORD i = 0; i < FileCount; i++) {
+        char sourcePath[MAX_PATH];
+        if (FAILED(StringCchPrintfA(sourcePath, MAX_PATH, "%s\\%s", SourceRoot, RelativePaths[i]))) {
+            AddResult(&operation, RelativePaths[i], STATUS_BUFFER_OVERFLOW);
+            continue;
+        }
+
+        QueueTask(&operation, 0, RelativePaths[i], sourcePath, false);
+    }
+
+    return FinishOperation(&operation, Report);
+}
+
+
+VOID
+BulkFreeReport(
+    _Inout_ SafeStorageBulkReport* Report
+)
+{
+    free(Report->Results);
+    Report->Results = NULL;
+    Report->ResultCount = 0;
+    Report->FailedCount = 0;
+}
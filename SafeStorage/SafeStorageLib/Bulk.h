@@ -0,0 +1,111 @@
+#ifndef _BULK_H_
+#define _BULK_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+// BulkTransferTree flags
+#define BULK_FLAG_SKIP_INTERNAL 0x1             // Silently skip names containing '~' (sidecars, versions, blocks)
+
+
+/*
+ * @brief       Transfers one file of a bulk operation. Runs on a pool thread, concurrently with other files.
+ *
+ * @param[in]   RelativePath    - Path of the file relative to the roots, e.g. "src\\main.c".
+ * @param[in]   SourcePath      - Where the file was found.
+ * @param[in]   DestinationPath - DestinationRoot\\RelativePath. Its directory exists.
+ * @param[in]   Context         - The context given to BulkTransferTree or BulkTransferFiles.
+ *
+ * @return      The status reported for the file.
+ */
+typedef NTSTATUS (*BULK_FILE_ROUTINE)(
+    _In_z_ const char* RelativePath,
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath,
+    _Inout_opt_ PVOID Context
+);
+
+
+/*
+ * @brief       Mirrors one or more directory trees into DestinationRoot, calling Routine for every file.
+ *
+ * @details     Every directory is listed by a task of its own on the library's work-stealing pool, which
+ *              creates the matching destination directory once and queues a task per file and per
+ *              subdirectory. Listing, directory creation and file transfers of the whole tree therefore
+ *              overlap, and many small files are in flight at once.
+ *
+ *              Roots after the first only contribute files that do not exist at the same relative path under
+ *              the first root (used to include submissions that were migrated to the cold tier).
+ *
+ *              Names containing '~' are reserved for internal files: with BULK_FLAG_SKIP_INTERNAL they are
+ *              skipped, otherwise they are reported as STATUS_OBJECT_NAME_INVALID (directories are not entered).
+ *
+ * @param[out]  Report          - Receives one result per file (and per directory that could not be handled).
+ *
+ * @return      TRUE if the first root could be listed and every file was handled; FALSE if out of memory
+ *              or the first root is not a readable directory. The report is filled in either way.
+ */
+bool
+BulkTransferTree(
+    _In_reads_(RootCount) const char* const* SourceRoots,
+    _In_ DWORD RootCount,
+    _In_z_ const char* DestinationRoot,
+    _In_ DWORD Flags,
+    _In_ BULK_FILE_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _Out_ SafeStorageBulkReport* Report
+);
+
+
+/*
+ * @brief       Calls Routine for every file of a list, in parallel on the pool. The relative path of
+ *              each file is its name; DestinationRoot must exist. A file named like an earlier one of the
+ *              list is reported as STATUS_OBJECT_NAME_COLLISION.
+ *
+ * @return      TRUE if every file was handled; FALSE if out of memory.
+ */
+bool
+BulkTransferFiles(
+    _In_reads_(FileCount) const char* const* SourcePaths,
+    _In_ DWORD FileCount,
+    _In_z_ const char* DestinationRoot,
+    _In_ BULK_FILE_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _Out_ SafeStorageBulkReport* Report
+);
+
+
+/*
+ * @brief       Calls Routine for every file of a list of paths relative to SourceRoot, in parallel on the pool.
+ *              Unlike BulkTransferFiles the relative paths keep their directories: the destination directory
+ *              of each file is created before Routine is called. Each path must be listed once.
+ *
+ * @return      TRUE if every file was handled; FALSE if out of memory.
+ */
+bool
+BulkTransferPaths(
+    _In_z_ const char* SourceRoot,
+    _In_reads_(FileCount) const char* const* RelativePaths,
+    _In_ DWORD FileCount,
+    _In_z_ const char* DestinationRoot,
+    _In_ BULK_FILE_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _Out_ SafeStorageBulkReport* Report
+);
+
+
+/*
+ * @brief       Frees the results of a report and zeroes it.
+ */
+VOID
+BulkFreeReport(
+    _Inout_ SafeStorageBulkReport* Report
+);
+
+
+EXTERN_C_END;
+#endif  //_BULK_H_
@@ -0,0 +1,529 @@
+#include "Cache.h"
+#include <ctype.h>
+
+
+// Where an entry currently lives
+typedef enum {
+    CACHE_SEGMENT_NONE = 0,                     // Evicted or not inserted yet
+    CACHE_SEGMENT_WINDOW,                       // Admission window, every new entry starts here
+    CACHE_SEGMENT_PROBATION,                    // Main cache, not hit since it was admitted
+    CACHE_SEGMENT_PROTECTED                     // Main cache, hit at least once since it was admitted
+} CACHE_SEGMENT;
+
+
+struct _CACHE_ENTRY {
+    struct _CACHE_ENTRY* HashNext;
+    struct _CACHE_ENTRY* Previous;              // Towards the most recently used entry of the segment
+    struct _CACHE_ENTRY* Next;                  // Towards the least recently used one
+    CACHE_SEGMENT Segment;
+    uint64_t Hash;
+    uint32_t Version;
+    uint64_t Size;
+    uint64_t LastWriteTime;
+    volatile LONG References;                   // One for the cache while the entry is in it, one per lookup in use
+    BYTE* Data;
+    char Path[MAX_PATH];
+};
+
+
+// One LRU list, most recently used entry first
+typedef struct _CACHE_LIST {
+    CACHE_ENTRY* Head;
+    CACHE_ENTRY* Tail;
+    uint64_t Bytes;
+} CACHE_LIST;
+
+
+// Global static variables
+static SRWLOCK g_CacheLock = SRWLOCK_INIT;      // Guards everything below, lookups included since they reorder the lists
+static uint64_t g_CacheMaxBytes = 0;
+static uint64_t g_CacheMaxEntryBytes = 0;
+static uint64_t g_WindowMaxBytes = 0;
+static uint64_t g_MainMaxBytes = 0;
+static uint64_t g_ProtectedMaxBytes = 0;
+static CACHE_ENTRY* g_Buckets[CACHE_BUCKET_COUNT] = { 0 };
+static CACHE_LIST g_Window = { 0 };
+static CACHE_LIST g_Probation = { 0 };
+static CACHE_LIST g_Protected = { 0 };
+static BYTE g_Sketch[CACHE_SKETCH_DEPTH][1 << CACHE_SKETCH_WIDTH_BITS] = { 0 };
+static uint64_t g_SketchAccesses = 0;
+static SafeStorageCacheStats g_CacheStats = { 0 };
+
+
+/**
+ * @brief       FNV-1a hash of a submission path, case-insensitive like the file system, and a version.
+ */
+static uint64_t HashKey(_In_z_ const char* path, _In_ uint32_t version) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = path; *c != '\0'; c++) {
+        hash = (hash ^ (BYTE)tolower((BYTE)*c)) * 1099511628211ULL;
+    }
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ ((version >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief       Returns the counter of a key in one row of the sketch.
+ */
+static BYTE* SketchCounter(_In_ uint64_t hash, _In_ int row) {
+    static const uint64_t seeds[CACHE_SKETCH_DEPTH] = {
+        0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+    };
+    uint64_t mixed = (hash ^ (hash >> 31)) * seeds[row];
+    return &g_Sketch[row][mixed >> (64 - CACHE_SKETCH_WIDTH_BITS)];
+}
+
+
+/**
+ * @brief       Counts an access in the sketch. Halves every counter periodically so that the sketch
+ *              reflects recent popularity rather than all-time popularity.
+ */
+static void RecordAccess(_In_ uint64_t hash) {
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        BYTE* counter = SketchCounter(hash, row);
+        if (*counter < CACHE_SKETCH_MAX_COUNT) {
+            (*counter)++;
+        }
+    }
+
+    if (++g_SketchAccesses >= (uint64_t)CACHE_SKETCH_RESET_FACTOR << CACHE_SKETCH_WIDTH_BITS) {
+        for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+            for (size_t i = 0; i < ARRAYSIZE(g_Sketch[row]); i++) {
+                g_Sketch[row][i] >>= 1;
+            }
+        }
+        g_SketchAccesses /= 2;
+    }
+}
+
+
+/**
+ * @brief       Estimated number of recent accesses to a key: the smallest of its counters.
+ */
+static BYTE EstimateFrequency(_In_ uint64_t hash) {
+    BYTE frequency = CACHE_SKETCH_MAX_COUNT;
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        BYTE count = *SketchCounter(hash, row);
+        if (count < frequency) {
+            frequency = count;
+        }
+    }
+    return frequency;
+}
+
+
+/**
+ * @brief       Returns the list of a segment.
+ */
+static CACHE_LIST* SegmentList(_In_ CACHE_SEGMENT segment) {
+    switch (segment) {
+    case CACHE_SEGMENT_WINDOW:
+        return &g_Window;
+    case CACHE_SEGMENT_PROBATION:
+        return &g_Probation;
+    case CACHE_SEGMENT_PROTECTED:
+        return &g_Protected;
+    default:
+        return NULL;
+    }
+}
+
+
+/**
+ * @brief       Removes an entry from the list of its segment.
+ */
+static void Unlink(_Inout_ CACHE_ENTRY* entry) {
+    CACHE_LIST* list = SegmentList(entry->Segment);
+    if (list == NULL) {
+        return;
+    }
+
+    if (entry->Previous != NULL) {
+        entry->Previous->Next = entry->Next;
+    }
+    else {
+        list->Head = entry->Next;
+    }
+    if (entry->Next != NULL) {
+        entry->Next->Previous = entry->Previous;
+    }
+    else {
+        list->Tail = entry->Previous;
+    }
+
+    list->Bytes -= entry->Size;
+    entry->Previous = NULL;
+    entry->Next = NULL;
+    entry->Segment = CACHE_SEGMENT_NONE;
+}
+
+
+/**
+ * @brief       Makes an entry the most recently used one of a segment, moving it there if needed.
+ */
+static void MoveToFront(_Inout_ CACHE_ENTRY* entry, _In_ CACHE_SEGMENT segment) {
+    Unlink(entry);
+
+    CACHE_LIST* list = SegmentList(segment);
+    entry->Segment = segment;
+    entry->Next = list->Head;
+    if (list->Head != NULL) {
+        list->Head->Previous = entry;
+    }
+    else {
+        list->Tail = entry;
+    }
+    list->Head = entry;
+    list->Bytes += entry->Size;
+}
+
+
+/**
+ * @brief       Frees an entry once its last reference is gone.
+ */
+static void ReleaseReference(_Inout_ CACHE_ENTRY* entry) {
+    if (InterlockedDecrement(&entry->References) == 0) {
+        free(entry->Data);
+        free(entry);
+    }
+}
+
+
+/**
+ * @brief       Removes an entry from the cache. Lookups still using it keep it alive until they release it.
+ */
+static void Evict(_Inout_ CACHE_ENTRY* entry) {
+    CACHE_ENTRY** link = &g_Buckets[entry->Hash % CACHE_BUCKET_COUNT];
+    while (*link != NULL && *link != entry) {
+        link = &(*link)->HashNext;
+    }
+    if (*link != NULL) {
+        *link = entry->HashNext;
+    }
+
+    Unlink(entry);
+    g_CacheStats.EntryCount--;
+    g_CacheStats.BytesCached -= entry->Size;
+    ReleaseReference(entry);
+}
+
+
+/**
+ * @brief       Finds the entry of a key, or NULL.
+ */
+static CACHE_ENTRY* FindEntry(_In_ uint64_t hash, _In_z_ const char* path, _In_ uint32_t version) {
+    for (CACHE_ENTRY* entry = g_Buckets[hash % CACHE_BUCKET_COUNT]; entry != NULL; entry = entry->HashNext) {
+        if (entry->Hash == hash && entry->Version == version && _stricmp(entry->Path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief       Returns the main cache's next eviction victim after a given one: the least recently used
+ *              probation entries first, then the protected ones.
+ */
+static CACHE_ENTRY* NextVictim(_In_opt_ const CACHE_ENTRY* victim) {
+    if (victim == NULL) {
+        return (g_Probation.Tail != NULL) ? g_Probation.Tail : g_Protected.Tail;
+    }
+    if (victim->Previous != NULL) {
+        return victim->Previous;
+    }
+    return (victim->Segment == CACHE_SEGMENT_PROBATION) ? g_Protected.Tail : NULL;
+}
+
+
+/**
+ * @brief       Decides whether an entry pushed out of the window enters the main cache. It does if it was
+ *              accessed more often than every entry that has to be evicted to make room for it.
+ */
+static void Admit(_Inout_ CACHE_ENTRY* candidate) {
+    BYTE frequency = EstimateFrequency(candidate->Hash);
+    uint64_t available = g_MainMaxBytes - min(g_MainMaxBytes, g_Probation.Bytes + g_Protected.Bytes);
+    bool admitted = candidate->Size <= g_MainMaxBytes;
+
+    CACHE_ENTRY* victim = NULL;
+    while (admitted && available < candidate->Size) {
+        victim = NextVictim(victim);
+        admitted = victim != NULL && frequency > EstimateFrequency(victim->Hash);
+        available += admitted ? victim->Size : 0;
+    }
+
+    if (!admitted) {
+        g_CacheStats.Rejections++;
+        Evict(candidate);
+        return;
+    }
+
+    // Room was found by walking the victims from the tail; evict exactly those
+    available = g_MainMaxBytes - min(g_MainMaxBytes, g_Probation.Bytes + g_Protected.Bytes);
+    while (available < candidate->Size) {
+        victim = NextVictim(NULL);
+        available += victim->Size;
+        g_CacheStats.Evictions++;
+        Evict(victim);
+    }
+
+    g_CacheStats.Admissions++;
+    MoveToFront(candidate, CACHE_SEGMENT_PROBATION);
+}
+
+
+/**
+ * @brief       Keeps the protected segment within its share by moving its least recently used entries back
+ *              to probation.
+ */
+static void BalanceProtected(void) {
+    while (g_Protected.Bytes > g_ProtectedMaxBytes && g_Protected.Tail != g_Protected.Head) {
+        MoveToFront(g_Protected.Tail, CACHE_SEGMENT_PROBATION);
+    }
+}
+
+
+/**
+ * @brief       Drops every entry. The caller holds the lock exclusively.
+ */
+static void EvictAll(void) {
+    for (size_t i = 0; i < ARRAYSIZE(g_Buckets); i++) {
+        while (g_Buckets[i] != NULL) {
+            Evict(g_Buckets[i]);
+        }
+    }
+}
+
+
+/**
+ * @brief       Reads a whole file into memory.
+ *
+ * @return      The contents, to be freed by the caller, or NULL if the file could not be read or does not
+ *              match the expected size and last write time.
+ */
+static BYTE* LoadFile(_In_z_ const char* path, _In_ uint64_t expectedSize, _In_opt_ const uint64_t* expectedLastWriteTime, _Out_ uint64_t* lastWriteTime) {
+    SS_FILE* file = IoOpenFile(path, IO_OPEN_READ);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    uint64_t size = 0;
+    bool loaded = IoGetFileSize(file, &size) && IoGetLastWriteTime(file, lastWriteTime) && size == expectedSize &&
+                  (expectedLastWriteTime == NULL || *lastWriteTime == *expectedLastWriteTime);
+
+    BYTE* data = loaded ? (BYTE*)malloc((size_t)max(size, (uint64_t)1)) : NULL;
+    for (uint64_t offset = 0; data != NULL && offset < size; ) {
+        DWORD bytesRead = 0;
+        if (!IoReadAt(file, offset, data + offset, (DWORD)min(size - offset, (uint64_t)CACHE_READ_SIZE), &bytesRead) || bytesRead == 0) {
+            free(data);
+            data = NULL;
+        }
+        offset += bytesRead;
+    }
+
+    IoCloseFile(file);
+    return data;
+}
+
+
+VOID
+CacheConfigure(
+    _In_ uint64_t MaxBytes,
+    _In_ uint64_t MaxEntryBytes
+)
+{
+    AcquireSRWLockExclusive(&g_CacheLock);
+
+    EvictAll();
+    memset(g_Sketch, 0, sizeof(g_Sketch));
+    g_SketchAccesses = 0;
+    memset(&g_CacheStats, 0, sizeof(g_CacheStats));
+
+    g_CacheMaxBytes = MaxBytes;
+    g_CacheMaxEntryBytes = min(MaxEntryBytes, MaxBytes);
+    g_WindowMaxBytes = MaxBytes / 100 * CACHE_WINDOW_PERCENT;
+    g_MainMaxBytes = MaxBytes - g_WindowMaxBytes;
+    g_ProtectedMaxBytes = g_MainMaxBytes / 100 * CACHE_PROTECTED_PERCENT;
+    g_CacheStats.MemoryLimit = MaxBytes;
+
+    ReleaseSRWLockExclusive(&g_CacheLock);
+}
+
+
+bool
+CacheIsEnabled(
+    VOID
+)
+{
+    AcquireSRWLockShared(&g_CacheLock);
+    bool enabled = g_CacheMaxBytes > 0;
+    ReleaseSRWLockShared(&g_CacheLock);
+    return enabled;
+}
+
+
+CACHE_ENTRY*
+CacheLookup(
+    _In_z_ const char* Path,
+    _In_ uint32_t Version,
+    _In_opt_ const IO_FILE_INFO* Current
+)
+{
+    uint64_t hash = HashKey(Path, Version);
+
+    AcquireSRWLockExclusive(&g_CacheLock);
+    if (g_CacheMaxBytes == 0) {
+        ReleaseSRWLockExclusive(&g_CacheLock);
+        return NULL;
+    }
+
+    // Misses count too: a submission retrieved often enough earns its place in the main cache
+    RecordAccess(hash);
+
+    CACHE_ENTRY* entry = FindEntry(hash, Path, Version);
+    if (entry != NULL && Current != NULL && (entry->Size != Current->Size || entry->LastWriteTime != Current->LastWriteTime)) {
+        g_CacheStats.Invalidations++;
+        Evict(entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        g_CacheStats.Misses++;
+        ReleaseSRWLockExclusive(&g_CacheLock);
+        return NULL;
+    }
+
+    // A second hit while on probation protects the entry
+    if (entry->Segment == CACHE_SEGMENT_PROBATION || entry->Segment == CACHE_SEGMENT_PROTECTED) {
+        MoveToFront(entry, CACHE_SEGMENT_PROTECTED);
+        BalanceProtected();
+    }
+    else {
+        MoveToFront(entry, CACHE_SEGMENT_WINDOW);
+    }
+
+    g_CacheStats.Hits++;
+    InterlockedIncrement(&entry->References);
+    ReleaseSRWLockExclusive(&g_CacheLock);
+    return entry;
+}
+
+
+const BYTE*
+CacheEntryData(
+    _In_ const CACHE_ENTRY* Entry,
+    _Out_ uint64_t* Size,
+    _Out_ uint64_t* LastWriteTime
+)
+{
+    *Size = Entry->Size;
+    *LastWriteTime = Entry->LastWriteTime;
+    return Entry->Data;
+}
+
+
+VOID
+CacheRelease(
+    _In_ CACHE_ENTRY* Entry
+)
+{
+    ReleaseReference(Entry);
+}
+
+
+VOID
+CacheInsert(
+    _In_z_ const char* Path,
+    _In_ uint32_t Version,
+    _In_opt_ const IO_FILE_INFO* Current,
+    _In_z_ const char* DataPath
+)
+{
+    AcquireSRWLockShared(&g_CacheLock);
+    uint64_t maxEntryBytes = g_CacheMaxEntryBytes;
+    ReleaseSRWLockShared(&g_CacheLock);
+
+    IO_FILE_INFO info = { 0 };
+    if (maxEntryBytes == 0 || !IoQueryFileInfo(DataPath, &info) || info.IsDirectory || info.Size > maxEntryBytes ||
+        (Current != NULL && info.Size != Current->Size)) {
+        return;
+    }
+
+    // Read outside the lock; the copy was just written and is normally still in memory
+    CACHE_ENTRY* entry = (CACHE_ENTRY*)calloc(1, sizeof(CACHE_ENTRY));
+    if (entry == NULL || FAILED(StringCchCopyA(entry->Path, MAX_PATH, Path))) {
+        free(entry);
+        return;
+    }
+    entry->Data = LoadFile(DataPath, info.Size, (Current != NULL) ? &Current->LastWriteTime : NULL, &entry->LastWriteTime);
+    if (entry->Data == NULL) {
+        free(entry);
+        return;
+    }
+    entry->Hash = HashKey(Path, Version);
+    entry->Version = Version;
+    entry->Size = info.Size;
+    entry->References = 1;
+
+    AcquireSRWLockExclusive(&g_CacheLock);
+
+    // Reconfigured meanwhile, or inserted by a concurrent retrieve of the same submission
+    if (entry->Size > g_CacheMaxEntryBytes || FindEntry(entry->Hash, entry->Path, entry->Version) != NULL) {
+        ReleaseSRWLockExclusive(&g_CacheLock);
+        ReleaseReference(entry);
+        return;
+    }
+
+    CACHE_ENTRY** bucket = &g_Buckets[entry->Hash % CACHE_BUCKET_COUNT];
+    entry->HashNext = *bucket;
+    *bucket = entry;
+    g_CacheStats.Insertions++;
+    g_CacheStats.EntryCount++;
+    g_CacheStats.BytesCached += entry->Size;
+    MoveToFront(entry, CACHE_SEGMENT_WINDOW);
+
+    // Entries leaving the window compete for the main cache
+    while (g_Window.Bytes > g_WindowMaxBytes) {
+        Admit(g_Window.Tail);
+    }
+
+    ReleaseSRWLockExclusive(&g_CacheLock);
+}
+
+
+VOID
+CacheInvalidate(
+    _In_z_ const char* Path
+)
+{
+    AcquireSRWLockExclusive(&g_CacheLock);
+
+    // Versions hash to different buckets, so look at every entry
+    for (size_t i = 0; i < ARRAYSIZE(g_Buckets); i++) {
+        CACHE_ENTRY* entry = g_Buckets[i];
+        while (entry != NULL) {
+            CACHE_ENTRY* next = entry->HashNext;
+            if (_stricmp(entry->Path, Path) == 0) {
+                g_CacheStats.Invalidations++;
+                Evict(entry);
+            }
+            entry = next;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&g_CacheLock);
+}
+
+
+VOID
+CacheGetStats(
+    _Out_ SafeStorageCacheStats* Stats
+)
+{
+    AcquireSRWLockShared(&g_CacheLock);
+    *Stats = g_CacheStats;
+    ReleaseSRWLockShared(&g_CacheLock);
+}
@@ -0,0 +1,131 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include "FileIo.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define CACHE_BUCKET_COUNT 1024                 // Hash buckets of the entry table
+#define CACHE_SKETCH_DEPTH 4                    // Rows of the frequency sketch
+#define CACHE_SKETCH_WIDTH_BITS 12              // log2 of the counters per row
+#define CACHE_SKETCH_MAX_COUNT 15               // Counters saturate here
+#define CACHE_SKETCH_RESET_FACTOR 10            // Counters are halved after this many accesses per counter of a row
+#define CACHE_WINDOW_PERCENT 1                  // Share of the memory limit used by the admission window
+#define CACHE_PROTECTED_PERCENT 80              // Share of the main cache reserved for entries hit more than once
+#define CACHE_READ_SIZE (64 * 1024 * 1024)      // Largest single read when loading an entry
+
+
+// A cached submission. Stays valid until released, even if it is evicted meanwhile.
+typedef struct _CACHE_ENTRY CACHE_ENTRY;
+
+
+/*
+ * @brief       Sets the memory limit of the cache and drops everything cached so far.
+ *
+ * @details     The cache is a W-TinyLFU: new entries go to a small LRU window; entries pushed out of the
+ *              window only enter the main cache (a segmented LRU) if they were accessed more often than
+ *              the entries they would evict, according to a count-min sketch of recent accesses. One-off
+ *              reads, such as a bulk retrieve of a whole tree, thus pass through the window without
+ *              flushing the submissions that are retrieved repeatedly.
+ *
+ * @param[in]   MaxBytes        - Memory limit for cached data; 0 disables the cache.
+ * @param[in]   MaxEntryBytes   - Larger files are never cached. At most MaxBytes.
+ */
+VOID
+CacheConfigure(
+    _In_ uint64_t MaxBytes,
+    _In_ uint64_t MaxEntryBytes
+);
+
+
+/*
+ * @brief       Returns TRUE if a memory limit is set.
+ */
+bool
+CacheIsEnabled(
+    VOID
+);
+
+
+/*
+ * @brief       Looks up a version of a submission and records the access.
+ *
+ * @param[in]   Path            - Path of the submission (it names the user as well).
+ * @param[in]   Version         - The version; 0 for the current contents.
+ * @param[in]   Current         - For Version 0, the submission as it is now. An entry cached for another
+ *                                size or last write time is stale and is dropped.
+ *
+ * @return      The entry, to be released with CacheRelease, or NULL on a miss.
+ */
+CACHE_ENTRY*
+CacheLookup(
+    _In_z_ const char* Path,
+    _In_ uint32_t Version,
+    _In_opt_ const IO_FILE_INFO* Current
+);
+
+
+/*
+ * @brief       Returns the cached contents of an entry, together with the file's size and last write time.
+ */
+const BYTE*
+CacheEntryData(
+    _In_ const CACHE_ENTRY* Entry,
+    _Out_ uint64_t* Size,
+    _Out_ uint64_t* LastWriteTime
+);
+
+
+/*
+ * @brief       Releases an entry returned by CacheLookup.
+ */
+VOID
+CacheRelease(
+    _In_ CACHE_ENTRY* Entry
+);
+
+
+/*
+ * @brief       Caches a version of a submission after a miss, reading it back from a copy just written.
+ *
+ * @details     Does nothing if the cache is disabled, the file is larger than the entry limit or the copy
+ *              does not match Current.
+ *
+ * @param[in]   Path            - Path of the submission, as given to CacheLookup.
+ * @param[in]   Version         - The version; 0 for the current contents.
+ * @param[in]   Current         - For Version 0, the submission as it was when the copy was made.
+ * @param[in]   DataPath        - The copy, usually still in the file system cache.
+ */
+VOID
+CacheInsert(
+    _In_z_ const char* Path,
+    _In_ uint32_t Version,
+    _In_opt_ const IO_FILE_INFO* Current,
+    _In_z_ const char* DataPath
+);
+
+
+/*
+ * @brief       Drops every cached version of a submission. Called when the submission is stored again.
+ */
+VOID
+CacheInvalidate(
+    _In_z_ const char* Path
+);
+
+
+/*
+ * @brief       Returns the counters of the cache since it was last configured.
+ */
+VOID
+CacheGetStats(
+    _Out_ SafeStorageCacheStats* Stats
+);
+
+
+EXTERN_C_END;
+#endif  //_CACHE_H_
@@ -0,0 +1,223 @@
+#include "Checkpoint.h"
+#include "Durability.h"
+
+
+#define CHECKPOINT_MAGIC 0x50435353             // "SSCP"
+#define CHECKPOINT_VERSION 1
+
+
+// On-disk header, followed by the completed-chunk bitmap (one bit per chunk, 32-bit words)
+typedef struct _CHECKPOINT_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t SourceSize;
+    uint64_t SourceLastWriteTime;
+    uint32_t ChunkSize;
+    uint32_t Reserved;
+    uint64_t ChunkCount;
+} CHECKPOINT_HEADER;
+
+
+struct _SS_CHECKPOINT {
+    SS_FILE* File;
+    CHECKPOINT_HEADER Header;
+    volatile LONG* Bitmap;
+    DWORD BitmapBytes;
+    volatile LONG PendingChunks;                // Chunks marked since the last persist
+    SRWLOCK PersistLock;
+};
+
+
+/**
+ * @brief       Allocates a checkpoint for the given source with an empty bitmap.
+ */
+static SS_CHECKPOINT* AllocateCheckpoint(_In_ uint64_t sourceSize, _In_ uint64_t sourceLastWriteTime, _In_ DWORD chunkSize) {
+    uint64_t chunkCount = (sourceSize + chunkSize - 1) / chunkSize;
+    uint64_t bitmapBytes = ((chunkCount + 31) / 32) * sizeof(LONG);
+    if (chunkCount == 0 || bitmapBytes > MAXDWORD) {
+        return NULL;
+    }
+
+    SS_CHECKPOINT* checkpoint = (SS_CHECKPOINT*)calloc(1, sizeof(SS_CHECKPOINT));
+    if (checkpoint == NULL) {
+        return NULL;
+    }
+
+    checkpoint->Bitmap = (volatile LONG*)calloc(1, (size_t)bitmapBytes);
+    if (checkpoint->Bitmap == NULL) {
+        free(checkpoint);
+        return NULL;
+    }
+
+    checkpoint->Header.Magic = CHECKPOINT_MAGIC;
+    checkpoint->Header.Version = CHECKPOINT_VERSION;
+    checkpoint->Header.SourceSize = sourceSize;
+    checkpoint->Header.SourceLastWriteTime = sourceLastWriteTime;
+    checkpoint->Header.ChunkSize = chunkSize;
+    checkpoint->Header.ChunkCount = chunkCount;
+    checkpoint->BitmapBytes = (DWORD)bitmapBytes;
+    InitializeSRWLock(&checkpoint->PersistLock);
+    return checkpoint;
+}
+
+
+SS_CHECKPOINT*
+CheckpointLoad(
+    _In_z_ const char* CheckpointPath,
+    _In_ uint64_t SourceSize,
+    _In_ uint64_t SourceLastWriteTime,
+    _In_ DWORD ChunkSize
+)
+{
+    SS_FILE* file = IoOpenFile(CheckpointPath, IO_OPEN_WRITE);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    SS_CHECKPOINT* checkpoint = AllocateCheckpoint(SourceSize, SourceLastWriteTime, ChunkSize);
+    if (checkpoint == NULL) {
+        IoCloseFile(file);
+        return NULL;
+    }
+
+    // The stored header must match the one we would write for this source exactly
+    CHECKPOINT_HEADER stored = { 0 };
+    DWORD bytesRead = 0;
+    if (!IoReadAt(file, 0, &stored, sizeof(stored), &bytesRead) || bytesRead != sizeof(stored) ||
+        memcmp(&stored, &checkpoint->Header, sizeof(stored)) != 0) {
+        CheckpointClose(checkpoint);
+        IoCloseFile(file);
+        return NULL;
+    }
+
+    if (!IoReadAt(file, sizeof(stored), (void*)checkpoint->Bitmap, checkpoint->BitmapBytes, &bytesRead) ||
+        bytesRead != checkpoint->BitmapBytes) {
+        CheckpointClose(checkpoint);
+        IoCloseFile(file);
+        return NULL;
+    }
+
+    checkpoint->File = file;
+    return checkpoint;
+}
+
+
+SS_CHECKPOINT*
+CheckpointCreate(
+    _In_z_ const char* CheckpointPath,
+    _In_ uint64_t SourceSize,
+    _In_ uint64_t SourceLastWriteTime,
+    _In_ DWORD ChunkSize
+)
+{
+    SS_CHECKPOINT* checkpoint = AllocateCheckpoint(SourceSize, SourceLastWriteTime, ChunkSize);
+    if (checkpoint == NULL) {
+        return NULL;
+    }
+
+    checkpoint->File = IoOpenFile(CheckpointPath, IO_OPEN_CREATE);
+    if (checkpoint->File == NULL ||
+        !IoWriteAt(checkpoint->File, 0, &checkpoint->Header, sizeof(checkpoint->Header)) ||
+        !IoWriteAt(checkpoint->File, sizeof(checkpoint->Header), (const void*)checkpoint->Bitmap, checkpoint->BitmapBytes)) {
+        printf("Failed to create the checkpoint file: %lu\n", GetLastError());
+        CheckpointClose(checkpoint);
+        IoDeleteFile(CheckpointPath);
+        return NULL;
+    }
+
+    return checkpoint;
+}
+
+
+bool
+CheckpointIsChunkDone(
+    _In_ SS_CHECKPOINT* Checkpoint,
+    _In_ uint64_t Chunk
+)
+{
+    return (Checkpoint->Bitmap[(size_t)(Chunk / 32)] & (LONG)(1UL << (Chunk % 32))) != 0;
+}
+
+
+uint64_t
+CheckpointCountDone(
+    _In_ SS_CHECKPOINT* Checkpoint
+)
+{
+    uint64_t done = 0;
+    for (uint64_t chunk = 0; chunk < Checkpoint->Header.ChunkCount; chunk++) {
+        if (CheckpointIsChunkDone(Checkpoint, chunk)) {
+            done++;
+        }
+    }
+    return done;
+}
+
+
+VOID
+CheckpointMarkChunkDone(
+    _In_ SS_CHECKPOINT* Checkpoint,
+    _In_ uint64_t Chunk,
+    _In_ SS_FILE* Data
+)
+{
+    InterlockedOr(&Checkpoint->Bitmap[(size_t)(Chunk / 32)], (LONG)(1UL << (Chunk % 32)));
+
+    // Exactly one worker sees the counter reach the interval; CheckpointPersist resets it
+    if (InterlockedIncrement(&Checkpoint->PendingChunks) == CHECKPOINT_PERSIST_INTERVAL) {
+        CheckpointPersist(Checkpoint, Data);
+    }
+}
+
+
+bool
+CheckpointPersist(
+    _In_ SS_CHECKPOINT* Checkpoint,
+    _In_ SS_FILE* Data
+)
+{
+    // The checkpoint itself only needs flushing for durability: an older bitmap merely copies chunks again
+    bool flush = (DurabilityGetMode() != SS_DURABILITY_NONE);
+    bool result = false;
+
+    AcquireSRWLockExclusive(&Checkpoint->PersistLock);
+    InterlockedExchange(&Checkpoint->PendingChunks, 0);
+
+    // Snapshot first: every bit in the snapshot belongs to a chunk whose write has completed,
+    // so flushing the data afterwards covers all of them
+    LONG* snapshot = (LONG*)malloc(Checkpoint->BitmapBytes);
+    if (snapshot != NULL) {
+        for (DWORD i = 0; i < Checkpoint->BitmapBytes / sizeof(LONG); i++) {
+            snapshot[i] = Checkpoint->Bitmap[i];
+        }
+
+        // The data is flushed in every durability mode. A bitmap that reaches the disk before its chunks would
+        // make a resume after a power loss skip chunks that were never written and checksum their garbage.
+        result = IoFlushFile(Data) &&
+                 IoWriteAt(Checkpoint->File, sizeof(Checkpoint->Header), snapshot, Checkpoint->BitmapBytes) &&
+                 (!flush || IoFlushFile(Checkpoint->File));
+        free(snapshot);
+    }
+
+    ReleaseSRWLockExclusive(&Checkpoint->PersistLock);
+
+    if (!result) {
+        printf("Failed to persist the transfer checkpoint: %lu\n", GetLastError());
+    }
+    return result;
+}
+
+
+VOID
+CheckpointClose(
+    _In_opt_ SS_CHECKPOINT* Checkpoint
+)
+{
+    if (Checkpoint == NULL) {
+        return;
+    }
+
+    IoCloseFile(Checkpoint->File);
+    free((void*)Checkpoint->Bitmap);
+    free(Checkpoint);
+}
@@ -0,0 +1,109 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+
+#include "includes.h"
+#include "FileIo.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define CHECKPOINT_SUFFIX "~checkpoint"         // Lives next to the <destination>~partial it describes
+#define CHECKPOINT_PERSIST_INTERVAL 256         // Completed chunks between two checkpoint writes
+
+
+// Bitmap of the chunks of an in-progress transfer that are already in the partial file.
+typedef struct _SS_CHECKPOINT SS_CHECKPOINT;
+
+
+/*
+ * @brief       Opens an existing checkpoint if it describes the same source as the current transfer.
+ *
+ * @param[in]   CheckpointPath          - Path of the checkpoint file.
+ * @param[in]   SourceSize              - Size of the source being transferred.
+ * @param[in]   SourceLastWriteTime     - Last write time of the source (FILETIME units).
+ * @param[in]   ChunkSize               - Chunk size of the current transfer.
+ *
+ * @return      The checkpoint, or NULL if there is none or it was recorded for a different source
+ *              (size, last write time or chunk size differ).
+ */
+SS_CHECKPOINT*
+CheckpointLoad(
+    _In_z_ const char* CheckpointPath,
+    _In_ uint64_t SourceSize,
+    _In_ uint64_t SourceLastWriteTime,
+    _In_ DWORD ChunkSize
+);
+
+
+/*
+ * @brief       Creates (or replaces) a checkpoint with no completed chunks.
+ *
+ * @return      The checkpoint, or NULL on failure.
+ */
+SS_CHECKPOINT*
+CheckpointCreate(
+    _In_z_ const char* CheckpointPath,
+    _In_ uint64_t SourceSize,
+    _In_ uint64_t SourceLastWriteTime,
+    _In_ DWORD ChunkSize
+);
+
+
+/*
+ * @brief       Returns TRUE if the chunk is recorded as already transferred.
+ */
+bool
+CheckpointIsChunkDone(
+    _In_ SS_CHECKPOINT* Checkpoint,
+    _In_ uint64_t Chunk
+);
+
+
+/*
+ * @brief       Returns the number of chunks recorded as transferred.
+ */
+uint64_t
+CheckpointCountDone(
+    _In_ SS_CHECKPOINT* Checkpoint
+);
+
+
+/*
+ * @brief       Records that a chunk has been written to Data. Safe to call from several workers.
+ *              Every CHECKPOINT_PERSIST_INTERVAL chunks the bitmap is written to disk (see CheckpointPersist).
+ */
+VOID
+CheckpointMarkChunkDone(
+    _In_ SS_CHECKPOINT* Checkpoint,
+    _In_ uint64_t Chunk,
+    _In_ SS_FILE* Data
+);
+
+
+/*
+ * @brief       Writes the current bitmap to the checkpoint file.
+ *
+ * @details     Data is always flushed before the bitmap is written, so a chunk is never recorded before its
+ *              bytes are on disk. Unless durability is SS_DURABILITY_NONE the checkpoint is flushed afterwards
+ *              as well; with SS_DURABILITY_NONE a power loss may lose the latest bitmap, which only means that
+ *              its chunks are copied again.
+ */
+bool
+CheckpointPersist(
+    _In_ SS_CHECKPOINT* Checkpoint,
+    _In_ SS_FILE* Data
+);
+
+
+/*
+ * @brief       Closes the checkpoint file and frees the bitmap. NULL is ignored.
+ */
+VOID
+CheckpointClose(
+    _In_opt_ SS_CHECKPOINT* Checkpoint
+);
+
+
+EXTERN_C_END;
+#endif  //_CHECKPOINT_H_
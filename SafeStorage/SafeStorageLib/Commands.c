@@ -1,4 +1,22 @@
 ﻿#include "Commands.h"
+#include "Autotune.h"
+#include "Bulk.h"
+#include "Cache.h"
+#include "Durability.h"
+#include "FileIo.h"
+#include "MemoryBackend.h"
+#include "OsBackend.h"
+#include "Scrubber.h"
+#include "Segments.h"
+#include "Striping.h"
+#include "ThrottledBackend.h"
+#include "ThreadPool.h"
+#include "Tiering.h"
+#include "Trace.h"
+#include "Transfer.h"
+#include "Usage.h"
+#include "Versions.h"
+#include "Watch.h"
 #include <stdbool.h>
 #include <strsafe.h>
 #include <errno.h>
@@ -10,6 +28,9 @@
 static bool g_IsUserLoggedIn = false;
 static char g_LoggedInUsername[USERNAME_MAX_LENGTH + 1] = { 0 };
 static char g_AppDirectory[MAX_PATH] = { 0 };
+static SRWLOCK g_UsersFileLock = SRWLOCK_INIT;     // Serializes appends to users.txt
+static volatile LONG g_DetectZeroChunks = FALSE;    // Store and retrieve also turn all-zero chunks into holes
+static SRWLOCK g_ThreadPoolLock = SRWLOCK_INIT;     // Serializes replacing the thread pool
 
 
 
@@ -29,17 +50,6 @@ bool InitializeAppDirectory() {
 }
 
 
-/**
- * @brief Extracts the filename from a full file path.
- *
- * @param filePath The full file path.
- * @return A pointer to the filename within the file path.
- */
-const char* ExtractFileName(const char* filePath) {
-    const char* lastSlash = strrchr(filePath, '\\'); // Look for the last backslash
-    return (lastSlash != NULL) ? lastSlash + 1 : filePath; // Return the part after the slash
-}
-
 /**
  * @brief       Converts a binary hash to a hexadecimal string.
  *
@@ -199,18 +209,25 @@ bool StoreUserCredentials(_In_z_ const char* username, _In_reads_bytes_(HASH_HEX
     char usersFilePath[MAX_PATH];
     sprintf_s(usersFilePath, MAX_PATH, "%s\\users.txt", g_AppDirectory);
 
-    // Open users.txt for appending
-    FILE* file = fopen(usersFilePath, "a");
-    if (file == NULL) {
-        printf("Error opening file for writing: %s\n", strerror(errno));
+    // Format the entry: username and hashed password as hex
+    char entry[USERNAME_MAX_LENGTH + HASH_HEX_LENGTH + 3];
+    if (FAILED(StringCchPrintfA(entry, _countof(entry), "%s:%.*s\n", username, HASH_HEX_LENGTH, hashedPassword))) {
+        printf("Invalid user credentials\n");
         return false;
     }
 
-    // Write username and hashed password as hex
-    fprintf(file, "%s:%s\n", username, hashedPassword);
+    // Append it to users.txt; concurrent registrations append one at a time
+    AcquireSRWLockExclusive(&g_UsersFileLock);
+    bool appended = IoAppendFileContents(usersFilePath, entry, strlen(entry));
+    DWORD error = GetLastError();
+    ReleaseSRWLockExclusive(&g_UsersFileLock);
+    if (!appended) {
+        printf("Error writing user credentials: %lu\n", error);
+        return false;
+    }
 
-    fclose(file);
-    return true;
+    // Make the new entry durable according to the selected mode
+    return DurabilityCommitFile(usersFilePath);
 }
 
 /**
@@ -224,28 +241,23 @@ bool UserAlreadyRegistered(_In_ const char* username) {
     char usersFilePath[MAX_PATH];
     sprintf_s(usersFilePath, MAX_PATH, "%s\\users.txt", g_AppDirectory);
 
-    // Open users.txt file for reading.
-    FILE* file = fopen(usersFilePath, "r");
-    if (file == NULL) {
-        // Handle error
+    // Read users.txt.
+    char* contents = NULL;
+    if (!IoReadFileContents(usersFilePath, &contents, NULL)) {
         return false;   // user not registered if the file does not exist.
     }
-    
-    char line[USERNAME_MAX_LENGTH + 1]; // Buffer to hold each line of the file
-    // Read lines and check for the username
-    while (fgets(line, sizeof(line), file)) {
-        // Remove newline character from the line if present
-        line[strcspn(line, "\n")] = 0;
-
-        // Compare the line with provided username
-        if (strcmp(line, username) == 0) {
-            fclose(file);
-            return true;    // User is registered
-        }
+
+    // Read lines and check for the username before the ':'
+    bool registered = false;
+    char* cursor = contents;
+    char* line = NULL;
+    while (!registered && (line = IoTextNextLine(&cursor)) != NULL) {
+        size_t nameLength = strcspn(line, ":");
+        registered = nameLength == strlen(username) && strncmp(line, username, nameLength) == 0;
     }
 
-    fclose(file);
-    return false;   // User found, already registered
+    free(contents);
+    return registered;
 }
 
 
@@ -263,6 +275,30 @@ SafeStorageInit(
         printf("Failed to initialize the application directory.\n");
         return STATUS_UNSUCCESSFUL;
     }
+
+    /* Account the space of the users under it */
+    UsageInit(g_AppDirectory);
+
+    /* Remember the transfer settings that work best on its devices */
+    AutotuneInit(g_AppDirectory);
+
+    /* Start the worker pool used for chunk-level work */
+    if (!PoolInit(0, false)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    /* Start the group-commit flusher */
+    if (!DurabilityInit()) {
+        PoolDeinit();
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    /* Start the background scrubber */
+    if (!ScrubberStart(g_AppDirectory, SCRUBBER_DEFAULT_BYTES_PER_SECOND, SCRUBBER_DEFAULT_INTERVAL_SECONDS)) {
+        DurabilityDeinit();
+        PoolDeinit();
+        return STATUS_UNSUCCESSFUL;
+    }
     return STATUS_SUCCESS;
 }
 
@@ -272,19 +308,265 @@ SafeStorageDeinit(
     VOID
 )
 {
-    /* The function is not implemented. It is your responsibility. */
-    /* Here you can clean up any global objects you have created earlier. */
+    /* Write the rest of the command trace */
+    TraceStop();
+
+    /* Store the changes of a watched directory that are still pending and stop watching it */
+    WatchStop();
+
+    /* Checkpoint the segment index and close the segments */
+    SegmentsStop();
+
+    /* Stop the background scrubber and migrator */
+    ScrubberStop();
+    TieringStop();
+
+    /* Run the queued chunk tasks to completion and stop the workers */
+    PoolDeinit();
+
+    /* Flush anything still queued for group commit and stop the flusher */
+    DurabilityDeinit();
+
+    /* Free the cached submissions */
+    CacheConfigure(0, 0);
+
+    /* Forget the usage table and the transfer settings, free the files kept in memory and go back to the operating system's file systems */
+    UsageReset();
+    AutotuneReset();
+    IoSetBackend(NULL);
+    MemoryBackendReset();
 
     return;
 }
 
 
 NTSTATUS WINAPI
-SafeStorageHandleRegister(
-    const char* Username,
-    uint16_t UsernameLength,
-    const char* Password,
-    uint16_t PasswordLength
+SafeStorageSetDurabilityMode(
+    SafeStorageDurabilityMode Mode
+)
+{
+    if (!DurabilitySetMode(Mode)) {
+        printf("Invalid durability mode.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureThreadPool(
+    uint32_t WorkerCount,
+    BOOLEAN PinWorkers
+)
+{
+    if (WorkerCount > POOL_MAX_WORKERS) {
+        printf("Invalid worker count.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Drains the current pool before the new one takes over. Commands running meanwhile wait for it or run
+    // their tasks on their own threads, see PoolDeinit.
+    AcquireSRWLockExclusive(&g_ThreadPoolLock);
+    PoolDeinit();
+    bool started = PoolInit(WorkerCount, PinWorkers != FALSE);
+    ReleaseSRWLockExclusive(&g_ThreadPoolLock);
+
+    return started ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureColdTier(
+    const char* ColdDirectory,
+    uint16_t ColdDirectoryLength,
+    uint32_t ColdAfterSeconds,
+    uint64_t BytesPerSecond,
+    BOOLEAN Compress
+)
+{
+    // Validate ColdDirectory
+    if (ColdDirectory == NULL || ColdDirectoryLength == 0 || ColdDirectoryLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid cold tier directory.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char coldDirectory[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(coldDirectory, ColdDirectory, ColdDirectoryLength);
+
+    // The cold tier must not overlap the hot one
+    if (_stricmp(coldDirectory, g_AppDirectory) == 0) {
+        printf("The cold tier must be a different directory.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!TieringStart(g_AppDirectory, coldDirectory, ColdAfterSeconds, BytesPerSecond, Compress != FALSE)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureDataRoots(
+    const char* const* DataRoots,
+    uint32_t DataRootCount,
+    uint32_t StripeUnitSize
+)
+{
+    if ((DataRoots == NULL && DataRootCount > 0) || DataRootCount > STRIPING_MAX_ROOTS - 1) {
+        printf("Invalid data roots.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // %APPDIR% is always the first root
+    for (uint32_t i = 0; i < DataRootCount; i++) {
+        if (DataRoots[i] == NULL || DataRoots[i][0] == '\0' || _stricmp(DataRoots[i], g_AppDirectory) == 0) {
+            printf("Invalid data root.\n");
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if (!StripingConfigure(g_AppDirectory, DataRoots, DataRootCount, (StripeUnitSize != 0) ? StripeUnitSize : CHUNK_SIZE)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureScrubber(
+    uint64_t BytesPerSecond,
+    uint32_t IntervalSeconds
+)
+{
+    if (IntervalSeconds == 0) {
+        printf("Invalid scrub interval.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ScrubberConfigure(BytesPerSecond, IntervalSeconds);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetScrubStats(
+    SafeStorageScrubStats* Stats
+)
+{
+    if (Stats == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ScrubberGetStats(Stats);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureSparseFiles(
+    BOOLEAN DetectZeroChunks
+)
+{
+    InterlockedExchange(&g_DetectZeroChunks, DetectZeroChunks ? TRUE : FALSE);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureCache(
+    uint64_t MemoryLimitBytes,
+    uint64_t MaxSubmissionBytes
+)
+{
+    if (MaxSubmissionBytes > MemoryLimitBytes) {
+        printf("Invalid cache submission size limit.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CacheConfigure(MemoryLimitBytes, (MaxSubmissionBytes != 0) ? MaxSubmissionBytes : MemoryLimitBytes / 8);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetCacheStats(
+    SafeStorageCacheStats* Stats
+)
+{
+    if (Stats == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CacheGetStats(Stats);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureIoBackend(
+    SafeStorageIoBackend Backend,
+    const SafeStorageDiskSimulation* Simulation
+)
+{
+    const IO_BACKEND* backend = NULL;
+    switch (Backend) {
+    case SS_IO_BACKEND_OS:
+        backend = OsBackendGet();
+        break;
+    case SS_IO_BACKEND_MEMORY:
+        backend = MemoryBackendGet();
+        break;
+    default:
+        printf("Invalid I/O backend.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Simulation != NULL &&
+        (Simulation->LatencyMicroseconds != 0 || Simulation->JitterMicroseconds != 0 || Simulation->BytesPerSecond != 0)) {
+        ThrottledBackendConfigure(backend, Simulation->LatencyMicroseconds, Simulation->JitterMicroseconds, Simulation->BytesPerSecond);
+        backend = ThrottledBackendGet();
+    }
+
+    // The segments stay in the backend they were written to
+    SegmentsStop();
+
+    // %APPDIR% has to exist in the new backend before anything is stored under it
+    IoSetBackend(backend);
+    if (!IoCreateDirectories(g_AppDirectory)) {
+        printf("Failed to create the application directory in the %s backend: %lu\n", backend->Name, GetLastError());
+        IoSetBackend(NULL);
+        UsageReset();
+        AutotuneReset();
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // The usage of the new backend's users and the settings of its devices are read from it
+    UsageReset();
+    AutotuneReset();
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageSetRetention(
+    uint32_t MaxVersions,
+    uint32_t MaxAgeDays
+)
+{
+    VersionsSetRetention(MaxVersions, MaxAgeDays);
+    return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleRegister.
+ */
+static NTSTATUS RunRegister(
+    _In_reads_(UsernameLength) const char* Username,
+    _In_ uint16_t UsernameLength,
+    _In_reads_(PasswordLength) const char* Password,
+    _In_ uint16_t PasswordLength
 )
 {
     // Validate username
@@ -312,19 +594,18 @@ SafeStorageHandleRegister(
     // Check if parent directory exists
     char usersDir[MAX_PATH];
     sprintf(usersDir, "%s\\users", g_AppDirectory);
-    if (!CreateDirectoryA(usersDir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
-        printf("Error creating users directory: %s\n", strerror(errno));
+    if (!IoCreateDirectories(usersDir)) {
+        printf("Error creating users directory: %lu\n", GetLastError());
         return SS_STATUS_MEMORY_ALLOCATION_FAILED;
     }
 
-    if (!CreateDirectoryA(userDirectory, NULL)) {
-        DWORD dwError = GetLastError();
-        if (dwError == ERROR_ALREADY_EXISTS) {
-            printf("Directory already exists\n");
-        }
-        else {
-            printf("Error creating directory: %s\n", strerror(dwError));
-        }
+    IO_FILE_INFO existing = { 0 };
+    if (IoQueryFileInfo(userDirectory, &existing)) {
+        printf("Directory already exists\n");
+        return SS_STATUS_MEMORY_ALLOCATION_FAILED;
+    }
+    if (!IoCreateDirectories(userDirectory)) {
+        printf("Error creating directory: %lu\n", GetLastError());
         return SS_STATUS_MEMORY_ALLOCATION_FAILED;
     }
 
@@ -344,6 +625,22 @@ SafeStorageHandleRegister(
 }
 
 
+NTSTATUS WINAPI
+SafeStorageHandleRegister(
+    const char* Username,
+    uint16_t UsernameLength,
+    const char* Password,
+    uint16_t PasswordLength
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_REGISTER, Username, UsernameLength, PasswordLength, &trace);
+    NTSTATUS status = RunRegister(Username, UsernameLength, Password, PasswordLength);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
 bool IsUserLoggedIn(void) {
     return g_IsUserLoggedIn;
 }
@@ -358,15 +655,15 @@ bool RetrieveUserCredentials(_In_ const char* Username, _Out_writes_z_(HASH_LENG
         return false;
     }
 
-    FILE* file = fopen(filePath, "r");
-    if (file == NULL) {
+    char* contents = NULL;
+    if (!IoReadFileContents(filePath, &contents, NULL)) {
         printf("Failed to open users.txt\n");
         OutHashedPassword[0] = '\0'; // Ensure it's always null-terminated
         return false;
     }
 
-    // Increase buffer size to accommodate 64 characters of hash + 1 for null terminator
-    char line[USERNAME_MAX_LENGTH + HASH_LENGTH * 2 + 2]; // 2 extra for ':' and '\0'
+    char* cursor = contents;
+    char* line = NULL;
     char storedUsername[USERNAME_MAX_LENGTH + 1] = { 0 };
     char storedHashedPassword[HASH_LENGTH * 2 + 1] = { 0 }; // 64 hex chars + 1 null terminator
 
@@ -374,10 +671,7 @@ bool RetrieveUserCredentials(_In_ const char* Username, _Out_writes_z_(HASH_LENG
     OutHashedPassword[0] = '\0';
 
     // Read each line and parse for username and hash
-    while (fgets(line, sizeof(line), file) != NULL) {
-        // Remove any trailing newline character
-        line[strcspn(line, "\r\n")] = '\0';
-
+    while ((line = IoTextNextLine(&cursor)) != NULL) {
         // Parse line as "username:hashed_password"
         if (sscanf_s(line, "%10[^:]:%64s", storedUsername, (unsigned)_countof(storedUsername), storedHashedPassword, (unsigned)_countof(storedHashedPassword)) == 2) {
             if (strcmp(Username, storedUsername) == 0) {
@@ -387,7 +681,7 @@ bool RetrieveUserCredentials(_In_ const char* Username, _Out_writes_z_(HASH_LENG
                 // Ensure null termination
                 OutHashedPassword[HASH_LENGTH * 2] = '\0';
 
-                fclose(file);
+                free(contents);
                 return true;
             }
         }
@@ -396,7 +690,7 @@ bool RetrieveUserCredentials(_In_ const char* Username, _Out_writes_z_(HASH_LENG
         }
     }
 
-    fclose(file);
+    free(contents);
     printf("User not found\n");
     return false;  // User not found
 }
@@ -404,18 +698,16 @@ bool RetrieveUserCredentials(_In_ const char* Username, _Out_writes_z_(HASH_LENG
 
 
 
-NTSTATUS WINAPI
-SafeStorageHandleLogin(
-    const char* Username,
-    uint16_t UsernameLength,
-    const char* Password,
-    uint16_t PasswordLength
+/**
+ * @brief       Implements SafeStorageHandleLogin.
+ */
+static NTSTATUS RunLogin(
+    _In_reads_(UsernameLength) const char* Username,
+    _In_ uint16_t UsernameLength,
+    _In_reads_(PasswordLength) const char* Password,
+    _In_ uint16_t PasswordLength
 )
 {
-    /* The function is not implemented. It is your responsibility. */
-    /* After you implement the function, you can remove UNREFERENCED_PARAMETER(x). */
-    /* This is just to prevent a compilation warning that the parameter is unused. */
-
     // Check if a user is already logged in
     if (g_IsUserLoggedIn) {
         printf("You are already logged in as %s. Please log out first.\n", g_LoggedInUsername);
@@ -466,7 +758,25 @@ SafeStorageHandleLogin(
 
 
 NTSTATUS WINAPI
-SafeStorageHandleLogout(
+SafeStorageHandleLogin(
+    const char* Username,
+    uint16_t UsernameLength,
+    const char* Password,
+    uint16_t PasswordLength
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_LOGIN, Username, UsernameLength, PasswordLength, &trace);
+    NTSTATUS status = RunLogin(Username, UsernameLength, Password, PasswordLength);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleLogout.
+ */
+static NTSTATUS RunLogout(
     VOID
 )
 {
@@ -476,6 +786,9 @@ SafeStorageHandleLogout(
         return SS_STATUS_NOT_LOGGED_IN;
     }
 
+    // A watched directory is synced as the user who started the watch
+    WatchStop();
+
     // Log the user out
     printf("Goodbye, %s!\n", g_LoggedInUsername);
     g_IsUserLoggedIn = false; // Set logged-in state to false
@@ -485,6 +798,19 @@ SafeStorageHandleLogout(
 }
 
 
+NTSTATUS WINAPI
+SafeStorageHandleLogout(
+    VOID
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_LOGOUT, NULL, 0, 0, &trace);
+    NTSTATUS status = RunLogout();
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
 void SetWritePermissions(LPCSTR filePath) {
     DWORD result;
     PACL pOldDACL = NULL;
@@ -544,90 +870,629 @@ void SetWritePermissions(LPCSTR filePath) {
 }
 
 
-NTSTATUS WINAPI
-SafeStorageHandleStore(
-    const char* SubmissionName,
-    uint16_t SubmissionNameLength,
-    const char* SourceFilePath,
-    uint16_t SourceFilePathLength
-)
-{
-    // Check if a user is logged in
-    if (!g_IsUserLoggedIn) {
-        printf("No user is logged in.\n");
-        return SS_STATUS_NOT_LOGGED_IN;
+/**
+ * @brief       Validates a submission name. The name becomes a file name under the user's directory,
+ *              so path separators, characters reserved by the file system and the '~' used for
+ *              in-progress files are rejected, as are "." and "..".
+ *
+ * @param       submissionName          The submission name to validate.
+ * @param       submissionNameLength    The length of the submission name.
+ * @return      TRUE if the submission name is valid; otherwise, FALSE.
+ */
+bool isValidSubmissionName(_In_reads_opt_(submissionNameLength) const char* submissionName, _In_ uint16_t submissionNameLength) {
+    if (submissionName == NULL || submissionNameLength == 0 || submissionNameLength > MAX_SUBMISSION_NAME_LENGTH) {
+        return false;
     }
 
-    // Validate SubmissionName
-    if (SubmissionName == NULL || SubmissionNameLength == 0 || SubmissionNameLength > MAX_SUBMISSION_NAME_LENGTH) {
-        printf("Invalid submission name.\n");
-        return STATUS_INVALID_PARAMETER;
+    if ((submissionNameLength == 1 && submissionName[0] == '.') ||
+        (submissionNameLength == 2 && submissionName[0] == '.' && submissionName[1] == '.')) {
+        return false;
     }
 
-    // Validate SourceFilePath
-    if (SourceFilePath == NULL || SourceFilePathLength == 0 || SourceFilePathLength > MAX_FILE_PATH_LENGTH) {
-        printf("Invalid source file path.\n");
-        return STATUS_INVALID_PARAMETER;
+    for (uint16_t i = 0; i < submissionNameLength; i++) {
+        if ((unsigned char)submissionName[i] < 0x20 || strchr("\\/:*?\"<>|~", submissionName[i]) != NULL) {
+            return false;
+        }
     }
 
-    // Construct the destination path for the submission
-    char destinationPath[MAX_PATH];
+    return true;
+}
+
+
+/**
+ * @brief       Builds %APPDIR%\users\<logged in user>\<SubmissionName>.
+ *
+ * @param       submissionName          The (validated) submission name.
+ * @param       submissionNameLength    The length of the submission name.
+ * @param       submissionPath          Receives the path (MAX_PATH characters).
+ * @return      TRUE if the path fits; otherwise, FALSE.
+ */
+bool BuildSubmissionPath(_In_reads_(submissionNameLength) const char* submissionName, _In_ uint16_t submissionNameLength, _Out_writes_z_(MAX_PATH) char* submissionPath) {
     int result = snprintf(
-        destinationPath,
-        sizeof(destinationPath),
+        submissionPath,
+        MAX_PATH,
         "%s\\users\\%s\\%.*s",
         g_AppDirectory,
         g_LoggedInUsername,
-        SubmissionNameLength,
-        SubmissionName
+        submissionNameLength,
+        submissionName
     );
 
     // Check for truncation or formatting errors
-    if (result < 0 || result >= (int)sizeof(destinationPath)) {
-        printf("Failed to construct the destination path.\n");
-        return STATUS_BUFFER_OVERFLOW;
-    }
+    return result >= 0 && result < MAX_PATH;
+}
 
 
-    // Ensure the user's directory exists
-    if (CreateDirectoryA(destinationPath, NULL) == 0 && GetLastError() != ERROR_ALREADY_EXISTS) {
-        printf("Failed to create the directory for the submission: %lu\n", GetLastError());
-        return STATUS_UNSUCCESSFUL;
+/**
+ * @brief       Validates a nested submission name, e.g. "project\src\main.c", as stored by the tree commands.
+ *              Every component must be a valid submission name; '/' separators are turned into '\'.
+ *
+ * @param       submissionPath          The submission name to validate and normalize, null-terminated.
+ * @return      TRUE if the submission name is valid; otherwise, FALSE.
+ */
+static bool isValidSubmissionPath(_Inout_z_ char* submissionPath) {
+    size_t length = strlen(submissionPath);
+    if (length == 0 || length >= MAX_PATH) {
+        return false;
     }
 
+    size_t start = 0;
+    for (size_t i = 0; i <= length; i++) {
+        if (submissionPath[i] == '/') {
+            submissionPath[i] = '\\';
+        }
+        if (submissionPath[i] == '\\' || submissionPath[i] == '\0') {
+            // Also rejects empty components, i.e. leading, trailing or doubled separators
+            if (i - start > MAX_SUBMISSION_NAME_LENGTH || !isValidSubmissionName(submissionPath + start, (uint16_t)(i - start))) {
+                return false;
+            }
+            start = i + 1;
+        }
+    }
 
-    //Copy the source file to the destination
-    const char* sourceFileName = ExtractFileName(SourceFilePath);
-
-    // Buffer to hold the final destination path
-    char fullDestinationPath[MAX_PATH];
+    return true;
+}
 
-    // Safely construct the full destination path
-    if (FAILED(StringCchPrintfA(fullDestinationPath, MAX_PATH, "%s\\%s", destinationPath, sourceFileName))) {
-        printf("Failed to construct the full destination path.\n");
-        return STATUS_UNSUCCESSFUL;
-    }
 
-    if (!CopyFileA(SourceFilePath, fullDestinationPath, FALSE)) {
-        printf("Failed to copy the file to the destination: %lu\n", GetLastError());
+/**
+ * @brief       Flags that make store and retrieve preserve holes (and, if configured, create them from zero chunks).
+ */
+static DWORD SparseTransferFlags(void) {
+    return TRANSFER_FLAG_SPARSE | (g_DetectZeroChunks ? TRANSFER_FLAG_DETECT_ZEROS : 0);
+}
+
+
+/**
+ * @brief       Returns the size of a submission, in whichever tier it is.
+ *
+ * @return      FALSE if the submission does not exist.
+ */
+static bool QuerySubmissionSize(_In_z_ const char* submissionPath, _Out_ uint64_t* size) {
+    char coldPath[MAX_PATH];
+    IO_FILE_INFO info = { 0 };
+    bool exists = IoQueryFileInfo(submissionPath, &info) ||
+                  (TieringGetColdPath(submissionPath, coldPath) && IoQueryFileInfo(coldPath, &info));
+
+    *size = exists ? info.Size : 0;
+    return exists;
+}
+
+
+/**
+ * @brief       Stores one file as a submission: preserves the version it replaces, copies the file over the
+ *              submission and records the new version. Shared by the single and bulk store commands.
+ *
+ * @param       userDirectory       %APPDIR%\users\<logged in user>.
+ * @param       submissionName      The validated submission name, possibly nested ("project\main.c").
+ * @param       sourcePath          The file to store; NULL to store the stream returned by readRoutine instead.
+ * @param       readRoutine         Reads the stream to store if there is no sourcePath.
+ * @param       readContext         Passed to readRoutine.
+ * @param       destinationPath     The path of the submission. Its directory must exist.
+ * @param       version             Receives the new version, or 0 if it could not be recorded.
+ * @param       storedSize          Receives the size of the submission as stored, or 0 if it was not stored.
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+static NTSTATUS StoreSubmission(
+    _In_z_ const char* userDirectory,
+    _In_z_ const char* submissionName,
+    _In_opt_z_ const char* sourcePath,
+    _In_opt_ TRANSFER_READ_ROUTINE readRoutine,
+    _Inout_opt_ PVOID readContext,
+    _In_z_ const char* destinationPath,
+    _Out_ uint32_t* version,
+    _Out_ uint64_t* storedSize
+)
+{
+    *version = 0;
+    *storedSize = 0;
+
+    // Check the quota before anything is copied: a new submission adds its size, an overwrite the difference.
+    // A stream's size is only known at the end, so it is limited to what is left of the quota instead.
+    uint64_t oldSize = 0;
+    bool isFile = QuerySubmissionSize(destinationPath, &oldSize);
+    bool exists = isFile || SegmentsQuery(g_LoggedInUsername, submissionName, &oldSize);
+    IO_FILE_INFO source = { 0 };
+    bool sourceFound = (sourcePath != NULL) && IoQueryFileInfo(sourcePath, &source);
+    if (sourcePath != NULL && !sourceFound) {
+        source.Size = oldSize;                  // TransferFile reports the missing source
+    }
+
+    // A small file is appended to a segment, unless the submission already is a file of its own
+    uint32_t segmentLimit = SegmentsMaxObjectSize();
+    bool segmented = sourceFound && !isFile && segmentLimit != 0 && source.Size <= segmentLimit;
+
+    USAGE_RESERVATION reservation = { 0 };
+    NTSTATUS status = UsageReserve(g_LoggedInUsername, (sourcePath != NULL) ? (int64_t)source.Size - (int64_t)oldSize : 0,
+                                   exists ? 0 : 1, &reservation);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    uint64_t maxStreamSize = (reservation.Headroom > (uint64_t)MAX_FILE_SIZE - oldSize) ? (uint64_t)MAX_FILE_SIZE : oldSize + reservation.Headroom;
+
+    // Submissions kept in segments have no versions to preserve or record
+    if (segmented) {
+        ScrubberNoteForegroundStart();
+        status = SegmentsStoreFile(g_LoggedInUsername, submissionName, sourcePath);
+        ScrubberNoteForegroundEnd();
+
+        uint64_t segmentSize = 0;
+        bool appended = NT_SUCCESS(status) && SegmentsQuery(g_LoggedInUsername, submissionName, &segmentSize);
+        UsageCommit(&reservation, appended, (int64_t)segmentSize - (int64_t)oldSize, exists ? 0 : 1);
+        *storedSize = segmentSize;
+        return status;
+    }
+
+    ScrubberNoteForegroundStart();
+
+    // The version about to be replaced must stay retrievable: copy its blocks that no earlier version has.
+    // They count towards the quota too, so the store fails if they do not fit.
+    status = VersionsFreezeCurrent(userDirectory, submissionName, g_LoggedInUsername);
+    if (!NT_SUCCESS(status)) {
+        ScrubberNoteForegroundEnd();
+        UsageCommit(&reservation, false, 0, 0);
+        return status;
+    }
+
+    // Copy in parallel chunks into a preallocated temporary file and publish it over the old submission.
+    // An interrupted store of the same source leaves a checkpoint, so repeating it resumes.
+    // The block checksums recorded on the way are what the scrubber verifies later.
+    // With data roots configured the copy is striped over them and written to all of them at once.
+    // A stream is written the same way while it is read, but cannot be read again to resume.
+    status = (sourcePath != NULL) ?
+        TransferFile(sourcePath, destinationPath, g_LoggedInUsername,
+                     TRANSFER_FLAG_RESUMABLE | TRANSFER_FLAG_MANIFEST | TRANSFER_FLAG_STRIPED | SparseTransferFlags()) :
+        TransferStream(readRoutine, readContext, destinationPath, g_LoggedInUsername,
+                       TRANSFER_FLAG_MANIFEST | TRANSFER_FLAG_STRIPED | SparseTransferFlags(), maxStreamSize);
+    ScrubberNoteForegroundEnd();
+    if (status == STATUS_FILE_TOO_LARGE && maxStreamSize < (uint64_t)MAX_FILE_SIZE) {
+        status = STATUS_QUOTA_EXCEEDED;
+    }
+
+    // Account for what was actually published; the source may have changed since it was checked
+    uint64_t newSize = 0;
+    bool stored = NT_SUCCESS(status) && QuerySubmissionSize(destinationPath, &newSize);
+    UsageCommit(&reservation, stored, (int64_t)newSize - (int64_t)oldSize, exists ? 0 : 1);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    *storedSize = newSize;
+
+    // An older cold-tier copy is now stale, and so is whatever was cached or kept in segments for the submission
+    TieringDiscardCold(destinationPath);
+    CacheInvalidate(destinationPath);
+    SegmentsDelete(g_LoggedInUsername, submissionName);
+
+    // The checksums just recorded become the new version. Should this fail, the next store or snapshot
+    // records the submission from its contents instead.
+    if (!VersionsRecordCurrent(userDirectory, submissionName, version)) {
+        *version = 0;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief       Implements the store commands: validates the submission name, creates the user's directory and
+ *              stores the file or stream as the submission.
+ *
+ * @param       submissionName          The submission to store.
+ * @param       submissionNameLength    The length of the submission name.
+ * @param       sourcePath              The file to store; NULL to store the stream returned by readRoutine instead.
+ * @param       readRoutine             Reads the stream to store if there is no sourcePath.
+ * @param       readContext             Passed to readRoutine.
+ * @param       storedSize              Receives the size of the submission as stored, or 0 if it was not stored.
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+static NTSTATUS HandleStore(
+    _In_reads_(submissionNameLength) const char* submissionName,
+    _In_ uint16_t submissionNameLength,
+    _In_opt_z_ const char* sourcePath,
+    _In_opt_ TRANSFER_READ_ROUTINE readRoutine,
+    _Inout_opt_ PVOID readContext,
+    _Out_ uint64_t* storedSize
+)
+{
+    *storedSize = 0;
+
+    // Construct the destination path for the submission
+    char destinationPath[MAX_PATH];
+    if (!BuildSubmissionPath(submissionName, submissionNameLength, destinationPath)) {
+        printf("Failed to construct the destination path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    // Ensure the user's directory exists
+    char userDirectory[MAX_PATH];
+    sprintf_s(userDirectory, MAX_PATH, "%s\\users\\%s", g_AppDirectory, g_LoggedInUsername);
+    if (!IoCreateDirectories(userDirectory)) {
+        printf("Failed to create the user directory: %lu\n", GetLastError());
         return STATUS_UNSUCCESSFUL;
     }
 
+    char name[MAX_SUBMISSION_NAME_LENGTH + 1] = { 0 };
+    memcpy(name, submissionName, submissionNameLength);
+
+    uint32_t version = 0;
+    NTSTATUS status = StoreSubmission(userDirectory, name, sourcePath, readRoutine, readContext, destinationPath, &version, storedSize);
+    if (!NT_SUCCESS(status)) {
+        printf("Failed to store the file: 0x%x\n", status);
+        return status;
+    }
 
-    printf("File successfully stored at: %s\n", destinationPath);
+    uint64_t segmentSize = 0;
+    if (version != 0) {
+        printf("File successfully stored at: %s (version %lu)\n", destinationPath, version);
+    }
+    else if (SegmentsQuery(g_LoggedInUsername, name, &segmentSize)) {
+        printf("File successfully stored in a segment as: %s\n", name);
+    }
+    else {
+        printf("File successfully stored at: %s (version not recorded)\n", destinationPath);
+    }
     return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief       Reads a stream from a handle. A pipe whose writer has closed it has ended.
+ */
+static bool ReadSourceHandle(_Inout_opt_ PVOID context, _Out_writes_bytes_to_(length, *bytesRead) void* buffer, _In_ DWORD length, _Out_ DWORD* bytesRead) {
+    if (ReadFile((HANDLE)context, buffer, length, bytesRead, NULL)) {
+        return true;
+    }
+
+    // A message longer than the buffer continues with the next read
+    DWORD error = GetLastError();
+    if (error == ERROR_MORE_DATA) {
+        return true;
+    }
+    *bytesRead = 0;
+    return error == ERROR_BROKEN_PIPE;
+}
+
+
+// The caller's read routine of SafeStorageHandleStoreStream
+typedef struct _CALLER_STREAM {
+    SafeStorageReadRoutine Routine;
+    void* Context;
+} CALLER_STREAM;
+
+
+/**
+ * @brief       Reads a stream through the caller's read routine.
+ */
+static bool ReadCallerStream(_Inout_opt_ PVOID context, _Out_writes_bytes_to_(length, *bytesRead) void* buffer, _In_ DWORD length, _Out_ DWORD* bytesRead) {
+    const CALLER_STREAM* stream = (const CALLER_STREAM*)context;
+    uint32_t count = 0;
+    bool result = stream->Routine(stream->Context, buffer, length, &count) != FALSE;
+
+    // Never trust the caller to stay within the buffer
+    *bytesRead = min(count, length);
+    return result;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleStore.
+ */
+static NTSTATUS RunStore(
+    _In_reads_(SubmissionNameLength) const char* SubmissionName,
+    _In_ uint16_t SubmissionNameLength,
+    _In_reads_(SourceFilePathLength) const char* SourceFilePath,
+    _In_ uint16_t SourceFilePathLength,
+    _Out_ uint64_t* StoredSize
+)
+{
+    *StoredSize = 0;
+
+    // Check if a user is logged in
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    // Validate SubmissionName
+    if (!isValidSubmissionName(SubmissionName, SubmissionNameLength)) {
+        printf("Invalid submission name.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Validate SourceFilePath
+    if (SourceFilePath == NULL || SourceFilePathLength == 0 || SourceFilePathLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid source file path.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // The caller's string is not guaranteed to be null-terminated at SourceFilePathLength
+    char sourcePath[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(sourcePath, SourceFilePath, SourceFilePathLength);
+
+    return HandleStore(SubmissionName, SubmissionNameLength, sourcePath, NULL, NULL, StoredSize);
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleStore(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* SourceFilePath,
+    uint16_t SourceFilePathLength
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_STORE, SubmissionName, SubmissionNameLength, SourceFilePathLength, &trace);
+    NTSTATUS status = RunStore(SubmissionName, SubmissionNameLength, SourceFilePath, SourceFilePathLength, &trace.Bytes);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleStoreStream.
+ */
+static NTSTATUS RunStoreStream(
+    _In_reads_(SubmissionNameLength) const char* SubmissionName,
+    _In_ uint16_t SubmissionNameLength,
+    _In_opt_ SafeStorageReadRoutine ReadRoutine,
+    _Inout_opt_ void* Context,
+    _Out_ uint64_t* StoredSize
+)
+{
+    *StoredSize = 0;
+
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (!isValidSubmissionName(SubmissionName, SubmissionNameLength) || ReadRoutine == NULL) {
+        printf("Invalid parameters.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CALLER_STREAM stream = { ReadRoutine, Context };
+    return HandleStore(SubmissionName, SubmissionNameLength, NULL, ReadCallerStream, &stream, StoredSize);
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleStoreStream(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    SafeStorageReadRoutine ReadRoutine,
+    void* Context
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_STORE_STREAM, SubmissionName, SubmissionNameLength, 0, &trace);
+    NTSTATUS status = RunStoreStream(SubmissionName, SubmissionNameLength, ReadRoutine, Context, &trace.Bytes);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleStoreFromHandle.
+ */
+static NTSTATUS RunStoreFromHandle(
+    _In_reads_(SubmissionNameLength) const char* SubmissionName,
+    _In_ uint16_t SubmissionNameLength,
+    _In_opt_ HANDLE SourceHandle,
+    _Out_ uint64_t* StoredSize
+)
+{
+    *StoredSize = 0;
+
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (!isValidSubmissionName(SubmissionName, SubmissionNameLength) ||
+        SourceHandle == NULL || SourceHandle == INVALID_HANDLE_VALUE) {
+        printf("Invalid parameters.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return HandleStore(SubmissionName, SubmissionNameLength, NULL, ReadSourceHandle, SourceHandle, StoredSize);
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleStoreFromHandle(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    HANDLE SourceHandle
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_STORE_STREAM, SubmissionName, SubmissionNameLength, 0, &trace);
+    NTSTATUS status = RunStoreFromHandle(SubmissionName, SubmissionNameLength, SourceHandle, &trace.Bytes);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Copies a submission, or a version of it, to a destination, promoting it from the cold tier
+ *              if needed. Shared by the single and bulk retrieve commands.
+ *
+ * @param       userDirectory       %APPDIR%\users\<logged in user>.
+ * @param       submissionName      The validated submission name, possibly nested ("project\main.c").
+ * @param       submissionPath      The path of the submission.
+ * @param       destinationPath     Where to copy the submission. Its directory must exist.
+ * @param       transferFlags       TRANSFER_FLAG_* values passed to TransferFile.
+ * @param       version             Version to reassemble instead, or 0 for the current one.
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+static NTSTATUS RetrieveSubmissionTo(
+    _In_z_ const char* userDirectory,
+    _In_z_ const char* submissionName,
+    _In_z_ const char* submissionPath,
+    _In_z_ const char* destinationPath,
+    _In_ DWORD transferFlags,
+    _In_ uint32_t version
+)
+{
+    ScrubberNoteForegroundStart();
+
+    // A submission kept in segments is written straight from its record. A file of the same name is newer.
+    uint64_t segmentSize = 0;
+    uint64_t segmentWriteTime = 0;
+    BYTE* segmentData = NULL;
+    if (version == 0 && !QuerySubmissionSize(submissionPath, &segmentSize) &&
+        SegmentsRead(g_LoggedInUsername, submissionName, &segmentData, &segmentSize, &segmentWriteTime)) {
+        NTSTATUS segmentStatus = TransferBuffer(segmentData, segmentSize, segmentWriteTime, destinationPath);
+        free(segmentData);
+        ScrubberNoteForegroundEnd();
+        return segmentStatus;
+    }
+
+    // A version retrieved recently is written straight from memory. The current version is identified by the
+    // submission's size and last write time; one in the cold tier is not cached.
+    IO_FILE_INFO current = { 0 };
+    bool cacheable = (transferFlags & TRANSFER_FLAG_DELTA) == 0 && CacheIsEnabled() &&
+                     (version != 0 || IoQueryFileInfo(submissionPath, &current));
+    CACHE_ENTRY* cached = cacheable ? CacheLookup(submissionPath, version, (version == 0) ? &current : NULL) : NULL;
+
+    NTSTATUS status = STATUS_SUCCESS;
+    if (cached != NULL) {
+        uint64_t size = 0;
+        uint64_t lastWriteTime = 0;
+        const BYTE* data = CacheEntryData(cached, &size, &lastWriteTime);
+        status = TransferBuffer(data, size, lastWriteTime, destinationPath);
+        CacheRelease(cached);
+    }
+
+    else {
+        // Bring the submission back from the cold tier if it was migrated
+        status = TieringEnsureHot(submissionPath);
+
+        // Earlier versions are reassembled from the block store (and from the submission, for blocks they share
+        // with the current version). The submission itself may not exist anymore.
+        if (version != 0) {
+            status = VersionsRestore(userDirectory, submissionName, version, destinationPath, g_LoggedInUsername);
+        }
+
+        // Same pipeline as store: the destination is replaced atomically once fully written.
+        // If the migrator moved the submission in the meantime, promote it and try once more.
+        else if (NT_SUCCESS(status)) {
+            transferFlags |= SparseTransferFlags();
+            status = TransferFile(submissionPath, destinationPath, g_LoggedInUsername, transferFlags);
+            if (status == STATUS_OBJECT_NAME_NOT_FOUND && NT_SUCCESS(TieringEnsureHot(submissionPath))) {
+                status = TransferFile(submissionPath, destinationPath, g_LoggedInUsername, transferFlags);
+            }
+        }
+    }
+
+    // The copy just written is still in the file system cache; keep it for the next retrieve
+    if (NT_SUCCESS(status) && cacheable && cached == NULL) {
+        CacheInsert(submissionPath, version, (version == 0) ? &current : NULL, destinationPath);
+    }
+
+    ScrubberNoteForegroundEnd();
+    if (NT_SUCCESS(status)) {
+        // Keeps the submission in the hot tier
+        TieringRecordAccess(submissionPath);
+    }
+    return status;
+}
+
+
+/**
+ * @brief       Implements the retrieve commands: validates the parameters, promotes the submission from the
+ *              cold tier if needed and copies it to the destination.
+ *
+ * @param       submissionName              The submission to retrieve.
+ * @param       submissionNameLength        The length of the submission name.
+ * @param       destinationFilePath         Where to copy the submission.
+ * @param       destinationFilePathLength   The length of the destination path.
+ * @param       transferFlags               TRANSFER_FLAG_* values passed to TransferFile.
+ * @param       version                     Version to reassemble instead, or 0 for the current one.
+ * @param       snapshotId                  Snapshot whose version to retrieve, or 0.
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+static NTSTATUS RetrieveSubmission(
+    _In_reads_(submissionNameLength) const char* submissionName,
+    _In_ uint16_t submissionNameLength,
+    _In_reads_(destinationFilePathLength) const char* destinationFilePath,
+    _In_ uint16_t destinationFilePathLength,
+    _In_ DWORD transferFlags,
+    _In_ uint32_t version,
+    _In_ uint32_t snapshotId
+)
+{
+    // Check if a user is logged in
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    // Validate the submission name. Submissions stored by the tree commands have nested names.
+    char name[MAX_PATH] = { 0 };
+    if (submissionName != NULL && submissionNameLength < MAX_PATH) {
+        memcpy(name, submissionName, submissionNameLength);
+    }
+    if (!isValidSubmissionPath(name)) {
+        printf("Invalid submission name.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Validate the destination path
+    if (destinationFilePath == NULL || destinationFilePathLength == 0 || destinationFilePathLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid destination file path.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char destinationPath[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(destinationPath, destinationFilePath, destinationFilePathLength);
+
+    // Construct the path of the stored submission
+    char submissionPath[MAX_PATH];
+    if (!BuildSubmissionPath(name, (uint16_t)strlen(name), submissionPath)) {
+        printf("Failed to construct the submission path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
 
+    char userDirectory[MAX_PATH];
+    sprintf_s(userDirectory, MAX_PATH, "%s\\users\\%s", g_AppDirectory, g_LoggedInUsername);
 
-    ///* The function is not implemented. It is your responsibility. */
-    ///* After you implement the function, you can remove UNREFERENCED_PARAMETER(x). */
-    ///* This is just to prevent a compilation warning that the parameter is unused. */
+    NTSTATUS status = STATUS_SUCCESS;
+    if (snapshotId != 0) {
+        status = VersionsResolveSnapshot(userDirectory, snapshotId, name, &version);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
 
-    //UNREFERENCED_PARAMETER(SubmissionName);
-    //UNREFERENCED_PARAMETER(SubmissionNameLength);
-    //UNREFERENCED_PARAMETER(SourceFilePath);
-    //UNREFERENCED_PARAMETER(SourceFilePathLength);
+    status = RetrieveSubmissionTo(userDirectory, name, submissionPath, destinationPath, transferFlags, version);
+    if (!NT_SUCCESS(status)) {
+        printf("Failed to retrieve the submission: 0x%x\n", status);
+        return status;
+    }
 
-    //return STATUS_NOT_IMPLEMENTED;
+    printf("Submission successfully retrieved to: %s\n", destinationPath);
+    return STATUS_SUCCESS;
 }
 
 
@@ -639,14 +1504,947 @@ SafeStorageHandleRetrieve(
     uint16_t DestinationFilePathLength
 )
 {
-    /* The function is not implemented. It is your responsibility. */
-    /* After you implement the function, you can remove UNREFERENCED_PARAMETER(x). */
-    /* This is just to prevent a compilation warning that the parameter is unused. */
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_RETRIEVE, SubmissionName, SubmissionNameLength, DestinationFilePathLength, &trace);
+    NTSTATUS status = RetrieveSubmission(SubmissionName, SubmissionNameLength, DestinationFilePath, DestinationFilePathLength, 0, 0, 0);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveDelta(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* DestinationFilePath,
+    uint16_t DestinationFilePathLength
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_RETRIEVE_DELTA, SubmissionName, SubmissionNameLength, DestinationFilePathLength, &trace);
+
+    // Only the blocks that differ from the submission are written to the existing destination
+    NTSTATUS status = RetrieveSubmission(SubmissionName, SubmissionNameLength, DestinationFilePath, DestinationFilePathLength, TRANSFER_FLAG_DELTA, 0, 0);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveVersion(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* DestinationFilePath,
+    uint16_t DestinationFilePathLength,
+    uint32_t Version
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_RETRIEVE_VERSION, SubmissionName, SubmissionNameLength, DestinationFilePathLength, &trace);
+    trace.Count = Version;
+    NTSTATUS status = RetrieveSubmission(SubmissionName, SubmissionNameLength, DestinationFilePath, DestinationFilePathLength, 0, Version, 0);
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleSnapshot.
+ */
+static NTSTATUS RunSnapshot(
+    _Out_opt_ uint32_t* SnapshotId
+)
+{
+    // Check if a user is logged in
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (SnapshotId == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char userDirectory[MAX_PATH];
+    sprintf_s(userDirectory, MAX_PATH, "%s\\users\\%s", g_AppDirectory, g_LoggedInUsername);
+
+    ScrubberNoteForegroundStart();
+    NTSTATUS status = VersionsSnapshot(userDirectory, g_LoggedInUsername, SnapshotId);
+    ScrubberNoteForegroundEnd();
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    printf("Snapshot %lu created.\n", *SnapshotId);
+    return STATUS_SUCCESS;
+}
 
-    UNREFERENCED_PARAMETER(SubmissionName);
-    UNREFERENCED_PARAMETER(SubmissionNameLength);
-    UNREFERENCED_PARAMETER(DestinationFilePath);
-    UNREFERENCED_PARAMETER(DestinationFilePathLength);
 
-    return STATUS_NOT_IMPLEMENTED;
+NTSTATUS WINAPI
+SafeStorageHandleSnapshot(
+    uint32_t* SnapshotId
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_SNAPSHOT, NULL, 0, 0, &trace);
+    NTSTATUS status = RunSnapshot(SnapshotId);
+    if (NT_SUCCESS(status)) {
+        trace.Count = *SnapshotId;
+    }
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveSnapshot(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* DestinationFilePath,
+    uint16_t DestinationFilePathLength,
+    uint32_t SnapshotId
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_RETRIEVE_SNAPSHOT, SubmissionName, SubmissionNameLength, DestinationFilePathLength, &trace);
+    trace.Count = SnapshotId;
+
+    NTSTATUS status = STATUS_INVALID_PARAMETER;
+    if (SnapshotId == 0) {
+        printf("Invalid snapshot identifier.\n");
+    }
+    else {
+        status = RetrieveSubmission(SubmissionName, SubmissionNameLength, DestinationFilePath, DestinationFilePathLength, 0, 0, SnapshotId);
+    }
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+// What a SafeStorageView holds on to until it is closed
+typedef struct _SUBMISSION_VIEW {
+    CACHE_ENTRY* Cached;                        // Set if the view points into the retrieve cache
+    SS_FILE* File;                              // Otherwise the open submission, mapped at Mapping
+    const void* Mapping;
+} SUBMISSION_VIEW;
+
+
+/**
+ * @brief       Opens and maps the current version of a submission, promoting it from the cold tier if needed.
+ *
+ * @param       submissionPath      The hot-tier path of the submission.
+ * @param       pattern             How the view will be read.
+ * @param       view                Receives the open file and its mapping.
+ * @param       size                Receives the size of the submission.
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+static NTSTATUS MapSubmission(_In_z_ const char* submissionPath, _In_ IoAccessPattern pattern, _Inout_ SUBMISSION_VIEW* view, _Out_ uint64_t* size) {
+    *size = 0;
+
+    NTSTATUS status = TieringEnsureHot(submissionPath);
+    if (NT_SUCCESS(status)) {
+        view->File = StripingOpenFile(submissionPath, IO_OPEN_READ);
+
+        // If the migrator moved the submission in the meantime, promote it and try once more
+        if (view->File == NULL && NT_SUCCESS(status = TieringEnsureHot(submissionPath))) {
+            view->File = StripingOpenFile(submissionPath, IO_OPEN_READ);
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    if (view->File == NULL) {
+        DWORD error = GetLastError();
+        return (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_UNSUCCESSFUL;
+    }
+
+    if (!IoMapView(view->File, pattern, &view->Mapping, size)) {
+        printf("Failed to map the submission: %lu\n", GetLastError());
+        IoCloseFile(view->File);
+        view->File = NULL;
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageOpenView(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    SafeStorageAccessPattern AccessPattern,
+    SafeStorageView* View
+)
+{
+    // Check if a user is logged in
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (View == NULL || AccessPattern < SS_ACCESS_NORMAL || AccessPattern > SS_ACCESS_RANDOM) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    memset(View, 0, sizeof(*View));
+
+    // Validate the submission name. Submissions stored by the tree commands have nested names.
+    char name[MAX_PATH] = { 0 };
+    if (SubmissionName != NULL && SubmissionNameLength < MAX_PATH) {
+        memcpy(name, SubmissionName, SubmissionNameLength);
+    }
+    if (!isValidSubmissionPath(name)) {
+        printf("Invalid submission name.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char submissionPath[MAX_PATH];
+    if (!BuildSubmissionPath(name, (uint16_t)strlen(name), submissionPath)) {
+        printf("Failed to construct the submission path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    SUBMISSION_VIEW* view = (SUBMISSION_VIEW*)calloc(1, sizeof(SUBMISSION_VIEW));
+    if (view == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+
+    ScrubberNoteForegroundStart();
+
+    // A submission the cache holds is already in memory: hand out the cached copy, pinned until the view is closed
+    IO_FILE_INFO current = { 0 };
+    if (CacheIsEnabled() && IoQueryFileInfo(submissionPath, &current)) {
+        view->Cached = CacheLookup(submissionPath, 0, &current);
+    }
+
+    NTSTATUS status = STATUS_SUCCESS;
+    if (view->Cached != NULL) {
+        uint64_t lastWriteTime = 0;
+        View->Data = CacheEntryData(view->Cached, &View->Length, &lastWriteTime);
+    }
+    else {
+        status = MapSubmission(submissionPath, (IoAccessPattern)AccessPattern, view, &View->Length);
+        View->Data = view->Mapping;
+    }
+
+    ScrubberNoteForegroundEnd();
+    if (!NT_SUCCESS(status)) {
+        printf("Failed to open the submission: 0x%x\n", status);
+        free(view);
+        memset(View, 0, sizeof(*View));
+        return status;
+    }
+
+    // Keeps the submission in the hot tier
+    TieringRecordAccess(submissionPath);
+    View->Reserved = view;
+    return STATUS_SUCCESS;
+}
+
+
+VOID WINAPI
+SafeStorageCloseView(
+    SafeStorageView* View
+)
+{
+    if (View == NULL || View->Reserved == NULL) {
+        return;
+    }
+
+    SUBMISSION_VIEW* view = (SUBMISSION_VIEW*)View->Reserved;
+    if (view->Cached != NULL) {
+        CacheRelease(view->Cached);
+    }
+    else {
+        IoUnmapView(view->File, view->Mapping);
+        IoCloseFile(view->File);
+    }
+
+    free(view);
+    memset(View, 0, sizeof(*View));
+}
+
+
+// Context of the bulk store and retrieve routines
+typedef struct _BULK_COMMAND {
+    char UserDirectory[MAX_PATH];
+    char Prefix[MAX_PATH];                      // Validated submission prefix, e.g. "project"
+    char PrefixDirectory[MAX_PATH];             // UserDirectory\Prefix
+    volatile LONG64 StoredBytes;                // Size of the submissions stored so far
+} BULK_COMMAND;
+
+
+/**
+ * @brief       Validates the parameters shared by the bulk commands and prepares their context.
+ *
+ * @param       submissionPrefix        The prefix of the submission names, possibly nested.
+ * @param       submissionPrefixLength  The length of the prefix.
+ * @param       report                  The caller's report, zeroed here.
+ * @param       command                 Receives the context.
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+static NTSTATUS BeginBulkCommand(
+    _In_reads_(submissionPrefixLength) const char* submissionPrefix,
+    _In_ uint16_t submissionPrefixLength,
+    _Out_opt_ SafeStorageBulkReport* report,
+    _Out_ BULK_COMMAND* command
+)
+{
+    // Check if a user is logged in
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (report == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    memset(report, 0, sizeof(*report));
+    memset(command, 0, sizeof(*command));
+
+    if (submissionPrefix != NULL && submissionPrefixLength < MAX_PATH) {
+        memcpy(command->Prefix, submissionPrefix, submissionPrefixLength);
+    }
+    if (!isValidSubmissionPath(command->Prefix)) {
+        printf("Invalid submission name.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (FAILED(StringCchPrintfA(command->UserDirectory, MAX_PATH, "%s\\users\\%s", g_AppDirectory, g_LoggedInUsername)) ||
+        FAILED(StringCchPrintfA(command->PrefixDirectory, MAX_PATH, "%s\\%s", command->UserDirectory, command->Prefix))) {
+        printf("Failed to construct the destination path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief       Prints the outcome of a bulk command and turns it into its status.
+ *
+ * @param       completed       FALSE if the walk failed or ran out of memory, so files may be missing from the report.
+ * @param       report          The per-file results.
+ * @param       action          "Stored" or "Retrieved".
+ * @return      STATUS_SUCCESS, STATUS_PARTIAL_COPY if some files failed, or STATUS_UNSUCCESSFUL.
+ */
+static NTSTATUS FinishBulkCommand(_In_ bool completed, _In_ const SafeStorageBulkReport* report, _In_z_ const char* action) {
+    for (uint32_t i = 0; i < report->ResultCount; i++) {
+        if (!NT_SUCCESS(report->Results[i].Status)) {
+            printf("  %s: 0x%x\n", report->Results[i].RelativePath, report->Results[i].Status);
+        }
+    }
+    printf("%s %lu of %lu files.\n", action, report->ResultCount - report->FailedCount, report->ResultCount);
+
+    if (!completed) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    return (report->FailedCount == 0) ? STATUS_SUCCESS : STATUS_PARTIAL_COPY;
+}
+
+
+/**
+ * @brief       BULK_FILE_ROUTINE of the store commands. Stores one file as <prefix>\<relative path>.
+ */
+static NTSTATUS StoreBulkFile(_In_z_ const char* relativePath, _In_z_ const char* sourcePath, _In_z_ const char* destinationPath, _Inout_opt_ PVOID context) {
+    BULK_COMMAND* command = (BULK_COMMAND*)context;
+    char submissionName[MAX_PATH];
+    uint32_t version = 0;
+    uint64_t storedSize = 0;
+
+    if (FAILED(StringCchPrintfA(submissionName, MAX_PATH, "%s\\%s", command->Prefix, relativePath))) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    if (!isValidSubmissionPath(submissionName)) {
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+    NTSTATUS status = StoreSubmission(command->UserDirectory, submissionName, sourcePath, NULL, NULL, destinationPath, &version, &storedSize);
+    InterlockedAdd64(&command->StoredBytes, (LONG64)storedSize);
+    return status;
+}
+
+
+/**
+ * @brief       BULK_FILE_ROUTINE of the retrieve command. Retrieves the submission <prefix>\<relative path>,
+ *              found in either tier.
+ */
+static NTSTATUS RetrieveBulkFile(_In_z_ const char* relativePath, _In_z_ const char* sourcePath, _In_z_ const char* destinationPath, _Inout_opt_ PVOID context) {
+    const BULK_COMMAND* command = (const BULK_COMMAND*)context;
+    char submissionName[MAX_PATH];
+    char submissionPath[MAX_PATH];
+
+    UNREFERENCED_PARAMETER(sourcePath);
+
+    // Always the hot path: a submission found in the cold tier is promoted like a single retrieve would
+    if (FAILED(StringCchPrintfA(submissionName, MAX_PATH, "%s\\%s", command->Prefix, relativePath)) ||
+        FAILED(StringCchPrintfA(submissionPath, MAX_PATH, "%s\\%s", command->UserDirectory, submissionName))) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    return RetrieveSubmissionTo(command->UserDirectory, submissionName, submissionPath, destinationPath, 0, 0);
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleStoreTree.
+ */
+static NTSTATUS RunStoreTree(
+    _In_reads_(SubmissionPrefixLength) const char* SubmissionPrefix,
+    _In_ uint16_t SubmissionPrefixLength,
+    _In_reads_(SourceDirectoryPathLength) const char* SourceDirectoryPath,
+    _In_ uint16_t SourceDirectoryPathLength,
+    _Out_opt_ SafeStorageBulkReport* Report,
+    _Out_ uint64_t* StoredSize
+)
+{
+    *StoredSize = 0;
+
+    BULK_COMMAND command;
+    NTSTATUS status = BeginBulkCommand(SubmissionPrefix, SubmissionPrefixLength, Report, &command);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Validate SourceDirectoryPath
+    if (SourceDirectoryPath == NULL || SourceDirectoryPathLength == 0 || SourceDirectoryPathLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid source directory path.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char sourcePath[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(sourcePath, SourceDirectoryPath, SourceDirectoryPathLength);
+
+    IO_FILE_INFO sourceInfo = { 0 };
+    if (!IoQueryFileInfo(sourcePath, &sourceInfo) || !sourceInfo.IsDirectory) {
+        printf("The source is not a directory.\n");
+        return STATUS_NOT_A_DIRECTORY;
+    }
+
+    // Directories are listed, and files stored, concurrently on the thread pool
+    const char* sourceRoots[] = { sourcePath };
+    bool completed = BulkTransferTree(sourceRoots, 1, command.PrefixDirectory, 0, StoreBulkFile, &command, Report);
+    *StoredSize = (uint64_t)command.StoredBytes;
+    return FinishBulkCommand(completed, Report, "Stored");
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleStoreTree(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* SourceDirectoryPath,
+    uint16_t SourceDirectoryPathLength,
+    SafeStorageBulkReport* Report
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_STORE_TREE, SubmissionPrefix, SubmissionPrefixLength, SourceDirectoryPathLength, &trace);
+    NTSTATUS status = RunStoreTree(SubmissionPrefix, SubmissionPrefixLength, SourceDirectoryPath, SourceDirectoryPathLength, Report, &trace.Bytes);
+    if (NT_SUCCESS(status)) {
+        trace.Count = Report->ResultCount;
+    }
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleStoreFiles.
+ */
+static NTSTATUS RunStoreFiles(
+    _In_reads_(SubmissionPrefixLength) const char* SubmissionPrefix,
+    _In_ uint16_t SubmissionPrefixLength,
+    _In_reads_opt_(SourceFileCount) const char* const* SourceFilePaths,
+    _In_ uint32_t SourceFileCount,
+    _Out_opt_ SafeStorageBulkReport* Report,
+    _Out_ uint64_t* StoredSize
+)
+{
+    *StoredSize = 0;
+
+    BULK_COMMAND command;
+    NTSTATUS status = BeginBulkCommand(SubmissionPrefix, SubmissionPrefixLength, Report, &command);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (SourceFilePaths == NULL || SourceFileCount == 0) {
+        printf("No files to store.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!IoCreateDirectories(command.PrefixDirectory)) {
+        printf("Failed to create the submission directory.\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    bool completed = BulkTransferFiles(SourceFilePaths, SourceFileCount, command.PrefixDirectory, StoreBulkFile, &command, Report);
+    *StoredSize = (uint64_t)command.StoredBytes;
+    return FinishBulkCommand(completed, Report, "Stored");
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleStoreFiles(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* const* SourceFilePaths,
+    uint32_t SourceFileCount,
+    SafeStorageBulkReport* Report
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_STORE_FILES, SubmissionPrefix, SubmissionPrefixLength, 0, &trace);
+    NTSTATUS status = RunStoreFiles(SubmissionPrefix, SubmissionPrefixLength, SourceFilePaths, SourceFileCount, Report, &trace.Bytes);
+    if (NT_SUCCESS(status)) {
+        trace.Count = Report->ResultCount;
+    }
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleRetrieveTree.
+ */
+static NTSTATUS RunRetrieveTree(
+    _In_reads_(SubmissionPrefixLength) const char* SubmissionPrefix,
+    _In_ uint16_t SubmissionPrefixLength,
+    _In_reads_(DestinationDirectoryPathLength) const char* DestinationDirectoryPath,
+    _In_ uint16_t DestinationDirectoryPathLength,
+    _Out_opt_ SafeStorageBulkReport* Report
+)
+{
+    BULK_COMMAND command;
+    NTSTATUS status = BeginBulkCommand(SubmissionPrefix, SubmissionPrefixLength, Report, &command);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Validate DestinationDirectoryPath
+    if (DestinationDirectoryPath == NULL || DestinationDirectoryPathLength == 0 || DestinationDirectoryPathLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid destination directory path.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char destinationPath[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(destinationPath, DestinationDirectoryPath, DestinationDirectoryPathLength);
+
+    // The hot tree first; the cold tree only adds the submissions that were migrated
+    const char* sourceRoots[2] = { 0 };
+    DWORD rootCount = 0;
+    char coldDirectory[MAX_PATH];
+    IO_FILE_INFO rootInfo = { 0 };
+
+    if (IoQueryFileInfo(command.PrefixDirectory, &rootInfo) && rootInfo.IsDirectory) {
+        sourceRoots[rootCount++] = command.PrefixDirectory;
+    }
+    if (TieringGetColdPath(command.PrefixDirectory, coldDirectory) &&
+        IoQueryFileInfo(coldDirectory, &rootInfo) && rootInfo.IsDirectory) {
+        sourceRoots[rootCount++] = coldDirectory;
+    }
+    if (rootCount == 0) {
+        printf("No submissions under: %s\n", command.Prefix);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    // Checksum manifests, checkpoints and other internal files are not submissions
+    bool completed = BulkTransferTree(sourceRoots, rootCount, destinationPath, BULK_FLAG_SKIP_INTERNAL, RetrieveBulkFile, &command, Report);
+    return FinishBulkCommand(completed, Report, "Retrieved");
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveTree(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* DestinationDirectoryPath,
+    uint16_t DestinationDirectoryPathLength,
+    SafeStorageBulkReport* Report
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_RETRIEVE_TREE, SubmissionPrefix, SubmissionPrefixLength, DestinationDirectoryPathLength, &trace);
+    NTSTATUS status = RunRetrieveTree(SubmissionPrefix, SubmissionPrefixLength, DestinationDirectoryPath, DestinationDirectoryPathLength, Report);
+    if (NT_SUCCESS(status)) {
+        trace.Count = Report->ResultCount;
+    }
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+VOID WINAPI
+SafeStorageFreeBulkReport(
+    SafeStorageBulkReport* Report
+)
+{
+    if (Report != NULL) {
+        BulkFreeReport(Report);
+    }
+}
+
+
+// The bulk store behind a directory watch
+typedef struct _WATCH_COMMAND {
+    BULK_COMMAND Bulk;
+    volatile LONG UnchangedCount;               // Files of the current batch that matched their submission
+} WATCH_COMMAND;
+
+
+// Global static variables
+static WATCH_COMMAND g_WatchCommand = { 0 };
+
+
+/**
+ * @brief       BULK_FILE_ROUTINE of the watch. Stores one changed file, unless its contents are already stored.
+ */
+static NTSTATUS StoreWatchedFile(_In_z_ const char* relativePath, _In_z_ const char* sourcePath, _In_z_ const char* destinationPath, _Inout_opt_ PVOID context) {
+    WATCH_COMMAND* command = (WATCH_COMMAND*)context;
+
+    // Editors often save files they did not change; that needs neither a copy nor a new version
+    if (TransferIsUpToDate(sourcePath, destinationPath)) {
+        InterlockedIncrement(&command->UnchangedCount);
+        return STATUS_SUCCESS;
+    }
+    return StoreBulkFile(relativePath, sourcePath, destinationPath, &command->Bulk);
+}
+
+
+/**
+ * @brief       WATCH_BATCH_ROUTINE. Stores a batch of changed files concurrently on the thread pool.
+ */
+static VOID StoreWatchedBatch(_In_z_ const char* root, _In_reads_(count) const char* const* relativePaths, _In_ DWORD count, _Inout_opt_ PVOID context, _Out_ WATCH_BATCH_RESULT* result) {
+    WATCH_COMMAND* command = (WATCH_COMMAND*)context;
+    SafeStorageBulkReport report = { 0 };
+
+    InterlockedExchange(&command->UnchangedCount, 0);
+    bool completed = BulkTransferPaths(root, relativePaths, count, command->Bulk.PrefixDirectory, StoreWatchedFile, command, &report);
+    FinishBulkCommand(completed, &report, "Synced");
+
+    // Files missing from an incomplete report were not stored either
+    result->Unchanged = (DWORD)command->UnchangedCount;
+    result->Failed = report.FailedCount + (count - report.ResultCount);
+    result->Stored = count - result->Failed - result->Unchanged;
+    BulkFreeReport(&report);
+}
+
+
+NTSTATUS WINAPI
+SafeStorageStartWatch(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* DirectoryPath,
+    uint16_t DirectoryPathLength,
+    uint32_t DebounceMilliseconds
+)
+{
+    SafeStorageBulkReport report;
+    BULK_COMMAND command;
+    NTSTATUS status = BeginBulkCommand(SubmissionPrefix, SubmissionPrefixLength, &report, &command);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // Validate DirectoryPath
+    if (DirectoryPath == NULL || DirectoryPathLength == 0 || DirectoryPathLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid directory path.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char directoryPath[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(directoryPath, DirectoryPath, DirectoryPathLength);
+
+    if (WatchIsRunning()) {
+        printf("A directory is already being watched.\n");
+        return STATUS_DEVICE_BUSY;
+    }
+
+    IO_FILE_INFO directoryInfo = { 0 };
+    if (!IoQueryFileInfo(directoryPath, &directoryInfo) || !directoryInfo.IsDirectory) {
+        printf("The path is not a directory.\n");
+        return STATUS_NOT_A_DIRECTORY;
+    }
+
+    if (!IoCreateDirectories(command.PrefixDirectory)) {
+        printf("Failed to create the submission directory.\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    g_WatchCommand.Bulk = command;
+    if (!WatchStart(directoryPath, DebounceMilliseconds, StoreWatchedBatch, &g_WatchCommand)) {
+        printf("Failed to watch the directory: %lu\n", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("Watching %s; changes are stored under %s.\n", directoryPath, command.Prefix);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageStopWatch(
+    VOID
+)
+{
+    if (!WatchIsRunning()) {
+        printf("No directory is being watched.\n");
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    WatchStop();
+
+    SafeStorageWatchStats stats;
+    WatchGetStats(&stats);
+    printf("Stopped watching: %llu files stored in %llu batches, %llu unchanged, %llu failed.\n",
+           stats.FilesStored, stats.Batches, stats.FilesUnchanged, stats.FilesFailed);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetWatchStats(
+    SafeStorageWatchStats* Stats
+)
+{
+    if (Stats == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WatchGetStats(Stats);
+    return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief       Implements SafeStorageHandleUsage.
+ */
+static NTSTATUS RunUsage(
+    VOID
+)
+{
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    SafeStorageUsage usage = { 0 };
+    NTSTATUS status = UsageGet(g_LoggedInUsername, &usage);
+    if (status == STATUS_NOT_FOUND) {
+        printf("%s has not stored anything yet.\n", g_LoggedInUsername);
+        return STATUS_SUCCESS;
+    }
+    if (!NT_SUCCESS(status)) {
+        printf("Failed to read the usage: %lu\n", GetLastError());
+        return status;
+    }
+
+    printf("%s stores %llu bytes in %llu submissions.\n", usage.Username, usage.Bytes, usage.Objects);
+    if (usage.QuotaBytes != 0 || usage.QuotaObjects != 0) {
+        printf("Quota: %llu bytes, %llu submissions (0 = unlimited).\n", usage.QuotaBytes, usage.QuotaObjects);
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageHandleUsage(
+    VOID
+)
+{
+    TRACE_RECORD trace;
+    TraceBegin(TRACE_OP_USAGE, NULL, 0, 0, &trace);
+    NTSTATUS status = RunUsage();
+    TraceEnd(&trace, status);
+    return status;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetUsage(
+    const char* Username,
+    uint16_t UsernameLength,
+    SafeStorageUsage* Usage
+)
+{
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (Username == NULL || !isValidUsername(Username, UsernameLength) || Usage == NULL) {
+        printf("Invalid username.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Like the quota, a user's usage is only shown to that user
+    char username[USERNAME_MAX_LENGTH + 1] = { 0 };
+    memcpy(username, Username, UsernameLength);
+    if (strcmp(username, g_LoggedInUsername) != 0) {
+        printf("Only the logged in user's own usage can be read.\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    return UsageGet(username, Usage);
+}
+
+
+NTSTATUS WINAPI
+SafeStorageSetQuota(
+    const char* Username,
+    uint16_t UsernameLength,
+    uint64_t QuotaBytes,
+    uint64_t QuotaObjects
+)
+{
+    if (!g_IsUserLoggedIn) {
+        printf("No user is logged in.\n");
+        return SS_STATUS_NOT_LOGGED_IN;
+    }
+
+    if (Username == NULL || !isValidUsername(Username, UsernameLength)) {
+        printf("Invalid username.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // There are no administrators: a user can only limit their own storage
+    char username[USERNAME_MAX_LENGTH + 1] = { 0 };
+    memcpy(username, Username, UsernameLength);
+    if (strcmp(username, g_LoggedInUsername) != 0) {
+        printf("Only the logged in user's own quota can be set.\n");
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (!UsageSetQuota(username, QuotaBytes, QuotaObjects)) {
+        printf("Failed to set the quota: %lu\n", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetUsageReport(
+    SafeStorageUsageReport* Report
+)
+{
+    if (Report == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return UsageGetReport(Report) ? STATUS_SUCCESS : STATUS_NO_MEMORY;
+}
+
+
+VOID WINAPI
+SafeStorageFreeUsageReport(
+    SafeStorageUsageReport* Report
+)
+{
+    if (Report != NULL) {
+        free(Report->Users);
+        memset(Report, 0, sizeof(*Report));
+    }
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureSegments(
+    uint32_t MaxObjectSize
+)
+{
+    if (MaxObjectSize > SEGMENT_MAX_OBJECT_LIMIT) {
+        printf("Invalid segment object size.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (MaxObjectSize == 0) {
+        SegmentsStop();
+        return STATUS_SUCCESS;
+    }
+
+    if (!SegmentsStart(g_AppDirectory, MaxObjectSize)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetSegmentStats(
+    SafeStorageSegmentStats* Stats
+)
+{
+    if (Stats == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SegmentsGetStats(Stats);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageStartTrace(
+    const char* TraceFilePath,
+    uint16_t TraceFilePathLength
+)
+{
+    if (TraceFilePath == NULL || TraceFilePathLength == 0 || TraceFilePathLength > MAX_FILE_PATH_LENGTH) {
+        printf("Invalid trace file path.\n");
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    char tracePath[MAX_FILE_PATH_LENGTH + 1] = { 0 };
+    memcpy(tracePath, TraceFilePath, TraceFilePathLength);
+
+    if (TraceIsRecording()) {
+        printf("A trace is already being recorded.\n");
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (!TraceStart(tracePath)) {
+        printf("Failed to create the trace file: %lu\n", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    printf("Recording the commands to %s.\n", tracePath);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageStopTrace(
+    VOID
+)
+{
+    if (!TraceIsRecording()) {
+        printf("No trace is being recorded.\n");
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    TraceStop();
+    printf("Stopped recording the commands.\n");
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageConfigureTransferTuning(
+    BOOLEAN Enabled
+)
+{
+    AutotuneSetEnabled(Enabled != FALSE);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS WINAPI
+SafeStorageGetTransferTuningStats(
+    SafeStorageTransferTuningStats* Stats
+)
+{
+    if (Stats == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    AutotuneGetStats(Stats);
+    return STATUS_SUCCESS;
 }
@@ -24,6 +24,133 @@ typedef enum {
 } SafeStorageStatus;
 
 
+// Durability levels for users.txt appends and stored submissions
+typedef enum {
+    SS_DURABILITY_NONE = 0,                     // Leave written data to the OS cache (fastest, not crash safe)
+    SS_DURABILITY_PER_OPERATION = 1,            // Flush every written file before the command returns
+    SS_DURABILITY_GROUP_COMMIT = 2              // Batch the flushes of concurrent commands in a background flusher
+} SafeStorageDurabilityMode;
+
+
+// Counters of the last completed scrub pass
+typedef struct _SafeStorageScrubStats {
+    uint64_t Passes;                            // Number of passes completed since SafeStorageInit
+    uint64_t SubmissionsScanned;                // Submissions whose blocks were all read and checked
+    uint64_t BytesVerified;
+    uint64_t CorruptSubmissions;                // Submissions with at least one mismatching block
+    uint64_t CorruptBlocks;
+    uint64_t MissingChecksums;                  // Submissions stored without a manifest
+    uint64_t StaleChecksums;                    // Manifests that no longer describe their submission
+    uint64_t ReadErrors;
+} SafeStorageScrubStats;
+
+
+// Counters of the retrieve cache since it was last configured
+typedef struct _SafeStorageCacheStats {
+    uint64_t Hits;                              // Retrieves served from memory
+    uint64_t Misses;
+    uint64_t Insertions;                        // Submissions loaded into the admission window after a miss
+    uint64_t Admissions;                        // Entries moved from the window to the main cache
+    uint64_t Rejections;                        // Entries dropped from the window as less popular than the main cache
+    uint64_t Evictions;                         // Main cache entries evicted to make room
+    uint64_t Invalidations;                     // Entries dropped because the submission was stored again
+    uint64_t EntryCount;
+    uint64_t BytesCached;
+    uint64_t MemoryLimit;
+} SafeStorageCacheStats;
+
+
+// Where files are kept, see SafeStorageConfigureIoBackend
+typedef enum {
+    SS_IO_BACKEND_OS = 0,                       // The file systems of the operating system (the default)
+    SS_IO_BACKEND_MEMORY = 1                    // Process memory; nothing reaches the disk
+} SafeStorageIoBackend;
+
+
+// A slower disk simulated in front of an I/O backend
+typedef struct _SafeStorageDiskSimulation {
+    uint32_t LatencyMicroseconds;               // Added to every operation that reaches the disk
+    uint32_t JitterMicroseconds;                // Largest random delay added on top of the latency
+    uint64_t BytesPerSecond;                    // Combined rate of all reads and writes; 0 for unlimited
+} SafeStorageDiskSimulation;
+
+
+// How a view will be read, see SafeStorageOpenView
+typedef enum {
+    SS_ACCESS_NORMAL = 0,                       // No particular order
+    SS_ACCESS_SEQUENTIAL = 1,                   // Front to back: the contents are read ahead of the reader
+    SS_ACCESS_RANDOM = 2                        // Scattered: nothing is read ahead
+} SafeStorageAccessPattern;
+
+
+// A read-only view of a submission's contents. Release with SafeStorageCloseView.
+typedef struct _SafeStorageView {
+    const void* Data;                           // NULL for an empty submission
+    uint64_t Length;
+    void* Reserved;                             // Owned by the library
+} SafeStorageView;
+
+
+// Supplies the next bytes of a streamed store, see SafeStorageHandleStoreStream. Writes at most Length bytes to
+// Buffer and their count to *BytesRead; 0 bytes mark the end of the stream. Returns FALSE if the stream failed.
+typedef BOOLEAN (*SafeStorageReadRoutine)(
+    void* Context,
+    void* Buffer,
+    uint32_t Length,
+    uint32_t* BytesRead
+);
+
+
+// Counters of the current or last directory watch, see SafeStorageStartWatch
+typedef struct _SafeStorageWatchStats {
+    uint64_t Events;                            // Change notifications received
+    uint64_t Overflows;                         // Times notifications were lost and the whole tree was queued
+    uint64_t Batches;                           // Batches of changed files handed to the store
+    uint64_t FilesStored;
+    uint64_t FilesUnchanged;                    // Saved without changing their contents, so not stored again
+    uint64_t FilesFailed;
+} SafeStorageWatchStats;
+
+
+// Outcome of one file of a bulk store or retrieve
+typedef struct _SafeStorageBulkResult {
+    char RelativePath[MAX_PATH];                // Path of the file relative to the tree (or its name, for a list of files)
+    NTSTATUS Status;
+} SafeStorageBulkResult;
+
+
+// Per-file outcomes of a bulk store or retrieve. Free with SafeStorageFreeBulkReport.
+typedef struct _SafeStorageBulkReport {
+    SafeStorageBulkResult* Results;             // In completion order
+    uint32_t ResultCount;
+    uint32_t FailedCount;
+} SafeStorageBulkReport;
+
+
+// State and counters of the segment engine, see SafeStorageConfigureSegments
+typedef struct _SafeStorageSegmentStats {
+    uint64_t MaxObjectSize;                     // 0 while the engine is disabled
+    uint64_t Segments;                          // Segment files, the active one included
+    uint64_t Objects;                           // Submissions kept in segments
+    uint64_t LiveBytes;                         // Records of those submissions
+    uint64_t DeadBytes;                         // Records overwritten or removed and not compacted yet
+    uint64_t Compactions;                       // Segments compacted and deleted since the engine was started
+    uint64_t BytesCompacted;                    // Live records moved by those compactions
+    uint64_t Checkpoints;                       // Index checkpoints written since the engine was started
+} SafeStorageSegmentStats;
+
+
+// Counters of the transfer tuner and the settings it remembered last, see SafeStorageConfigureTransferTuning
+typedef struct _SafeStorageTransferTuningStats {
+    uint64_t TunedTransfers;                    // Transfers that probed and remembered their best settings
+    uint64_t ProbeBatches;                      // Batches moved with trial settings
+    uint64_t Devices;                           // Pairs of source and destination devices with remembered settings
+    uint64_t LastSpanSize;                      // Bytes per I/O remembered last; 0 if nothing was remembered yet
+    uint64_t LastDepth;                         // I/Os of one transfer in flight at the same time
+    uint64_t LastBytesPerSecond;                // Throughput measured with those settings
+} SafeStorageTransferTuningStats;
+
+
 // Macro definitions for username and password requirements
 #define USERNAME_MIN_LENGTH 5
 #define USERNAME_MAX_LENGTH 10
@@ -40,6 +167,25 @@ typedef enum {
 #define SPECIAL_CHARACTERS "!@#$%^&*"
 
 
+// Space used by one user, see SafeStorageGetUsage
+typedef struct _SafeStorageUsage {
+    char Username[USERNAME_MAX_LENGTH + 1];
+    uint64_t Bytes;                             // Total size of the user's submissions, in both tiers, and of older versions
+    uint64_t Objects;                           // Number of submissions
+    uint64_t QuotaBytes;                        // 0 if unlimited
+    uint64_t QuotaObjects;                      // 0 if unlimited
+} SafeStorageUsage;
+
+
+// Usage of every user. Free with SafeStorageFreeUsageReport.
+typedef struct _SafeStorageUsageReport {
+    SafeStorageUsage* Users;
+    uint32_t UserCount;
+    uint64_t TotalBytes;
+    uint64_t TotalObjects;
+} SafeStorageUsageReport;
+
+
 /*
  * @brief       This command will be called at the beginning to initialize support for the safe storage lib.
  *              Here you can create global data, find %APPDIR%, and allocate/ create any resources you consider necessary
@@ -62,6 +208,265 @@ SafeStorageDeinit(
 );
 
 
+/*
+ * @brief       Selects how durable the register and store commands are before they return.
+ *
+ *
+ * @details     SS_DURABILITY_NONE (the default) keeps the previous behavior: data is left in the OS cache.
+ *              SS_DURABILITY_PER_OPERATION flushes users.txt or the stored submission on every command.
+ *              SS_DURABILITY_GROUP_COMMIT hands the flush to a background flusher which collects the requests
+ *              of concurrent callers for a few milliseconds and flushes them as one batch; every caller still
+ *              blocks until its own data is on disk.
+ *
+ *              Can be called at any time after SafeStorageInit.
+ *
+ *
+ * @param[in]   Mode            - The durability level to use from now on.
+ */
+NTSTATUS WINAPI
+SafeStorageSetDurabilityMode(
+    SafeStorageDurabilityMode Mode
+);
+
+
+/*
+ * @brief       Resizes the worker pool that runs the chunk-level work of store and retrieve.
+ *
+ *
+ * @details     SafeStorageInit starts one worker per processor. Each worker has its own queue of tasks and
+ *              idle workers steal from the busy ones, so uneven chunks still spread over all cores.
+ *
+ *              Must not be called while a store or retrieve is running. Queued work is finished first.
+ *
+ *
+ * @param[in]   WorkerCount             - Number of workers; 0 means one per processor. At most 64.
+ *
+ * @param[in]   PinWorkers              - TRUE to bind each worker to its own processor.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureThreadPool(
+    uint32_t WorkerCount,
+    BOOLEAN PinWorkers
+);
+
+
+/*
+ * @brief       Enables a cold storage tier and starts the background migrator.
+ *
+ *
+ * @details     Submissions are stored under %APPDIR%\\users (the hot tier). The migrator periodically looks for
+ *              submissions that have not been stored or retrieved for ColdAfterSeconds and moves them to
+ *              <ColdDirectory>\\users\\<user>\\<SubmissionName>, optionally NTFS-compressed, without exceeding
+ *              BytesPerSecond of background I/O.
+ *
+ *              The retrieve command transparently promotes a cold submission back to the hot tier before copying it.
+ *              Storing over a cold submission replaces it in the hot tier and discards the cold copy.
+ *
+ *              Must be called after SafeStorageInit. Calling it again restarts the migrator with the new settings.
+ *
+ *
+ * @param[in]   ColdDirectory           - Root directory of the cold tier (e.g. on a slower, larger disk).
+ *
+ * @param[in]   ColdDirectoryLength     - The length of the "ColdDirectory" string,
+ *                                        not including the NULL terminator.
+ *
+ * @param[in]   ColdAfterSeconds        - Time since the last access after which a submission is moved.
+ *
+ * @param[in]   BytesPerSecond          - I/O budget of the migrator (reads plus writes); 0 means unlimited.
+ *
+ * @param[in]   Compress                - TRUE to compress the cold copies.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureColdTier(
+    const char* ColdDirectory,
+    uint16_t ColdDirectoryLength,
+    uint32_t ColdAfterSeconds,
+    uint64_t BytesPerSecond,
+    BOOLEAN Compress
+);
+
+
+/*
+ * @brief       Stripes newly stored submissions over several data roots, RAID-0 style.
+ *
+ *
+ * @details     A striped submission is split into units of StripeUnitSize bytes that are assigned to
+ *              %APPDIR% and the data roots in turn. Every root holds a sparse file with only its own units,
+ *              so each stores an equal share of the data, and the chunks of one store or retrieve are read
+ *              and written on all roots at once. With the roots on separate drives, throughput scales with
+ *              the number of drives without a software RAID underneath.
+ *
+ *              Each striped submission has a layout record, %APPDIR%\users\<user>\<SubmissionName>~stripes,
+ *              naming its stripes. Submissions stored earlier keep their layout (or stay unstriped) until they
+ *              are stored again, so the roots can be changed at any time; roots still referenced by a
+ *              layout must stay available.
+ *
+ *
+ * @param[in]   DataRoots               - Directories to stripe over besides %APPDIR%, usually one per drive.
+ *                                        Created if missing.
+ *
+ * @param[in]   DataRootCount           - The number of entries of "DataRoots"; 0 stops striping new submissions.
+ *
+ * @param[in]   StripeUnitSize          - Bytes per unit, a multiple of CHUNK_SIZE; 0 means CHUNK_SIZE.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureDataRoots(
+    const char* const* DataRoots,
+    uint32_t DataRootCount,
+    uint32_t StripeUnitSize
+);
+
+
+/*
+ * @brief       Configures the background scrubber and starts a pass right away.
+ *
+ *
+ * @details     Every stored submission has a manifest (<SubmissionName>~manifest) with the SHA-256 checksum of each
+ *              64 KB block. The scrubber, started by SafeStorageInit, periodically re-reads all submissions of all
+ *              users, including the ones in the cold tier, and compares them with their manifests. It runs at
+ *              background priority, reads no more than BytesPerSecond and pauses while store or retrieve
+ *              commands are running.
+ *
+ *              After every pass the counters are available through SafeStorageGetScrubStats and a report listing
+ *              every corrupt block is written to %APPDIR%\scrub_report.txt.
+ *
+ *              By default the scrubber reads 16 MB/s and runs once a day.
+ *
+ *
+ * @param[in]   BytesPerSecond          - Read budget of the scrubber; 0 means unlimited.
+ *
+ * @param[in]   IntervalSeconds         - Time between the end of a pass and the start of the next one. Must not be 0.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureScrubber(
+    uint64_t BytesPerSecond,
+    uint32_t IntervalSeconds
+);
+
+
+/*
+ * @brief       Returns the counters of the last completed scrub pass.
+ *
+ *
+ * @param[out]  Stats                   - Receives the counters. Passes is 0 until the first pass completes.
+ */
+NTSTATUS WINAPI
+SafeStorageGetScrubStats(
+    SafeStorageScrubStats* Stats
+);
+
+
+/*
+ * @brief       Configures how store and retrieve handle sparse files.
+ *
+ *
+ * @details     Store and retrieve always preserve the holes of a sparse source: the unallocated ranges reported
+ *              by the file system are neither read nor written, and the copy is created as a sparse file, so a
+ *              mostly empty VM image or database file transfers in time proportional to its data.
+ *
+ *              With DetectZeroChunks set, 64 KB chunks of the source that are allocated but contain only zeros
+ *              are also left as holes in the copy. This costs a scan of every chunk and makes every copy sparse.
+ *              It is off by default.
+ *
+ *
+ * @param[in]   DetectZeroChunks        - Whether to turn all-zero chunks into holes.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureSparseFiles(
+    BOOLEAN DetectZeroChunks
+);
+
+
+/*
+ * @brief       Configures the in-memory cache of recently retrieved submissions.
+ *
+ *
+ * @details     Retrieves of small and medium submissions keep a copy of the data in memory, keyed by user,
+ *              submission and version. Retrieving the same version again writes the destination straight
+ *              from memory instead of reading the submission. A cached current version is only used while the
+ *              submission keeps its size and last write time, and storing a submission drops all of its
+ *              cached versions. Delta retrieves bypass the cache.
+ *
+ *              Eviction is scan-resistant (W-TinyLFU): a submission read once, e.g. by a retrieve of a whole
+ *              tree, only displaces cached ones if it was retrieved more often recently than they were.
+ *              Hit and miss counters are available through SafeStorageGetCacheStats.
+ *
+ *              The cache is disabled by default. Reconfiguring it empties it and resets its counters.
+ *
+ *
+ * @param[in]   MemoryLimitBytes        - Memory used for cached data; 0 disables the cache.
+ *
+ * @param[in]   MaxSubmissionBytes      - Larger submissions are never cached; 0 means 1/8 of MemoryLimitBytes.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureCache(
+    uint64_t MemoryLimitBytes,
+    uint64_t MaxSubmissionBytes
+);
+
+
+/*
+ * @brief       Returns the counters of the retrieve cache.
+ *
+ *
+ * @param[out]  Stats                   - Receives the counters.
+ */
+NTSTATUS WINAPI
+SafeStorageGetCacheStats(
+    SafeStorageCacheStats* Stats
+);
+
+
+/*
+ * @brief       Selects where the library keeps its files, optionally behind a simulated slower disk.
+ *
+ *
+ * @details     Every file operation of the library (users.txt, submissions, manifests, versions, layouts and
+ *              reports) goes through the selected backend. SS_IO_BACKEND_MEMORY keeps everything in process
+ *              memory under the same paths, which makes benchmarks and tests independent of the disk;
+ *              its contents are freed by SafeStorageDeinit. The source and destination files of store and
+ *              retrieve are accessed through the backend as well, so with the memory backend a source has
+ *              to be created in it first (see IoWriteFileContents).
+ *
+ *              With a Simulation, every operation that reaches the disk is delayed by the latency plus a random
+ *              jitter, and reads and writes share the given bandwidth. The jitter sequence is the same on every
+ *              run, so measurements are repeatable.
+ *
+ *              Call it right after SafeStorageInit: files written before are not visible in another backend.
+ *              SafeStorageDeinit switches back to SS_IO_BACKEND_OS.
+ *
+ *
+ * @param[in]   Backend                 - One of the SafeStorageIoBackend values.
+ *
+ * @param[in]   Simulation              - Optional; NULL (or all zeros) for the backend's own speed.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureIoBackend(
+    SafeStorageIoBackend Backend,
+    const SafeStorageDiskSimulation* Simulation
+);
+
+
+/*
+ * @brief       Sets how many older versions of each submission are kept.
+ *
+ *
+ * @details     Applied every time a store creates a new version. The current version of a submission and every
+ *              version frozen by a snapshot are always kept. Blocks no remaining version uses are deleted.
+ *              By default every version is kept.
+ *
+ *
+ * @param[in]   MaxVersions             - Versions to keep per submission, the current one included; 0 means unlimited.
+ *
+ * @param[in]   MaxAgeDays              - Versions created more than this many days ago are removed; 0 means unlimited.
+ */
+NTSTATUS WINAPI
+SafeStorageSetRetention(
+    uint32_t MaxVersions,
+    uint32_t MaxAgeDays
+);
+
+
 /*
  * @brief       Handles the "register" command.
  *
@@ -180,10 +585,19 @@ SafeStorageHandleLogout(
  *
  *              If no file exists with the name SourceFilePath, the function will return an error.
  *
- *              If a file already exists at %APPDIR%\\Users\\<current_logged_in_user>\\<SubmissionName>, it will be overwritten.
+ *              If a file already exists at %APPDIR%\\Users\\<current_logged_in_user>\\<SubmissionName>, it is replaced by a
+ *              new version; earlier versions remain available through SafeStorageHandleRetrieveVersion. Versions share
+ *              their unchanged 64 KB blocks: before the submission is replaced, only the blocks that no earlier version
+ *              already has are copied to the user's block store (%APPDIR%\\Users\\<user>\\~blocks).
+ *              The new contents are written into a preallocated <SubmissionName>~partial file and renamed over the
+ *              old submission once complete, so a concurrent reader never sees a partially written file.
+ *              Progress is checkpointed in <SubmissionName>~checkpoint (a bitmap of completed chunks plus the
+ *              source's size and last write time). If the store is interrupted, repeating it with the same,
+ *              unmodified source only transfers the chunks that are still missing.
  *
  *
- * @param[in]   SubmissionName          - A string representing the submission name.
+ * @param[in]   SubmissionName          - A string representing the submission name. It must be a valid file name
+ *                                        and must not contain '~'.
  *
  * @param[in]   SubmissionNameLength    - The length of the "SubmissionName" string,
  *                                        not including the NULL terminator.
@@ -210,6 +624,60 @@ SafeStorageHandleStore(
 );
 
 
+/*
+ * @brief       Handles the "store" command for data that is not in a file: a pipe, a generated dump or archive.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              Stores everything ReadRoutine returns until it reports the end of the stream as the submission
+ *              <SubmissionName>, as SafeStorageHandleStore would store a file with these contents (versions and
+ *              manifests included). The length does not have to be known: while the calling thread reads the next
+ *              chunks, the chunks already read are written on the library's thread pool. At most 32 chunks are held
+ *              in memory; reading pauses until one of them is written. The submission is replaced atomically once
+ *              the stream has ended and every chunk is written; if the stream fails or exceeds the maximum size,
+ *              the previous submission is kept.
+ *
+ *              A stream cannot be read again, so an interrupted streamed store is not resumed. The submission gets
+ *              the time the stream ended as its last write time.
+ *
+ *
+ * @param[in]   SubmissionName          - A string representing the submission name. It must be a valid file name
+ *                                        and must not contain '~'.
+ *
+ * @param[in]   SubmissionNameLength    - The length of the "SubmissionName" string,
+ *                                        not including the NULL terminator.
+ *
+ * @param[in]   ReadRoutine             - Called on the calling thread for the next bytes of the stream.
+ *
+ * @param[in]   Context                 - Passed to ReadRoutine.
+ *
+ *
+ * @return      STATUS_SUCCESS, SS_STATUS_NOT_LOGGED_IN, STATUS_INVALID_PARAMETER, STATUS_FILE_TOO_LARGE,
+ *              or STATUS_UNSUCCESSFUL if the stream or the write failed.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleStoreStream(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    SafeStorageReadRoutine ReadRoutine,
+    void* Context
+);
+
+
+/*
+ * @brief       Like SafeStorageHandleStoreStream, for a stream read from a handle until its end: the read end of a
+ *              pipe (including the standard input of a process started with a redirected one), a file or a
+ *              console. The handle must have been opened for synchronous I/O. A pipe ends when its writer closes it.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleStoreFromHandle(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    HANDLE SourceHandle
+);
+
+
 /*
  * @brief       Handles the "retrieve" command.
  *
@@ -222,6 +690,10 @@ SafeStorageHandleStore(
  *              If no source file exists, the function will return an error.
  *
  *              If a file already exists at DestinationFilePath, it will be overwritten.
+ *              As with store, the copy is published with an atomic rename.
+ *
+ *              Stores and retrieves running at the same time share the disk: each user gets an equal share of
+ *              the chunk I/O, and transfers of up to 4 MB are served ahead of larger ones.
  *
  *
  * @param[in]   SubmissionName              - A string representing the submission name.
@@ -250,5 +722,576 @@ SafeStorageHandleRetrieve(
 );
 
 
+/*
+ * @brief       Handles the "retrieve" command in delta mode.
+ *
+ *
+ * @details     Same as SafeStorageHandleRetrieve, but meant for retrieving the same submission into the same place
+ *              again after small updates. If DestinationFilePath already exists, its 64 KB blocks are checksummed
+ *              in parallel and compared with the checksums recorded when the submission was stored; only the blocks
+ *              that differ are written, and the file is then truncated or extended to the submission's size.
+ *              An unchanged multi-GB destination therefore costs reads only.
+ *
+ *              The destination is updated in place rather than replaced atomically: if the command is interrupted,
+ *              the destination may mix old and new blocks until the next delta retrieve repairs it.
+ *              If the destination does not exist or the submission has no checksums, a full retrieve is done.
+ *
+ *
+ * @param[in]   SubmissionName              - A string representing the submission name.
+ *
+ * @param[in]   SubmissionNameLength        - The length of the "SubmissionName" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   DestinationFilePath         - A string representing the absolute path,
+ *                                            where the submission will be copied.
+ *
+ * @param[in]   DestinationFilePathLength   - The length of the "DestinationFilePath" string,
+ *                                            not including the NULL terminator.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveDelta(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* DestinationFilePath,
+    uint16_t DestinationFilePathLength
+);
+
+
+/*
+ * @brief       Handles the "retrieve" command for an earlier version of a submission.
+ *
+ *
+ * @details     Same as SafeStorageHandleRetrieve, but copies the given version. Versions are numbered from 1 in the
+ *              order they were stored; 0 means the current version. The version is reassembled from its blocks,
+ *              each of which is verified against the checksum recorded when the version was stored.
+ *
+ *              Returns STATUS_OBJECT_NAME_NOT_FOUND if the version does not exist or was removed by the retention
+ *              policy, and STATUS_DATA_ERROR if one of its blocks is damaged.
+ *
+ *
+ * @param[in]   SubmissionName              - A string representing the submission name.
+ *
+ * @param[in]   SubmissionNameLength        - The length of the "SubmissionName" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   DestinationFilePath         - A string representing the absolute path,
+ *                                            where the version will be copied.
+ *
+ * @param[in]   DestinationFilePathLength   - The length of the "DestinationFilePath" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   Version                     - The version to retrieve, or 0 for the current one.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveVersion(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* DestinationFilePath,
+    uint16_t DestinationFilePathLength,
+    uint32_t Version
+);
+
+
+/*
+ * @brief       Handles the "snapshot" command.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              Freezes the current version of every submission of the user. No data is copied: the snapshot only
+ *              records version numbers in %APPDIR%\\Users\\<user>\\~snapshots\\<SnapshotId>, and the versions it refers
+ *              to are exempt from the retention policy. Use SafeStorageHandleRetrieveSnapshot to read them back.
+ *
+ *
+ * @param[out]  SnapshotId              - Receives the identifier of the new snapshot. Identifiers start at 1.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleSnapshot(
+    uint32_t* SnapshotId
+);
+
+
+/*
+ * @brief       Handles the "retrieve" command for a submission as it was when a snapshot was taken.
+ *
+ *
+ * @details     Same as SafeStorageHandleRetrieveVersion with the version the snapshot froze.
+ *              Returns STATUS_OBJECT_NAME_NOT_FOUND if the snapshot does not exist or did not contain the submission.
+ *
+ *
+ * @param[in]   SnapshotId                  - A snapshot returned by SafeStorageHandleSnapshot.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveSnapshot(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    const char* DestinationFilePath,
+    uint16_t DestinationFilePathLength,
+    uint32_t SnapshotId
+);
+
+
+/*
+ * @brief       Gives read-only, in-place access to the current version of a submission.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              Instead of copying the submission to another file, its contents are returned as memory of this
+ *              process: the stored file is mapped, so nothing is copied and pages are read from disk only when
+ *              first touched. A submission held by the retrieve cache is served from the cache's memory instead,
+ *              and one striped over several data roots is read into private memory first. A submission in the
+ *              cold tier is promoted, as with SafeStorageHandleRetrieve.
+ *
+ *              The memory stays valid and unchanged until SafeStorageCloseView, even after logout. Meanwhile a
+ *              submission on disk stays mapped, so storing it again fails until the view is closed.
+ *
+ *
+ * @param[in]   SubmissionName              - The name of the submission, possibly nested, as for SafeStorageHandleRetrieve.
+ *
+ * @param[in]   SubmissionNameLength        - The length of the "SubmissionName" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   AccessPattern               - How the contents will be read. SS_ACCESS_SEQUENTIAL prefetches them
+ *                                            with large reads; SS_ACCESS_RANDOM leaves every page to be read on
+ *                                            first access.
+ *
+ * @param[out]  View                        - Receives the contents.
+ *
+ *
+ * @return      STATUS_SUCCESS, STATUS_OBJECT_NAME_NOT_FOUND if there is no such submission, or another failure status.
+ */
+NTSTATUS WINAPI
+SafeStorageOpenView(
+    const char* SubmissionName,
+    uint16_t SubmissionNameLength,
+    SafeStorageAccessPattern AccessPattern,
+    SafeStorageView* View
+);
+
+
+/*
+ * @brief       Releases a view returned by SafeStorageOpenView and zeroes it. A zeroed view is ignored.
+ */
+VOID WINAPI
+SafeStorageCloseView(
+    SafeStorageView* View
+);
+
+
+/*
+ * @brief       Handles the "store" command for a whole directory tree.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              Every file under SourceDirectoryPath is stored as the submission <SubmissionPrefix>\\<relative path>,
+ *              e.g. "project\\src\\main.c", exactly as SafeStorageHandleStore would store it (versions and manifests
+ *              included). Directories are listed in parallel and files are stored concurrently on the library's
+ *              thread pool, so trees of many small files are not handled one file at a time. Each such submission
+ *              can also be retrieved on its own by passing its nested name to SafeStorageHandleRetrieve.
+ *
+ *              Files whose names are not valid submission names (e.g. containing '~') are reported as
+ *              STATUS_OBJECT_NAME_INVALID and skipped.
+ *
+ *
+ * @param[in]   SubmissionPrefix            - The submission names of the tree start with this. May itself be nested
+ *                                            ("projects\\2024"); '/' is accepted as a separator.
+ *
+ * @param[in]   SubmissionPrefixLength      - The length of the "SubmissionPrefix" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   SourceDirectoryPath         - A string representing the absolute path of the directory to store.
+ *
+ * @param[in]   SourceDirectoryPathLength   - The length of the "SourceDirectoryPath" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[out]  Report                      - Receives the status of every file. Free with SafeStorageFreeBulkReport.
+ *
+ *
+ * @return      STATUS_SUCCESS if every file was stored, STATUS_PARTIAL_COPY if some failed (see Report),
+ *              STATUS_NOT_A_DIRECTORY if the source cannot be listed, or another failure status.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleStoreTree(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* SourceDirectoryPath,
+    uint16_t SourceDirectoryPathLength,
+    SafeStorageBulkReport* Report
+);
+
+
+/*
+ * @brief       Handles the "store" command for a list of files.
+ *
+ *
+ * @details     Same as SafeStorageHandleStoreTree, for files given one by one: each file is stored as
+ *              <SubmissionPrefix>\\<file name>. Report entries are named by file name.
+ *
+ *
+ * @param[in]   SourceFilePaths             - Absolute, null-terminated paths of the files to store.
+ *
+ * @param[in]   SourceFileCount             - The number of entries of "SourceFilePaths".
+ */
+NTSTATUS WINAPI
+SafeStorageHandleStoreFiles(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* const* SourceFilePaths,
+    uint32_t SourceFileCount,
+    SafeStorageBulkReport* Report
+);
+
+
+/*
+ * @brief       Handles the "retrieve" command for every submission under a prefix.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              Recreates the tree stored by SafeStorageHandleStoreTree under DestinationDirectoryPath: the
+ *              submission <SubmissionPrefix>\\<relative path> is copied to DestinationDirectoryPath\\<relative path>,
+ *              creating directories as needed. Submissions migrated to the cold tier are included. Files are
+ *              retrieved concurrently, as with SafeStorageHandleStoreTree.
+ *
+ *
+ * @param[in]   DestinationDirectoryPath    - A string representing the absolute path of the directory to fill.
+ *
+ * @param[in]   DestinationDirectoryPathLength - The length of the "DestinationDirectoryPath" string,
+ *                                            not including the NULL terminator.
+ *
+ *
+ * @return      STATUS_SUCCESS if every file was retrieved, STATUS_PARTIAL_COPY if some failed (see Report),
+ *              STATUS_OBJECT_NAME_NOT_FOUND if nothing is stored under the prefix, or another failure status.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleRetrieveTree(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* DestinationDirectoryPath,
+    uint16_t DestinationDirectoryPathLength,
+    SafeStorageBulkReport* Report
+);
+
+
+/*
+ * @brief       Frees the results of a report filled by a bulk store or retrieve command.
+ */
+VOID WINAPI
+SafeStorageFreeBulkReport(
+    SafeStorageBulkReport* Report
+);
+
+
+
+/*
+ * @brief       Starts keeping a directory tree in sync with the logged in user's submissions.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              From now on, every file created, saved or renamed under DirectoryPath is stored again as the
+ *              submission <SubmissionPrefix>\\<relative path>, like SafeStorageHandleStoreTree stores it. Changes are
+ *              reported by ReadDirectoryChangesW and coalesced: a file saved many times counts once, and the
+ *              changed files are stored together, in parallel on the library's thread pool, once the tree has
+ *              been quiet for DebounceMilliseconds. A burst of thousands of saves therefore becomes a few bulk
+ *              stores. A file whose contents match its submission's block checksums (touched, or rewritten with
+ *              the same bytes) is not stored again and gets no new version. A file that did change is stored
+ *              like any other (sparse, resumable and replaced atomically), so readers never see a half-updated
+ *              submission.
+ *
+ *              Files already in the tree are not stored when the watch starts; store them with
+ *              SafeStorageHandleStoreTree first. Deleted files keep their submissions. The watch runs in the
+ *              background until SafeStorageStopWatch, logout or SafeStorageDeinit, each of which stores the
+ *              changes still pending first. Only one directory is watched at a time, and it has to be on disk.
+ *
+ *
+ * @param[in]   SubmissionPrefix            - The submission names of the tree start with this, as for
+ *                                            SafeStorageHandleStoreTree.
+ *
+ * @param[in]   SubmissionPrefixLength      - The length of the "SubmissionPrefix" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   DirectoryPath               - A string representing the absolute path of the directory to watch.
+ *
+ * @param[in]   DirectoryPathLength         - The length of the "DirectoryPath" string,
+ *                                            not including the NULL terminator.
+ *
+ * @param[in]   DebounceMilliseconds        - How long the tree has to be quiet before its changes are stored;
+ *                                            0 for 500 ms.
+ *
+ *
+ * @return      STATUS_SUCCESS, STATUS_NOT_A_DIRECTORY, STATUS_DEVICE_BUSY if a directory is already being
+ *              watched, or another failure status.
+ */
+NTSTATUS WINAPI
+SafeStorageStartWatch(
+    const char* SubmissionPrefix,
+    uint16_t SubmissionPrefixLength,
+    const char* DirectoryPath,
+    uint16_t DirectoryPathLength,
+    uint32_t DebounceMilliseconds
+);
+
+
+/*
+ * @brief       Stores the changes still pending and stops the directory watch.
+ *
+ *
+ * @return      STATUS_SUCCESS, or STATUS_INVALID_DEVICE_STATE if no directory is being watched.
+ */
+NTSTATUS WINAPI
+SafeStorageStopWatch(
+    VOID
+);
+
+
+/*
+ * @brief       Returns the counters of the current or last directory watch.
+ *
+ *
+ * @return      STATUS_SUCCESS, or STATUS_INVALID_PARAMETER if Stats is NULL.
+ */
+NTSTATUS WINAPI
+SafeStorageGetWatchStats(
+    SafeStorageWatchStats* Stats
+);
+
+
+/*
+ * @brief       Handles the "usage" command: prints how much the logged in user stores and the user's quota.
+ *
+ *
+ * @details     This command is available only if a user is currently logged in.
+ *
+ *              Every user's usage is kept in %APPDIR%\\usage.dat, one fixed-size record per user, and updated
+ *              by every store as it publishes a submission, so it is read rather than computed. A user who stored
+ *              submissions before usage was accounted is counted once, by walking the user's directory.
+ *
+ *              Usage counts the current contents of the submissions. Earlier versions, which only keep the blocks
+ *              that changed, are not included.
+ *
+ *
+ * @return      STATUS_SUCCESS, SS_STATUS_NOT_LOGGED_IN or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS WINAPI
+SafeStorageHandleUsage(
+    VOID
+);
+
+
+/*
+ * @brief       Returns the usage and quota of a user.
+ *
+ *
+ * @details     Only reads the accounting: a user who has neither stored anything nor set a quota yet has no
+ *              usage recorded, and STATUS_NOT_FOUND is returned.
+ *
+ *              This command is available only if a user is currently logged in, and only for that user's own usage.
+ *
+ *
+ * @param[in]   Username                - The user; must be the logged in user.
+ *
+ * @param[in]   UsernameLength          - The length of the "Username" string, not including the NULL terminator.
+ *
+ * @param[out]  Usage                   - Receives the usage.
+ *
+ *
+ * @return      STATUS_SUCCESS, SS_STATUS_NOT_LOGGED_IN, STATUS_ACCESS_DENIED, STATUS_NOT_FOUND,
+ *              STATUS_INVALID_PARAMETER or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS WINAPI
+SafeStorageGetUsage(
+    const char* Username,
+    uint16_t UsernameLength,
+    SafeStorageUsage* Usage
+);
+
+
+/*
+ * @brief       Limits how much a user may store.
+ *
+ *
+ * @details     Every store is checked against the quota before any bytes are copied, including the stores that
+ *              are still in progress: one that would take the user's usage beyond QuotaBytes, or create a
+ *              submission beyond QuotaObjects, fails with STATUS_QUOTA_EXCEEDED and leaves the submission as it was.
+ *              Overwriting a submission only counts the difference in size. A streamed store, whose size is not
+ *              known in advance, fails as soon as it outgrows the quota.
+ *
+ *              Older versions take space too: the blocks a store preserves of the version it replaces count
+ *              towards QuotaBytes (not QuotaObjects), and the store fails with STATUS_QUOTA_EXCEEDED if they
+ *              do not fit. Their bytes are given back once retention (SafeStorageSetRetention) prunes them.
+ *
+ *              Submissions already stored are kept even if they exceed a new, lower quota.
+ *
+ *              This command is available only if a user is currently logged in, and only for that user's own quota.
+ *
+ *
+ * @param[in]   Username                - The user; must be the logged in user.
+ *
+ * @param[in]   UsernameLength          - The length of the "Username" string, not including the NULL terminator.
+ *
+ * @param[in]   QuotaBytes              - Largest total size of the user's submissions; 0 for unlimited.
+ *
+ * @param[in]   QuotaObjects            - Largest number of submissions; 0 for unlimited.
+ *
+ *
+ * @return      STATUS_SUCCESS, SS_STATUS_NOT_LOGGED_IN, STATUS_ACCESS_DENIED, STATUS_INVALID_PARAMETER
+ *              or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS WINAPI
+SafeStorageSetQuota(
+    const char* Username,
+    uint16_t UsernameLength,
+    uint64_t QuotaBytes,
+    uint64_t QuotaObjects
+);
+
+
+/*
+ * @brief       Returns the usage of every user and the totals, from the usage kept in memory; no directory is walked.
+ *
+ *
+ * @param[out]  Report                  - Receives the report. Free with SafeStorageFreeUsageReport.
+ *
+ *
+ * @return      STATUS_SUCCESS, STATUS_INVALID_PARAMETER or STATUS_NO_MEMORY.
+ */
+NTSTATUS WINAPI
+SafeStorageGetUsageReport(
+    SafeStorageUsageReport* Report
+);
+
+
+/*
+ * @brief       Frees the users of a report filled by SafeStorageGetUsageReport and zeroes it.
+ */
+VOID WINAPI
+SafeStorageFreeUsageReport(
+    SafeStorageUsageReport* Report
+);
+
+
+/*
+ * @brief       Keeps small submissions in large, shared, append-only segment files instead of one file each.
+ *
+ *
+ * @details     While the engine is enabled, a store of a file of at most MaxObjectSize bytes appends one
+ *              checksummed record to the active segment under %APPDIR%\segments and updates an in-memory index,
+ *              instead of creating the submission's file, its manifest and its version; the record is made
+ *              durable according to the durability mode. This turns many small stores into sequential writes to
+ *              a few preallocated files. Retrieves find the submission through the index and read it with a
+ *              single read.
+ *
+ *              Only new submissions and those already kept in segments go there. A submission that is a file
+ *              stays one, and storing a larger file over a submission kept in segments moves it to a file.
+ *              Versions, snapshots, views, the cold tier, striping and the tree retrieve only apply to
+ *              submissions stored as files, and streamed stores always create files.
+ *
+ *              The index is checkpointed periodically and rebuilt on the next start from the checkpoint and the
+ *              records appended after it. A background thread compacts segments that are mostly overwritten
+ *              data. Disabling the engine checkpoints and closes it; the submissions it holds are not available
+ *              again until it is enabled. It is disabled by default and by SafeStorageConfigureIoBackend.
+ *
+ *
+ * @param[in]   MaxObjectSize           - Largest submission kept in segments, at most 4 MB; 0 disables the engine.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureSegments(
+    uint32_t MaxObjectSize
+);
+
+
+/*
+ * @brief       Returns the state and counters of the segment engine.
+ *
+ *
+ * @param[out]  Stats                   - Receives the counters.
+ */
+NTSTATUS WINAPI
+SafeStorageGetSegmentStats(
+    SafeStorageSegmentStats* Stats
+);
+
+
+/*
+ * @brief       Starts recording the commands to a trace file that SafeStorageReplay can run again.
+ *
+ *
+ * @details     From now on, every SafeStorageHandle* command appends a fixed-size binary record to the trace:
+ *              when it was called and how long it took, in microseconds, the command, its status, the calling
+ *              thread, the login session it ran in, the lengths of its name and path arguments, a hash of the
+ *              user, submission or prefix name, the size of what a store stored and the files of a bulk
+ *              command. Names, paths, passwords and contents are not recorded.
+ *
+ *              Recording costs a timestamp and an in-memory append per command; the records are written to
+ *              the file in batches. Only one trace is recorded at a time, until SafeStorageStopTrace or
+ *              SafeStorageDeinit.
+ *
+ *
+ * @param[in]   TraceFilePath           - A string representing the path of the trace file; replaced if it exists.
+ *
+ * @param[in]   TraceFilePathLength     - The length of the "TraceFilePath" string, not including the NULL terminator.
+ *
+ *
+ * @return      STATUS_SUCCESS, STATUS_INVALID_PARAMETER, STATUS_DEVICE_BUSY if a trace is already being recorded,
+ *              or STATUS_UNSUCCESSFUL if the file cannot be created.
+ */
+NTSTATUS WINAPI
+SafeStorageStartTrace(
+    const char* TraceFilePath,
+    uint16_t TraceFilePathLength
+);
+
+
+/*
+ * @brief       Writes the rest of the trace and closes it.
+ *
+ *
+ * @return      STATUS_SUCCESS, or STATUS_INVALID_DEVICE_STATE if no trace is being recorded.
+ */
+NTSTATUS WINAPI
+SafeStorageStopTrace(
+    VOID
+);
+
+
+/*
+ * @brief       Turns the tuning of store and retrieve transfers on or off.
+ *
+ *
+ * @details     Store and retrieve copy a file in I/Os of one or more 64 KB chunks, several of them in flight at
+ *              once. How large and how many works best depends on the devices: fast SSDs want deep queues, disks
+ *              and network file systems large sequential I/Os. With tuning on (the default), a transfer of at least
+ *              32 MB spends its first quarter probing: it moves batches with twice or half the I/O size (up to
+ *              1 MB) and twice or half the I/Os in flight (up to the number of workers), keeps what is faster and
+ *              stops once nothing is. The best settings are remembered per pair of source and destination
+ *              volumes, in %APPDIR%\transfer_tuning.txt, and smaller transfers between the same volumes use them.
+ *              The next large transfer starts its probe from them.
+ *
+ *              With tuning off every transfer uses 64 KB I/Os on every worker. Checksums, checkpoints and
+ *              stripes are kept per 64 KB chunk either way.
+ *
+ *
+ * @param[in]   Enabled                 - Whether to probe and use remembered settings.
+ */
+NTSTATUS WINAPI
+SafeStorageConfigureTransferTuning(
+    BOOLEAN Enabled
+);
+
+
+/*
+ * @brief       Returns the counters of the transfer tuner and the settings it remembered last.
+ *
+ *
+ * @param[out]  Stats                   - Receives the counters.
+ */
+NTSTATUS WINAPI
+SafeStorageGetTransferTuningStats(
+    SafeStorageTransferTuningStats* Stats
+);
+
 EXTERN_C_END;
 #endif  //_COMMANDS_H_
@@ -0,0 +1,205 @@
+#include "Durability.h"
+#include "FileIo.h"
+
+
+// A caller blocked in DurabilityCommitFile. The node lives on the caller's stack.
+typedef struct _COMMIT_REQUEST {
+    struct _COMMIT_REQUEST* Next;
+    const char* FilePath;
+    bool Done;
+    bool Succeeded;
+} COMMIT_REQUEST;
+
+
+// Global static variables
+static volatile LONG g_DurabilityMode = SS_DURABILITY_NONE;
+static SRWLOCK g_CommitLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE g_CommitPending = CONDITION_VARIABLE_INIT;   // Signaled when a request is queued
+static CONDITION_VARIABLE g_CommitDone = CONDITION_VARIABLE_INIT;      // Signaled when a batch is flushed
+static COMMIT_REQUEST* g_PendingRequests = NULL;
+static DWORD g_PendingCount = 0;
+static bool g_FlusherStopping = false;
+static HANDLE g_FlusherThread = NULL;
+
+
+/**
+ * @brief       Flushes the cached data and metadata of a file to disk.
+ *
+ * @param       filePath        The file to flush.
+ * @return      TRUE if the flush succeeded; otherwise, FALSE.
+ */
+static bool FlushFileByPath(_In_z_ const char* filePath) {
+    if (!IoFlushPath(filePath)) {
+        printf("Failed to flush %s: %lu\n", filePath, GetLastError());
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Flushes one batch of requests. Each distinct file is flushed once and the
+ *              outcome is reported to every request that named it.
+ *
+ * @param       batch           The detached list of requests.
+ */
+static void FlushBatch(_In_ COMMIT_REQUEST* batch) {
+    for (COMMIT_REQUEST* request = batch; request != NULL; request = request->Next) {
+        // An earlier request for the same file already carries the outcome
+        bool alreadyFlushed = false;
+        for (COMMIT_REQUEST* earlier = batch; earlier != request; earlier = earlier->Next) {
+            if (_stricmp(earlier->FilePath, request->FilePath) == 0) {
+                request->Succeeded = earlier->Succeeded;
+                alreadyFlushed = true;
+                break;
+            }
+        }
+
+        if (!alreadyFlushed) {
+            request->Succeeded = FlushFileByPath(request->FilePath);
+        }
+    }
+}
+
+
+/**
+ * @brief       Group-commit flusher. Waits for requests, lets a short window pass so that concurrent
+ *              callers can join the batch, then flushes the whole batch at once.
+ */
+static DWORD WINAPI FlusherThreadProc(_In_ LPVOID parameter) {
+    UNREFERENCED_PARAMETER(parameter);
+
+    AcquireSRWLockExclusive(&g_CommitLock);
+    for (;;) {
+        while (g_PendingRequests == NULL && !g_FlusherStopping) {
+            SleepConditionVariableSRW(&g_CommitPending, &g_CommitLock, INFINITE, 0);
+        }
+
+        if (g_PendingRequests == NULL) {
+            break;  // Stopping and nothing left to flush
+        }
+
+        // Give concurrent callers a chance to join this batch
+        ULONGLONG deadline = GetTickCount64() + GROUP_COMMIT_WINDOW_MS;
+        while (!g_FlusherStopping && g_PendingCount < GROUP_COMMIT_MAX_BATCH) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                break;
+            }
+            SleepConditionVariableSRW(&g_CommitPending, &g_CommitLock, (DWORD)(deadline - now), 0);
+        }
+
+        COMMIT_REQUEST* batch = g_PendingRequests;
+        g_PendingRequests = NULL;
+        g_PendingCount = 0;
+        ReleaseSRWLockExclusive(&g_CommitLock);
+
+        FlushBatch(batch);
+
+        AcquireSRWLockExclusive(&g_CommitLock);
+        for (COMMIT_REQUEST* request = batch; request != NULL; request = request->Next) {
+            request->Done = true;
+        }
+        WakeAllConditionVariable(&g_CommitDone);
+    }
+    ReleaseSRWLockExclusive(&g_CommitLock);
+
+    return 0;
+}
+
+
+bool
+DurabilityInit(
+    VOID
+)
+{
+    g_FlusherStopping = false;
+    g_FlusherThread = CreateThread(NULL, 0, FlusherThreadProc, NULL, 0, NULL);
+    if (g_FlusherThread == NULL) {
+        printf("Failed to start the group-commit flusher: %lu\n", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+
+VOID
+DurabilityDeinit(
+    VOID
+)
+{
+    if (g_FlusherThread == NULL) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_CommitLock);
+    g_FlusherStopping = true;
+    WakeAllConditionVariable(&g_CommitPending);
+    ReleaseSRWLockExclusive(&g_CommitLock);
+
+    WaitForSingleObject(g_FlusherThread, INFINITE);
+    CloseHandle(g_FlusherThread);
+    g_FlusherThread = NULL;
+}
+
+
+bool
+DurabilitySetMode(
+    _In_ SafeStorageDurabilityMode Mode
+)
+{
+    if (Mode != SS_DURABILITY_NONE && Mode != SS_DURABILITY_PER_OPERATION && Mode != SS_DURABILITY_GROUP_COMMIT) {
+        return false;
+    }
+
+    InterlockedExchange(&g_DurabilityMode, (LONG)Mode);
+    return true;
+}
+
+
+SafeStorageDurabilityMode
+DurabilityGetMode(
+    VOID
+)
+{
+    return (SafeStorageDurabilityMode)InterlockedCompareExchange(&g_DurabilityMode, 0, 0);
+}
+
+
+bool
+DurabilityCommitFile(
+    _In_z_ const char* FilePath
+)
+{
+    SafeStorageDurabilityMode mode = DurabilityGetMode();
+
+    if (mode == SS_DURABILITY_NONE) {
+        return true;
+    }
+
+    // Without a flusher (not initialized or already shut down) fall back to a synchronous flush
+    if (mode == SS_DURABILITY_PER_OPERATION || g_FlusherThread == NULL) {
+        return FlushFileByPath(FilePath);
+    }
+
+    COMMIT_REQUEST request = { 0 };
+    request.FilePath = FilePath;
+
+    AcquireSRWLockExclusive(&g_CommitLock);
+    if (g_FlusherStopping) {
+        ReleaseSRWLockExclusive(&g_CommitLock);
+        return FlushFileByPath(FilePath);
+    }
+
+    request.Next = g_PendingRequests;
+    g_PendingRequests = &request;
+    g_PendingCount++;
+    WakeConditionVariable(&g_CommitPending);
+
+    while (!request.Done) {
+        SleepConditionVariableSRW(&g_CommitDone, &g_CommitLock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&g_CommitLock);
+
+    return request.Succeeded;
+}
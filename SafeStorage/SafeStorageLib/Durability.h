@@ -0,0 +1,77 @@
+#ifndef _DURABILITY_H_
+#define _DURABILITY_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define GROUP_COMMIT_WINDOW_MS 5                // How long the flusher waits to collect a batch
+#define GROUP_COMMIT_MAX_BATCH 256              // Flush early once this many requests are pending
+
+
+/*
+ * @brief       Starts the group-commit flusher thread. Called from SafeStorageInit.
+ *
+ * @return      TRUE if the flusher is running; otherwise, FALSE.
+ */
+bool
+DurabilityInit(
+    VOID
+);
+
+
+/*
+ * @brief       Flushes every pending request and stops the flusher thread. Called from SafeStorageDeinit.
+ */
+VOID
+DurabilityDeinit(
+    VOID
+);
+
+
+/*
+ * @brief       Selects how DurabilityCommitFile makes data durable.
+ *
+ * @param[in]   Mode            - One of the SafeStorageDurabilityMode values.
+ *
+ * @return      TRUE if the mode is valid; otherwise, FALSE.
+ */
+bool
+DurabilitySetMode(
+    _In_ SafeStorageDurabilityMode Mode
+);
+
+
+/*
+ * @brief       Returns the currently selected durability mode.
+ */
+SafeStorageDurabilityMode
+DurabilityGetMode(
+    VOID
+);
+
+
+/*
+ * @brief       Makes the contents of a closed file durable according to the current mode.
+ *
+ * @details     SS_DURABILITY_NONE returns immediately and leaves the data to the cache manager.
+ *              SS_DURABILITY_PER_OPERATION flushes the file on the calling thread.
+ *              SS_DURABILITY_GROUP_COMMIT queues the file for the flusher thread and blocks until
+ *              the batch that contains it has been flushed. Requests for the same file that land
+ *              in one batch are flushed only once.
+ *
+ * @param[in]   FilePath        - Path of the file that was just written.
+ *
+ * @return      TRUE if the data reached stable storage (or durability is disabled); otherwise, FALSE.
+ */
+bool
+DurabilityCommitFile(
+    _In_z_ const char* FilePath
+);
+
+
+EXTERN_C_END;
+#endif  //_DURABILITY_H_
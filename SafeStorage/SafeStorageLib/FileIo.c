@@ -0,0 +1,754 @@
+#include "FileIo.h"
+#include "IoBackend.h"
+#include "OsBackend.h"
+#include <stdarg.h>
+
+
+struct _SS_FILE {
+    const IO_BACKEND* Backend;                  // The backend the file was opened with
+    IO_HANDLE Handle;                           // Supports concurrent positional I/O
+    DWORD StripeCount;                          // Striped files only: number of handles in Stripes, else 0
+    DWORD StripeUnit;                           // Striped files only: bytes stored in one stripe before the next
+    IO_HANDLE* Stripes;                         // Striped files only: one handle per stripe, Stripes[0] == Handle
+};
+
+
+// IoEnumerateFiles state while it lists one directory
+typedef struct _ENUMERATE_CONTEXT {
+    bool Recursive;
+    IO_ENUMERATE_CALLBACK Callback;
+    void* Context;
+} ENUMERATE_CONTEXT;
+
+
+// Global static variables
+static const IO_BACKEND* volatile g_Backend = NULL;     // NULL until set: the operating system
+
+
+/**
+ * @brief       Returns the backend new operations go to.
+ */
+static const IO_BACKEND* CurrentBackend(void) {
+    const IO_BACKEND* backend = g_Backend;
+    return (backend != NULL) ? backend : OsBackendGet();
+}
+
+
+/**
+ * @brief       Returns the number of handles behind a file: one, or one per stripe.
+ */
+static DWORD HandleCount(_In_ const SS_FILE* file) {
+    return (file->StripeCount > 0) ? file->StripeCount : 1;
+}
+
+
+/**
+ * @brief       Returns the handle with the given index (see HandleCount).
+ */
+static IO_HANDLE HandleAt(_In_ const SS_FILE* file, _In_ DWORD index) {
+    return (file->StripeCount > 0) ? file->Stripes[index] : file->Handle;
+}
+
+
+/**
+ * @brief       Positional read or write of a file. On a striped file the range is split at stripe unit
+ *              boundaries and every piece goes to the stripe that holds it, at the same offset.
+ *
+ * @return      TRUE on success; otherwise, FALSE. A read at or past end of file succeeds with 0 bytes.
+ */
+static bool TransferAt(_In_ SS_FILE* file, _In_ uint64_t offset, _In_ void* buffer, _In_ DWORD length, _In_ bool write, _Out_ DWORD* transferred) {
+    if (file->StripeCount == 0) {
+        return file->Backend->TransferAt(file->Handle, offset, buffer, length, write, transferred);
+    }
+
+    *transferred = 0;
+    while (*transferred < length) {
+        uint64_t position = offset + *transferred;
+        uint64_t unit = position / file->StripeUnit;
+        DWORD piece = (DWORD)min((uint64_t)(length - *transferred), (unit + 1) * file->StripeUnit - position);
+        DWORD done = 0;
+
+        if (!file->Backend->TransferAt(file->Stripes[unit % file->StripeCount], position, (BYTE*)buffer + *transferred, piece, write, &done)) {
+            return false;
+        }
+        *transferred += done;
+
+        // End of file: every stripe has the file's full size
+        if (done < piece) {
+            break;
+        }
+    }
+    return true;
+}
+
+
+VOID
+IoSetBackend(
+    _In_opt_ const IO_BACKEND* Backend
+)
+{
+    InterlockedExchangePointer((PVOID volatile*)&g_Backend, (PVOID)Backend);
+}
+
+
+const IO_BACKEND*
+IoGetBackend(
+    VOID
+)
+{
+    return CurrentBackend();
+}
+
+
+SS_FILE*
+IoOpenFile(
+    _In_z_ const char* Path,
+    _In_ IoOpenMode Mode
+)
+{
+    SS_FILE* file = (SS_FILE*)calloc(1, sizeof(SS_FILE));
+    if (file == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    file->Backend = CurrentBackend();
+    file->Handle = file->Backend->Open(Path, Mode);
+    if (file->Handle == NULL) {
+        DWORD error = GetLastError();
+        free(file);
+        SetLastError(error);
+        return NULL;
+    }
+
+    return file;
+}
+
+
+SS_FILE*
+IoOpenStripedFile(
+    _In_reads_(PathCount) const char* const* Paths,
+    _In_ DWORD PathCount,
+    _In_ DWORD StripeUnit,
+    _In_ IoOpenMode Mode
+)
+{
+    if (PathCount == 0 || StripeUnit == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    SS_FILE* file = (SS_FILE*)calloc(1, sizeof(SS_FILE));
+    IO_HANDLE* stripes = (IO_HANDLE*)calloc(PathCount, sizeof(IO_HANDLE));
+    if (file == NULL || stripes == NULL) {
+        free(stripes);
+        free(file);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    file->Backend = CurrentBackend();
+    for (DWORD i = 0; i < PathCount; i++) {
+        stripes[i] = file->Backend->Open(Paths[i], Mode);
+        if (stripes[i] == NULL) {
+            DWORD error = GetLastError();
+            while (i-- > 0) {
+                file->Backend->Close(stripes[i]);
+            }
+            free(stripes);
+            free(file);
+            SetLastError(error);
+            return NULL;
+        }
+    }
+
+    file->Handle = stripes[0];
+    file->StripeCount = PathCount;
+    file->StripeUnit = StripeUnit;
+    file->Stripes = stripes;
+    return file;
+}
+
+
+VOID
+IoCloseFile(
+    _In_opt_ SS_FILE* File
+)
+{
+    if (File == NULL) {
+        return;
+    }
+
+    for (DWORD i = 0; i < HandleCount(File); i++) {
+        File->Backend->Close(HandleAt(File, i));
+    }
+    free(File->Stripes);
+    free(File);
+}
+
+
+bool
+IoReadAt(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Offset,
+    _Out_writes_bytes_to_(Length, *BytesRead) void* Buffer,
+    _In_ DWORD Length,
+    _Out_ DWORD* BytesRead
+)
+{
+    return TransferAt(File, Offset, Buffer, Length, false, BytesRead);
+}
+
+
+bool
+IoWriteAt(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Offset,
+    _In_reads_bytes_(Length) const void* Buffer,
+    _In_ DWORD Length
+)
+{
+    DWORD written = 0;
+    return TransferAt(File, Offset, (void*)Buffer, Length, true, &written) && written == Length;
+}
+
+
+bool
+IoGetFileSize(
+    _In_ SS_FILE* File,
+    _Out_ uint64_t* Size
+)
+{
+    return File->Backend->GetSize(File->Handle, Size);
+}
+
+
+bool
+IoGetLastWriteTime(
+    _In_ SS_FILE* File,
+    _Out_ uint64_t* LastWriteTime
+)
+{
+    return File->Backend->GetLastWriteTime(File->Handle, LastWriteTime);
+}
+
+
+bool
+IoSetLastWriteTime(
+    _In_ SS_FILE* File,
+    _In_ uint64_t LastWriteTime
+)
+{
+    bool result = true;
+    for (DWORD i = 0; result && i < HandleCount(File); i++) {
+        result = File->Backend->SetLastWriteTime(HandleAt(File, i), LastWriteTime);
+    }
+    return result;
+}
+
+
+bool
+IoSetFileSize(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Size
+)
+{
+    // Every stripe has the full size; each only holds data in its own units
+    bool result = true;
+    for (DWORD i = 0; result && i < HandleCount(File); i++) {
+        result = File->Backend->SetSize(HandleAt(File, i), Size);
+    }
+    return result;
+}
+
+
+bool
+IoPreallocate(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Size
+)
+{
+    // Reserving the full size on every stripe would take StripeCount times the space
+    if (File->StripeCount > 0) {
+        return IoSetSparse(File) && IoSetFileSize(File, Size);
+    }
+
+    return File->Backend->Reserve(File->Handle, Size) && IoSetFileSize(File, Size);
+}
+
+
+bool
+IoFlushFile(
+    _In_ SS_FILE* File
+)
+{
+    bool result = true;
+    for (DWORD i = 0; result && i < HandleCount(File); i++) {
+        result = File->Backend->Flush(HandleAt(File, i));
+    }
+    return result;
+}
+
+
+bool
+IoReplaceFile(
+    _In_z_ const char* Source,
+    _In_z_ const char* Destination
+)
+{
+    return CurrentBackend()->Replace(Source, Destination);
+}
+
+
+bool
+IoDeleteFile(
+    _In_z_ const char* Path
+)
+{
+    return CurrentBackend()->Delete(Path);
+}
+
+
+bool
+IoQueryFileInfo(
+    _In_z_ const char* Path,
+    _Out_ IO_FILE_INFO* Info
+)
+{
+    return CurrentBackend()->QueryInfo(Path, Info);
+}
+
+
+/**
+ * @brief       Backend List callback of IoEnumerateFiles. Passes the entry on and descends into directories.
+ */
+static IoEnumerateAction EnumerateEntry(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    ENUMERATE_CONTEXT* enumeration = (ENUMERATE_CONTEXT*)context;
+
+    IoEnumerateAction action = enumeration->Callback(path, name, info, enumeration->Context);
+    if (action == IO_ENUMERATE_STOP) {
+        return IO_ENUMERATE_STOP;
+    }
+
+    if (enumeration->Recursive && info->IsDirectory && action == IO_ENUMERATE_CONTINUE) {
+        if (!IoEnumerateFiles(path, true, enumeration->Callback, enumeration->Context) && GetLastError() == ERROR_CANCELLED) {
+            return IO_ENUMERATE_STOP;
+        }
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+bool
+IoEnumerateFiles(
+    _In_z_ const char* Directory,
+    _In_ bool Recursive,
+    _In_ IO_ENUMERATE_CALLBACK Callback,
+    _In_opt_ void* Context
+)
+{
+    ENUMERATE_CONTEXT enumeration = { 0 };
+    enumeration.Recursive = Recursive;
+    enumeration.Callback = Callback;
+    enumeration.Context = Context;
+
+    return CurrentBackend()->List(Directory, EnumerateEntry, &enumeration);
+}
+
+
+bool
+IoCreateDirectories(
+    _In_z_ const char* Path
+)
+{
+    const IO_BACKEND* backend = CurrentBackend();
+    char partial[MAX_PATH];
+    if (FAILED(StringCchCopyA(partial, MAX_PATH, Path))) {
+        return false;
+    }
+
+    // Create every prefix that ends at a separator, skipping a drive ("C:\") or UNC ("\\server\") root
+    for (char* separator = strchr(partial + 1, '\\'); separator != NULL; separator = strchr(separator + 1, '\\')) {
+        if (separator[-1] == ':' || separator[-1] == '\\') {
+            continue;
+        }
+
+        *separator = '\0';
+        if (!backend->MakeDirectory(partial) && GetLastError() != ERROR_ALREADY_EXISTS && GetLastError() != ERROR_ACCESS_DENIED) {
+            return false;
+        }
+        *separator = '\\';
+    }
+
+    return backend->MakeDirectory(partial) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+
+bool
+IoTouchFile(
+    _In_z_ const char* Path
+)
+{
+    return CurrentBackend()->Touch(Path);
+}
+
+
+bool
+IoFlushPath(
+    _In_z_ const char* Path
+)
+{
+    return CurrentBackend()->FlushPath(Path);
+}
+
+
+bool
+IoReadFileContents(
+    _In_z_ const char* Path,
+    _Outptr_result_maybenull_z_ char** Contents,
+    _Out_opt_ size_t* Length
+)
+{
+    *Contents = NULL;
+    if (Length != NULL) {
+        *Length = 0;
+    }
+
+    SS_FILE* file = IoOpenFile(Path, IO_OPEN_READ);
+    if (file == NULL) {
+        return false;
+    }
+
+    uint64_t size = 0;
+    char* data = NULL;
+    bool result = IoGetFileSize(file, &size) && size < MAXDWORD;
+    if (!result) {
+        SetLastError(ERROR_FILE_TOO_LARGE);
+    }
+    else if ((data = (char*)malloc((size_t)size + 1)) == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        result = false;
+    }
+
+    // The file may shrink meanwhile; what was read is what it contains
+    DWORD read = 0;
+    result = result && IoReadAt(file, 0, data, (DWORD)size, &read);
+    DWORD error = GetLastError();
+    IoCloseFile(file);
+
+    if (!result) {
+        free(data);
+        SetLastError(error);
+        return false;
+    }
+
+    data[read] = '\0';
+    *Contents = data;
+    if (Length != NULL) {
+        *Length = read;
+    }
+    return true;
+}
+
+
+bool
+IoWriteFileContents(
+    _In_z_ const char* Path,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length
+)
+{
+    if (Length > MAXDWORD) {
+        SetLastError(ERROR_FILE_TOO_LARGE);
+        return false;
+    }
+
+    SS_FILE* file = IoOpenFile(Path, IO_OPEN_CREATE);
+    if (file == NULL) {
+        return false;
+    }
+
+    bool result = Length == 0 || IoWriteAt(file, 0, Data, (DWORD)Length);
+    DWORD error = GetLastError();
+    IoCloseFile(file);
+
+    SetLastError(error);
+    return result;
+}
+
+
+bool
+IoAppendFileContents(
+    _In_z_ const char* Path,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length
+)
+{
+    if (Length > MAXDWORD) {
+        SetLastError(ERROR_FILE_TOO_LARGE);
+        return false;
+    }
+
+    SS_FILE* file = IoOpenFile(Path, IO_OPEN_ALWAYS);
+    if (file == NULL) {
+        return false;
+    }
+
+    uint64_t size = 0;
+    bool result = IoGetFileSize(file, &size) && (Length == 0 || IoWriteAt(file, size, Data, (DWORD)Length));
+    DWORD error = GetLastError();
+    IoCloseFile(file);
+
+    SetLastError(error);
+    return result;
+}
+
+
+bool
+IoTextAppend(
+    _Inout_ IO_TEXT* Text,
+    _In_z_ _Printf_format_string_ const char* Format,
+    ...
+)
+{
+    if (Text->Failed) {
+        return false;
+    }
+
+    va_list arguments;
+    va_start(arguments, Format);
+    int needed = _vscprintf(Format, arguments);
+    va_end(arguments);
+
+    if (needed < 0) {
+        Text->Failed = true;
+        return false;
+    }
+
+    if (Text->Length + (size_t)needed + 1 > Text->Capacity) {
+        size_t capacity = max(2 * Text->Capacity, Text->Length + (size_t)needed + 1);
+        capacity = max(capacity, 256);
+        char* grown = (char*)realloc(Text->Data, capacity);
+        if (grown == NULL) {
+            Text->Failed = true;
+            return false;
+        }
+        Text->Data = grown;
+        Text->Capacity = capacity;
+    }
+
+    va_start(arguments, Format);
+    int written = vsprintf_s(Text->Data + Text->Length, Text->Capacity - Text->Length, Format, arguments);
+    va_end(arguments);
+
+    if (written != needed) {
+        Text->Failed = true;
+        return false;
+    }
+
+    Text->Length += (size_t)written;
+    return true;
+}
+
+
+VOID
+IoTextFree(
+    _Inout_ IO_TEXT* Text
+)
+{
+    free(Text->Data);
+    memset(Text, 0, sizeof(*Text));
+}
+
+
+char*
+IoTextNextLine(
+    _Inout_ char** Cursor
+)
+{
+    char* line = *Cursor;
+    if (line == NULL || *line == '\0') {
+        return NULL;
+    }
+
+    char* end = line + strcspn(line, "\n");
+    *Cursor = (*end == '\n') ? end + 1 : end;
+    *end = '\0';
+
+    if (end > line && end[-1] == '\r') {
+        end[-1] = '\0';
+    }
+    return line;
+}
+
+
+bool
+IoSetCompression(
+    _In_ SS_FILE* File
+)
+{
+    bool result = true;
+    for (DWORD i = 0; result && i < HandleCount(File); i++) {
+        result = File->Backend->SetCompression(HandleAt(File, i));
+    }
+    return result;
+}
+
+
+bool
+IoSetSparse(
+    _In_ SS_FILE* File
+)
+{
+    bool result = true;
+    for (DWORD i = 0; result && i < HandleCount(File); i++) {
+        result = File->Backend->SetSparse(HandleAt(File, i));
+    }
+    return result;
+}
+
+
+/**
+ * @brief       qsort comparison of IO_RANGE values by offset.
+ */
+static int CompareRanges(_In_ const void* left, _In_ const void* right) {
+    uint64_t leftOffset = ((const IO_RANGE*)left)->Offset;
+    uint64_t rightOffset = ((const IO_RANGE*)right)->Offset;
+    return (leftOffset > rightOffset) - (leftOffset < rightOffset);
+}
+
+
+bool
+IoQueryAllocatedRanges(
+    _In_ SS_FILE* File,
+    _In_ uint64_t FileSize,
+    _Outptr_result_maybenull_ IO_RANGE** Ranges,
+    _Out_ DWORD* RangeCount
+)
+{
+    if (File->StripeCount == 0) {
+        return File->Backend->QueryAllocatedRanges(File->Handle, FileSize, Ranges, RangeCount);
+    }
+
+    *Ranges = NULL;
+    *RangeCount = 0;
+
+    // A stripe is a hole outside its own units, so the data of the file is the union of the stripes' data
+    IO_RANGE* ranges = NULL;
+    DWORD count = 0;
+    for (DWORD i = 0; i < File->StripeCount; i++) {
+        IO_RANGE* stripeRanges = NULL;
+        DWORD stripeCount = 0;
+        if (!File->Backend->QueryAllocatedRanges(File->Stripes[i], FileSize, &stripeRanges, &stripeCount)) {
+            free(ranges);
+            return false;
+        }
+
+        if (stripeCount > 0) {
+            IO_RANGE* grown = (IO_RANGE*)realloc(ranges, (count + stripeCount) * sizeof(IO_RANGE));
+            if (grown == NULL) {
+                free(stripeRanges);
+                free(ranges);
+                return false;
+            }
+            ranges = grown;
+            memcpy(ranges + count, stripeRanges, stripeCount * sizeof(IO_RANGE));
+            count += stripeCount;
+        }
+        free(stripeRanges);
+    }
+
+    // Sort and merge overlapping or adjacent ranges
+    if (count > 0) {
+        qsort(ranges, count, sizeof(IO_RANGE), CompareRanges);
+    }
+    DWORD merged = 0;
+    for (DWORD i = 0; i < count; i++) {
+        if (merged > 0 && ranges[i].Offset <= ranges[merged - 1].Offset + ranges[merged - 1].Length) {
+            uint64_t end = max(ranges[merged - 1].Offset + ranges[merged - 1].Length, ranges[i].Offset + ranges[i].Length);
+            ranges[merged - 1].Length = end - ranges[merged - 1].Offset;
+        }
+        else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+
+    *Ranges = ranges;
+    *RangeCount = merged;
+    return true;
+}
+
+
+bool
+IoMapView(
+    _In_ SS_FILE* File,
+    _In_ IoAccessPattern Pattern,
+    _Outptr_result_maybenull_ const void** View,
+    _Out_ uint64_t* Size
+)
+{
+    *View = NULL;
+    if (!IoGetFileSize(File, Size)) {
+        return false;
+    }
+
+    // Nothing to map; the backends refuse empty mappings
+    if (*Size == 0) {
+        return true;
+    }
+    if (File->StripeCount == 0) {
+        return File->Backend->MapView(File->Handle, *Size, Pattern, View);
+    }
+
+    // The stripes interleave, so the file is assembled in memory of its own
+    if (*Size > (uint64_t)SIZE_MAX) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+    BYTE* buffer = (BYTE*)VirtualAlloc(NULL, (SIZE_T)*Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (buffer == NULL) {
+        return false;
+    }
+
+    bool result = true;
+    for (uint64_t offset = 0; result && offset < *Size; ) {
+        DWORD length = (DWORD)min(*Size - offset, (uint64_t)IO_VIEW_READ_SIZE);
+        DWORD bytesRead = 0;
+        result = IoReadAt(File, offset, buffer + offset, length, &bytesRead);
+        if (result && bytesRead != length) {
+            SetLastError(ERROR_HANDLE_EOF);
+            result = false;
+        }
+        offset += length;
+    }
+
+    DWORD oldProtection = 0;
+    if (!result || !VirtualProtect(buffer, (SIZE_T)*Size, PAGE_READONLY, &oldProtection)) {
+        DWORD error = GetLastError();
+        VirtualFree(buffer, 0, MEM_RELEASE);
+        SetLastError(error);
+        return false;
+    }
+
+    *View = buffer;
+    return true;
+}
+
+
+VOID
+IoUnmapView(
+    _In_ SS_FILE* File,
+    _In_opt_ const void* View
+)
+{
+    if (View == NULL) {
+        return;
+    }
+
+    if (File->StripeCount == 0) {
+        File->Backend->UnmapView(File->Handle, View);
+    }
+    else {
+        VirtualFree((LPVOID)View, 0, MEM_RELEASE);
+    }
+}
@@ -0,0 +1,440 @@
+#ifndef _FILEIO_H_
+#define _FILEIO_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define IO_VIEW_READ_SIZE (16 * 1024 * 1024)    // Reads that assemble a striped file for IoMapView
+
+
+// An open file that supports concurrent positional reads and writes from several threads.
+typedef struct _SS_FILE SS_FILE;
+
+
+// How IoOpenFile opens a file
+typedef enum {
+    IO_OPEN_READ = 0,                           // Existing file, read-only
+    IO_OPEN_WRITE = 1,                          // Existing file, read-write
+    IO_OPEN_CREATE = 2,                         // Create or truncate, read-write
+    IO_OPEN_ALWAYS = 3                          // Open if present (keeping contents) or create, read-write
+} IoOpenMode;
+
+
+// Attributes reported by IoQueryFileInfo and IoEnumerateFiles
+typedef struct _IO_FILE_INFO {
+    uint64_t Size;
+    uint64_t LastWriteTime;                     // FILETIME units
+    uint64_t LastAccessTime;                    // FILETIME units
+    bool IsDirectory;
+} IO_FILE_INFO;
+
+
+// A byte range of a file, as reported by IoQueryAllocatedRanges
+typedef struct _IO_RANGE {
+    uint64_t Offset;
+    uint64_t Length;
+} IO_RANGE;
+
+
+// How the memory of IoMapView will be read
+typedef enum {
+    IO_ACCESS_NORMAL = 0,                       // No particular order
+    IO_ACCESS_SEQUENTIAL = 1,                   // Front to back: read ahead of the reader
+    IO_ACCESS_RANDOM = 2                        // Scattered: do not read ahead
+} IoAccessPattern;
+
+
+// What IoEnumerateFiles does after the callback returns
+typedef enum {
+    IO_ENUMERATE_CONTINUE = 0,                  // Keep going (and descend into a directory)
+    IO_ENUMERATE_SKIP = 1,                      // Do not descend into this directory
+    IO_ENUMERATE_STOP = 2                       // End the enumeration
+} IoEnumerateAction;
+
+
+typedef IoEnumerateAction (*IO_ENUMERATE_CALLBACK)(
+    _In_z_ const char* Path,
+    _In_z_ const char* Name,
+    _In_ const IO_FILE_INFO* Info,
+    _In_opt_ void* Context
+    );
+
+
+// Text built up in memory by IoTextAppend, to be written with IoWriteFileContents. Zero-initialize before use.
+typedef struct _IO_TEXT {
+    char* Data;                                 // NUL-terminated; NULL while empty
+    size_t Length;
+    size_t Capacity;
+    bool Failed;                                // Out of memory; every later append fails as well
+} IO_TEXT;
+
+
+/*
+ * @brief       Opens a file for positional I/O.
+ *
+ * @param[in]   Path            - The file to open.
+ * @param[in]   Mode            - One of the IoOpenMode values.
+ *
+ * @return      The opened file, or NULL on failure (GetLastError has the reason).
+ */
+SS_FILE*
+IoOpenFile(
+    _In_z_ const char* Path,
+    _In_ IoOpenMode Mode
+);
+
+
+/*
+ * @brief       Opens a file striped over several files, RAID-0 style, for positional I/O.
+ *
+ * @details     Byte ranges of StripeUnit bytes are assigned to the stripes in turn: the range at Offset lives
+ *              in stripe (Offset / StripeUnit) % PathCount, at the same Offset. Every stripe has the full size
+ *              of the file and is expected to be sparse, so it only takes space for its own units. Reads and
+ *              writes are split at unit boundaries; the other functions apply to every stripe (size, times
+ *              and allocated ranges are those of the first, except that allocated ranges are the union).
+ *              IoCloseFile closes every stripe.
+ *
+ * @param[in]   Paths           - One file per stripe, in stripe order.
+ * @param[in]   PathCount       - Number of stripes.
+ * @param[in]   StripeUnit      - Bytes per unit; not 0.
+ * @param[in]   Mode            - One of the IoOpenMode values, used for every stripe.
+ *
+ * @return      The opened file, or NULL on failure (GetLastError has the reason).
+ */
+SS_FILE*
+IoOpenStripedFile(
+    _In_reads_(PathCount) const char* const* Paths,
+    _In_ DWORD PathCount,
+    _In_ DWORD StripeUnit,
+    _In_ IoOpenMode Mode
+);
+
+
+/*
+ * @brief       Closes a file returned by IoOpenFile or IoOpenStripedFile. NULL is ignored.
+ */
+VOID
+IoCloseFile(
+    _In_opt_ SS_FILE* File
+);
+
+
+/*
+ * @brief       Reads up to Length bytes at Offset. Safe to call concurrently on the same file.
+ *
+ * @param[out]  BytesRead       - Number of bytes read; less than Length only at end of file.
+ *
+ * @return      TRUE on success (including a short read at end of file); otherwise, FALSE.
+ */
+bool
+IoReadAt(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Offset,
+    _Out_writes_bytes_to_(Length, *BytesRead) void* Buffer,
+    _In_ DWORD Length,
+    _Out_ DWORD* BytesRead
+);
+
+
+/*
+ * @brief       Writes Length bytes at Offset. Safe to call concurrently on the same file.
+ *
+ * @return      TRUE if every byte was written; otherwise, FALSE.
+ */
+bool
+IoWriteAt(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Offset,
+    _In_reads_bytes_(Length) const void* Buffer,
+    _In_ DWORD Length
+);
+
+
+/*
+ * @brief       Retrieves the current size of the file.
+ */
+bool
+IoGetFileSize(
+    _In_ SS_FILE* File,
+    _Out_ uint64_t* Size
+);
+
+
+/*
+ * @brief       Retrieves the last write time of the file as a FILETIME value (100 ns intervals since 1601).
+ */
+bool
+IoGetLastWriteTime(
+    _In_ SS_FILE* File,
+    _Out_ uint64_t* LastWriteTime
+);
+
+
+/*
+ * @brief       Sets the last write time of the file. Later writes through the same handle do not change it again.
+ */
+bool
+IoSetLastWriteTime(
+    _In_ SS_FILE* File,
+    _In_ uint64_t LastWriteTime
+);
+
+
+/*
+ * @brief       Truncates or extends the file to Size bytes. An extension reads as zeros.
+ */
+bool
+IoSetFileSize(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Size
+);
+
+
+/*
+ * @brief       Reserves Size bytes of contiguous allocation for the file and sets its end of file to Size,
+ *              so that out-of-order chunk writes neither extend the file nor fragment it. The stripes of
+ *              a striped file are made sparse and sized instead.
+ */
+bool
+IoPreallocate(
+    _In_ SS_FILE* File,
+    _In_ uint64_t Size
+);
+
+
+/*
+ * @brief       Flushes the file's cached data and metadata to disk.
+ */
+bool
+IoFlushFile(
+    _In_ SS_FILE* File
+);
+
+
+/*
+ * @brief       Atomically replaces Destination with Source (same volume). Readers see either the old
+ *              or the new file, never a partial one.
+ */
+bool
+IoReplaceFile(
+    _In_z_ const char* Source,
+    _In_z_ const char* Destination
+);
+
+
+/*
+ * @brief       Deletes a file. A file that does not exist counts as deleted.
+ */
+bool
+IoDeleteFile(
+    _In_z_ const char* Path
+);
+
+
+/*
+ * @brief       Retrieves the size and times of a file or directory by path.
+ *
+ * @return      TRUE if the path exists; otherwise, FALSE.
+ */
+bool
+IoQueryFileInfo(
+    _In_z_ const char* Path,
+    _Out_ IO_FILE_INFO* Info
+);
+
+
+/*
+ * @brief       Calls Callback for every file and directory under Directory ("." and ".." excluded).
+ *              With Recursive set, directories are descended into unless the callback returns
+ *              IO_ENUMERATE_SKIP for them.
+ *
+ * @return      FALSE if Directory cannot be listed or the callback stopped the enumeration; otherwise, TRUE.
+ */
+bool
+IoEnumerateFiles(
+    _In_z_ const char* Directory,
+    _In_ bool Recursive,
+    _In_ IO_ENUMERATE_CALLBACK Callback,
+    _In_opt_ void* Context
+);
+
+
+/*
+ * @brief       Creates Path and any missing parent directories. An existing directory counts as created.
+ */
+bool
+IoCreateDirectories(
+    _In_z_ const char* Path
+);
+
+
+/*
+ * @brief       Sets the last access time of a file to now. Used to track accesses explicitly, since
+ *              the file system may be configured not to update access times.
+ */
+bool
+IoTouchFile(
+    _In_z_ const char* Path
+);
+
+
+/*
+ * @brief       Makes a file that is not open durable, the way IoFlushFile does for an open one.
+ */
+bool
+IoFlushPath(
+    _In_z_ const char* Path
+);
+
+
+/*
+ * @brief       Reads a whole, small file into memory.
+ *
+ * @param[in]   Path            - The file to read.
+ * @param[out]  Contents        - Receives the contents, NUL-terminated, allocated with malloc. Free with free().
+ * @param[out]  Length          - Optionally receives the number of bytes read, without the terminator.
+ *
+ * @return      TRUE on success; otherwise, FALSE (GetLastError has the reason).
+ */
+bool
+IoReadFileContents(
+    _In_z_ const char* Path,
+    _Outptr_result_maybenull_z_ char** Contents,
+    _Out_opt_ size_t* Length
+);
+
+
+/*
+ * @brief       Creates or truncates a file and writes Data to it. Not durable until flushed.
+ */
+bool
+IoWriteFileContents(
+    _In_z_ const char* Path,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length
+);
+
+
+/*
+ * @brief       Appends Data to a file, creating it if it does not exist.
+ */
+bool
+IoAppendFileContents(
+    _In_z_ const char* Path,
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ size_t Length
+);
+
+
+/*
+ * @brief       Appends printf-style formatted text to Text.
+ *
+ * @return      TRUE on success; FALSE if out of memory now or before (Text->Failed).
+ */
+bool
+IoTextAppend(
+    _Inout_ IO_TEXT* Text,
+    _In_z_ _Printf_format_string_ const char* Format,
+    ...
+);
+
+
+/*
+ * @brief       Frees the memory of Text and empties it.
+ */
+VOID
+IoTextFree(
+    _Inout_ IO_TEXT* Text
+);
+
+
+/*
+ * @brief       Splits the next line off text read with IoReadFileContents, in place.
+ *
+ * @param[in,out] Cursor        - Start of the remaining text; advanced past the line.
+ *
+ * @return      The line without its line break, or NULL at the end of the text.
+ */
+char*
+IoTextNextLine(
+    _Inout_ char** Cursor
+);
+
+
+/*
+ * @brief       Enables file-system (NTFS) compression on an open file.
+ */
+bool
+IoSetCompression(
+    _In_ SS_FILE* File
+);
+
+
+
+/*
+ * @brief       Marks an open file as sparse: ranges that are never written take no disk space and read as zeros.
+ */
+bool
+IoSetSparse(
+    _In_ SS_FILE* File
+);
+
+
+/*
+ * @brief       Lists the ranges of [0, FileSize) that are backed by disk space, in ascending order. Everything
+ *              else is a hole. A file that is not sparse, or a file system without sparse files, reports the
+ *              whole file as one range.
+ *
+ * @param[out]  Ranges      - Receives an array allocated with malloc (NULL if there are no ranges). Free with free().
+ * @param[out]  RangeCount  - Receives the number of ranges.
+ *
+ * @return      TRUE on success; otherwise, FALSE.
+ */
+bool
+IoQueryAllocatedRanges(
+    _In_ SS_FILE* File,
+    _In_ uint64_t FileSize,
+    _Outptr_result_maybenull_ IO_RANGE** Ranges,
+    _Out_ DWORD* RangeCount
+);
+
+
+
+/*
+ * @brief       Makes the contents of an open file readable in memory, read-only.
+ *
+ * @details     The file's backend maps it where it can (the operating system maps the file into the address
+ *              space, so pages are read on first access). A striped file has no single range to map and is
+ *              read into private memory up front instead. Either way the memory stays valid until IoUnmapView,
+ *              and the file must stay open until then. While mapped, the file cannot be resized or replaced.
+ *
+ * @param[in]   Pattern         - How the memory will be read; only a hint.
+ * @param[out]  View            - Receives the contents; NULL for an empty file.
+ * @param[out]  Size            - Receives the size of the file.
+ *
+ * @return      TRUE on success; otherwise, FALSE.
+ */
+bool
+IoMapView(
+    _In_ SS_FILE* File,
+    _In_ IoAccessPattern Pattern,
+    _Outptr_result_maybenull_ const void** View,
+    _Out_ uint64_t* Size
+);
+
+
+/*
+ * @brief       Releases memory returned by IoMapView for the same file. NULL is ignored.
+ */
+VOID
+IoUnmapView(
+    _In_ SS_FILE* File,
+    _In_opt_ const void* View
+);
+
+
+EXTERN_C_END;
+#endif  //_FILEIO_H_
@@ -0,0 +1,96 @@
+#ifndef _IOBACKEND_H_
+#define _IOBACKEND_H_
+
+
+#include "includes.h"
+#include "FileIo.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+// An open file of a backend. NULL is never a valid handle.
+typedef PVOID IO_HANDLE;
+
+
+/*
+ * @brief       The file operations every Io* function ends up in. FileIo.c adds striping, recursive
+ *              enumeration and the other conveniences on top, so a backend only implements the primitives.
+ *
+ * @details     Failures return FALSE (or NULL) with a Win32 error code in GetLastError, the way the
+ *              operating system backend reports them; callers test for ERROR_FILE_NOT_FOUND,
+ *              ERROR_PATH_NOT_FOUND, ERROR_ALREADY_EXISTS and ERROR_HANDLE_EOF.
+ *
+ *              Every function may be called concurrently from several threads, including positional
+ *              reads and writes on the same handle.
+ */
+typedef struct _IO_BACKEND {
+    const char* Name;
+
+    // Opens a file the way IoOpenFile documents it.
+    IO_HANDLE (*Open)(_In_z_ const char* Path, _In_ IoOpenMode Mode);
+    VOID (*Close)(_In_ IO_HANDLE Handle);
+
+    // Positional read or write. A read at or past end of file succeeds with 0 bytes; a write extends the file.
+    bool (*TransferAt)(_In_ IO_HANDLE Handle, _In_ uint64_t Offset, _Inout_updates_bytes_(Length) void* Buffer, _In_ DWORD Length, _In_ bool Write, _Out_ DWORD* Transferred);
+
+    bool (*GetSize)(_In_ IO_HANDLE Handle, _Out_ uint64_t* Size);
+    bool (*SetSize)(_In_ IO_HANDLE Handle, _In_ uint64_t Size);
+
+    // Reserves allocation for Size bytes without changing the end of file.
+    bool (*Reserve)(_In_ IO_HANDLE Handle, _In_ uint64_t Size);
+
+    bool (*GetLastWriteTime)(_In_ IO_HANDLE Handle, _Out_ uint64_t* LastWriteTime);
+    bool (*SetLastWriteTime)(_In_ IO_HANDLE Handle, _In_ uint64_t LastWriteTime);
+    bool (*Flush)(_In_ IO_HANDLE Handle);
+    bool (*SetCompression)(_In_ IO_HANDLE Handle);
+    bool (*SetSparse)(_In_ IO_HANDLE Handle);
+    bool (*QueryAllocatedRanges)(_In_ IO_HANDLE Handle, _In_ uint64_t FileSize, _Outptr_result_maybenull_ IO_RANGE** Ranges, _Out_ DWORD* RangeCount);
+
+    // Maps the first Size (> 0) bytes of an open file read-only; UnmapView releases them. While mapped, the file
+    // cannot be resized (ERROR_USER_MAPPED_FILE) and its handle stays open.
+    bool (*MapView)(_In_ IO_HANDLE Handle, _In_ uint64_t Size, _In_ IoAccessPattern Pattern, _Outptr_ const void** View);
+    VOID (*UnmapView)(_In_ IO_HANDLE Handle, _In_ const void* View);
+
+    // Path operations, see the Io* function of the same name
+    bool (*Replace)(_In_z_ const char* Source, _In_z_ const char* Destination);
+    bool (*Delete)(_In_z_ const char* Path);
+    bool (*QueryInfo)(_In_z_ const char* Path, _Out_ IO_FILE_INFO* Info);
+
+    // Lists one directory, without descending into subdirectories; the callback's IO_ENUMERATE_SKIP means nothing here.
+    bool (*List)(_In_z_ const char* Directory, _In_ IO_ENUMERATE_CALLBACK Callback, _In_opt_ void* Context);
+
+    // Creates one directory; FALSE with ERROR_ALREADY_EXISTS if it exists.
+    bool (*MakeDirectory)(_In_z_ const char* Path);
+
+    bool (*Touch)(_In_z_ const char* Path);
+
+    // Makes a file that is not open (anymore) durable.
+    bool (*FlushPath)(_In_z_ const char* Path);
+} IO_BACKEND;
+
+
+/*
+ * @brief       Routes all file operations opened from now on through Backend.
+ *
+ * @details     Files that are already open keep using the backend they were opened with. Paths are not
+ *              translated, so the application directory has to exist in the new backend as well.
+ *
+ * @param[in]   Backend         - The backend to use; NULL selects the operating system (the default).
+ */
+VOID
+IoSetBackend(
+    _In_opt_ const IO_BACKEND* Backend
+);
+
+
+/*
+ * @brief       Returns the backend new operations go to.
+ */
+const IO_BACKEND*
+IoGetBackend(
+    VOID
+);
+
+
+EXTERN_C_END;
+#endif  //_IOBACKEND_H_
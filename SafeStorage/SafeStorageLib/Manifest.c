@@ -0,0 +1,165 @@
+#include "Manifest.h"
+#include "Durability.h"
+#include "FileIo.h"
+#include "Transfer.h"
+
+
+#define MANIFEST_MAGIC 0x464D5353               // "SSMF"
+#define MANIFEST_VERSION 1
+
+
+// On-disk header, followed by BlockCount checksums of HASH_LENGTH bytes
+typedef struct _MANIFEST_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t FileSize;
+    uint64_t LastWriteTime;
+    uint32_t BlockSize;
+    uint32_t Reserved;
+    uint64_t BlockCount;
+} MANIFEST_HEADER;
+
+
+SS_MANIFEST*
+ManifestCreate(
+    _In_ uint64_t FileSize,
+    _In_ DWORD BlockSize
+)
+{
+    if (BlockSize == 0) {
+        return NULL;
+    }
+
+    uint64_t blockCount = (FileSize + BlockSize - 1) / BlockSize;
+    if (blockCount * HASH_LENGTH > MAXDWORD) {
+        return NULL;
+    }
+
+    SS_MANIFEST* manifest = (SS_MANIFEST*)calloc(1, sizeof(SS_MANIFEST));
+    if (manifest == NULL) {
+        return NULL;
+    }
+
+    // One extra entry keeps the allocation non-empty for empty files
+    manifest->BlockHashes = calloc((size_t)blockCount + 1, HASH_LENGTH);
+    if (manifest->BlockHashes == NULL) {
+        free(manifest);
+        return NULL;
+    }
+
+    manifest->FileSize = FileSize;
+    manifest->BlockSize = BlockSize;
+    manifest->BlockCount = blockCount;
+    return manifest;
+}
+
+
+VOID
+ManifestFree(
+    _In_opt_ SS_MANIFEST* Manifest
+)
+{
+    if (Manifest == NULL) {
+        return;
+    }
+
+    free(Manifest->BlockHashes);
+    free(Manifest);
+}
+
+
+bool
+ManifestHashBlock(
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ DWORD Length,
+    _Out_writes_bytes_all_(HASH_LENGTH) BYTE* Hash
+)
+{
+    // The SHA-256 pseudo-handle needs no provider to be opened and may be shared by all threads
+    NTSTATUS status = BCryptHash(BCRYPT_SHA256_ALG_HANDLE, NULL, 0, (PUCHAR)Data, Length, Hash, HASH_LENGTH);
+    return BCRYPT_SUCCESS(status);
+}
+
+
+bool
+ManifestWrite(
+    _In_ const SS_MANIFEST* Manifest,
+    _In_z_ const char* ManifestPath
+)
+{
+    char partialPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", ManifestPath, TRANSFER_PARTIAL_SUFFIX))) {
+        return false;
+    }
+
+    MANIFEST_HEADER header = { 0 };
+    header.Magic = MANIFEST_MAGIC;
+    header.Version = MANIFEST_VERSION;
+    header.FileSize = Manifest->FileSize;
+    header.LastWriteTime = Manifest->LastWriteTime;
+    header.BlockSize = Manifest->BlockSize;
+    header.BlockCount = Manifest->BlockCount;
+
+    SS_FILE* file = IoOpenFile(partialPath, IO_OPEN_CREATE);
+    if (file == NULL) {
+        printf("Failed to create the manifest: %lu\n", GetLastError());
+        return false;
+    }
+
+    bool result = IoWriteAt(file, 0, &header, sizeof(header)) &&
+                  IoWriteAt(file, sizeof(header), Manifest->BlockHashes, (DWORD)(Manifest->BlockCount * HASH_LENGTH));
+    IoCloseFile(file);
+
+    result = result && DurabilityCommitFile(partialPath) && IoReplaceFile(partialPath, ManifestPath);
+    if (!result) {
+        printf("Failed to write the manifest: %lu\n", GetLastError());
+        IoDeleteFile(partialPath);
+    }
+    return result;
+}
+
+
+SS_MANIFEST*
+ManifestRead(
+    _In_z_ const char* ManifestPath
+)
+{
+    SS_FILE* file = IoOpenFile(ManifestPath, IO_OPEN_READ);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    MANIFEST_HEADER header = { 0 };
+    DWORD bytesRead = 0;
+    SS_MANIFEST* manifest = NULL;
+
+    if (IoReadAt(file, 0, &header, sizeof(header), &bytesRead) && bytesRead == sizeof(header) &&
+        header.Magic == MANIFEST_MAGIC && header.Version == MANIFEST_VERSION) {
+        manifest = ManifestCreate(header.FileSize, header.BlockSize);
+    }
+
+    if (manifest != NULL) {
+        DWORD hashBytes = (DWORD)(manifest->BlockCount * HASH_LENGTH);
+        manifest->LastWriteTime = header.LastWriteTime;
+
+        if (manifest->BlockCount != header.BlockCount ||
+            !IoReadAt(file, sizeof(header), manifest->BlockHashes, hashBytes, &bytesRead) || bytesRead != hashBytes) {
+            ManifestFree(manifest);
+            manifest = NULL;
+        }
+    }
+
+    IoCloseFile(file);
+    return manifest;
+}
+
+
+bool
+ManifestMatchesFile(
+    _In_ const SS_MANIFEST* Manifest,
+    _In_ uint64_t FileSize,
+    _In_ uint64_t LastWriteTime
+)
+{
+    return Manifest->FileSize == FileSize && Manifest->LastWriteTime == LastWriteTime;
+}
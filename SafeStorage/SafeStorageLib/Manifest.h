@@ -0,0 +1,92 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define MANIFEST_SUFFIX "~manifest"             // Sidecar next to the submission it describes
+#define MANIFEST_BLOCK_SIZE CHUNK_SIZE          // Every block of a submission has its own checksum
+
+
+// Block checksums of a stored submission. The checksum of block i covers bytes
+// [i * BlockSize, min((i + 1) * BlockSize, FileSize)).
+typedef struct _SS_MANIFEST {
+    uint64_t FileSize;
+    uint64_t LastWriteTime;                     // Of the submission the checksums were computed for
+    DWORD BlockSize;
+    uint64_t BlockCount;
+    BYTE (*BlockHashes)[HASH_LENGTH];           // SHA-256 of each block
+} SS_MANIFEST;
+
+
+/*
+ * @brief       Allocates a manifest for a file of the given size with zeroed checksums.
+ *
+ * @return      The manifest, or NULL if out of memory.
+ */
+SS_MANIFEST*
+ManifestCreate(
+    _In_ uint64_t FileSize,
+    _In_ DWORD BlockSize
+);
+
+
+/*
+ * @brief       Frees a manifest. NULL is ignored.
+ */
+VOID
+ManifestFree(
+    _In_opt_ SS_MANIFEST* Manifest
+);
+
+
+/*
+ * @brief       Computes the SHA-256 checksum of one block. Safe to call from several threads.
+ */
+bool
+ManifestHashBlock(
+    _In_reads_bytes_(Length) const void* Data,
+    _In_ DWORD Length,
+    _Out_writes_bytes_all_(HASH_LENGTH) BYTE* Hash
+);
+
+
+/*
+ * @brief       Writes the manifest to ManifestPath + TRANSFER_PARTIAL_SUFFIX, makes it durable according to the
+ *              durability mode and atomically renames it to ManifestPath.
+ */
+bool
+ManifestWrite(
+    _In_ const SS_MANIFEST* Manifest,
+    _In_z_ const char* ManifestPath
+);
+
+
+/*
+ * @brief       Reads a manifest written by ManifestWrite.
+ *
+ * @return      The manifest, or NULL if it does not exist or is malformed.
+ */
+SS_MANIFEST*
+ManifestRead(
+    _In_z_ const char* ManifestPath
+);
+
+
+/*
+ * @brief       Returns TRUE if the manifest was computed for the file as it is now (same size and last write time).
+ */
+bool
+ManifestMatchesFile(
+    _In_ const SS_MANIFEST* Manifest,
+    _In_ uint64_t FileSize,
+    _In_ uint64_t LastWriteTime
+);
+
+
+EXTERN_C_END;
+#endif  //_MANIFEST_H_
@@ -0,0 +1,877 @@
+#include "MemoryBackend.h"
+
+
+// A file or directory of the memory backend. Open handles point at the node itself.
+typedef struct _MEMORY_NODE {
+    struct _MEMORY_NODE* NextInBucket;
+    struct _MEMORY_NODE* Parent;                // NULL directly below a root, or once unlinked
+    struct _MEMORY_NODE* FirstChild;            // Directories only
+    struct _MEMORY_NODE* PreviousSibling;
+    struct _MEMORY_NODE* NextSibling;
+    volatile LONG References;                   // One while linked into the table, plus one per open handle
+    bool IsDirectory;
+    char Path[MAX_PATH];                        // Full path, the key of the table
+    SRWLOCK DataLock;                           // Shared to read or write within the file, exclusive to resize it
+    BYTE* Data;
+    uint64_t Size;
+    size_t Capacity;
+    LONG Mappings;                              // Views handed out by MemoryMapView; Data must not move meanwhile
+    volatile LONG64 LastWriteTime;
+    volatile LONG64 LastAccessTime;
+} MEMORY_NODE;
+
+
+// An entry of a directory, copied by MemoryList so the callback runs without the namespace lock
+typedef struct _MEMORY_LISTING {
+    char Name[MAX_PATH];
+    IO_FILE_INFO Info;
+} MEMORY_LISTING;
+
+
+// Global static variables
+static SRWLOCK g_NamespaceLock = SRWLOCK_INIT;  // Guards the table and the tree links of every node
+static MEMORY_NODE* g_Buckets[MEMORY_BUCKET_COUNT] = { 0 };
+
+
+/**
+ * @brief       Returns the current time in FILETIME units.
+ */
+static uint64_t Now(void) {
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    return ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+
+/**
+ * @brief       Returns the length of the root of a full path: "C:\" or "\\server\share".
+ */
+static size_t RootLength(_In_z_ const char* path) {
+    if (path[0] == '\\' && path[1] == '\\') {
+        const char* server = strchr(path + 2, '\\');
+        const char* share = (server != NULL) ? strchr(server + 1, '\\') : NULL;
+        return (share != NULL) ? (size_t)(share - path) : strlen(path);
+    }
+    return (path[0] != '\0' && path[1] == ':') ? 3 : 0;
+}
+
+
+/**
+ * @brief       Makes a path absolute and drops a trailing separator, giving the key of its node.
+ */
+static bool NormalizePath(_In_z_ const char* path, _Out_writes_z_(MAX_PATH) char* fullPath) {
+    DWORD length = GetFullPathNameA(path, MAX_PATH, fullPath, NULL);
+    if (length == 0) {
+        return false;
+    }
+    if (length >= MAX_PATH) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return false;
+    }
+
+    if (length > RootLength(fullPath) && fullPath[length - 1] == '\\') {
+        fullPath[length - 1] = '\0';
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Returns TRUE if a full path is a root, which always exists.
+ */
+static bool IsRoot(_In_z_ const char* fullPath) {
+    return strlen(fullPath) <= RootLength(fullPath);
+}
+
+
+/**
+ * @brief       FNV-1a hash of a path, ignoring case.
+ */
+static DWORD HashPath(_In_z_ const char* fullPath) {
+    DWORD hash = 2166136261u;
+    for (const char* c = fullPath; *c != '\0'; c++) {
+        char folded = (*c >= 'a' && *c <= 'z') ? (char)(*c - 'a' + 'A') : *c;
+        hash = (hash ^ (BYTE)folded) * 16777619u;
+    }
+    return hash % MEMORY_BUCKET_COUNT;
+}
+
+
+/**
+ * @brief       Looks up the node of a full path. The namespace lock must be held.
+ */
+static MEMORY_NODE* FindLocked(_In_z_ const char* fullPath) {
+    for (MEMORY_NODE* node = g_Buckets[HashPath(fullPath)]; node != NULL; node = node->NextInBucket) {
+        if (_stricmp(node->Path, fullPath) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief       Looks up the directory that contains a full path. The namespace lock must be held.
+ *
+ * @param[out]  parent          - Receives the directory, or NULL if the path is directly below a root.
+ *
+ * @return      TRUE if the directory exists; otherwise, FALSE with ERROR_PATH_NOT_FOUND.
+ */
+static bool FindParentLocked(_In_z_ const char* fullPath, _Out_ MEMORY_NODE** parent) {
+    *parent = NULL;
+
+    const char* separator = strrchr(fullPath, '\\');
+    if (separator == NULL || (size_t)(separator - fullPath) <= RootLength(fullPath)) {
+        return true;
+    }
+
+    char parentPath[MAX_PATH];
+    if (FAILED(StringCchCopyNA(parentPath, MAX_PATH, fullPath, (size_t)(separator - fullPath)))) {
+        return false;
+    }
+
+    *parent = FindLocked(parentPath);
+    if (*parent == NULL || !(*parent)->IsDirectory) {
+        *parent = NULL;
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Returns the error for a path that has no node: whether the file or its directory is missing.
+ */
+static DWORD MissingErrorLocked(_In_z_ const char* fullPath) {
+    MEMORY_NODE* parent = NULL;
+    return FindParentLocked(fullPath, &parent) ? ERROR_FILE_NOT_FOUND : ERROR_PATH_NOT_FOUND;
+}
+
+
+/**
+ * @brief       Adds a node to the table and to the children of its directory. The namespace lock must be held exclusively.
+ */
+static void LinkLocked(_In_ MEMORY_NODE* node, _In_opt_ MEMORY_NODE* parent) {
+    DWORD bucket = HashPath(node->Path);
+    node->NextInBucket = g_Buckets[bucket];
+    g_Buckets[bucket] = node;
+
+    node->Parent = parent;
+    node->PreviousSibling = NULL;
+    node->NextSibling = NULL;
+    if (parent != NULL) {
+        node->NextSibling = parent->FirstChild;
+        if (parent->FirstChild != NULL) {
+            parent->FirstChild->PreviousSibling = node;
+        }
+        parent->FirstChild = node;
+    }
+}
+
+
+/**
+ * @brief       Removes a node from the table and from its directory. The namespace lock must be held exclusively.
+ *              The table's reference is left to the caller.
+ */
+static void UnlinkLocked(_In_ MEMORY_NODE* node) {
+    for (MEMORY_NODE** link = &g_Buckets[HashPath(node->Path)]; *link != NULL; link = &(*link)->NextInBucket) {
+        if (*link == node) {
+            *link = node->NextInBucket;
+            break;
+        }
+    }
+
+    if (node->PreviousSibling != NULL) {
+        node->PreviousSibling->NextSibling = node->NextSibling;
+    }
+    else if (node->Parent != NULL) {
+        node->Parent->FirstChild = node->NextSibling;
+    }
+    if (node->NextSibling != NULL) {
+        node->NextSibling->PreviousSibling = node->PreviousSibling;
+    }
+
+    node->NextInBucket = NULL;
+    node->Parent = NULL;
+    node->PreviousSibling = NULL;
+    node->NextSibling = NULL;
+}
+
+
+/**
+ * @brief       Creates a file or directory node and links it. The namespace lock must be held exclusively.
+ */
+static MEMORY_NODE* CreateNodeLocked(_In_z_ const char* fullPath, _In_opt_ MEMORY_NODE* parent, _In_ bool isDirectory) {
+    MEMORY_NODE* node = (MEMORY_NODE*)calloc(1, sizeof(MEMORY_NODE));
+    if (node == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    (void)StringCchCopyA(node->Path, MAX_PATH, fullPath);
+    InitializeSRWLock(&node->DataLock);
+    node->References = 1;
+    node->IsDirectory = isDirectory;
+    node->LastWriteTime = (LONG64)Now();
+    node->LastAccessTime = node->LastWriteTime;
+
+    LinkLocked(node, parent);
+    return node;
+}
+
+
+/**
+ * @brief       Drops a reference to a node, freeing it with the last one.
+ */
+static void ReleaseNode(_In_ MEMORY_NODE* node) {
+    if (InterlockedDecrement(&node->References) == 0) {
+        free(node->Data);
+        free(node);
+    }
+}
+
+
+/**
+ * @brief       Grows the allocation of a file to hold at least size bytes. The data lock must be held exclusively.
+ *
+ * @return      TRUE on success; otherwise, FALSE with ERROR_DISK_FULL, as memory is the disk of this backend,
+ *              or ERROR_USER_MAPPED_FILE if the contents would have to move while they are mapped.
+ */
+static bool EnsureCapacityLocked(_In_ MEMORY_NODE* node, _In_ uint64_t size) {
+    if (size <= node->Capacity) {
+        return true;
+    }
+    if (node->Mappings > 0) {
+        SetLastError(ERROR_USER_MAPPED_FILE);
+        return false;
+    }
+    if (size > (uint64_t)SIZE_MAX) {
+        SetLastError(ERROR_DISK_FULL);
+        return false;
+    }
+
+    // Double to keep appends linear; fall back to the exact size when memory is short
+    size_t capacity = max(max((size_t)size, 2 * node->Capacity), MEMORY_MIN_CAPACITY);
+    BYTE* grown = (BYTE*)realloc(node->Data, capacity);
+    if (grown == NULL) {
+        capacity = (size_t)size;
+        grown = (BYTE*)realloc(node->Data, capacity);
+    }
+    if (grown == NULL) {
+        SetLastError(ERROR_DISK_FULL);
+        return false;
+    }
+
+    node->Data = grown;
+    node->Capacity = capacity;
+    return true;
+}
+
+
+/**
+ * @brief       Copies the attributes of a node.
+ */
+static void FillInfo(_In_ MEMORY_NODE* node, _Out_ IO_FILE_INFO* info) {
+    memset(info, 0, sizeof(*info));
+
+    AcquireSRWLockShared(&node->DataLock);
+    info->Size = node->Size;
+    ReleaseSRWLockShared(&node->DataLock);
+
+    info->LastWriteTime = (uint64_t)node->LastWriteTime;
+    info->LastAccessTime = (uint64_t)node->LastAccessTime;
+    info->IsDirectory = node->IsDirectory;
+}
+
+
+/**
+ * @brief       Opens a file (see IoOpenFile).
+ */
+static IO_HANDLE MemoryOpen(_In_z_ const char* path, _In_ IoOpenMode mode) {
+    char fullPath[MAX_PATH];
+    if (mode > IO_OPEN_ALWAYS) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    if (!NormalizePath(path, fullPath)) {
+        return NULL;
+    }
+
+    // Only creating or truncating a file changes the namespace
+    bool create = (mode == IO_OPEN_CREATE || mode == IO_OPEN_ALWAYS);
+    if (create) {
+        AcquireSRWLockExclusive(&g_NamespaceLock);
+    }
+    else {
+        AcquireSRWLockShared(&g_NamespaceLock);
+    }
+
+    MEMORY_NODE* node = FindLocked(fullPath);
+    MEMORY_NODE* parent = NULL;
+    DWORD error = ERROR_SUCCESS;
+    if ((node != NULL && node->IsDirectory) || IsRoot(fullPath)) {
+        error = ERROR_ACCESS_DENIED;
+    }
+    else if (node == NULL && !create) {
+        error = MissingErrorLocked(fullPath);
+    }
+    else if (node == NULL) {
+        if (!FindParentLocked(fullPath, &parent) || (node = CreateNodeLocked(fullPath, parent, false)) == NULL) {
+            error = GetLastError();
+        }
+    }
+    else if (mode == IO_OPEN_CREATE) {
+        AcquireSRWLockExclusive(&node->DataLock);
+        if (node->Mappings > 0) {
+            error = ERROR_USER_MAPPED_FILE;
+        }
+        else {
+            free(node->Data);
+            node->Data = NULL;
+            node->Size = 0;
+            node->Capacity = 0;
+            node->LastWriteTime = (LONG64)Now();
+        }
+        ReleaseSRWLockExclusive(&node->DataLock);
+    }
+
+    if (error == ERROR_SUCCESS) {
+        InterlockedIncrement(&node->References);
+    }
+
+    if (create) {
+        ReleaseSRWLockExclusive(&g_NamespaceLock);
+    }
+    else {
+        ReleaseSRWLockShared(&g_NamespaceLock);
+    }
+
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return NULL;
+    }
+    return (IO_HANDLE)node;
+}
+
+
+/**
+ * @brief       Closes a handle returned by MemoryOpen. A file deleted meanwhile is freed now.
+ */
+static VOID MemoryClose(_In_ IO_HANDLE handle) {
+    ReleaseNode((MEMORY_NODE*)handle);
+}
+
+
+/**
+ * @brief       Copies data out of or into a file.
+ */
+static bool MemoryTransferAt(_In_ IO_HANDLE handle, _In_ uint64_t offset, _Inout_updates_bytes_(length) void* buffer, _In_ DWORD length, _In_ bool write, _Out_ DWORD* transferred) {
+    MEMORY_NODE* node = (MEMORY_NODE*)handle;
+    *transferred = 0;
+
+    if (!write) {
+        AcquireSRWLockShared(&node->DataLock);
+        if (offset < node->Size) {
+            *transferred = (DWORD)min((uint64_t)length, node->Size - offset);
+            memcpy(buffer, node->Data + (size_t)offset, *transferred);
+        }
+        ReleaseSRWLockShared(&node->DataLock);
+        return true;
+    }
+
+    uint64_t end = offset + length;
+    if (end < offset) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Concurrent writes within the file only need the contents to stay where they are
+    AcquireSRWLockShared(&node->DataLock);
+    bool inside = (end <= node->Size);
+    if (inside) {
+        memcpy(node->Data + (size_t)offset, buffer, length);
+    }
+    ReleaseSRWLockShared(&node->DataLock);
+
+    if (!inside) {
+        AcquireSRWLockExclusive(&node->DataLock);
+        bool result = EnsureCapacityLocked(node, end);
+        if (result) {
+            if (offset > node->Size) {
+                memset(node->Data + node->Size, 0, (size_t)(offset - node->Size));
+            }
+            memcpy(node->Data + (size_t)offset, buffer, length);
+            node->Size = max(node->Size, end);
+        }
+        ReleaseSRWLockExclusive(&node->DataLock);
+
+        if (!result) {
+            return false;
+        }
+    }
+
+    InterlockedExchange64(&node->LastWriteTime, (LONG64)Now());
+    *transferred = length;
+    return true;
+}
+
+
+/**
+ * @brief       Returns the size of an open file.
+ */
+static bool MemoryGetSize(_In_ IO_HANDLE handle, _Out_ uint64_t* size) {
+    MEMORY_NODE* node = (MEMORY_NODE*)handle;
+
+    AcquireSRWLockShared(&node->DataLock);
+    *size = node->Size;
+    ReleaseSRWLockShared(&node->DataLock);
+    return true;
+}
+
+
+/**
+ * @brief       Truncates or zero-extends an open file.
+ */
+static bool MemorySetSize(_In_ IO_HANDLE handle, _In_ uint64_t size) {
+    MEMORY_NODE* node = (MEMORY_NODE*)handle;
+
+    AcquireSRWLockExclusive(&node->DataLock);
+    bool result = EnsureCapacityLocked(node, size);
+    if (result) {
+        if (size > node->Size) {
+            memset(node->Data + node->Size, 0, (size_t)(size - node->Size));
+        }
+        node->Size = size;
+    }
+    ReleaseSRWLockExclusive(&node->DataLock);
+
+    if (result) {
+        InterlockedExchange64(&node->LastWriteTime, (LONG64)Now());
+    }
+    return result;
+}
+
+
+/**
+ * @brief       Allocates memory for an open file up front.
+ */
+static bool MemoryReserve(_In_ IO_HANDLE handle, _In_ uint64_t size) {
+    MEMORY_NODE* node = (MEMORY_NODE*)handle;
+
+    AcquireSRWLockExclusive(&node->DataLock);
+    bool result = EnsureCapacityLocked(node, size);
+    ReleaseSRWLockExclusive(&node->DataLock);
+    return result;
+}
+
+
+/**
+ * @brief       Hands out the contents of a file in place. Until the view is released the file cannot grow beyond
+ *              its allocation or be truncated, so the contents stay where they are.
+ */
+static bool MemoryMapView(_In_ IO_HANDLE handle, _In_ uint64_t size, _In_ IoAccessPattern pattern, _Outptr_ const void** view) {
+    MEMORY_NODE* node = (MEMORY_NODE*)handle;
+    UNREFERENCED_PARAMETER(pattern);
+
+    AcquireSRWLockExclusive(&node->DataLock);
+    bool result = size <= node->Size;
+    if (result) {
+        node->Mappings++;
+    }
+    *view = result ? node->Data : NULL;
+    ReleaseSRWLockExclusive(&node->DataLock);
+
+    if (!result) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+    }
+    return result;
+}
+
+
+/**
+ * @brief       Releases a view returned by MemoryMapView.
+ */
+static VOID MemoryUnmapView(_In_ IO_HANDLE handle, _In_ const void* view) {
+    MEMORY_NODE* node = (MEMORY_NODE*)handle;
+    UNREFERENCED_PARAMETER(view);
+
+    AcquireSRWLockExclusive(&node->DataLock);
+    node->Mappings--;
+    ReleaseSRWLockExclusive(&node->DataLock);
+}
+
+
+/**
+ * @brief       Returns the last write time of an open file.
+ */
+static bool MemoryGetLastWriteTime(_In_ IO_HANDLE handle, _Out_ uint64_t* lastWriteTime) {
+    *lastWriteTime = (uint64_t)((MEMORY_NODE*)handle)->LastWriteTime;
+    return true;
+}
+
+
+/**
+ * @brief       Sets the last write time of an open file.
+ */
+static bool MemorySetLastWriteTime(_In_ IO_HANDLE handle, _In_ uint64_t lastWriteTime) {
+    InterlockedExchange64(&((MEMORY_NODE*)handle)->LastWriteTime, (LONG64)lastWriteTime);
+    return true;
+}
+
+
+/**
+ * @brief       Flush, compression and sparse requests: nothing to do in memory.
+ */
+static bool MemoryNothingToDo(_In_ IO_HANDLE handle) {
+    UNREFERENCED_PARAMETER(handle);
+    return true;
+}
+
+
+/**
+ * @brief       Reports the whole file as allocated; holes are stored as zeros.
+ */
+static bool MemoryQueryAllocatedRanges(_In_ IO_HANDLE handle, _In_ uint64_t fileSize, _Outptr_result_maybenull_ IO_RANGE** ranges, _Out_ DWORD* rangeCount) {
+    UNREFERENCED_PARAMETER(handle);
+    *ranges = NULL;
+    *rangeCount = 0;
+
+    if (fileSize == 0) {
+        return true;
+    }
+
+    *ranges = (IO_RANGE*)malloc(sizeof(IO_RANGE));
+    if (*ranges == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+    (*ranges)[0].Offset = 0;
+    (*ranges)[0].Length = fileSize;
+    *rangeCount = 1;
+    return true;
+}
+
+
+/**
+ * @brief       Renames a file, replacing the destination. Open handles of the source follow it.
+ */
+static bool MemoryReplace(_In_z_ const char* source, _In_z_ const char* destination) {
+    char sourcePath[MAX_PATH];
+    char destinationPath[MAX_PATH];
+    if (!NormalizePath(source, sourcePath) || !NormalizePath(destination, destinationPath)) {
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_NamespaceLock);
+
+    MEMORY_NODE* node = FindLocked(sourcePath);
+    MEMORY_NODE* replaced = FindLocked(destinationPath);
+    MEMORY_NODE* parent = NULL;
+    DWORD error = ERROR_SUCCESS;
+    if (node == NULL) {
+        error = MissingErrorLocked(sourcePath);
+    }
+    else if (node->IsDirectory || (replaced != NULL && replaced->IsDirectory) || IsRoot(destinationPath)) {
+        error = ERROR_ACCESS_DENIED;
+    }
+    else if (!FindParentLocked(destinationPath, &parent)) {
+        error = GetLastError();
+    }
+    else if (replaced != node) {
+        if (replaced != NULL) {
+            UnlinkLocked(replaced);
+        }
+        UnlinkLocked(node);
+        (void)StringCchCopyA(node->Path, MAX_PATH, destinationPath);
+        LinkLocked(node, parent);
+    }
+
+    ReleaseSRWLockExclusive(&g_NamespaceLock);
+
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return false;
+    }
+    if (replaced != NULL && replaced != node) {
+        ReleaseNode(replaced);
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Deletes a file; a file that does not exist counts as deleted.
+ */
+static bool MemoryDelete(_In_z_ const char* path) {
+    char fullPath[MAX_PATH];
+    if (!NormalizePath(path, fullPath)) {
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_NamespaceLock);
+    MEMORY_NODE* node = FindLocked(fullPath);
+    bool directory = (node != NULL && node->IsDirectory);
+    if (node != NULL && !directory) {
+        UnlinkLocked(node);
+    }
+    ReleaseSRWLockExclusive(&g_NamespaceLock);
+
+    if (directory) {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return false;
+    }
+    if (node != NULL) {
+        ReleaseNode(node);
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Returns the attributes of a file or directory.
+ */
+static bool MemoryQueryInfo(_In_z_ const char* path, _Out_ IO_FILE_INFO* info) {
+    char fullPath[MAX_PATH];
+    memset(info, 0, sizeof(*info));
+    if (!NormalizePath(path, fullPath)) {
+        return false;
+    }
+    if (IsRoot(fullPath)) {
+        info->IsDirectory = true;
+        return true;
+    }
+
+    AcquireSRWLockShared(&g_NamespaceLock);
+    MEMORY_NODE* node = FindLocked(fullPath);
+    DWORD error = (node != NULL) ? ERROR_SUCCESS : MissingErrorLocked(fullPath);
+    if (node != NULL) {
+        FillInfo(node, info);
+    }
+    ReleaseSRWLockShared(&g_NamespaceLock);
+
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Appends a copy of a node to a listing.
+ */
+static bool AddListing(_Inout_ MEMORY_LISTING** listing, _Inout_ size_t* count, _Inout_ size_t* capacity, _In_ MEMORY_NODE* node) {
+    if (*count == *capacity) {
+        size_t newCapacity = max(2 * *capacity, 16);
+        MEMORY_LISTING* grown = (MEMORY_LISTING*)realloc(*listing, newCapacity * sizeof(MEMORY_LISTING));
+        if (grown == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+        *listing = grown;
+        *capacity = newCapacity;
+    }
+
+    MEMORY_LISTING* entry = &(*listing)[(*count)++];
+    (void)StringCchCopyA(entry->Name, MAX_PATH, strrchr(node->Path, '\\') + 1);
+    FillInfo(node, &entry->Info);
+    return true;
+}
+
+
+/**
+ * @brief       Calls the callback for every entry of one directory.
+ */
+static bool MemoryList(_In_z_ const char* directory, _In_ IO_ENUMERATE_CALLBACK callback, _In_opt_ void* context) {
+    char fullPath[MAX_PATH];
+    if (!NormalizePath(directory, fullPath)) {
+        return false;
+    }
+
+    MEMORY_LISTING* listing = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    AcquireSRWLockShared(&g_NamespaceLock);
+    if (IsRoot(fullPath)) {
+        // Roots are not nodes: their entries are the nodes without a parent under the same root
+        size_t rootLength = strlen(fullPath);
+        for (DWORD bucket = 0; error == ERROR_SUCCESS && bucket < MEMORY_BUCKET_COUNT; bucket++) {
+            for (MEMORY_NODE* node = g_Buckets[bucket]; error == ERROR_SUCCESS && node != NULL; node = node->NextInBucket) {
+                if (node->Parent == NULL && _strnicmp(node->Path, fullPath, rootLength) == 0 && !AddListing(&listing, &count, &capacity, node)) {
+                    error = GetLastError();
+                }
+            }
+        }
+    }
+    else {
+        MEMORY_NODE* node = FindLocked(fullPath);
+        if (node == NULL) {
+            error = ERROR_PATH_NOT_FOUND;
+        }
+        else if (!node->IsDirectory) {
+            error = ERROR_DIRECTORY;
+        }
+        for (MEMORY_NODE* child = (error == ERROR_SUCCESS) ? node->FirstChild : NULL; child != NULL; child = child->NextSibling) {
+            if (!AddListing(&listing, &count, &capacity, child)) {
+                error = GetLastError();
+                break;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_NamespaceLock);
+
+    // Without the lock: the callback may create or delete files itself
+    for (size_t i = 0; error == ERROR_SUCCESS && i < count; i++) {
+        char path[MAX_PATH];
+        if (FAILED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", directory, listing[i].Name))) {
+            continue;
+        }
+        if (callback(path, listing[i].Name, &listing[i].Info, context) == IO_ENUMERATE_STOP) {
+            error = ERROR_CANCELLED;
+        }
+    }
+
+    free(listing);
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Creates one directory.
+ */
+static bool MemoryMakeDirectory(_In_z_ const char* path) {
+    char fullPath[MAX_PATH];
+    if (!NormalizePath(path, fullPath)) {
+        return false;
+    }
+    if (IsRoot(fullPath)) {
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_NamespaceLock);
+    MEMORY_NODE* parent = NULL;
+    DWORD error = ERROR_SUCCESS;
+    if (FindLocked(fullPath) != NULL) {
+        error = ERROR_ALREADY_EXISTS;
+    }
+    else if (!FindParentLocked(fullPath, &parent) || CreateNodeLocked(fullPath, parent, true) == NULL) {
+        error = GetLastError();
+    }
+    ReleaseSRWLockExclusive(&g_NamespaceLock);
+
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Sets the last access time of a file to now.
+ */
+static bool MemoryTouch(_In_z_ const char* path) {
+    char fullPath[MAX_PATH];
+    if (!NormalizePath(path, fullPath)) {
+        return false;
+    }
+
+    AcquireSRWLockShared(&g_NamespaceLock);
+    MEMORY_NODE* node = FindLocked(fullPath);
+    DWORD error = (node != NULL) ? ERROR_SUCCESS : MissingErrorLocked(fullPath);
+    if (node != NULL) {
+        InterlockedExchange64(&node->LastAccessTime, (LONG64)Now());
+    }
+    ReleaseSRWLockShared(&g_NamespaceLock);
+
+    if (error != ERROR_SUCCESS) {
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Flushes a file by path: it only has to exist.
+ */
+static bool MemoryFlushPath(_In_z_ const char* path) {
+    IO_FILE_INFO info = { 0 };
+    if (!MemoryQueryInfo(path, &info)) {
+        return false;
+    }
+    if (info.IsDirectory) {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return false;
+    }
+    return true;
+}
+
+
+// Global static variables
+static const IO_BACKEND g_MemoryBackend = {
+    "memory",
+    MemoryOpen,
+    MemoryClose,
+    MemoryTransferAt,
+    MemoryGetSize,
+    MemorySetSize,
+    MemoryReserve,
+    MemoryGetLastWriteTime,
+    MemorySetLastWriteTime,
+    MemoryNothingToDo,
+    MemoryNothingToDo,
+    MemoryNothingToDo,
+    MemoryQueryAllocatedRanges,
+    MemoryMapView,
+    MemoryUnmapView,
+    MemoryReplace,
+    MemoryDelete,
+    MemoryQueryInfo,
+    MemoryList,
+    MemoryMakeDirectory,
+    MemoryTouch,
+    MemoryFlushPath
+};
+
+
+const IO_BACKEND*
+MemoryBackendGet(
+    VOID
+)
+{
+    return &g_MemoryBackend;
+}
+
+
+VOID
+MemoryBackendReset(
+    VOID
+)
+{
+    AcquireSRWLockExclusive(&g_NamespaceLock);
+    for (DWORD bucket = 0; bucket < MEMORY_BUCKET_COUNT; bucket++) {
+        MEMORY_NODE* node = g_Buckets[bucket];
+        g_Buckets[bucket] = NULL;
+
+        while (node != NULL) {
+            MEMORY_NODE* next = node->NextInBucket;
+            node->NextInBucket = NULL;
+            node->Parent = NULL;
+            node->FirstChild = NULL;
+            node->PreviousSibling = NULL;
+            node->NextSibling = NULL;
+            ReleaseNode(node);
+            node = next;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_NamespaceLock);
+}
@@ -0,0 +1,39 @@
+#ifndef _MEMORYBACKEND_H_
+#define _MEMORYBACKEND_H_
+
+
+#include "includes.h"
+#include "IoBackend.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define MEMORY_BUCKET_COUNT 4096                // Hash buckets of the file table
+#define MEMORY_MIN_CAPACITY 4096                // Smallest allocation for file contents
+
+
+/*
+ * @brief       Returns a backend that keeps every file and directory in process memory.
+ *
+ * @details     Paths are made absolute with GetFullPathNameA and compared case-insensitively, like NTFS
+ *              does. Drive and UNC share roots always exist; every other directory has to be created.
+ *              Sparse files and compression are accepted but have no effect, so the whole file is
+ *              reported as allocated. Contents survive until MemoryBackendReset or the end of the process.
+ */
+const IO_BACKEND*
+MemoryBackendGet(
+    VOID
+);
+
+
+/*
+ * @brief       Deletes every file and directory of the memory backend. Open files stay readable until closed.
+ */
+VOID
+MemoryBackendReset(
+    VOID
+);
+
+
+EXTERN_C_END;
+#endif  //_MEMORYBACKEND_H_
@@ -0,0 +1,515 @@
+#include "OsBackend.h"
+
+
+/**
+ * @brief       Converts a FILETIME into a single 64-bit value.
+ */
+static uint64_t FileTimeToUint64(_In_ const FILETIME* fileTime) {
+    return ((uint64_t)fileTime->dwHighDateTime << 32) | fileTime->dwLowDateTime;
+}
+
+
+/**
+ * @brief       Converts a 64-bit value back into a FILETIME.
+ */
+static FILETIME Uint64ToFileTime(_In_ uint64_t value) {
+    FILETIME fileTime = { 0 };
+    fileTime.dwLowDateTime = (DWORD)(value & 0xFFFFFFFF);
+    fileTime.dwHighDateTime = (DWORD)(value >> 32);
+    return fileTime;
+}
+
+
+/**
+ * @brief       Issues a file-system control request and waits for it to complete. The handle is
+ *              overlapped, so the request needs an OVERLAPPED structure of its own.
+ *
+ * @return      TRUE on success; otherwise, FALSE with the error in GetLastError. With ERROR_MORE_DATA
+ *              *returned still holds the size of the partial output.
+ */
+static bool ControlFile(_In_ HANDLE handle, _In_ DWORD code, _In_opt_ void* input, _In_ DWORD inputLength, _Out_opt_ void* output, _In_ DWORD outputLength, _Out_ DWORD* returned) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    *returned = 0;
+
+    if (overlapped.hEvent == NULL) {
+        return false;
+    }
+
+    BOOL result = DeviceIoControl(handle, code, input, inputLength, output, outputLength, NULL, &overlapped);
+    DWORD error = result ? ERROR_SUCCESS : GetLastError();
+    if (result || error == ERROR_IO_PENDING) {
+        result = GetOverlappedResult(handle, &overlapped, returned, TRUE);
+        error = result ? ERROR_SUCCESS : GetLastError();
+    }
+    else {
+        *returned = (DWORD)overlapped.InternalHigh;
+    }
+
+    CloseHandle(overlapped.hEvent);
+    SetLastError(error);
+    return result != FALSE;
+}
+
+
+/**
+ * @brief       Opens a handle for positional I/O (see IoOpenFile).
+ */
+static IO_HANDLE OsOpen(_In_z_ const char* path, _In_ IoOpenMode mode) {
+    DWORD access = GENERIC_READ;
+    DWORD share = FILE_SHARE_READ | FILE_SHARE_DELETE;
+    DWORD disposition = OPEN_EXISTING;
+
+    switch (mode) {
+    case IO_OPEN_READ:
+        share |= FILE_SHARE_WRITE;
+        break;
+    case IO_OPEN_WRITE:
+        access |= GENERIC_WRITE;
+        break;
+    case IO_OPEN_CREATE:
+        access |= GENERIC_WRITE;
+        disposition = CREATE_ALWAYS;
+        break;
+    case IO_OPEN_ALWAYS:
+        access |= GENERIC_WRITE;
+        disposition = OPEN_ALWAYS;
+        break;
+    default:
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    // Delete access is shared so that a publish can rename over a file that is being read
+    HANDLE handle = CreateFileA(path,
+                                access,
+                                share,
+                                NULL,
+                                disposition,
+                                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+                                NULL);
+    return (handle == INVALID_HANDLE_VALUE) ? NULL : (IO_HANDLE)handle;
+}
+
+
+/**
+ * @brief       Closes a handle returned by OsOpen.
+ */
+static VOID OsClose(_In_ IO_HANDLE handle) {
+    CloseHandle((HANDLE)handle);
+}
+
+
+/**
+ * @brief       Issues one positional read or write and waits for it to complete.
+ *              Every call uses its own event, so concurrent calls on the same handle do not
+ *              wake each other up.
+ */
+static bool OsTransferAt(_In_ IO_HANDLE handle, _In_ uint64_t offset, _Inout_updates_bytes_(length) void* buffer, _In_ DWORD length, _In_ bool write, _Out_ DWORD* transferred) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    *transferred = 0;
+
+    if (overlapped.hEvent == NULL) {
+        return false;
+    }
+
+    BOOL issued = write
+        ? WriteFile((HANDLE)handle, buffer, length, NULL, &overlapped)
+        : ReadFile((HANDLE)handle, buffer, length, NULL, &overlapped);
+
+    bool result = true;
+    if (!issued && GetLastError() != ERROR_IO_PENDING) {
+        result = (!write && GetLastError() == ERROR_HANDLE_EOF);
+    }
+    else if (!GetOverlappedResult((HANDLE)handle, &overlapped, transferred, TRUE)) {
+        result = (!write && GetLastError() == ERROR_HANDLE_EOF);
+        *transferred = 0;
+    }
+
+    CloseHandle(overlapped.hEvent);
+    return result;
+}
+
+
+/**
+ * @brief       Returns the size of an open file.
+ */
+static bool OsGetSize(_In_ IO_HANDLE handle, _Out_ uint64_t* size) {
+    LARGE_INTEGER fileSize = { 0 };
+    if (!GetFileSizeEx((HANDLE)handle, &fileSize)) {
+        *size = 0;
+        return false;
+    }
+
+    *size = (uint64_t)fileSize.QuadPart;
+    return true;
+}
+
+
+/**
+ * @brief       Sets the end of file of an open file.
+ */
+static bool OsSetSize(_In_ IO_HANDLE handle, _In_ uint64_t size) {
+    FILE_END_OF_FILE_INFO endOfFile = { 0 };
+    endOfFile.EndOfFile.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle((HANDLE)handle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile)) != FALSE;
+}
+
+
+/**
+ * @brief       Reserves disk space for an open file without changing its end of file.
+ */
+static bool OsReserve(_In_ IO_HANDLE handle, _In_ uint64_t size) {
+    FILE_ALLOCATION_INFO allocation = { 0 };
+    allocation.AllocationSize.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle((HANDLE)handle, FileAllocationInfo, &allocation, sizeof(allocation)) != FALSE;
+}
+
+
+/**
+ * @brief       Returns the last write time of an open file.
+ */
+static bool OsGetLastWriteTime(_In_ IO_HANDLE handle, _Out_ uint64_t* lastWriteTime) {
+    FILETIME lastWrite = { 0 };
+    if (!GetFileTime((HANDLE)handle, NULL, NULL, &lastWrite)) {
+        *lastWriteTime = 0;
+        return false;
+    }
+
+    *lastWriteTime = FileTimeToUint64(&lastWrite);
+    return true;
+}
+
+
+/**
+ * @brief       Sets the last write time of an open file.
+ */
+static bool OsSetLastWriteTime(_In_ IO_HANDLE handle, _In_ uint64_t lastWriteTime) {
+    FILETIME lastWrite = Uint64ToFileTime(lastWriteTime);
+    return SetFileTime((HANDLE)handle, NULL, NULL, &lastWrite) != FALSE;
+}
+
+
+/**
+ * @brief       Flushes an open file to disk.
+ */
+static bool OsFlush(_In_ IO_HANDLE handle) {
+    return FlushFileBuffers((HANDLE)handle) != FALSE;
+}
+
+
+/**
+ * @brief       Turns on NTFS compression for an open file.
+ */
+static bool OsSetCompression(_In_ IO_HANDLE handle) {
+    USHORT format = COMPRESSION_FORMAT_DEFAULT;
+    DWORD returned = 0;
+    return ControlFile((HANDLE)handle, FSCTL_SET_COMPRESSION, &format, sizeof(format), NULL, 0, &returned);
+}
+
+
+/**
+ * @brief       Marks an open file as sparse.
+ */
+static bool OsSetSparse(_In_ IO_HANDLE handle) {
+    DWORD returned = 0;
+    return ControlFile((HANDLE)handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned);
+}
+
+
+/**
+ * @brief       Lists the allocated ranges of an open file (see IoQueryAllocatedRanges).
+ */
+static bool OsQueryAllocatedRanges(_In_ IO_HANDLE handle, _In_ uint64_t fileSize, _Outptr_result_maybenull_ IO_RANGE** rangesOut, _Out_ DWORD* rangeCount) {
+    FILE_ALLOCATED_RANGE_BUFFER query = { 0 };
+    FILE_ALLOCATED_RANGE_BUFFER batch[64];
+    IO_RANGE* ranges = NULL;
+    DWORD count = 0;
+    DWORD capacity = 0;
+
+    *rangesOut = NULL;
+    *rangeCount = 0;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = (LONGLONG)fileSize;
+
+    // The file system returns as many ranges as fit and ERROR_MORE_DATA; continue after the last one
+    while ((uint64_t)query.FileOffset.QuadPart < fileSize) {
+        DWORD returned = 0;
+        bool complete = ControlFile((HANDLE)handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), batch, sizeof(batch), &returned);
+        DWORD error = GetLastError();
+        DWORD batchCount = returned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+
+        if (!complete && error != ERROR_MORE_DATA) {
+            free(ranges);
+
+            // No sparse file support: everything is allocated
+            if (error != ERROR_INVALID_FUNCTION) {
+                return false;
+            }
+            ranges = (IO_RANGE*)malloc(sizeof(IO_RANGE));
+            if (ranges == NULL) {
+                return false;
+            }
+            ranges[0].Offset = 0;
+            ranges[0].Length = fileSize;
+            *rangesOut = ranges;
+            *rangeCount = 1;
+            return true;
+        }
+
+        if (count + batchCount > capacity) {
+            DWORD newCapacity = max(2 * capacity, count + batchCount);
+            IO_RANGE* grown = (IO_RANGE*)realloc(ranges, newCapacity * sizeof(IO_RANGE));
+            if (grown == NULL) {
+                free(ranges);
+                return false;
+            }
+            ranges = grown;
+            capacity = newCapacity;
+        }
+
+        for (DWORD i = 0; i < batchCount; i++) {
+            ranges[count].Offset = (uint64_t)batch[i].FileOffset.QuadPart;
+            ranges[count].Length = (uint64_t)batch[i].Length.QuadPart;
+            count++;
+        }
+
+        if (complete || batchCount == 0) {
+            break;
+        }
+
+        const IO_RANGE* last = &ranges[count - 1];
+        query.FileOffset.QuadPart = (LONGLONG)(last->Offset + last->Length);
+        query.Length.QuadPart = (LONGLONG)(fileSize - min(fileSize, last->Offset + last->Length));
+    }
+
+    *rangesOut = ranges;
+    *rangeCount = count;
+    return true;
+}
+
+
+/**
+ * @brief       Maps an open file read-only. A sequential view is prefetched from the start with large reads;
+ *              beyond OS_VIEW_PREFETCH_SIZE the memory manager's own read-ahead follows the reader.
+ */
+static bool OsMapView(_In_ IO_HANDLE handle, _In_ uint64_t size, _In_ IoAccessPattern pattern, _Outptr_ const void** view) {
+    *view = NULL;
+    if (size > (uint64_t)SIZE_MAX) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA((HANDLE)handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        return false;
+    }
+
+    // The view keeps the section alive on its own
+    void* mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    DWORD error = GetLastError();
+    CloseHandle(mapping);
+    if (mapped == NULL) {
+        SetLastError(error);
+        return false;
+    }
+
+    // Only a hint: a failed prefetch leaves the pages to be read on demand
+    if (pattern == IO_ACCESS_SEQUENTIAL) {
+        WIN32_MEMORY_RANGE_ENTRY range = { mapped, (SIZE_T)min(size, (uint64_t)OS_VIEW_PREFETCH_SIZE) };
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    *view = mapped;
+    return true;
+}
+
+
+/**
+ * @brief       Unmaps a view returned by OsMapView.
+ */
+static VOID OsUnmapView(_In_ IO_HANDLE handle, _In_ const void* view) {
+    UNREFERENCED_PARAMETER(handle);
+    UnmapViewOfFile(view);
+}
+
+
+/**
+ * @brief       Renames a file, replacing the destination, and waits until the rename is on disk.
+ */
+static bool OsReplace(_In_z_ const char* source, _In_z_ const char* destination) {
+    return MoveFileExA(source, destination, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+}
+
+
+/**
+ * @brief       Deletes a file; a file that does not exist counts as deleted.
+ */
+static bool OsDelete(_In_z_ const char* path) {
+    if (DeleteFileA(path)) {
+        return true;
+    }
+
+    DWORD error = GetLastError();
+    return error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND;
+}
+
+
+/**
+ * @brief       Returns the attributes of a file or directory.
+ */
+static bool OsQueryInfo(_In_z_ const char* path, _Out_ IO_FILE_INFO* info) {
+    WIN32_FILE_ATTRIBUTE_DATA data = { 0 };
+    memset(info, 0, sizeof(*info));
+
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+        return false;
+    }
+
+    info->Size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    info->LastWriteTime = FileTimeToUint64(&data.ftLastWriteTime);
+    info->LastAccessTime = FileTimeToUint64(&data.ftLastAccessTime);
+    info->IsDirectory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    return true;
+}
+
+
+/**
+ * @brief       Calls the callback for every entry of one directory.
+ */
+static bool OsList(_In_z_ const char* directory, _In_ IO_ENUMERATE_CALLBACK callback, _In_opt_ void* context) {
+    char pattern[MAX_PATH];
+    if (FAILED(StringCchPrintfA(pattern, MAX_PATH, "%s\\*", directory))) {
+        return false;
+    }
+
+    WIN32_FIND_DATAA findData = { 0 };
+    HANDLE find = FindFirstFileA(pattern, &findData);
+    if (find == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    bool result = true;
+    do {
+        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0) {
+            continue;
+        }
+
+        char path[MAX_PATH];
+        if (FAILED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", directory, findData.cFileName))) {
+            continue;
+        }
+
+        IO_FILE_INFO info = { 0 };
+        info.Size = ((uint64_t)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+        info.LastWriteTime = FileTimeToUint64(&findData.ftLastWriteTime);
+        info.LastAccessTime = FileTimeToUint64(&findData.ftLastAccessTime);
+        info.IsDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+        if (callback(path, findData.cFileName, &info, context) == IO_ENUMERATE_STOP) {
+            result = false;
+            break;
+        }
+    } while (FindNextFileA(find, &findData));
+
+    FindClose(find);
+    if (!result) {
+        SetLastError(ERROR_CANCELLED);
+    }
+    return result;
+}
+
+
+/**
+ * @brief       Creates one directory.
+ */
+static bool OsCreateDirectory(_In_z_ const char* path) {
+    return CreateDirectoryA(path, NULL) != FALSE;
+}
+
+
+/**
+ * @brief       Sets the last access time of a file to now.
+ */
+static bool OsTouch(_In_z_ const char* path) {
+    HANDLE file = CreateFileA(path,
+                              FILE_WRITE_ATTRIBUTES,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    bool result = SetFileTime(file, NULL, &now, NULL) != FALSE;
+
+    CloseHandle(file);
+    return result;
+}
+
+
+/**
+ * @brief       Opens a file just to flush it. FlushFileBuffers needs write access.
+ */
+static bool OsFlushPath(_In_z_ const char* path) {
+    HANDLE file = CreateFileA(path,
+                              GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    bool result = FlushFileBuffers(file) != FALSE;
+    DWORD error = GetLastError();
+
+    CloseHandle(file);
+    SetLastError(error);
+    return result;
+}
+
+
+// Global static variables
+static const IO_BACKEND g_OsBackend = {
+    "os",
+    OsOpen,
+    OsClose,
+    OsTransferAt,
+    OsGetSize,
+    OsSetSize,
+    OsReserve,
+    OsGetLastWriteTime,
+    OsSetLastWriteTime,
+    OsFlush,
+    OsSetCompression,
+    OsSetSparse,
+    OsQueryAllocatedRanges,
+    OsMapView,
+    OsUnmapView,
+    OsReplace,
+    OsDelete,
+    OsQueryInfo,
+    OsList,
+    OsCreateDirectory,
+    OsTouch,
+    OsFlushPath
+};
+
+
+const IO_BACKEND*
+OsBackendGet(
+    VOID
+)
+{
+    return &g_OsBackend;
+}
@@ -0,0 +1,27 @@
+#ifndef _OSBACKEND_H_
+#define _OSBACKEND_H_
+
+
+#include "includes.h"
+#include "IoBackend.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define OS_VIEW_PREFETCH_SIZE (64 * 1024 * 1024) // Read ahead of a sequential view up front; the rest follows the reader
+
+
+/*
+ * @brief       Returns the backend that performs file operations on the operating system's file systems.
+ *
+ * @details     Files are opened with FILE_FLAG_OVERLAPPED, so positional reads and writes on the same handle
+ *              can be issued from several threads at once. This is the default backend.
+ */
+const IO_BACKEND*
+OsBackendGet(
+    VOID
+);
+
+
+EXTERN_C_END;
+#endif  //_OSBACKEND_H_
@@ -0,0 +1,85 @@
+#include "RateLimit.h"
+
+
+/**
+ * @brief       Adds the tokens accumulated since the last refill, capped at one second worth.
+ *              Must be called with the limiter lock held.
+ */
+static void Refill(_Inout_ RATE_LIMITER* limiter, _In_ LONG64 bytesPerSecond) {
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG elapsed = now - limiter->LastRefill;
+    limiter->LastRefill = now;
+
+    limiter->Available += (LONG64)((elapsed * (ULONGLONG)bytesPerSecond) / 1000);
+    if (limiter->Available > bytesPerSecond) {
+        limiter->Available = bytesPerSecond;
+    }
+}
+
+
+VOID
+RateLimiterInit(
+    _Out_ RATE_LIMITER* Limiter,
+    _In_ uint64_t BytesPerSecond
+)
+{
+    InitializeSRWLock(&Limiter->Lock);
+    Limiter->BytesPerSecond = (LONG64)BytesPerSecond;
+    Limiter->Available = (LONG64)BytesPerSecond;
+    Limiter->LastRefill = GetTickCount64();
+}
+
+
+VOID
+RateLimiterSetRate(
+    _Inout_ RATE_LIMITER* Limiter,
+    _In_ uint64_t BytesPerSecond
+)
+{
+    AcquireSRWLockExclusive(&Limiter->Lock);
+    Limiter->BytesPerSecond = (LONG64)BytesPerSecond;
+    if (Limiter->Available > (LONG64)BytesPerSecond) {
+        Limiter->Available = (LONG64)BytesPerSecond;
+    }
+    ReleaseSRWLockExclusive(&Limiter->Lock);
+}
+
+
+bool
+RateLimiterAcquire(
+    _Inout_ RATE_LIMITER* Limiter,
+    _In_ uint64_t Bytes,
+    _In_opt_ HANDLE StopEvent
+)
+{
+    for (;;) {
+        DWORD waitMilliseconds = 0;
+
+        AcquireSRWLockExclusive(&Limiter->Lock);
+        LONG64 bytesPerSecond = Limiter->BytesPerSecond;
+        if (bytesPerSecond <= 0) {
+            ReleaseSRWLockExclusive(&Limiter->Lock);
+            return true;
+        }
+
+        Refill(Limiter, bytesPerSecond);
+        if (Limiter->Available > 0) {
+            Limiter->Available -= (LONG64)Bytes;
+            ReleaseSRWLockExclusive(&Limiter->Lock);
+            return true;
+        }
+
+        // Sleep until the debt is paid off
+        waitMilliseconds = (DWORD)min(((ULONGLONG)(1 - Limiter->Available) * 1000) / (ULONGLONG)bytesPerSecond + 1, 1000ULL);
+        ReleaseSRWLockExclusive(&Limiter->Lock);
+
+        if (StopEvent != NULL) {
+            if (WaitForSingleObject(StopEvent, waitMilliseconds) == WAIT_OBJECT_0) {
+                return false;
+            }
+        }
+        else {
+            Sleep(waitMilliseconds);
+        }
+    }
+}
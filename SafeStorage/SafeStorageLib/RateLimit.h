@@ -0,0 +1,58 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+// Token bucket that limits background I/O to a number of bytes per second.
+typedef struct _RATE_LIMITER {
+    SRWLOCK Lock;
+    volatile LONG64 BytesPerSecond;             // 0 means unlimited
+    LONG64 Available;                           // Tokens in the bucket; negative after an oversized request
+    ULONGLONG LastRefill;                       // GetTickCount64 of the last refill
+} RATE_LIMITER;
+
+
+/*
+ * @brief       Initializes the limiter with a full bucket (one second worth of bytes).
+ *
+ * @param[in]   BytesPerSecond  - Sustained rate; 0 disables limiting.
+ */
+VOID
+RateLimiterInit(
+    _Out_ RATE_LIMITER* Limiter,
+    _In_ uint64_t BytesPerSecond
+);
+
+
+/*
+ * @brief       Changes the sustained rate of an initialized limiter.
+ */
+VOID
+RateLimiterSetRate(
+    _Inout_ RATE_LIMITER* Limiter,
+    _In_ uint64_t BytesPerSecond
+);
+
+
+/*
+ * @brief       Takes Bytes from the bucket, sleeping until enough tokens have accumulated.
+ *              A request larger than the bucket is granted and paid for by the following requests.
+ *
+ * @param[in]   StopEvent       - Optional event that aborts the wait when signaled.
+ *
+ * @return      TRUE once the bytes may be transferred; FALSE if StopEvent was signaled.
+ */
+bool
+RateLimiterAcquire(
+    _Inout_ RATE_LIMITER* Limiter,
+    _In_ uint64_t Bytes,
+    _In_opt_ HANDLE StopEvent
+);
+
+
+EXTERN_C_END;
+#endif  //_RATELIMIT_H_
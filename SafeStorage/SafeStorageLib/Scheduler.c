@@ -0,0 +1,231 @@
+#include "Scheduler.h"
+
+
+// A chunk worker blocked in SchedulerAcquire. The node lives on the worker's stack.
+typedef struct _SCHEDULER_REQUEST {
+    struct _SCHEDULER_REQUEST* Next;
+    DWORD Bytes;
+    bool Granted;
+} SCHEDULER_REQUEST;
+
+
+struct _SCHEDULER_QUEUE {
+    struct _SCHEDULER_QUEUE* Next;              // All queues
+    struct _SCHEDULER_QUEUE* NextActive;        // Round-robin order of the queues of a class with waiting requests
+    char Owner[USERNAME_MAX_LENGTH + 1];
+    SchedulerClass Class;
+    LONG References;
+    bool Active;
+    uint64_t Deficit;                           // Bytes the queue may still issue in its current turn
+    SCHEDULER_REQUEST* Head;                    // Waiting requests, oldest first
+    SCHEDULER_REQUEST* Tail;
+};
+
+
+// Global static variables
+static SRWLOCK g_SchedulerLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE g_SchedulerGranted = CONDITION_VARIABLE_INIT;   // Signaled when requests are granted
+static SCHEDULER_QUEUE* g_Queues = NULL;
+static SCHEDULER_QUEUE* g_ActiveHead[SCHEDULER_CLASS_COUNT] = { 0 };
+static SCHEDULER_QUEUE* g_ActiveTail[SCHEDULER_CLASS_COUNT] = { 0 };
+static DWORD g_InFlight = 0;
+
+
+/**
+ * @brief       Appends a queue to the round of its class. Must be called with g_SchedulerLock held.
+ */
+static void ActivateQueue(_Inout_ SCHEDULER_QUEUE* queue) {
+    queue->NextActive = NULL;
+    if (g_ActiveTail[queue->Class] == NULL) {
+        g_ActiveHead[queue->Class] = queue;
+    }
+    else {
+        g_ActiveTail[queue->Class]->NextActive = queue;
+    }
+    g_ActiveTail[queue->Class] = queue;
+    queue->Active = true;
+}
+
+
+/**
+ * @brief       Removes the queue at the head of the round of a class. Must be called with g_SchedulerLock held.
+ */
+static SCHEDULER_QUEUE* PopActiveQueue(_In_ SchedulerClass schedulerClass) {
+    SCHEDULER_QUEUE* queue = g_ActiveHead[schedulerClass];
+    g_ActiveHead[schedulerClass] = queue->NextActive;
+    if (g_ActiveHead[schedulerClass] == NULL) {
+        g_ActiveTail[schedulerClass] = NULL;
+    }
+    queue->NextActive = NULL;
+    queue->Active = false;
+    return queue;
+}
+
+
+/**
+ * @brief       Deficit round robin over the queues of one class. The queue at the head of the round
+ *              issues requests while its deficit covers them; otherwise it gets another quantum and
+ *              goes to the back of the round. Must be called with g_SchedulerLock held.
+ *
+ * @return      The next request to grant, or NULL if no queue of the class is waiting.
+ */
+static SCHEDULER_REQUEST* PickRequest(_In_ SchedulerClass schedulerClass) {
+    while (g_ActiveHead[schedulerClass] != NULL) {
+        SCHEDULER_QUEUE* queue = g_ActiveHead[schedulerClass];
+        SCHEDULER_REQUEST* request = queue->Head;
+
+        if (request->Bytes <= queue->Deficit) {
+            queue->Deficit -= request->Bytes;
+            queue->Head = request->Next;
+            if (queue->Head == NULL) {
+                // An idle queue does not keep its unused deficit
+                queue->Tail = NULL;
+                queue->Deficit = 0;
+                PopActiveQueue(schedulerClass);
+            }
+            return request;
+        }
+
+        queue = PopActiveQueue(schedulerClass);
+        queue->Deficit += SCHEDULER_QUANTUM;
+        ActivateQueue(queue);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief       Grants waiting requests while slots are free, interactive ones first.
+ *              Must be called with g_SchedulerLock held.
+ */
+static void Dispatch(void) {
+    bool granted = false;
+
+    while (g_InFlight < SCHEDULER_MAX_IN_FLIGHT) {
+        SCHEDULER_REQUEST* request = PickRequest(SCHEDULER_CLASS_INTERACTIVE);
+        if (request == NULL) {
+            request = PickRequest(SCHEDULER_CLASS_BULK);
+        }
+        if (request == NULL) {
+            break;
+        }
+
+        request->Granted = true;
+        g_InFlight++;
+        granted = true;
+    }
+
+    if (granted) {
+        WakeAllConditionVariable(&g_SchedulerGranted);
+    }
+}
+
+
+SCHEDULER_QUEUE*
+SchedulerOpenQueue(
+    _In_opt_z_ const char* Owner,
+    _In_ SchedulerClass Class
+)
+{
+    const char* owner = (Owner != NULL) ? Owner : "";
+    SCHEDULER_QUEUE* queue = NULL;
+
+    AcquireSRWLockExclusive(&g_SchedulerLock);
+    for (queue = g_Queues; queue != NULL; queue = queue->Next) {
+        if (queue->Class == Class && strcmp(queue->Owner, owner) == 0) {
+            break;
+        }
+    }
+
+    if (queue == NULL) {
+        queue = (SCHEDULER_QUEUE*)calloc(1, sizeof(SCHEDULER_QUEUE));
+        if (queue != NULL) {
+            StringCchCopyA(queue->Owner, sizeof(queue->Owner), owner);
+            queue->Class = Class;
+            queue->Next = g_Queues;
+            g_Queues = queue;
+        }
+    }
+
+    if (queue != NULL) {
+        queue->References++;
+    }
+    ReleaseSRWLockExclusive(&g_SchedulerLock);
+
+    return queue;
+}
+
+
+VOID
+SchedulerCloseQueue(
+    _In_opt_ SCHEDULER_QUEUE* Queue
+)
+{
+    if (Queue == NULL) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_SchedulerLock);
+    if (--Queue->References == 0) {
+        // Nothing can be waiting: every waiter holds a reference
+        SCHEDULER_QUEUE** link = &g_Queues;
+        while (*link != Queue) {
+            link = &(*link)->Next;
+        }
+        *link = Queue->Next;
+        free(Queue);
+    }
+    ReleaseSRWLockExclusive(&g_SchedulerLock);
+}
+
+
+SchedulerClass
+SchedulerClassForSize(
+    _In_ uint64_t TransferSize
+)
+{
+    return (TransferSize <= SCHEDULER_INTERACTIVE_LIMIT) ? SCHEDULER_CLASS_INTERACTIVE : SCHEDULER_CLASS_BULK;
+}
+
+
+VOID
+SchedulerAcquire(
+    _Inout_ SCHEDULER_QUEUE* Queue,
+    _In_ DWORD Bytes
+)
+{
+    SCHEDULER_REQUEST request = { 0 };
+    request.Bytes = Bytes;
+
+    AcquireSRWLockExclusive(&g_SchedulerLock);
+    if (Queue->Tail == NULL) {
+        Queue->Head = &request;
+    }
+    else {
+        Queue->Tail->Next = &request;
+    }
+    Queue->Tail = &request;
+
+    if (!Queue->Active) {
+        ActivateQueue(Queue);
+    }
+
+    Dispatch();
+    while (!request.Granted) {
+        SleepConditionVariableSRW(&g_SchedulerGranted, &g_SchedulerLock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&g_SchedulerLock);
+}
+
+
+VOID
+SchedulerRelease(
+    VOID
+)
+{
+    AcquireSRWLockExclusive(&g_SchedulerLock);
+    g_InFlight--;
+    Dispatch();
+    ReleaseSRWLockExclusive(&g_SchedulerLock);
+}
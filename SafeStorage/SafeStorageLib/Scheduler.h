@@ -0,0 +1,86 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define SCHEDULER_MAX_IN_FLIGHT 8               // Chunk I/Os that may run at the same time, across all transfers
+#define SCHEDULER_QUANTUM CHUNK_SIZE            // Bytes a queue may issue per round-robin turn
+#define SCHEDULER_INTERACTIVE_LIMIT (4 * 1024 * 1024)  // Transfers up to this size are interactive
+
+
+// Priority classes. Bulk requests are only dispatched when no interactive request is waiting.
+typedef enum {
+    SCHEDULER_CLASS_INTERACTIVE = 0,
+    SCHEDULER_CLASS_BULK = 1,
+    SCHEDULER_CLASS_COUNT
+} SchedulerClass;
+
+
+// The queue of one user and class, shared by all of that user's transfers in the class
+typedef struct _SCHEDULER_QUEUE SCHEDULER_QUEUE;
+
+
+/*
+ * @brief       Returns the queue of Owner in the given class, creating it on first use.
+ *
+ * @details     Within a class, waiting requests are served by deficit round robin: each queue with waiting
+ *              requests may issue SCHEDULER_QUANTUM bytes per turn, so every user gets an equal share of the
+ *              chunk I/O slots no matter how many or how large its transfers are.
+ *
+ * @param[in]   Owner           - The user the I/O is done for; NULL for internal work (e.g. tier promotions).
+ * @param[in]   Class           - The priority class; see SchedulerClassForSize.
+ *
+ * @return      The queue, or NULL if out of memory. Release it with SchedulerCloseQueue.
+ */
+SCHEDULER_QUEUE*
+SchedulerOpenQueue(
+    _In_opt_z_ const char* Owner,
+    _In_ SchedulerClass Class
+);
+
+
+/*
+ * @brief       Drops a reference obtained from SchedulerOpenQueue. NULL is ignored.
+ */
+VOID
+SchedulerCloseQueue(
+    _In_opt_ SCHEDULER_QUEUE* Queue
+);
+
+
+/*
+ * @brief       Returns the priority class of a transfer of the given size.
+ */
+SchedulerClass
+SchedulerClassForSize(
+    _In_ uint64_t TransferSize
+);
+
+
+/*
+ * @brief       Waits until the scheduler grants one chunk I/O of Bytes bytes to the queue.
+ *              Every call must be followed by SchedulerRelease once the I/O is done.
+ */
+VOID
+SchedulerAcquire(
+    _Inout_ SCHEDULER_QUEUE* Queue,
+    _In_ DWORD Bytes
+);
+
+
+/*
+ * @brief       Returns the slot of a finished chunk I/O and hands it to the next waiting request.
+ */
+VOID
+SchedulerRelease(
+    VOID
+);
+
+
+EXTERN_C_END;
+#endif  //_SCHEDULER_H_
@@ -0,0 +1,368 @@
+#include "Scrubber.h"
+#include "FileIo.h"
+#include "Manifest.h"
+#include "RateLimit.h"
+#include "Striping.h"
+#include "Tiering.h"
+#include "Transfer.h"
+
+
+// State of one pass over all submissions
+typedef struct _SCRUB_PASS {
+    SafeStorageScrubStats Stats;
+    IO_TEXT Report;                             // Details of every problem found; the summary is appended at the end
+    BYTE* Buffer;                               // One manifest block
+} SCRUB_PASS;
+
+
+// Global static variables
+static char g_ScrubAppDirectory[MAX_PATH] = { 0 };
+static SRWLOCK g_ScrubLock = SRWLOCK_INIT;      // Guards g_ScrubInterval and g_LastPass
+static uint32_t g_ScrubInterval = SCRUBBER_DEFAULT_INTERVAL_SECONDS;
+static SafeStorageScrubStats g_LastPass = { 0 };
+static RATE_LIMITER g_ScrubLimiter;
+static volatile LONG g_ForegroundOperations = 0;
+static HANDLE g_ScrubberThread = NULL;
+static HANDLE g_ScrubberStop = NULL;
+static HANDLE g_ScrubberWake = NULL;
+
+
+/**
+ * @brief       Waits until no store or retrieve command is running.
+ *
+ * @return      TRUE once the foreground is idle; FALSE if the scrubber is stopping.
+ */
+static bool WaitForIdleForeground(void) {
+    while (InterlockedCompareExchange(&g_ForegroundOperations, 0, 0) > 0) {
+        if (WaitForSingleObject(g_ScrubberStop, SCRUBBER_BACKOFF_MS) == WAIT_OBJECT_0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Opens a submission for verification, from the cold tier if it was migrated.
+ */
+static SS_FILE* OpenSubmission(_In_z_ const char* submissionPath) {
+    SS_FILE* file = StripingOpenFile(submissionPath, IO_OPEN_READ);
+    char coldPath[MAX_PATH];
+
+    if (file == NULL && TieringGetColdPath(submissionPath, coldPath)) {
+        file = IoOpenFile(coldPath, IO_OPEN_READ);
+    }
+    return file;
+}
+
+
+/**
+ * @brief       Re-reads one submission within the read budget and compares every block with its manifest.
+ *              The size and last write time are taken from the open handle, so a submission replaced by a
+ *              concurrent store is either verified as a whole or reported as stale.
+ *
+ * @return      FALSE if the scrubber is stopping; otherwise, TRUE.
+ */
+static bool ScrubSubmission(_Inout_ SCRUB_PASS* pass, _In_z_ const char* manifestPath) {
+    char submissionPath[MAX_PATH];
+    size_t pathLength = strlen(manifestPath) - strlen(MANIFEST_SUFFIX);
+    if (FAILED(StringCchCopyNA(submissionPath, MAX_PATH, manifestPath, pathLength))) {
+        return true;
+    }
+
+    SS_MANIFEST* manifest = ManifestRead(manifestPath);
+    if (manifest == NULL) {
+        pass->Stats.ReadErrors++;
+        IoTextAppend(&pass->Report, "Unreadable manifest: %s\n", manifestPath);
+        return true;
+    }
+
+    SS_FILE* file = OpenSubmission(submissionPath);
+    if (file == NULL) {
+        // Either the submission was never published or the manifest outlived it
+        pass->Stats.StaleChecksums++;
+        ManifestFree(manifest);
+        return true;
+    }
+
+    uint64_t fileSize = 0;
+    uint64_t lastWriteTime = 0;
+    if (!IoGetFileSize(file, &fileSize) || !IoGetLastWriteTime(file, &lastWriteTime) ||
+        !ManifestMatchesFile(manifest, fileSize, lastWriteTime) || manifest->BlockSize > MANIFEST_BLOCK_SIZE) {
+        pass->Stats.StaleChecksums++;
+        IoCloseFile(file);
+        ManifestFree(manifest);
+        return true;
+    }
+
+    bool running = true;
+    uint64_t corruptBlocks = 0;
+
+    for (uint64_t block = 0; block < manifest->BlockCount; block++) {
+        uint64_t offset = block * manifest->BlockSize;
+        DWORD length = (DWORD)min((uint64_t)manifest->BlockSize, fileSize - offset);
+        DWORD bytesRead = 0;
+        BYTE hash[HASH_LENGTH];
+
+        running = WaitForIdleForeground() && RateLimiterAcquire(&g_ScrubLimiter, length, g_ScrubberStop);
+        if (!running) {
+            break;
+        }
+
+        if (!IoReadAt(file, offset, pass->Buffer, length, &bytesRead) || bytesRead != length) {
+            pass->Stats.ReadErrors++;
+            IoTextAppend(&pass->Report, "Read error at offset %llu: %s\n", offset, submissionPath);
+            break;
+        }
+
+        if (!ManifestHashBlock(pass->Buffer, length, hash) ||
+            memcmp(hash, manifest->BlockHashes[block], HASH_LENGTH) != 0) {
+            corruptBlocks++;
+            IoTextAppend(&pass->Report, "Corrupt block %llu (offset %llu): %s\n", block, offset, submissionPath);
+        }
+        pass->Stats.BytesVerified += length;
+    }
+
+    if (running) {
+        pass->Stats.SubmissionsScanned++;
+        if (corruptBlocks > 0) {
+            pass->Stats.CorruptSubmissions++;
+            pass->Stats.CorruptBlocks += corruptBlocks;
+            printf("Scrubber: %llu corrupt block(s) in %s\n", corruptBlocks, submissionPath);
+        }
+    }
+
+    IoCloseFile(file);
+    ManifestFree(manifest);
+    return running;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of the scrubber. Verifies the submission of every manifest and
+ *              counts the submissions that have none (stored before checksums were recorded).
+ */
+static IoEnumerateAction ScrubEntry(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    SCRUB_PASS* pass = (SCRUB_PASS*)context;
+
+    if (WaitForSingleObject(g_ScrubberStop, 0) == WAIT_OBJECT_0) {
+        return IO_ENUMERATE_STOP;
+    }
+
+    // Version records and the block store are not submissions; their blocks are checked when restored
+    if (info->IsDirectory) {
+        return (strchr(name, '~') != NULL) ? IO_ENUMERATE_SKIP : IO_ENUMERATE_CONTINUE;
+    }
+
+    size_t nameLength = strlen(name);
+    size_t suffixLength = strlen(MANIFEST_SUFFIX);
+    if (nameLength > suffixLength && strcmp(name + nameLength - suffixLength, MANIFEST_SUFFIX) == 0) {
+        return ScrubSubmission(pass, path) ? IO_ENUMERATE_CONTINUE : IO_ENUMERATE_STOP;
+    }
+
+    // Other internal files (partial copies, checkpoints) are not submissions
+    if (strchr(name, '~') != NULL) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    char manifestPath[MAX_PATH];
+    IO_FILE_INFO manifestInfo = { 0 };
+    if (SUCCEEDED(StringCchPrintfA(manifestPath, MAX_PATH, "%s%s", path, MANIFEST_SUFFIX)) &&
+        !IoQueryFileInfo(manifestPath, &manifestInfo)) {
+        pass->Stats.MissingChecksums++;
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Runs one pass over all submissions and, unless interrupted, publishes its counters and report.
+ */
+static void RunScrubPass(void) {
+    char usersDirectory[MAX_PATH];
+    char reportPath[MAX_PATH];
+    char partialPath[MAX_PATH];
+
+    if (FAILED(StringCchPrintfA(usersDirectory, MAX_PATH, "%s\\users", g_ScrubAppDirectory)) ||
+        FAILED(StringCchPrintfA(reportPath, MAX_PATH, "%s\\%s", g_ScrubAppDirectory, SCRUBBER_REPORT_FILE)) ||
+        FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", reportPath, TRANSFER_PARTIAL_SUFFIX))) {
+        return;
+    }
+
+    SCRUB_PASS pass = { 0 };
+    pass.Buffer = (BYTE*)malloc(MANIFEST_BLOCK_SIZE);
+    if (pass.Buffer == NULL) {
+        return;
+    }
+
+    IoEnumerateFiles(usersDirectory, true, ScrubEntry, &pass);
+    bool completed = WaitForSingleObject(g_ScrubberStop, 0) != WAIT_OBJECT_0;
+
+    AcquireSRWLockExclusive(&g_ScrubLock);
+    if (completed) {
+        pass.Stats.Passes = g_LastPass.Passes + 1;
+        g_LastPass = pass.Stats;
+    }
+    ReleaseSRWLockExclusive(&g_ScrubLock);
+
+    if (completed) {
+        SYSTEMTIME now = { 0 };
+        GetLocalTime(&now);
+
+        IoTextAppend(&pass.Report,
+            "\nScrub pass %llu finished at %04u-%02u-%02u %02u:%02u:%02u\n"
+            "Submissions scanned:    %llu\n"
+            "Bytes verified:         %llu\n"
+            "Corrupt submissions:    %llu\n"
+            "Corrupt blocks:         %llu\n"
+            "Missing checksums:      %llu\n"
+            "Stale checksums:        %llu\n"
+            "Read errors:            %llu\n",
+            pass.Stats.Passes, now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+            pass.Stats.SubmissionsScanned, pass.Stats.BytesVerified, pass.Stats.CorruptSubmissions,
+            pass.Stats.CorruptBlocks, pass.Stats.MissingChecksums, pass.Stats.StaleChecksums, pass.Stats.ReadErrors);
+    }
+
+    completed = completed && !pass.Report.Failed && IoWriteFileContents(partialPath, pass.Report.Data, pass.Report.Length);
+    if (!completed || !IoReplaceFile(partialPath, reportPath)) {
+        IoDeleteFile(partialPath);
+    }
+    IoTextFree(&pass.Report);
+    free(pass.Buffer);
+}
+
+
+/**
+ * @brief       Scrubber thread. Runs a pass every g_ScrubInterval seconds, or right away when reconfigured,
+ *              at background (low CPU and I/O) priority until the stop event is signaled.
+ */
+static DWORD WINAPI ScrubberThreadProc(_In_ LPVOID parameter) {
+    UNREFERENCED_PARAMETER(parameter);
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    HANDLE events[2] = { g_ScrubberStop, g_ScrubberWake };
+    for (;;) {
+        AcquireSRWLockShared(&g_ScrubLock);
+        DWORD waitMilliseconds = (DWORD)min((uint64_t)g_ScrubInterval * 1000, (uint64_t)(INFINITE - 1));
+        ReleaseSRWLockShared(&g_ScrubLock);
+
+        if (WaitForMultipleObjects(2, events, FALSE, waitMilliseconds) == WAIT_OBJECT_0) {
+            break;
+        }
+        RunScrubPass();
+    }
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return 0;
+}
+
+
+bool
+ScrubberStart(
+    _In_z_ const char* AppDirectory,
+    _In_ uint64_t BytesPerSecond,
+    _In_ uint32_t IntervalSeconds
+)
+{
+    ScrubberStop();
+
+    if (FAILED(StringCchCopyA(g_ScrubAppDirectory, MAX_PATH, AppDirectory))) {
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_ScrubLock);
+    g_ScrubInterval = IntervalSeconds;
+    memset(&g_LastPass, 0, sizeof(g_LastPass));
+    ReleaseSRWLockExclusive(&g_ScrubLock);
+
+    RateLimiterInit(&g_ScrubLimiter, BytesPerSecond);
+    g_ForegroundOperations = 0;
+
+    g_ScrubberStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    g_ScrubberWake = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (g_ScrubberStop == NULL || g_ScrubberWake == NULL) {
+        ScrubberStop();
+        return false;
+    }
+
+    g_ScrubberThread = CreateThread(NULL, 0, ScrubberThreadProc, NULL, 0, NULL);
+    if (g_ScrubberThread == NULL) {
+        printf("Failed to start the scrubber: %lu\n", GetLastError());
+        ScrubberStop();
+        return false;
+    }
+
+    return true;
+}
+
+
+VOID
+ScrubberStop(
+    VOID
+)
+{
+    if (g_ScrubberThread != NULL) {
+        SetEvent(g_ScrubberStop);
+        WaitForSingleObject(g_ScrubberThread, INFINITE);
+        CloseHandle(g_ScrubberThread);
+        g_ScrubberThread = NULL;
+    }
+
+    if (g_ScrubberStop != NULL) {
+        CloseHandle(g_ScrubberStop);
+        g_ScrubberStop = NULL;
+    }
+
+    if (g_ScrubberWake != NULL) {
+        CloseHandle(g_ScrubberWake);
+        g_ScrubberWake = NULL;
+    }
+}
+
+
+VOID
+ScrubberConfigure(
+    _In_ uint64_t BytesPerSecond,
+    _In_ uint32_t IntervalSeconds
+)
+{
+    AcquireSRWLockExclusive(&g_ScrubLock);
+    g_ScrubInterval = IntervalSeconds;
+    ReleaseSRWLockExclusive(&g_ScrubLock);
+
+    RateLimiterSetRate(&g_ScrubLimiter, BytesPerSecond);
+
+    if (g_ScrubberWake != NULL) {
+        SetEvent(g_ScrubberWake);
+    }
+}
+
+
+VOID
+ScrubberGetStats(
+    _Out_ SafeStorageScrubStats* Stats
+)
+{
+    AcquireSRWLockShared(&g_ScrubLock);
+    *Stats = g_LastPass;
+    ReleaseSRWLockShared(&g_ScrubLock);
+}
+
+
+VOID
+ScrubberNoteForegroundStart(
+    VOID
+)
+{
+    InterlockedIncrement(&g_ForegroundOperations);
+}
+
+
+VOID
+ScrubberNoteForegroundEnd(
+    VOID
+)
+{
+    InterlockedDecrement(&g_ForegroundOperations);
+}
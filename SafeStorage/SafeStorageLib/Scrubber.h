@@ -0,0 +1,78 @@
+#ifndef _SCRUBBER_H_
+#define _SCRUBBER_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define SCRUBBER_DEFAULT_BYTES_PER_SECOND (16ULL * 1024 * 1024)
+#define SCRUBBER_DEFAULT_INTERVAL_SECONDS (24 * 60 * 60)
+#define SCRUBBER_BACKOFF_MS 50                  // Pause between checks while foreground commands are running
+#define SCRUBBER_REPORT_FILE "scrub_report.txt" // Written to %APPDIR% after every pass
+
+
+/*
+ * @brief       Starts the scrubber thread.
+ *
+ * @details     Every IntervalSeconds the scrubber walks <AppDirectory>\\users, re-reads each submission that has a
+ *              manifest (from the cold tier if it was migrated) and compares its blocks with the recorded
+ *              checksums. It reads no more than BytesPerSecond, runs at background priority and pauses while
+ *              any store or retrieve command is in flight.
+ *
+ * @return      TRUE if the thread is running; otherwise, FALSE.
+ */
+bool
+ScrubberStart(
+    _In_z_ const char* AppDirectory,
+    _In_ uint64_t BytesPerSecond,
+    _In_ uint32_t IntervalSeconds
+);
+
+
+/*
+ * @brief       Stops the scrubber thread. A pass in progress is abandoned without a report.
+ */
+VOID
+ScrubberStop(
+    VOID
+);
+
+
+/*
+ * @brief       Changes the read budget and the time between passes, and starts a pass right away.
+ */
+VOID
+ScrubberConfigure(
+    _In_ uint64_t BytesPerSecond,
+    _In_ uint32_t IntervalSeconds
+);
+
+
+/*
+ * @brief       Returns the number of completed passes and the counters of the last one.
+ */
+VOID
+ScrubberGetStats(
+    _Out_ SafeStorageScrubStats* Stats
+);
+
+
+/*
+ * @brief       Called around every store and retrieve so the scrubber can stay out of their way.
+ */
+VOID
+ScrubberNoteForegroundStart(
+    VOID
+);
+
+VOID
+ScrubberNoteForegroundEnd(
+    VOID
+);
+
+
+EXTERN_C_END;
+#endif  //_SCRUBBER_H_
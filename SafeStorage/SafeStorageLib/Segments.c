@@ -0,0 +1,1362 @@
+#include "Segments.h"
+#include "Durability.h"
+#include "FileIo.h"
+#include "Manifest.h"
+#include "Transfer.h"
+#include <ctype.h>
+#include <strsafe.h>
+
+
+#define SEGMENT_MAGIC 0x47535353                // "SSSG"
+#define SEGMENT_RECORD_MAGIC 0x52535353         // "SSSR"
+#define SEGMENT_CHECKPOINT_MAGIC 0x4B535353     // "SSSK"
+#define SEGMENT_VERSION 1
+#define SEGMENT_RECORD_TOMBSTONE 0x1            // The object was removed; the record has no data
+#define SEGMENT_KEY_LENGTH (USERNAME_MAX_LENGTH + 1 + MAX_PATH) // "<user>\<submission>" and its terminator
+#define SEGMENT_READER_WAIT_MS 1                // Poll interval while a compacted segment is still being read
+
+
+// Start of every segment file
+typedef struct _SEGMENT_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Id;
+    uint32_t Reserved;
+} SEGMENT_HEADER;
+
+
+// Start of every record, followed by the user name, the submission name, the data and zeros up to
+// SEGMENT_RECORD_ALIGNMENT
+typedef struct _SEGMENT_RECORD_HEADER {
+    uint32_t Magic;
+    uint16_t Flags;
+    uint16_t UserLength;
+    uint32_t NameLength;
+    uint32_t DataLength;
+    uint64_t Sequence;                          // Orders the records of an object; never reused
+    uint64_t LastWriteTime;                     // Of the stored file, FILETIME units
+    BYTE Hash[HASH_LENGTH];                     // SHA-256 of the whole record with this field zeroed
+} SEGMENT_RECORD_HEADER;
+
+
+// An object in the index: where its newest record is
+typedef struct _SEGMENT_ENTRY {
+    struct _SEGMENT_ENTRY* Next;                // Next entry of the same bucket
+    char* Key;                                  // "<user>\<submission>", compared case-insensitively
+    uint64_t Hash;                              // HashKey(Key)
+    uint64_t Sequence;
+    uint64_t Offset;
+    uint64_t LastWriteTime;
+    uint32_t Segment;
+    uint32_t RecordLength;
+    uint32_t DataLength;
+    uint16_t UserLength;
+    bool Removed;                               // Replay only: the newest record seen so far is a tombstone
+} SEGMENT_ENTRY;
+
+
+// An open segment file
+typedef struct _SEGMENT {
+    SS_FILE* File;
+    uint64_t Used;                              // End of the last record
+    uint64_t LiveBytes;                         // Records of the segment the index points to
+    uint64_t FlushedTo;                         // Records before this are durable; guarded by g_SegmentFlushLock
+    volatile LONG Readers;                      // Reads and flushes in progress outside g_SegmentLock
+} SEGMENT;
+
+
+// Start of the checkpoint, followed by the used size of every segment (0 if deleted) and the entries
+typedef struct _SEGMENT_CHECKPOINT_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t SegmentCount;
+    uint32_t ActiveSegment;                     // Replay resumes in this segment, at its used size
+    uint64_t NextSequence;
+    uint64_t EntryCount;
+    BYTE Hash[HASH_LENGTH];                     // SHA-256 of the whole checkpoint with this field zeroed
+} SEGMENT_CHECKPOINT_HEADER;
+
+
+// One entry of the checkpoint, followed by its key without terminator
+typedef struct _SEGMENT_CHECKPOINT_ENTRY {
+    uint64_t Sequence;
+    uint64_t Offset;
+    uint64_t LastWriteTime;
+    uint32_t Segment;
+    uint32_t RecordLength;
+    uint32_t DataLength;
+    uint16_t UserLength;
+    uint16_t KeyLength;
+} SEGMENT_CHECKPOINT_ENTRY;
+
+
+// Segment files found by ListSegmentFile
+typedef struct _SEGMENT_LIST {
+    uint32_t* Ids;
+    DWORD Count;
+    DWORD Capacity;
+    bool Failed;                                // Out of memory
+} SEGMENT_LIST;
+
+
+// A live record to be moved by CompactSegment
+typedef struct _SEGMENT_MOVE {
+    char* Key;
+    uint64_t Offset;
+    uint32_t RecordLength;
+} SEGMENT_MOVE;
+
+
+// Global static variables
+static SRWLOCK g_SegmentLock = SRWLOCK_INIT;    // Guards the index, the segment table and appends
+static SRWLOCK g_SegmentFlushLock = SRWLOCK_INIT; // Serializes segment flushes, so that one covers those queued behind it
+static bool g_SegmentsRunning = false;
+static uint32_t g_SegmentMaxObjectSize = 0;
+static char g_SegmentDirectory[MAX_PATH] = { 0 };
+static SEGMENT** g_Segments = NULL;             // By id; NULL once deleted. A segment keeps its address until it is.
+static uint32_t g_SegmentCount = 0;             // Highest id + 1
+static uint32_t g_SegmentCapacity = 0;
+static uint32_t g_ActiveSegment = 0;            // The one appended to; all others are sealed
+static SEGMENT_ENTRY** g_SegmentBuckets = NULL;
+static uint32_t g_SegmentBucketCount = 0;       // A power of two
+static uint64_t g_SegmentEntryCount = 0;
+static volatile LONG64 g_NextSequence = 1;
+static uint64_t g_CheckpointSequence = 0;       // g_NextSequence when the last checkpoint was taken; 0 forces the next one
+static uint32_t g_CheckpointActive = 0;         // Segments below this one are covered by the last checkpoint
+static SafeStorageSegmentStats g_SegmentCounters = { 0 }; // Compactions, BytesCompacted and Checkpoints
+static HANDLE g_MaintenanceThread = NULL;
+static HANDLE g_MaintenanceStop = NULL;
+
+
+/**
+ * @brief       Case-insensitive FNV-1a hash of an index key.
+ */
+static uint64_t HashKey(_In_z_ const char* key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = key; *c != '\0'; c++) {
+        hash = (hash ^ (BYTE)tolower((BYTE)*c)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * @brief       Builds the index key of a submission.
+ */
+static bool BuildKey(_In_z_ const char* username, _In_z_ const char* submissionName, _Out_writes_z_(SEGMENT_KEY_LENGTH) char* key) {
+    return strlen(username) <= USERNAME_MAX_LENGTH &&
+           SUCCEEDED(StringCchPrintfA(key, SEGMENT_KEY_LENGTH, "%s\\%s", username, submissionName));
+}
+
+
+/**
+ * @brief       Builds the path of a segment file.
+ */
+static bool SegmentPath(_In_ uint32_t id, _Out_writes_z_(MAX_PATH) char* path) {
+    return SUCCEEDED(StringCchPrintfA(path, MAX_PATH, "%s\\%08lu.seg", g_SegmentDirectory, id));
+}
+
+
+/**
+ * @brief       Returns the size of a record, padding included.
+ */
+static uint32_t RecordLength(_In_ uint32_t userLength, _In_ uint32_t nameLength, _In_ uint32_t dataLength) {
+    uint32_t length = (uint32_t)sizeof(SEGMENT_RECORD_HEADER) + userLength + nameLength + dataLength;
+    return (length + SEGMENT_RECORD_ALIGNMENT - 1) & ~(uint32_t)(SEGMENT_RECORD_ALIGNMENT - 1);
+}
+
+
+/**
+ * @brief       Checks that a record header is plausible and that the record fits in Available bytes.
+ */
+static bool IsValidRecordHeader(_In_ const SEGMENT_RECORD_HEADER* header, _In_ uint64_t available) {
+    return header->Magic == SEGMENT_RECORD_MAGIC &&
+           header->UserLength != 0 && header->UserLength <= USERNAME_MAX_LENGTH &&
+           header->NameLength != 0 && header->NameLength < MAX_PATH &&
+           header->DataLength <= SEGMENT_MAX_OBJECT_LIMIT &&
+           ((header->Flags & SEGMENT_RECORD_TOMBSTONE) == 0 || header->DataLength == 0) &&
+           RecordLength(header->UserLength, header->NameLength, header->DataLength) <= available;
+}
+
+
+/**
+ * @brief       Computes the checksum of a record, or checks it.
+ *
+ * @return      TRUE if the checksum was computed, or matches.
+ */
+static bool HashRecord(_Inout_updates_bytes_(length) BYTE* record, _In_ uint32_t length, _In_ bool verify) {
+    SEGMENT_RECORD_HEADER* header = (SEGMENT_RECORD_HEADER*)record;
+    BYTE expected[HASH_LENGTH];
+    BYTE actual[HASH_LENGTH];
+
+    memcpy(expected, header->Hash, HASH_LENGTH);
+    memset(header->Hash, 0, HASH_LENGTH);
+    bool result = ManifestHashBlock(record, length, actual);
+    memcpy(header->Hash, verify ? expected : actual, HASH_LENGTH);
+
+    return result && (!verify || memcmp(expected, actual, HASH_LENGTH) == 0);
+}
+
+
+/**
+ * @brief       Allocates a record with its header and names filled in. The data follows the names and is zeroed.
+ *
+ * @return      The record, or NULL if out of memory.
+ */
+static BYTE* AllocateRecord(_In_z_ const char* username, _In_z_ const char* submissionName, _In_ uint16_t flags, _In_ uint32_t dataLength, _In_ uint64_t lastWriteTime, _Out_ uint32_t* length) {
+    uint32_t userLength = (uint32_t)strlen(username);
+    uint32_t nameLength = (uint32_t)strlen(submissionName);
+    *length = RecordLength(userLength, nameLength, dataLength);
+
+    BYTE* record = (BYTE*)calloc(1, *length);
+    if (record == NULL) {
+        return NULL;
+    }
+
+    SEGMENT_RECORD_HEADER* header = (SEGMENT_RECORD_HEADER*)record;
+    header->Magic = SEGMENT_RECORD_MAGIC;
+    header->Flags = flags;
+    header->UserLength = (uint16_t)userLength;
+    header->NameLength = nameLength;
+    header->DataLength = dataLength;
+    header->LastWriteTime = lastWriteTime;
+    memcpy(record + sizeof(*header), username, userLength);
+    memcpy(record + sizeof(*header) + userLength, submissionName, nameLength);
+    return record;
+}
+
+
+/**
+ * @brief       Finds the entry of a key. Must be called with g_SegmentLock held.
+ */
+static SEGMENT_ENTRY* FindEntryLocked(_In_z_ const char* key, _In_ uint64_t hash) {
+    if (g_SegmentBucketCount == 0) {
+        return NULL;
+    }
+
+    for (SEGMENT_ENTRY* entry = g_SegmentBuckets[hash & (g_SegmentBucketCount - 1)]; entry != NULL; entry = entry->Next) {
+        if (entry->Hash == hash && _stricmp(entry->Key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief       Doubles the buckets once the index holds twice as many entries. If that fails, the chains just
+ *              get longer. Must be called with g_SegmentLock held exclusively.
+ */
+static void GrowIndexLocked(void) {
+    if (g_SegmentEntryCount < 2ULL * g_SegmentBucketCount || g_SegmentBucketCount >= 0x80000000) {
+        return;
+    }
+
+    uint32_t bucketCount = g_SegmentBucketCount * 2;
+    SEGMENT_ENTRY** buckets = (SEGMENT_ENTRY**)calloc(bucketCount, sizeof(*buckets));
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        SEGMENT_ENTRY* entry = g_SegmentBuckets[i];
+        while (entry != NULL) {
+            SEGMENT_ENTRY* next = entry->Next;
+            entry->Next = buckets[entry->Hash & (bucketCount - 1)];
+            buckets[entry->Hash & (bucketCount - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(g_SegmentBuckets);
+    g_SegmentBuckets = buckets;
+    g_SegmentBucketCount = bucketCount;
+}
+
+
+/**
+ * @brief       Adds an empty entry for a key. Must be called with g_SegmentLock held exclusively.
+ *
+ * @return      The entry, or NULL if out of memory.
+ */
+static SEGMENT_ENTRY* InsertEntryLocked(_In_z_ const char* key, _In_ uint64_t hash, _In_ uint16_t userLength) {
+    SEGMENT_ENTRY* entry = (SEGMENT_ENTRY*)calloc(1, sizeof(*entry));
+    char* keyCopy = _strdup(key);
+    if (entry == NULL || keyCopy == NULL) {
+        free(entry);
+        free(keyCopy);
+        return NULL;
+    }
+
+    GrowIndexLocked();
+
+    entry->Key = keyCopy;
+    entry->Hash = hash;
+    entry->UserLength = userLength;
+    entry->Next = g_SegmentBuckets[hash & (g_SegmentBucketCount - 1)];
+    g_SegmentBuckets[hash & (g_SegmentBucketCount - 1)] = entry;
+    g_SegmentEntryCount++;
+    return entry;
+}
+
+
+/**
+ * @brief       Unlinks and frees an entry. Must be called with g_SegmentLock held exclusively.
+ */
+static void RemoveEntryLocked(_In_ SEGMENT_ENTRY* entry) {
+    SEGMENT_ENTRY** link = &g_SegmentBuckets[entry->Hash & (g_SegmentBucketCount - 1)];
+    while (*link != entry) {
+        link = &(*link)->Next;
+    }
+    *link = entry->Next;
+
+    g_SegmentEntryCount--;
+    free(entry->Key);
+    free(entry);
+}
+
+
+/**
+ * @brief       Makes an index key out of the names in a record.
+ */
+static bool RecordKey(_In_ const BYTE* record, _Out_writes_z_(SEGMENT_KEY_LENGTH) char* key) {
+    const SEGMENT_RECORD_HEADER* header = (const SEGMENT_RECORD_HEADER*)record;
+    const char* username = (const char*)record + sizeof(*header);
+
+    return SUCCEEDED(StringCchPrintfA(key, SEGMENT_KEY_LENGTH, "%.*s\\%.*s",
+                                      (int)header->UserLength, username, (int)header->NameLength, username + header->UserLength));
+}
+
+
+/**
+ * @brief       Points the index at a record if it is newer than what the index knows of its object.
+ *              A tombstone removes the object; while replaying, it is kept as a removed entry instead, so
+ *              that older records replayed later do not bring the object back. Must be called with
+ *              g_SegmentLock held exclusively.
+ *
+ * @return      FALSE if out of memory.
+ */
+static bool ApplyRecordLocked(_In_ const SEGMENT_RECORD_HEADER* header, _In_z_ const char* key, _In_ uint32_t segmentId, _In_ uint64_t offset, _In_ bool replaying) {
+    uint64_t hash = HashKey(key);
+    bool removed = (header->Flags & SEGMENT_RECORD_TOMBSTONE) != 0;
+
+    SEGMENT_ENTRY* entry = FindEntryLocked(key, hash);
+    if (entry != NULL && entry->Sequence >= header->Sequence) {
+        return true;                            // A newer record of the object is known; this one is dead
+    }
+
+    if (entry == NULL) {
+        if (removed && !replaying) {
+            return true;
+        }
+        entry = InsertEntryLocked(key, hash, header->UserLength);
+        if (entry == NULL) {
+            return false;
+        }
+    }
+    else if (!entry->Removed) {
+        g_Segments[entry->Segment]->LiveBytes -= entry->RecordLength;
+    }
+
+    if (removed && !replaying) {
+        RemoveEntryLocked(entry);
+        return true;
+    }
+
+    entry->Sequence = header->Sequence;
+    entry->Segment = segmentId;
+    entry->Offset = offset;
+    entry->RecordLength = RecordLength(header->UserLength, header->NameLength, header->DataLength);
+    entry->DataLength = header->DataLength;
+    entry->LastWriteTime = header->LastWriteTime;
+    entry->Removed = removed;
+    if (!removed) {
+        g_Segments[segmentId]->LiveBytes += entry->RecordLength;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Opens a segment file, or creates and preallocates it, and puts it in the table.
+ *              Must be called with g_SegmentLock held exclusively.
+ *
+ * @return      The segment, or NULL on failure.
+ */
+static SEGMENT* OpenSegmentLocked(_In_ uint32_t id, _In_ bool create) {
+    char path[MAX_PATH];
+    if (!SegmentPath(id, path)) {
+        return NULL;
+    }
+
+    if (id >= g_SegmentCapacity) {
+        uint32_t capacity = max(max(id + 1, 2 * g_SegmentCapacity), 16U);
+        SEGMENT** segments = (SEGMENT**)realloc(g_Segments, capacity * sizeof(*segments));
+        if (segments == NULL) {
+            return NULL;
+        }
+        memset(segments + g_SegmentCapacity, 0, (capacity - g_SegmentCapacity) * sizeof(*segments));
+        g_Segments = segments;
+        g_SegmentCapacity = capacity;
+    }
+
+    SEGMENT* segment = (SEGMENT*)calloc(1, sizeof(*segment));
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    SEGMENT_HEADER header = { 0 };
+    DWORD bytesRead = 0;
+    segment->File = IoOpenFile(path, create ? IO_OPEN_CREATE : IO_OPEN_WRITE);
+    bool result = segment->File != NULL;
+
+    if (result && create) {
+        header.Magic = SEGMENT_MAGIC;
+        header.Version = SEGMENT_VERSION;
+        header.Id = id;
+        result = IoPreallocate(segment->File, SEGMENT_SIZE) && IoWriteAt(segment->File, 0, &header, sizeof(header));
+    }
+    else if (result) {
+        result = IoReadAt(segment->File, 0, &header, sizeof(header), &bytesRead) && bytesRead == sizeof(header) &&
+                 header.Magic == SEGMENT_MAGIC && header.Version == SEGMENT_VERSION && header.Id == id;
+    }
+
+    if (!result) {
+        if (create) {
+            printf("Failed to create segment %lu: %lu\n", id, GetLastError());
+        }
+        IoCloseFile(segment->File);
+        free(segment);
+        if (create) {
+            IoDeleteFile(path);
+        }
+        return NULL;
+    }
+
+    segment->Used = sizeof(header);
+    g_Segments[id] = segment;
+    g_SegmentCount = max(g_SegmentCount, id + 1);
+    return segment;
+}
+
+
+/**
+ * @brief       Appends a record to the active segment, sealing it and creating the next one if the record does
+ *              not fit. A sealed segment is flushed so that the checkpoints after it can rely on its records.
+ *              Must be called with g_SegmentLock held exclusively.
+ */
+static bool AppendLocked(_In_reads_bytes_(length) const BYTE* record, _In_ uint32_t length, _Out_ uint32_t* segmentId, _Out_ uint64_t* offset) {
+    SEGMENT* segment = g_Segments[g_ActiveSegment];
+
+    if (segment->Used + length > SEGMENT_SIZE) {
+        IoFlushFile(segment->File);
+        segment = OpenSegmentLocked(g_SegmentCount, true);
+        if (segment == NULL) {
+            return false;
+        }
+        g_ActiveSegment = g_SegmentCount - 1;
+    }
+
+    if (!IoWriteAt(segment->File, segment->Used, record, length)) {
+        return false;
+    }
+
+    *segmentId = g_ActiveSegment;
+    *offset = segment->Used;
+    segment->Used += length;
+    return true;
+}
+
+
+/**
+ * @brief       Makes the records of a segment up to End durable according to the durability mode. A flush
+ *              covers every record appended before it started, so stores that wait for one in progress
+ *              usually find their record already flushed.
+ */
+static bool CommitSegment(_In_ SEGMENT* segment, _In_ uint64_t end) {
+    if (DurabilityGetMode() == SS_DURABILITY_NONE) {
+        return true;
+    }
+
+    bool result = true;
+    AcquireSRWLockExclusive(&g_SegmentFlushLock);
+    if (segment->FlushedTo < end) {
+        AcquireSRWLockShared(&g_SegmentLock);
+        uint64_t used = segment->Used;
+        ReleaseSRWLockShared(&g_SegmentLock);
+
+        result = IoFlushFile(segment->File);
+        if (result) {
+            segment->FlushedTo = used;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_SegmentFlushLock);
+    return result;
+}
+
+
+/**
+ * @brief       Numbers a record, computes its checksum, appends it and updates the index.
+ *
+ * @return      STATUS_SUCCESS, STATUS_NO_MEMORY or STATUS_UNSUCCESSFUL.
+ */
+static NTSTATUS AppendRecord(_Inout_updates_bytes_(length) BYTE* record, _In_ uint32_t length, _In_z_ const char* key) {
+    SEGMENT_RECORD_HEADER* header = (SEGMENT_RECORD_HEADER*)record;
+
+    // Sequence numbers are handed out before the lock, so records may be appended out of order;
+    // the index only ever moves to a higher sequence number
+    header->Sequence = (uint64_t)InterlockedIncrement64(&g_NextSequence) - 1;
+    if (!HashRecord(record, length, false)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+    SEGMENT* segment = NULL;
+    uint32_t segmentId = 0;
+    uint64_t offset = 0;
+
+    AcquireSRWLockExclusive(&g_SegmentLock);
+    if (g_SegmentsRunning && AppendLocked(record, length, &segmentId, &offset)) {
+        status = ApplyRecordLocked(header, key, segmentId, offset, false) ? STATUS_SUCCESS : STATUS_NO_MEMORY;
+        segment = g_Segments[segmentId];
+        InterlockedIncrement(&segment->Readers);
+    }
+    ReleaseSRWLockExclusive(&g_SegmentLock);
+
+    if (segment != NULL) {
+        if (NT_SUCCESS(status) && !CommitSegment(segment, offset + length)) {
+            status = STATUS_UNSUCCESSFUL;
+        }
+        InterlockedDecrement(&segment->Readers);
+    }
+    return status;
+}
+
+
+/**
+ * @brief       Applies the records of a segment from Offset on, up to the first one that is incomplete or fails
+ *              its checksum, which becomes the end of the segment. Must be called with g_SegmentLock held
+ *              exclusively.
+ */
+static void ReplaySegmentLocked(_In_ uint32_t id, _In_ uint64_t offset) {
+    SEGMENT* segment = g_Segments[id];
+    uint64_t highestSequence = 0;
+    char key[SEGMENT_KEY_LENGTH];
+
+    for (;;) {
+        SEGMENT_RECORD_HEADER header;
+        DWORD bytesRead = 0;
+        if (offset + sizeof(header) > SEGMENT_SIZE ||
+            !IoReadAt(segment->File, offset, &header, sizeof(header), &bytesRead) || bytesRead != sizeof(header) ||
+            !IsValidRecordHeader(&header, SEGMENT_SIZE - offset)) {
+            break;
+        }
+
+        uint32_t length = RecordLength(header.UserLength, header.NameLength, header.DataLength);
+        BYTE* record = (BYTE*)malloc(length);
+        bool valid = record != NULL &&
+                     IoReadAt(segment->File, offset, record, length, &bytesRead) && bytesRead == length &&
+                     HashRecord(record, length, true) && RecordKey(record, key) &&
+                     ApplyRecordLocked(&header, key, id, offset, true);
+        free(record);
+        if (!valid) {
+            break;
+        }
+
+        highestSequence = max(highestSequence, header.Sequence);
+        offset += length;
+    }
+
+    segment->Used = offset;
+    if (highestSequence >= (uint64_t)g_NextSequence) {
+        g_NextSequence = (LONG64)(highestSequence + 1);
+    }
+}
+
+
+/**
+ * @brief       Frees the index and closes every segment. Must be called with g_SegmentLock held exclusively.
+ */
+static void CloseSegmentsLocked(void) {
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        while (g_SegmentBuckets[i] != NULL) {
+            SEGMENT_ENTRY* entry = g_SegmentBuckets[i];
+            g_SegmentBuckets[i] = entry->Next;
+            free(entry->Key);
+            free(entry);
+        }
+    }
+    free(g_SegmentBuckets);
+    g_SegmentBuckets = NULL;
+    g_SegmentBucketCount = 0;
+    g_SegmentEntryCount = 0;
+
+    for (uint32_t i = 0; i < g_SegmentCount; i++) {
+        if (g_Segments[i] != NULL) {
+            IoCloseFile(g_Segments[i]->File);
+            free(g_Segments[i]);
+        }
+    }
+    free(g_Segments);
+    g_Segments = NULL;
+    g_SegmentCount = 0;
+    g_SegmentCapacity = 0;
+    g_ActiveSegment = 0;
+    g_NextSequence = 1;
+    g_CheckpointSequence = 0;
+    g_CheckpointActive = 0;
+}
+
+
+/**
+ * @brief       Loads the checkpoint: opens the segments it lists and fills the index. Must be called with
+ *              g_SegmentLock held exclusively.
+ *
+ * @return      TRUE if a valid checkpoint was loaded; otherwise, FALSE and nothing is loaded.
+ */
+static bool LoadCheckpointLocked(_Out_ uint64_t* activeUsed) {
+    char path[MAX_PATH];
+    char* contents = NULL;
+    size_t length = 0;
+    *activeUsed = 0;
+
+    if (FAILED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", g_SegmentDirectory, SEGMENT_CHECKPOINT_FILE_NAME)) ||
+        !IoReadFileContents(path, &contents, &length)) {
+        return false;
+    }
+
+    SEGMENT_CHECKPOINT_HEADER header = { 0 };
+    BYTE hash[HASH_LENGTH];
+    bool result = length >= sizeof(header) && length <= MAXDWORD;
+    if (result) {
+        memcpy(&header, contents, sizeof(header));
+        memset(((SEGMENT_CHECKPOINT_HEADER*)contents)->Hash, 0, HASH_LENGTH);
+        result = header.Magic == SEGMENT_CHECKPOINT_MAGIC && header.Version == SEGMENT_VERSION &&
+                 header.ActiveSegment < header.SegmentCount &&
+                 (length - sizeof(header)) / sizeof(uint64_t) >= header.SegmentCount &&
+                 ManifestHashBlock(contents, (DWORD)length, hash) && memcmp(hash, header.Hash, HASH_LENGTH) == 0;
+    }
+
+    // The segments, as far as they were written when the checkpoint was taken. One missing on disk was
+    // compacted after the checkpoint and no entry points to it anymore.
+    size_t position = sizeof(header);
+    for (uint32_t id = 0; result && id < header.SegmentCount; id++) {
+        uint64_t used = 0;
+        memcpy(&used, contents + position, sizeof(used));
+        position += sizeof(used);
+
+        SEGMENT* segment = (used != 0) ? OpenSegmentLocked(id, false) : NULL;
+        if (segment != NULL) {
+            segment->Used = used;
+            segment->FlushedTo = used;
+        }
+        if (id == header.ActiveSegment) {
+            *activeUsed = used;
+        }
+    }
+
+    char key[SEGMENT_KEY_LENGTH];
+    for (uint64_t i = 0; result && i < header.EntryCount; i++) {
+        SEGMENT_CHECKPOINT_ENTRY record;
+        result = length - position >= sizeof(record);
+        if (result) {
+            memcpy(&record, contents + position, sizeof(record));
+            position += sizeof(record);
+            result = record.KeyLength < SEGMENT_KEY_LENGTH && length - position >= record.KeyLength;
+        }
+        if (!result) {
+            break;
+        }
+
+        memcpy(key, contents + position, record.KeyLength);
+        key[record.KeyLength] = '\0';
+        position += record.KeyLength;
+
+        if (record.Segment >= g_SegmentCount || g_Segments[record.Segment] == NULL) {
+            continue;
+        }
+
+        uint64_t hash = HashKey(key);
+        SEGMENT_ENTRY* entry = InsertEntryLocked(key, hash, record.UserLength);
+        result = entry != NULL;
+        if (result) {
+            entry->Sequence = record.Sequence;
+            entry->Segment = record.Segment;
+            entry->Offset = record.Offset;
+            entry->RecordLength = record.RecordLength;
+            entry->DataLength = record.DataLength;
+            entry->LastWriteTime = record.LastWriteTime;
+            g_Segments[record.Segment]->LiveBytes += record.RecordLength;
+        }
+    }
+
+    free(contents);
+    if (!result) {
+        printf("Ignoring the invalid segment checkpoint; replaying every segment.\n");
+        CloseSegmentsLocked();
+        g_SegmentBuckets = (SEGMENT_ENTRY**)calloc(SEGMENT_INDEX_INITIAL_BUCKETS, sizeof(*g_SegmentBuckets));
+        g_SegmentBucketCount = (g_SegmentBuckets != NULL) ? SEGMENT_INDEX_INITIAL_BUCKETS : 0;
+        return false;
+    }
+
+    g_NextSequence = (LONG64)header.NextSequence;
+    g_CheckpointSequence = header.NextSequence;
+    g_CheckpointActive = header.ActiveSegment;
+    g_ActiveSegment = header.ActiveSegment;
+    return true;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of LoadSegmentsLocked. Collects the ids of the segment files.
+ */
+static IoEnumerateAction ListSegmentFile(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    SEGMENT_LIST* list = (SEGMENT_LIST*)context;
+    UNREFERENCED_PARAMETER(path);
+
+    char* end = NULL;
+    unsigned long id = strtoul(name, &end, 10);
+    if (info->IsDirectory || end == name || _stricmp(end, ".seg") != 0 || id > MAXDWORD - 1) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    if (list->Count == list->Capacity) {
+        DWORD capacity = max(2 * list->Capacity, 16U);
+        uint32_t* ids = (uint32_t*)realloc(list->Ids, capacity * sizeof(*ids));
+        if (ids == NULL) {
+            list->Failed = true;
+            return IO_ENUMERATE_STOP;
+        }
+        list->Ids = ids;
+        list->Capacity = capacity;
+    }
+    list->Ids[list->Count++] = (uint32_t)id;
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Rebuilds the index from the checkpoint and the records appended after it, and picks the segment
+ *              to append to. Must be called with g_SegmentLock held exclusively.
+ */
+static bool LoadSegmentsLocked(void) {
+    g_SegmentBuckets = (SEGMENT_ENTRY**)calloc(SEGMENT_INDEX_INITIAL_BUCKETS, sizeof(*g_SegmentBuckets));
+    if (g_SegmentBuckets == NULL) {
+        return false;
+    }
+    g_SegmentBucketCount = SEGMENT_INDEX_INITIAL_BUCKETS;
+
+    uint64_t activeUsed = 0;
+    bool checkpointed = LoadCheckpointLocked(&activeUsed);
+    if (g_SegmentBuckets == NULL) {
+        return false;
+    }
+
+    SEGMENT_LIST list = { 0 };
+    IoEnumerateFiles(g_SegmentDirectory, false, ListSegmentFile, &list);
+    if (list.Failed) {
+        free(list.Ids);
+        return false;
+    }
+
+    // Segments the checkpoint covers are already in the index. One it covers but does not list was compacted
+    // and only survived because the engine stopped before deleting it. The checkpoint's active segment is
+    // replayed from where the checkpoint left it, newer segments from their start.
+    for (DWORD i = 0; i < list.Count; i++) {
+        uint32_t id = list.Ids[i];
+        char path[MAX_PATH];
+
+        if (checkpointed && id < g_CheckpointActive) {
+            if (g_Segments[id] == NULL && SegmentPath(id, path)) {
+                IoDeleteFile(path);
+            }
+            continue;
+        }
+
+        if (checkpointed && id == g_CheckpointActive && g_Segments[id] != NULL) {
+            ReplaySegmentLocked(id, activeUsed);
+        }
+        else if (id >= g_SegmentCount || g_Segments[id] == NULL) {
+            if (OpenSegmentLocked(id, false) != NULL) {
+                ReplaySegmentLocked(id, sizeof(SEGMENT_HEADER));
+            }
+        }
+    }
+    free(list.Ids);
+
+    // Tombstones have done their job once every record is replayed
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        SEGMENT_ENTRY* entry = g_SegmentBuckets[i];
+        while (entry != NULL) {
+            SEGMENT_ENTRY* next = entry->Next;
+            if (entry->Removed) {
+                RemoveEntryLocked(entry);
+            }
+            entry = next;
+        }
+    }
+
+    // Appends continue in the newest segment
+    g_ActiveSegment = 0;
+    for (uint32_t id = g_SegmentCount; id > 0; id--) {
+        if (g_Segments[id - 1] != NULL) {
+            g_ActiveSegment = id - 1;
+            break;
+        }
+    }
+    if (g_SegmentCount == 0 || g_Segments[g_ActiveSegment] == NULL) {
+        if (OpenSegmentLocked(g_SegmentCount, true) == NULL) {
+            return false;
+        }
+        g_ActiveSegment = g_SegmentCount - 1;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Writes the index and the segment table to SEGMENT_CHECKPOINT_FILE_NAME. The active segment is
+ *              flushed first, so the checkpoint never covers records that are not on disk, and the checkpoint is
+ *              always flushed, whatever the durability mode, because compaction deletes segments once it is.
+ */
+static bool WriteCheckpoint(void) {
+    char path[MAX_PATH];
+    char partialPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", g_SegmentDirectory, SEGMENT_CHECKPOINT_FILE_NAME)) ||
+        FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", path, TRANSFER_PARTIAL_SUFFIX))) {
+        return false;
+    }
+
+    AcquireSRWLockShared(&g_SegmentLock);
+
+    size_t length = sizeof(SEGMENT_CHECKPOINT_HEADER) + (size_t)g_SegmentCount * sizeof(uint64_t);
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        for (SEGMENT_ENTRY* entry = g_SegmentBuckets[i]; entry != NULL; entry = entry->Next) {
+            length += sizeof(SEGMENT_CHECKPOINT_ENTRY) + strlen(entry->Key);
+        }
+    }
+
+    BYTE* buffer = (length <= MAXDWORD) ? (BYTE*)malloc(length) : NULL;
+    if (buffer == NULL) {
+        ReleaseSRWLockShared(&g_SegmentLock);
+        return false;
+    }
+
+    SEGMENT_CHECKPOINT_HEADER header = { 0 };
+    header.Magic = SEGMENT_CHECKPOINT_MAGIC;
+    header.Version = SEGMENT_VERSION;
+    header.SegmentCount = g_SegmentCount;
+    header.ActiveSegment = g_ActiveSegment;
+    header.NextSequence = (uint64_t)g_NextSequence;
+    header.EntryCount = g_SegmentEntryCount;
+
+    size_t position = sizeof(header);
+    for (uint32_t id = 0; id < g_SegmentCount; id++) {
+        uint64_t used = (g_Segments[id] != NULL) ? g_Segments[id]->Used : 0;
+        memcpy(buffer + position, &used, sizeof(used));
+        position += sizeof(used);
+    }
+
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        for (SEGMENT_ENTRY* entry = g_SegmentBuckets[i]; entry != NULL; entry = entry->Next) {
+            SEGMENT_CHECKPOINT_ENTRY record = { 0 };
+            record.Sequence = entry->Sequence;
+            record.Offset = entry->Offset;
+            record.LastWriteTime = entry->LastWriteTime;
+            record.Segment = entry->Segment;
+            record.RecordLength = entry->RecordLength;
+            record.DataLength = entry->DataLength;
+            record.UserLength = entry->UserLength;
+            record.KeyLength = (uint16_t)strlen(entry->Key);
+            memcpy(buffer + position, &record, sizeof(record));
+            memcpy(buffer + position + sizeof(record), entry->Key, record.KeyLength);
+            position += sizeof(record) + record.KeyLength;
+        }
+    }
+
+    // Compaction, the only other thread that deletes segments, is the caller or stopped
+    SEGMENT* active = g_Segments[g_ActiveSegment];
+    ReleaseSRWLockShared(&g_SegmentLock);
+
+    memcpy(buffer, &header, sizeof(header));
+    bool result = ManifestHashBlock(buffer, (DWORD)length, ((SEGMENT_CHECKPOINT_HEADER*)buffer)->Hash) &&
+                  IoFlushFile(active->File) &&
+                  IoWriteFileContents(partialPath, buffer, length) && IoFlushPath(partialPath) &&
+                  IoReplaceFile(partialPath, path);
+    free(buffer);
+
+    if (!result) {
+        printf("Failed to write the segment checkpoint: %lu\n", GetLastError());
+        IoDeleteFile(partialPath);
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_SegmentLock);
+    g_CheckpointSequence = header.NextSequence;
+    g_CheckpointActive = header.ActiveSegment;
+    g_SegmentCounters.Checkpoints++;
+    ReleaseSRWLockExclusive(&g_SegmentLock);
+    return true;
+}
+
+
+/**
+ * @brief       Picks the sealed segment covered by the last checkpoint with the most dead bytes, if at least
+ *              SEGMENT_COMPACT_DEAD_PERCENT of it is dead.
+ */
+static bool PickSegmentToCompact(_Out_ uint32_t* segmentId) {
+    uint64_t mostDead = 0;
+    bool found = false;
+
+    AcquireSRWLockShared(&g_SegmentLock);
+    for (uint32_t id = 0; id < g_CheckpointActive && id < g_SegmentCount; id++) {
+        SEGMENT* segment = g_Segments[id];
+        if (segment == NULL || id == g_ActiveSegment) {
+            continue;
+        }
+
+        uint64_t records = segment->Used - sizeof(SEGMENT_HEADER);
+        uint64_t dead = records - segment->LiveBytes;
+        if (dead * 100 >= records * SEGMENT_COMPACT_DEAD_PERCENT && dead >= mostDead) {
+            mostDead = dead;
+            *segmentId = id;
+            found = true;
+        }
+    }
+    ReleaseSRWLockShared(&g_SegmentLock);
+    return found;
+}
+
+
+/**
+ * @brief       Moves the live records of a sealed segment to the active one and deletes it.
+ *
+ * @details     The records are copied byte for byte, sequence number and checksum included, so a copy and its
+ *              original are the same record to a replay. An object stored again while its record is being
+ *              moved keeps the newer record. The segment is deleted only after a checkpoint covers the copies,
+ *              and only once no read is using it.
+ */
+static void CompactSegment(_In_ uint32_t segmentId) {
+    SEGMENT_MOVE* moves = NULL;
+    uint64_t moveCount = 0;
+    bool result = true;
+
+    // Collect the live records in one pass over the index
+    AcquireSRWLockShared(&g_SegmentLock);
+    SEGMENT* segment = g_Segments[segmentId];
+    uint64_t liveCount = 0;
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        for (SEGMENT_ENTRY* entry = g_SegmentBuckets[i]; entry != NULL; entry = entry->Next) {
+            liveCount += (entry->Segment == segmentId) ? 1 : 0;
+        }
+    }
+    if (liveCount != 0) {
+        moves = (SEGMENT_MOVE*)calloc((size_t)liveCount, sizeof(*moves));
+        result = moves != NULL;
+    }
+    for (uint32_t i = 0; result && i < g_SegmentBucketCount; i++) {
+        for (SEGMENT_ENTRY* entry = g_SegmentBuckets[i]; result && entry != NULL; entry = entry->Next) {
+            if (entry->Segment == segmentId) {
+                moves[moveCount].Key = _strdup(entry->Key);
+                moves[moveCount].Offset = entry->Offset;
+                moves[moveCount].RecordLength = entry->RecordLength;
+                result = moves[moveCount++].Key != NULL;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_SegmentLock);
+
+    for (uint64_t i = 0; result && i < moveCount; i++) {
+        if (WaitForSingleObject(g_MaintenanceStop, 0) == WAIT_OBJECT_0) {
+            result = false;
+            break;
+        }
+
+        // The record is read and checked outside the lock; no other thread deletes this segment
+        BYTE* record = (BYTE*)malloc(moves[i].RecordLength);
+        DWORD bytesRead = 0;
+        result = record != NULL &&
+                 IoReadAt(segment->File, moves[i].Offset, record, moves[i].RecordLength, &bytesRead) &&
+                 bytesRead == moves[i].RecordLength && HashRecord(record, moves[i].RecordLength, true);
+        if (!result && record != NULL) {
+            printf("Segment %lu has a corrupt record of %s; not compacting it.\n", segmentId, moves[i].Key);
+        }
+
+        AcquireSRWLockExclusive(&g_SegmentLock);
+        SEGMENT_ENTRY* entry = result ? FindEntryLocked(moves[i].Key, HashKey(moves[i].Key)) : NULL;
+        uint32_t newSegmentId = 0;
+        uint64_t newOffset = 0;
+        if (entry != NULL && entry->Segment == segmentId && entry->Offset == moves[i].Offset) {
+            result = AppendLocked(record, moves[i].RecordLength, &newSegmentId, &newOffset);
+            if (result) {
+                segment->LiveBytes -= entry->RecordLength;
+                g_Segments[newSegmentId]->LiveBytes += entry->RecordLength;
+                entry->Segment = newSegmentId;
+                entry->Offset = newOffset;
+                g_SegmentCounters.BytesCompacted += entry->RecordLength;
+            }
+        }
+        ReleaseSRWLockExclusive(&g_SegmentLock);
+        free(record);
+    }
+
+    for (uint64_t i = 0; i < moveCount; i++) {
+        free(moves[i].Key);
+    }
+    free(moves);
+
+    if (!result || !WriteCheckpoint()) {
+        return;
+    }
+
+    // Detach the segment; reads that found it before may still be running
+    AcquireSRWLockExclusive(&g_SegmentLock);
+    result = segment->LiveBytes == 0;
+    if (result) {
+        g_Segments[segmentId] = NULL;
+        g_SegmentCounters.Compactions++;
+        g_CheckpointSequence = 0;               // The next checkpoint no longer lists the segment
+    }
+    ReleaseSRWLockExclusive(&g_SegmentLock);
+    if (!result) {
+        return;
+    }
+
+    while (segment->Readers != 0) {
+        Sleep(SEGMENT_READER_WAIT_MS);
+    }
+
+    char path[MAX_PATH];
+    IoCloseFile(segment->File);
+    free(segment);
+    if (SegmentPath(segmentId, path)) {
+        IoDeleteFile(path);
+    }
+}
+
+
+/**
+ * @brief       Thread routine that checkpoints the index when it changed and compacts one segment per interval,
+ *              at background priority, until the stop event is signaled.
+ */
+static DWORD WINAPI MaintenanceThreadProc(_In_ LPVOID parameter) {
+    UNREFERENCED_PARAMETER(parameter);
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    while (WaitForSingleObject(g_MaintenanceStop, SEGMENT_MAINTENANCE_INTERVAL_MS) == WAIT_TIMEOUT) {
+        AcquireSRWLockShared(&g_SegmentLock);
+        bool changed = (uint64_t)g_NextSequence != g_CheckpointSequence;
+        ReleaseSRWLockShared(&g_SegmentLock);
+
+        uint32_t segmentId = 0;
+        if ((!changed || WriteCheckpoint()) && PickSegmentToCompact(&segmentId)) {
+            CompactSegment(segmentId);
+        }
+    }
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return 0;
+}
+
+
+bool
+SegmentsStart(
+    _In_z_ const char* AppDirectory,
+    _In_ uint32_t MaxObjectSize
+)
+{
+    if (MaxObjectSize == 0 || MaxObjectSize > SEGMENT_MAX_OBJECT_LIMIT) {
+        return false;
+    }
+
+    // A running engine only changes its size limit
+    AcquireSRWLockExclusive(&g_SegmentLock);
+    bool running = g_SegmentsRunning;
+    if (running) {
+        g_SegmentMaxObjectSize = MaxObjectSize;
+    }
+    ReleaseSRWLockExclusive(&g_SegmentLock);
+    if (running) {
+        return true;
+    }
+
+    if (FAILED(StringCchPrintfA(g_SegmentDirectory, MAX_PATH, "%s\\%s", AppDirectory, SEGMENT_DIRECTORY_NAME)) ||
+        !IoCreateDirectories(g_SegmentDirectory)) {
+        printf("Failed to create the segment directory: %lu\n", GetLastError());
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_SegmentLock);
+    bool loaded = LoadSegmentsLocked();
+    if (loaded) {
+        g_SegmentMaxObjectSize = MaxObjectSize;
+        g_SegmentsRunning = true;
+    }
+    else {
+        printf("Failed to load the segments.\n");
+        CloseSegmentsLocked();
+    }
+    ReleaseSRWLockExclusive(&g_SegmentLock);
+    if (!loaded) {
+        return false;
+    }
+
+    g_MaintenanceStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (g_MaintenanceStop == NULL) {
+        SegmentsStop();
+        return false;
+    }
+
+    g_MaintenanceThread = CreateThread(NULL, 0, MaintenanceThreadProc, NULL, 0, NULL);
+    if (g_MaintenanceThread == NULL) {
+        printf("Failed to start the segment maintenance: %lu\n", GetLastError());
+        SegmentsStop();
+        return false;
+    }
+    return true;
+}
+
+
+VOID
+SegmentsStop(
+    VOID
+)
+{
+    if (g_MaintenanceThread != NULL) {
+        SetEvent(g_MaintenanceStop);
+        WaitForSingleObject(g_MaintenanceThread, INFINITE);
+        CloseHandle(g_MaintenanceThread);
+        g_MaintenanceThread = NULL;
+    }
+
+    if (g_MaintenanceStop != NULL) {
+        CloseHandle(g_MaintenanceStop);
+        g_MaintenanceStop = NULL;
+    }
+
+    AcquireSRWLockShared(&g_SegmentLock);
+    bool running = g_SegmentsRunning;
+    ReleaseSRWLockShared(&g_SegmentLock);
+    if (running) {
+        WriteCheckpoint();
+    }
+
+    AcquireSRWLockExclusive(&g_SegmentLock);
+    g_SegmentsRunning = false;
+    g_SegmentMaxObjectSize = 0;
+    CloseSegmentsLocked();
+    memset(&g_SegmentCounters, 0, sizeof(g_SegmentCounters));
+    ReleaseSRWLockExclusive(&g_SegmentLock);
+}
+
+
+uint32_t
+SegmentsMaxObjectSize(
+    VOID
+)
+{
+    AcquireSRWLockShared(&g_SegmentLock);
+    uint32_t maxObjectSize = g_SegmentMaxObjectSize;
+    ReleaseSRWLockShared(&g_SegmentLock);
+    return maxObjectSize;
+}
+
+
+NTSTATUS
+SegmentsStoreFile(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName,
+    _In_z_ const char* SourcePath
+)
+{
+    char key[SEGMENT_KEY_LENGTH];
+    if (!BuildKey(Username, SubmissionName, key)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    SS_FILE* source = IoOpenFile(SourcePath, IO_OPEN_READ);
+    if (source == NULL) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    uint64_t size = 0;
+    uint64_t lastWriteTime = 0;
+    if (!IoGetFileSize(source, &size) || !IoGetLastWriteTime(source, &lastWriteTime)) {
+        IoCloseFile(source);
+        return STATUS_UNSUCCESSFUL;
+    }
+    if (size > SegmentsMaxObjectSize()) {
+        IoCloseFile(source);
+        return STATUS_FILE_TOO_LARGE;
+    }
+
+    // The file is read straight into the record, after the names
+    uint32_t length = 0;
+    BYTE* record = AllocateRecord(Username, SubmissionName, 0, (uint32_t)size, lastWriteTime, &length);
+    if (record == NULL) {
+        IoCloseFile(source);
+        return STATUS_NO_MEMORY;
+    }
+
+    DWORD bytesRead = 0;
+    BYTE* data = record + sizeof(SEGMENT_RECORD_HEADER) + strlen(Username) + strlen(SubmissionName);
+    bool read = size == 0 || (IoReadAt(source, 0, data, (DWORD)size, &bytesRead) && bytesRead == size);
+    IoCloseFile(source);
+
+    NTSTATUS status = read ? AppendRecord(record, length, key) : STATUS_UNSUCCESSFUL;
+    free(record);
+    return status;
+}
+
+
+bool
+SegmentsRead(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName,
+    _Outptr_result_bytebuffer_(*Size) BYTE** Data,
+    _Out_ uint64_t* Size,
+    _Out_ uint64_t* LastWriteTime
+)
+{
+    *Data = NULL;
+    *Size = 0;
+    *LastWriteTime = 0;
+
+    char key[SEGMENT_KEY_LENGTH];
+    if (!BuildKey(Username, SubmissionName, key)) {
+        return false;
+    }
+
+    // The segment cannot be deleted while it counts this reader
+    AcquireSRWLockShared(&g_SegmentLock);
+    SEGMENT_ENTRY* entry = g_SegmentsRunning ? FindEntryLocked(key, HashKey(key)) : NULL;
+    SEGMENT* segment = NULL;
+    uint64_t offset = 0;
+    uint32_t length = 0;
+    if (entry != NULL) {
+        segment = g_Segments[entry->Segment];
+        offset = entry->Offset;
+        length = entry->RecordLength;
+        InterlockedIncrement(&segment->Readers);
+    }
+    ReleaseSRWLockShared(&g_SegmentLock);
+    if (segment == NULL) {
+        return false;
+    }
+
+    BYTE* record = (BYTE*)malloc(length);
+    DWORD bytesRead = 0;
+    bool result = record != NULL && IoReadAt(segment->File, offset, record, length, &bytesRead) && bytesRead == length;
+    InterlockedDecrement(&segment->Readers);
+
+    if (result && !HashRecord(record, length, true)) {
+        printf("The segment record of %s is corrupt.\n", key);
+        result = false;
+    }
+    if (!result) {
+        free(record);
+        return false;
+    }
+
+    // The data is moved to the start of the record, which becomes the caller's buffer
+    const SEGMENT_RECORD_HEADER* header = (const SEGMENT_RECORD_HEADER*)record;
+    uint64_t lastWriteTime = header->LastWriteTime;
+    uint32_t dataLength = header->DataLength;
+    memmove(record, record + sizeof(*header) + header->UserLength + header->NameLength, dataLength);
+
+    *Data = record;
+    *Size = dataLength;
+    *LastWriteTime = lastWriteTime;
+    return true;
+}
+
+
+bool
+SegmentsQuery(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName,
+    _Out_ uint64_t* Size
+)
+{
+    *Size = 0;
+
+    char key[SEGMENT_KEY_LENGTH];
+    if (!BuildKey(Username, SubmissionName, key)) {
+        return false;
+    }
+
+    AcquireSRWLockShared(&g_SegmentLock);
+    SEGMENT_ENTRY* entry = g_SegmentsRunning ? FindEntryLocked(key, HashKey(key)) : NULL;
+    if (entry != NULL) {
+        *Size = entry->DataLength;
+    }
+    ReleaseSRWLockShared(&g_SegmentLock);
+    return entry != NULL;
+}
+
+
+VOID
+SegmentsDelete(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName
+)
+{
+    uint64_t size = 0;
+    char key[SEGMENT_KEY_LENGTH];
+    if (!SegmentsQuery(Username, SubmissionName, &size) || !BuildKey(Username, SubmissionName, key)) {
+        return;
+    }
+
+    uint32_t length = 0;
+    BYTE* record = AllocateRecord(Username, SubmissionName, SEGMENT_RECORD_TOMBSTONE, 0, 0, &length);
+    if (record != NULL) {
+        AppendRecord(record, length, key);
+        free(record);
+    }
+}
+
+
+VOID
+SegmentsCountUser(
+    _In_z_ const char* Username,
+    _Out_ uint64_t* Bytes,
+    _Out_ uint64_t* Objects
+)
+{
+    size_t userLength = strlen(Username);
+    *Bytes = 0;
+    *Objects = 0;
+
+    AcquireSRWLockShared(&g_SegmentLock);
+    for (uint32_t i = 0; i < g_SegmentBucketCount; i++) {
+        for (SEGMENT_ENTRY* entry = g_SegmentBuckets[i]; entry != NULL; entry = entry->Next) {
+            if (entry->UserLength == userLength && _strnicmp(entry->Key, Username, userLength) == 0) {
+                *Bytes += entry->DataLength;
+                (*Objects)++;
+            }
+        }
+    }
+    ReleaseSRWLockShared(&g_SegmentLock);
+}
+
+
+VOID
+SegmentsGetStats(
+    _Out_ SafeStorageSegmentStats* Stats
+)
+{
+    AcquireSRWLockShared(&g_SegmentLock);
+    *Stats = g_SegmentCounters;
+    Stats->MaxObjectSize = g_SegmentMaxObjectSize;
+    Stats->Objects = g_SegmentEntryCount;
+    for (uint32_t id = 0; id < g_SegmentCount; id++) {
+        SEGMENT* segment = g_Segments[id];
+        if (segment != NULL) {
+            Stats->Segments++;
+            Stats->LiveBytes += segment->LiveBytes;
+            Stats->DeadBytes += segment->Used - sizeof(SEGMENT_HEADER) - segment->LiveBytes;
+        }
+    }
+    ReleaseSRWLockShared(&g_SegmentLock);
+}
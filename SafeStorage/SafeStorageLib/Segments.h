@@ -0,0 +1,152 @@
+#ifndef _SEGMENTS_H_
+#define _SEGMENTS_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define SEGMENT_DIRECTORY_NAME "segments"       // %APPDIR%\segments: the segment files and the index checkpoint
+#define SEGMENT_SIZE (64 * 1024 * 1024)         // Every segment file is preallocated at this size
+#define SEGMENT_MAX_OBJECT_LIMIT (SEGMENT_SIZE / 16) // Largest submission size the engine can be configured for
+#define SEGMENT_RECORD_ALIGNMENT 8              // Records start at multiples of this
+#define SEGMENT_INDEX_INITIAL_BUCKETS 4096      // Doubled whenever the index holds twice as many objects
+#define SEGMENT_CHECKPOINT_FILE_NAME "index.checkpoint"
+#define SEGMENT_MAINTENANCE_INTERVAL_MS 5000    // How often the index is checkpointed and a segment compacted
+#define SEGMENT_COMPACT_DEAD_PERCENT 50         // Sealed segments with at least this much dead space are compacted
+
+
+/*
+ * @brief       Starts the segment engine, which keeps small submissions in large shared segment files.
+ *
+ * @details     Every stored object becomes a record appended to the active segment: a header with the user,
+ *              the submission name, a sequence number and a SHA-256 checksum of the record, followed by the
+ *              data. Segments are preallocated and only ever written at their end, so a store is one
+ *              sequential write into an existing file instead of the creation of several files. When the active
+ *              segment is full it is flushed and sealed and the next one is created.
+ *
+ *              An in-memory hash index maps (user, submission) to the newest record. It is checkpointed to
+ *              SEGMENT_CHECKPOINT_FILE_NAME every SEGMENT_MAINTENANCE_INTERVAL_MS (if it changed) and when the
+ *              engine stops. Starting loads the checkpoint and replays only the records appended after it,
+ *              stopping at the first record that is incomplete or fails its checksum; without a checkpoint all
+ *              segments are replayed. A record replaces an object only if its sequence number is higher, so the
+ *              order in which segments are replayed does not matter.
+ *
+ *              Overwritten and deleted objects leave dead records behind. The maintenance thread compacts
+ *              sealed segments that are at least SEGMENT_COMPACT_DEAD_PERCENT dead and covered by a checkpoint:
+ *              their live records are copied unchanged to the active segment, a checkpoint is written and
+ *              the segment is deleted once no read is using it.
+ *
+ *              Segment files are accessed through the selected I/O backend.
+ *
+ * @param[in]   AppDirectory    - The application directory (%APPDIR%).
+ * @param[in]   MaxObjectSize   - Largest submission kept in segments; at most SEGMENT_MAX_OBJECT_LIMIT.
+ *
+ * @return      TRUE if the engine is running; otherwise, FALSE.
+ */
+bool
+SegmentsStart(
+    _In_z_ const char* AppDirectory,
+    _In_ uint32_t MaxObjectSize
+);
+
+
+/*
+ * @brief       Checkpoints the index, stops the maintenance thread and closes the segments. Does nothing if the
+ *              engine is not running.
+ */
+VOID
+SegmentsStop(
+    VOID
+);
+
+
+/*
+ * @brief       Returns the largest submission kept in segments, or 0 if the engine is not running.
+ */
+uint32_t
+SegmentsMaxObjectSize(
+    VOID
+);
+
+
+/*
+ * @brief       Appends a file as the newest record of a submission and makes it durable according to the
+ *              durability mode.
+ *
+ * @return      STATUS_SUCCESS, STATUS_OBJECT_NAME_NOT_FOUND if the file does not exist, STATUS_FILE_TOO_LARGE
+ *              if it exceeds the configured size, STATUS_NO_MEMORY or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS
+SegmentsStoreFile(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName,
+    _In_z_ const char* SourcePath
+);
+
+
+/*
+ * @brief       Reads the current contents of a submission kept in segments and verifies their checksum.
+ *
+ * @param[out]  Data            - Receives the contents, allocated with malloc (possibly empty). Free with free().
+ * @param[out]  Size            - Receives the size of the contents.
+ * @param[out]  LastWriteTime   - Receives the last write time of the file that was stored.
+ *
+ * @return      FALSE if the submission is not kept in segments or cannot be read.
+ */
+bool
+SegmentsRead(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName,
+    _Outptr_result_bytebuffer_(*Size) BYTE** Data,
+    _Out_ uint64_t* Size,
+    _Out_ uint64_t* LastWriteTime
+);
+
+
+/*
+ * @brief       Returns TRUE and the size of a submission if it is kept in segments.
+ */
+bool
+SegmentsQuery(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName,
+    _Out_ uint64_t* Size
+);
+
+
+/*
+ * @brief       Removes a submission from the segments by appending a tombstone record, e.g. once it has been
+ *              stored as a file of its own. Does nothing if it is not kept in segments.
+ */
+VOID
+SegmentsDelete(
+    _In_z_ const char* Username,
+    _In_z_ const char* SubmissionName
+);
+
+
+/*
+ * @brief       Adds up the submissions of a user kept in segments. Walks the whole index.
+ */
+VOID
+SegmentsCountUser(
+    _In_z_ const char* Username,
+    _Out_ uint64_t* Bytes,
+    _Out_ uint64_t* Objects
+);
+
+
+/*
+ * @brief       Returns the state and counters of the engine.
+ */
+VOID
+SegmentsGetStats(
+    _Out_ SafeStorageSegmentStats* Stats
+);
+
+
+EXTERN_C_END;
+#endif  //_SEGMENTS_H_
@@ -0,0 +1,360 @@
+#include "Striping.h"
+#include "Commands.h"
+#include "Durability.h"
+#include "Transfer.h"
+
+
+// Layout record of a striped file. On disk: "<unit> <count> <size> <last write time>" followed by the
+// paths of stripes 1 .. count - 1, one per line. Size and time are 0 while the file is being written.
+typedef struct _STRIPE_LAYOUT {
+    DWORD StripeUnit;
+    DWORD StripeCount;                          // The file itself included
+    uint64_t Size;                              // Size and last write time of the file the layout was published with
+    uint64_t LastWriteTime;
+    char Paths[STRIPING_MAX_ROOTS][MAX_PATH];   // Paths[0] is the file itself
+} STRIPE_LAYOUT;
+
+
+// Global static variables
+static SRWLOCK g_StripingLock = SRWLOCK_INIT;   // Guards the configuration
+static char g_PrimaryDirectory[MAX_PATH] = { 0 };
+static char g_DataRoots[STRIPING_MAX_ROOTS - 1][MAX_PATH] = { 0 };
+static DWORD g_DataRootCount = 0;
+static DWORD g_StripeUnit = CHUNK_SIZE;
+static volatile LONG64 g_Generation = 0;        // Makes the stripe names of every new file unique
+
+
+/**
+ * @brief       Reads the layout record of a file.
+ *
+ * @return      TRUE if the file has a layout record; FALSE if it has none (it is not striped) or it cannot be read.
+ */
+static bool ReadLayout(_In_z_ const char* path, _Out_ STRIPE_LAYOUT* layout) {
+    char layoutPath[MAX_PATH];
+    char* contents = NULL;
+
+    memset(layout, 0, sizeof(*layout));
+    if (FAILED(StringCchPrintfA(layoutPath, MAX_PATH, "%s%s", path, STRIPING_LAYOUT_SUFFIX)) ||
+        FAILED(StringCchCopyA(layout->Paths[0], MAX_PATH, path)) ||
+        !IoReadFileContents(layoutPath, &contents, NULL)) {
+        return false;
+    }
+
+    char* cursor = contents;
+    char* line = IoTextNextLine(&cursor);
+    bool result = line != NULL &&
+                  sscanf_s(line, "%lu %lu %llu %llu", &layout->StripeUnit, &layout->StripeCount, &layout->Size, &layout->LastWriteTime) == 4 &&
+                  layout->StripeUnit > 0 && layout->StripeCount > 1 && layout->StripeCount <= STRIPING_MAX_ROOTS;
+
+    for (DWORD i = 1; result && i < layout->StripeCount; i++) {
+        line = IoTextNextLine(&cursor);
+        result = line != NULL && SUCCEEDED(StringCchCopyA(layout->Paths[i], MAX_PATH, line));
+    }
+
+    free(contents);
+    return result;
+}
+
+
+/**
+ * @brief       Writes the layout record of a file, atomically replacing the previous one.
+ */
+static bool WriteLayout(_In_ const STRIPE_LAYOUT* layout) {
+    char layoutPath[MAX_PATH];
+    char partialPath[MAX_PATH];
+    IO_TEXT text = { 0 };
+
+    if (FAILED(StringCchPrintfA(layoutPath, MAX_PATH, "%s%s", layout->Paths[0], STRIPING_LAYOUT_SUFFIX)) ||
+        FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", layoutPath, TRANSFER_PARTIAL_SUFFIX))) {
+        return false;
+    }
+
+    bool result = IoTextAppend(&text, "%lu %lu %llu %llu\n", layout->StripeUnit, layout->StripeCount, layout->Size, layout->LastWriteTime);
+    for (DWORD i = 1; result && i < layout->StripeCount; i++) {
+        result = IoTextAppend(&text, "%s\n", layout->Paths[i]);
+    }
+
+    result = result && IoWriteFileContents(partialPath, text.Data, text.Length) &&
+             DurabilityCommitFile(partialPath) && IoReplaceFile(partialPath, layoutPath);
+    if (!result) {
+        IoDeleteFile(partialPath);
+    }
+    IoTextFree(&text);
+    return result;
+}
+
+
+/**
+ * @brief       Deletes the layout record of a file.
+ */
+static void DeleteLayoutRecord(_In_z_ const char* path) {
+    char layoutPath[MAX_PATH];
+    if (SUCCEEDED(StringCchPrintfA(layoutPath, MAX_PATH, "%s%s", path, STRIPING_LAYOUT_SUFFIX))) {
+        IoDeleteFile(layoutPath);
+    }
+}
+
+
+/**
+ * @brief       Deletes the other stripes of a file and its layout record, but not the file itself.
+ */
+static void DeleteStripes(_In_ const STRIPE_LAYOUT* layout) {
+    for (DWORD i = 1; i < layout->StripeCount; i++) {
+        IoDeleteFile(layout->Paths[i]);
+    }
+    DeleteLayoutRecord(layout->Paths[0]);
+}
+
+
+/**
+ * @brief       Opens the stripes of a layout as one file.
+ */
+static SS_FILE* OpenLayout(_In_ const STRIPE_LAYOUT* layout, _In_ IoOpenMode mode) {
+    const char* paths[STRIPING_MAX_ROOTS];
+    for (DWORD i = 0; i < layout->StripeCount; i++) {
+        paths[i] = layout->Paths[i];
+    }
+    return IoOpenStripedFile(paths, layout->StripeCount, layout->StripeUnit, mode);
+}
+
+
+/**
+ * @brief       Lays out a new file over the configured roots. Stripe i > 0 is named after the path the file
+ *              will be published as, plus a new generation, so it never collides with a published stripe.
+ *
+ * @return      TRUE if the file is to be striped; FALSE if striping is disabled or finalPath is not under
+ *              the application directory.
+ */
+static bool PlanLayout(_In_z_ const char* path, _In_z_ const char* finalPath, _Out_ STRIPE_LAYOUT* layout) {
+    memset(layout, 0, sizeof(*layout));
+    uint64_t generation = (uint64_t)InterlockedIncrement64(&g_Generation);
+
+    AcquireSRWLockShared(&g_StripingLock);
+    size_t primaryLength = strlen(g_PrimaryDirectory);
+    bool result = g_DataRootCount > 0 &&
+                  _strnicmp(finalPath, g_PrimaryDirectory, primaryLength) == 0 && finalPath[primaryLength] == '\\' &&
+                  SUCCEEDED(StringCchCopyA(layout->Paths[0], MAX_PATH, path));
+
+    layout->StripeUnit = g_StripeUnit;
+    layout->StripeCount = 1 + g_DataRootCount;
+    for (DWORD i = 1; result && i < layout->StripeCount; i++) {
+        result = SUCCEEDED(StringCchPrintfA(layout->Paths[i], MAX_PATH, "%s%s~%016llx.%lu",
+                                            g_DataRoots[i - 1], finalPath + primaryLength, generation, i));
+    }
+    ReleaseSRWLockShared(&g_StripingLock);
+
+    return result;
+}
+
+
+bool
+StripingConfigure(
+    _In_z_ const char* PrimaryDirectory,
+    _In_reads_(RootCount) const char* const* DataRoots,
+    _In_ DWORD RootCount,
+    _In_ DWORD StripeUnit
+)
+{
+    if (RootCount > STRIPING_MAX_ROOTS - 1 || StripeUnit == 0 || StripeUnit % CHUNK_SIZE != 0) {
+        printf("Invalid striping configuration.\n");
+        return false;
+    }
+
+    for (DWORD i = 0; i < RootCount; i++) {
+        if (DataRoots[i] == NULL || strlen(DataRoots[i]) >= MAX_PATH || !IoCreateDirectories(DataRoots[i])) {
+            printf("Failed to create the data root: %s\n", (DataRoots[i] != NULL) ? DataRoots[i] : "");
+            return false;
+        }
+    }
+
+    // Generations only need to be unique per file path; starting from the clock keeps them unique across restarts
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    LONG64 start = (LONG64)(((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime);
+
+    AcquireSRWLockExclusive(&g_StripingLock);
+    if (g_Generation < start) {
+        InterlockedExchange64(&g_Generation, start);
+    }
+    StringCchCopyA(g_PrimaryDirectory, MAX_PATH, PrimaryDirectory);
+    for (DWORD i = 0; i < RootCount; i++) {
+        StringCchCopyA(g_DataRoots[i], MAX_PATH, DataRoots[i]);
+    }
+    g_DataRootCount = RootCount;
+    g_StripeUnit = StripeUnit;
+    ReleaseSRWLockExclusive(&g_StripingLock);
+
+    return true;
+}
+
+
+SS_FILE*
+StripingOpenFile(
+    _In_z_ const char* Path,
+    _In_ IoOpenMode Mode
+)
+{
+    STRIPE_LAYOUT* layout = (STRIPE_LAYOUT*)malloc(sizeof(STRIPE_LAYOUT));
+    if (layout == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    for (DWORD attempt = 0; attempt < STRIPING_OPEN_ATTEMPTS; attempt++) {
+        if (!ReadLayout(Path, layout)) {
+            free(layout);
+            return IoOpenFile(Path, Mode);
+        }
+
+        // The layout of a file that is still being written is not checked
+        uint64_t size = 0;
+        uint64_t lastWriteTime = 0;
+        SS_FILE* file = OpenLayout(layout, Mode);
+        if (file != NULL &&
+            ((layout->Size == 0 && layout->LastWriteTime == 0) ||
+             (IoGetFileSize(file, &size) && IoGetLastWriteTime(file, &lastWriteTime) &&
+              size == layout->Size && lastWriteTime == layout->LastWriteTime))) {
+            free(layout);
+            return file;
+        }
+
+        // StripingReplaceFile publishes the new layout right before the file; the old stripes may be gone already
+        IoCloseFile(file);
+        Sleep(attempt);
+    }
+
+    free(layout);
+    SetLastError(ERROR_SHARING_VIOLATION);
+    return NULL;
+}
+
+
+SS_FILE*
+StripingCreateFile(
+    _In_z_ const char* Path,
+    _In_z_ const char* FinalPath,
+    _In_ bool Stripe
+)
+{
+    STRIPE_LAYOUT* layout = (STRIPE_LAYOUT*)malloc(sizeof(STRIPE_LAYOUT));
+    if (layout == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    // Stripes of an earlier, abandoned attempt
+    if (ReadLayout(Path, layout)) {
+        DeleteStripes(layout);
+    }
+
+    if (!Stripe || !PlanLayout(Path, FinalPath, layout)) {
+        free(layout);
+        return IoOpenFile(Path, IO_OPEN_CREATE);
+    }
+
+    bool result = true;
+    for (DWORD i = 1; result && i < layout->StripeCount; i++) {
+        char parent[MAX_PATH];
+        StringCchCopyA(parent, MAX_PATH, layout->Paths[i]);
+        char* separator = strrchr(parent, '\\');
+        if (separator != NULL) {
+            *separator = '\0';
+        }
+        result = IoCreateDirectories(parent);
+    }
+
+    // Recorded before any stripe exists, so that a failed attempt can always be cleaned up
+    SS_FILE* file = (result && WriteLayout(layout)) ? OpenLayout(layout, IO_OPEN_CREATE) : NULL;
+    if (file == NULL) {
+        DWORD error = GetLastError();
+        DeleteStripes(layout);
+        SetLastError(error);
+    }
+
+    free(layout);
+    return file;
+}
+
+
+bool
+StripingReplaceFile(
+    _In_z_ const char* Source,
+    _In_z_ const char* Destination
+)
+{
+    STRIPE_LAYOUT* previous = (STRIPE_LAYOUT*)malloc(sizeof(STRIPE_LAYOUT));
+    STRIPE_LAYOUT* layout = (STRIPE_LAYOUT*)malloc(sizeof(STRIPE_LAYOUT));
+    if (previous == NULL || layout == NULL) {
+        free(layout);
+        free(previous);
+        return false;
+    }
+
+    bool replaced = ReadLayout(Destination, previous);
+    bool result = true;
+
+    if (ReadLayout(Source, layout)) {
+        // Published with the file's final size and last write time, which is what makes it valid
+        IO_FILE_INFO info = { 0 };
+        result = IoQueryFileInfo(Source, &info);
+        for (DWORD i = 1; result && i < layout->StripeCount; i++) {
+            result = DurabilityCommitFile(layout->Paths[i]);
+        }
+        layout->Size = info.Size;
+        layout->LastWriteTime = info.LastWriteTime;
+        result = result && SUCCEEDED(StringCchCopyA(layout->Paths[0], MAX_PATH, Destination)) && WriteLayout(layout);
+
+        // Until the rename, readers see the old file with the new layout and retry
+        if (result && !IoReplaceFile(Source, Destination)) {
+            if (replaced) {
+                WriteLayout(previous);
+            }
+            else {
+                DeleteLayoutRecord(Destination);
+            }
+            result = false;
+        }
+        if (result) {
+            DeleteLayoutRecord(Source);
+        }
+    }
+    else {
+        // The old layout no longer matches the new file, so readers retry until it is gone
+        result = IoReplaceFile(Source, Destination);
+        if (result && replaced) {
+            DeleteLayoutRecord(Destination);
+        }
+    }
+
+    // Readers that have the replaced stripes open keep reading them until they close them
+    if (result && replaced) {
+        for (DWORD i = 1; i < previous->StripeCount; i++) {
+            IoDeleteFile(previous->Paths[i]);
+        }
+    }
+
+    free(layout);
+    free(previous);
+    return result;
+}
+
+
+bool
+StripingDeleteFile(
+    _In_z_ const char* Path
+)
+{
+    STRIPE_LAYOUT* layout = (STRIPE_LAYOUT*)malloc(sizeof(STRIPE_LAYOUT));
+    if (layout == NULL) {
+        return false;
+    }
+
+    // The file first: once it is gone nobody opens the other stripes anymore
+    bool result = IoDeleteFile(Path);
+    if (result && ReadLayout(Path, layout)) {
+        DeleteStripes(layout);
+    }
+
+    free(layout);
+    return result;
+}
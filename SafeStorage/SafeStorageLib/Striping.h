@@ -0,0 +1,100 @@
+#ifndef _STRIPING_H_
+#define _STRIPING_H_
+
+
+#include "includes.h"
+#include "FileIo.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define STRIPING_LAYOUT_SUFFIX "~stripes"       // <file>~stripes: layout record of a striped file
+#define STRIPING_MAX_ROOTS 16                   // Data roots a file can be striped over, the application directory included
+#define STRIPING_OPEN_ATTEMPTS 8                // Opens that find a layout being replaced are retried this often
+
+
+/*
+ * @brief       Configures the data roots that new submissions are striped over.
+ *
+ * @details     The first stripe of a striped file is the file itself, under PrimaryDirectory. Stripe i > 0
+ *              lives under DataRoots[i - 1], at the same relative path with "~<generation>.<i>" appended.
+ *              Every stripe has the full size of the file and is sparse, holding only its own units, so each
+ *              root stores 1 / (RootCount + 1) of the data and chunk I/O is spread over all of them.
+ *
+ *              Which files a striped file consists of is recorded next to it in <file> + STRIPING_LAYOUT_SUFFIX,
+ *              so files keep working when the roots are reconfigured later. Files stored before stay as
+ *              they are.
+ *
+ * @param[in]   PrimaryDirectory    - The application directory (%APPDIR%).
+ * @param[in]   DataRoots           - Additional roots, usually on separate drives. Created if missing.
+ * @param[in]   RootCount           - Number of additional roots, at most STRIPING_MAX_ROOTS - 1; 0 disables striping.
+ * @param[in]   StripeUnit          - Bytes stored in one stripe before moving on to the next; a non-zero
+ *                                    multiple of CHUNK_SIZE.
+ *
+ * @return      TRUE if the configuration was applied; otherwise, FALSE and the previous one is kept.
+ */
+bool
+StripingConfigure(
+    _In_z_ const char* PrimaryDirectory,
+    _In_reads_(RootCount) const char* const* DataRoots,
+    _In_ DWORD RootCount,
+    _In_ DWORD StripeUnit
+);
+
+
+/*
+ * @brief       Opens an existing file, striped or not, for positional I/O.
+ *
+ * @details     A layout record only counts if it describes the file as it is (same size and last write time).
+ *              One that does not is being replaced by StripingReplaceFile: the open is retried.
+ *
+ * @return      The opened file, or NULL on failure (GetLastError has the reason).
+ */
+SS_FILE*
+StripingOpenFile(
+    _In_z_ const char* Path,
+    _In_ IoOpenMode Mode
+);
+
+
+/*
+ * @brief       Creates or truncates a file that will be published as FinalPath by StripingReplaceFile.
+ *
+ * @details     With Stripe set, data roots configured and FinalPath under the application directory, the file
+ *              is created striped and its layout record is written right away, so that StripingOpenFile can
+ *              reopen it (e.g. to resume an interrupted transfer). Stripes of an earlier attempt are deleted.
+ *
+ * @return      The created file, or NULL on failure (GetLastError has the reason).
+ */
+SS_FILE*
+StripingCreateFile(
+    _In_z_ const char* Path,
+    _In_z_ const char* FinalPath,
+    _In_ bool Stripe
+);
+
+
+/*
+ * @brief       Atomically replaces Destination with Source, striped or not (see IoReplaceFile).
+ *
+ * @details     The other stripes of Source are made durable and its layout record is published first; the
+ *              stripes Destination had before are deleted afterwards. Source itself must already be durable.
+ */
+bool
+StripingReplaceFile(
+    _In_z_ const char* Source,
+    _In_z_ const char* Destination
+);
+
+
+/*
+ * @brief       Deletes a file together with its other stripes and layout record, if it has any.
+ */
+bool
+StripingDeleteFile(
+    _In_z_ const char* Path
+);
+
+
+EXTERN_C_END;
+#endif  //_STRIPING_H_
@@ -0,0 +1,527 @@
+#include "ThreadPool.h"
+
+
+// A range of indices to run. Stored by value in the deques.
+typedef struct _POOL_TASK {
+    POOL_TASK_ROUTINE Routine;
+    PVOID Context;
+    POOL_GROUP* Group;
+    uint64_t Begin;
+    uint64_t End;
+} POOL_TASK;
+
+
+// Growable ring of tasks. The owner pushes and pops at Bottom, thieves take from Top.
+typedef struct _POOL_DEQUE {
+    SRWLOCK Lock;
+    POOL_TASK* Tasks;
+    size_t Capacity;                            // Always a power of two
+    size_t Top;
+    size_t Bottom;
+} POOL_DEQUE;
+
+
+typedef struct _POOL_WORKER {
+    POOL_DEQUE Deque;
+    HANDLE Thread;
+    DWORD Index;
+} POOL_WORKER;
+
+
+// Global static variables
+static SRWLOCK g_PoolConfigLock = SRWLOCK_INIT; // Serializes PoolInit and PoolDeinit
+static volatile LONG g_PoolAvailable = FALSE;   // Workers may be used; cleared while the pool is stopped or replaced
+static volatile LONG g_PoolUsers = 0;           // Threads in PoolSubmit or PoolWait that use the workers
+static POOL_WORKER* g_Workers = NULL;
+static DWORD g_WorkerCount = 0;
+static HANDLE g_WorkAvailable = NULL;           // Semaphore idle workers sleep on
+static volatile LONG g_IdleWorkers = 0;
+static volatile LONG64 g_QueuedTasks = 0;       // Tasks sitting in any deque
+static volatile LONG g_PoolStopping = FALSE;
+static volatile LONG g_NextDeque = 0;           // Round-robin target of submissions from outside the pool
+static volatile LONG64 g_TasksExecuted = 0;
+static volatile LONG64 g_Steals = 0;
+static __declspec(thread) POOL_WORKER* t_CurrentWorker = NULL;
+
+
+/**
+ * @brief       Pushes a task to the bottom of a deque, doubling the ring when it is full.
+ *
+ * @return      TRUE if the task was queued; FALSE if out of memory.
+ */
+static bool DequePush(_Inout_ POOL_DEQUE* deque, _In_ const POOL_TASK* task) {
+    AcquireSRWLockExclusive(&deque->Lock);
+
+    if (deque->Bottom - deque->Top == deque->Capacity) {
+        size_t capacity = (deque->Capacity == 0) ? POOL_DEQUE_INITIAL_CAPACITY : deque->Capacity * 2;
+        POOL_TASK* tasks = (POOL_TASK*)malloc(capacity * sizeof(POOL_TASK));
+        if (tasks == NULL) {
+            ReleaseSRWLockExclusive(&deque->Lock);
+            return false;
+        }
+
+        size_t count = deque->Bottom - deque->Top;
+        for (size_t i = 0; i < count; i++) {
+            tasks[i] = deque->Tasks[(deque->Top + i) & (deque->Capacity - 1)];
+        }
+        free(deque->Tasks);
+        deque->Tasks = tasks;
+        deque->Capacity = capacity;
+        deque->Top = 0;
+        deque->Bottom = count;
+    }
+
+    deque->Tasks[deque->Bottom & (deque->Capacity - 1)] = *task;
+    deque->Bottom++;
+
+    ReleaseSRWLockExclusive(&deque->Lock);
+    return true;
+}
+
+
+/**
+ * @brief       Takes the newest task of a deque (owner side) or the oldest one (thief side).
+ */
+static bool DequeTake(_Inout_ POOL_DEQUE* deque, _In_ bool steal, _Out_ POOL_TASK* task) {
+    bool taken = false;
+
+    // Cheap unlocked check; a stale answer only costs one more look later
+    if (deque->Bottom == deque->Top) {
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&deque->Lock);
+    if (deque->Bottom != deque->Top) {
+        if (steal) {
+            *task = deque->Tasks[deque->Top & (deque->Capacity - 1)];
+            deque->Top++;
+        }
+        else {
+            deque->Bottom--;
+            *task = deque->Tasks[deque->Bottom & (deque->Capacity - 1)];
+        }
+        taken = true;
+    }
+    ReleaseSRWLockExclusive(&deque->Lock);
+
+    return taken;
+}
+
+
+/**
+ * @brief       Takes a task of one group out of a deque, the newest one (owner side) or the oldest one
+ *              (thief side). Tasks of other groups keep their places.
+ */
+static bool DequeTakeGroup(_Inout_ POOL_DEQUE* deque, _In_ const POOL_GROUP* group, _In_ bool steal, _Out_ POOL_TASK* task) {
+    bool taken = false;
+
+    if (deque->Bottom == deque->Top) {
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&deque->Lock);
+    size_t count = deque->Bottom - deque->Top;
+    size_t mask = deque->Capacity - 1;
+    for (size_t i = 0; !taken && i < count; i++) {
+        size_t position = steal ? deque->Top + i : deque->Bottom - 1 - i;
+        if (deque->Tasks[position & mask].Group != group) {
+            continue;
+        }
+
+        // Close the gap by moving the newer tasks down
+        *task = deque->Tasks[position & mask];
+        for (size_t j = position; j + 1 < deque->Bottom; j++) {
+            deque->Tasks[j & mask] = deque->Tasks[(j + 1) & mask];
+        }
+        deque->Bottom--;
+        taken = true;
+    }
+    ReleaseSRWLockExclusive(&deque->Lock);
+
+    return taken;
+}
+
+
+/**
+ * @brief       Queues a task and wakes an idle worker if there is one.
+ *              Tasks created on a worker go to its own deque; others are spread round-robin.
+ */
+static bool QueueTask(_In_ const POOL_TASK* task) {
+    POOL_WORKER* worker = t_CurrentWorker;
+    if (worker == NULL) {
+        worker = &g_Workers[(DWORD)InterlockedIncrement(&g_NextDeque) % g_WorkerCount];
+    }
+
+    if (!DequePush(&worker->Deque, task)) {
+        return false;
+    }
+
+    // Pairs with the idle check in WorkerThreadProc: either the worker sees the task or we see the worker
+    InterlockedIncrement64(&g_QueuedTasks);
+    if (InterlockedCompareExchange(&g_IdleWorkers, 0, 0) > 0) {
+        ReleaseSemaphore(g_WorkAvailable, 1, NULL);
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Marks one task of a group as finished and wakes the waiters if it was the last one.
+ *              The group usually lives on the waiter's stack: it may be gone as soon as the waiter sees
+ *              Pending at 0, so the decrement and the wake happen under the lock PoolWait decides under.
+ */
+static void CompleteTask(_Inout_ POOL_GROUP* group) {
+    AcquireSRWLockExclusive(&group->Lock);
+    if (InterlockedDecrement64(&group->Pending) == 0) {
+        WakeAllConditionVariable(&group->Done);
+    }
+    ReleaseSRWLockExclusive(&group->Lock);
+}
+
+
+/**
+ * @brief       Runs a range task. The upper half of the remaining range is split off and queued until a
+ *              single index is left, so thieves always find the largest pieces at the top of the deque.
+ */
+static void RunTask(_In_ POOL_TASK* task) {
+    while (task->End - task->Begin > 1) {
+        POOL_TASK upperHalf = *task;
+        upperHalf.Begin = task->Begin + (task->End - task->Begin) / 2;
+
+        InterlockedIncrement64(&task->Group->Pending);
+        if (!QueueTask(&upperHalf)) {
+            // Out of memory: run the rest of the range here instead
+            InterlockedDecrement64(&task->Group->Pending);
+            break;
+        }
+        task->End = upperHalf.Begin;
+    }
+
+    for (uint64_t index = task->Begin; index < task->End; index++) {
+        task->Routine(task->Context, index);
+    }
+    InterlockedExchangeAdd64(&g_TasksExecuted, (LONG64)(task->End - task->Begin));
+
+    CompleteTask(task->Group);
+}
+
+
+/**
+ * @brief       Finds a task: the newest one of the caller's own deque first, then the oldest one of
+ *              any other deque, starting with the next worker.
+ */
+static bool FindTask(_In_opt_ POOL_WORKER* self, _Out_ POOL_TASK* task) {
+    if (self != NULL && DequeTake(&self->Deque, false, task)) {
+        InterlockedDecrement64(&g_QueuedTasks);
+        return true;
+    }
+
+    DWORD start = (self != NULL) ? self->Index + 1 : (DWORD)g_NextDeque;
+    for (DWORD i = 0; i < g_WorkerCount; i++) {
+        POOL_WORKER* victim = &g_Workers[(start + i) % g_WorkerCount];
+        if (victim != self && DequeTake(&victim->Deque, true, task)) {
+            InterlockedDecrement64(&g_QueuedTasks);
+            InterlockedIncrement64(&g_Steals);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief       Like FindTask, but only finds tasks of one group.
+ */
+static bool FindGroupTask(_In_opt_ POOL_WORKER* self, _In_ const POOL_GROUP* group, _Out_ POOL_TASK* task) {
+    if (self != NULL && DequeTakeGroup(&self->Deque, group, false, task)) {
+        InterlockedDecrement64(&g_QueuedTasks);
+        return true;
+    }
+
+    DWORD start = (self != NULL) ? self->Index + 1 : (DWORD)g_NextDeque;
+    for (DWORD i = 0; i < g_WorkerCount; i++) {
+        POOL_WORKER* victim = &g_Workers[(start + i) % g_WorkerCount];
+        if (victim != self && DequeTakeGroup(&victim->Deque, group, true, task)) {
+            InterlockedDecrement64(&g_QueuedTasks);
+            InterlockedIncrement64(&g_Steals);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief       Registers a thread about to use the workers. Fails while the pool is not available, in which
+ *              case the caller does without them. Every successful call is paired with LeavePool.
+ */
+static bool EnterPool(void) {
+    // Pairs with PoolDeinit: either it sees this user or this user sees the pool going away
+    InterlockedIncrement(&g_PoolUsers);
+    if (InterlockedCompareExchange(&g_PoolAvailable, FALSE, FALSE) == FALSE) {
+        InterlockedDecrement(&g_PoolUsers);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Ends a use of the workers started by EnterPool.
+ */
+static void LeavePool(void) {
+    InterlockedDecrement(&g_PoolUsers);
+}
+
+
+/**
+ * @brief       Worker thread. Runs tasks until the pool is stopping and every deque is empty.
+ */
+static DWORD WINAPI WorkerThreadProc(_In_ LPVOID parameter) {
+    POOL_WORKER* self = (POOL_WORKER*)parameter;
+    t_CurrentWorker = self;
+
+    for (;;) {
+        POOL_TASK task;
+        if (FindTask(self, &task)) {
+            RunTask(&task);
+            continue;
+        }
+
+        if (g_PoolStopping && InterlockedCompareExchange64(&g_QueuedTasks, 0, 0) == 0) {
+            break;
+        }
+
+        // Announce the sleep before the final check so a concurrent QueueTask cannot be missed
+        InterlockedIncrement(&g_IdleWorkers);
+        if (InterlockedCompareExchange64(&g_QueuedTasks, 0, 0) == 0 && !g_PoolStopping) {
+            WaitForSingleObject(g_WorkAvailable, INFINITE);
+        }
+        InterlockedDecrement(&g_IdleWorkers);
+    }
+
+    t_CurrentWorker = NULL;
+    return 0;
+}
+
+
+bool
+PoolInit(
+    _In_ DWORD WorkerCount,
+    _In_ bool PinWorkers
+)
+{
+    SYSTEM_INFO systemInfo = { 0 };
+    GetSystemInfo(&systemInfo);
+
+    AcquireSRWLockExclusive(&g_PoolConfigLock);
+    if (g_Workers != NULL) {
+        printf("The thread pool is already running.\n");
+        ReleaseSRWLockExclusive(&g_PoolConfigLock);
+        return false;
+    }
+
+    DWORD workerCount = (WorkerCount == 0) ? systemInfo.dwNumberOfProcessors : WorkerCount;
+    workerCount = max(min(workerCount, (DWORD)POOL_MAX_WORKERS), 1UL);
+
+    g_Workers = (POOL_WORKER*)calloc(workerCount, sizeof(POOL_WORKER));
+    g_WorkAvailable = CreateSemaphoreA(NULL, 0, MAXLONG, NULL);
+    if (g_Workers == NULL || g_WorkAvailable == NULL) {
+        printf("Failed to create the thread pool: %lu\n", GetLastError());
+        ReleaseSRWLockExclusive(&g_PoolConfigLock);
+        PoolDeinit();
+        return false;
+    }
+
+    g_PoolStopping = FALSE;
+    g_IdleWorkers = 0;
+    g_QueuedTasks = 0;
+    g_TasksExecuted = 0;
+    g_Steals = 0;
+
+    for (DWORD i = 0; i < workerCount; i++) {
+        InitializeSRWLock(&g_Workers[i].Deque.Lock);
+        g_Workers[i].Index = i;
+    }
+    g_WorkerCount = workerCount;
+
+    for (DWORD i = 0; i < workerCount; i++) {
+        // Created suspended so that pinning takes effect before the worker runs anything
+        g_Workers[i].Thread = CreateThread(NULL, 0, WorkerThreadProc, &g_Workers[i], CREATE_SUSPENDED, NULL);
+        if (g_Workers[i].Thread == NULL) {
+            printf("Failed to start a thread pool worker: %lu\n", GetLastError());
+            ReleaseSRWLockExclusive(&g_PoolConfigLock);
+            PoolDeinit();
+            return false;
+        }
+
+        if (PinWorkers) {
+            DWORD processor = i % systemInfo.dwNumberOfProcessors;
+            SetThreadAffinityMask(g_Workers[i].Thread, (DWORD_PTR)1 << (processor % (sizeof(DWORD_PTR) * 8)));
+        }
+        ResumeThread(g_Workers[i].Thread);
+    }
+
+    InterlockedExchange(&g_PoolAvailable, TRUE);
+    ReleaseSRWLockExclusive(&g_PoolConfigLock);
+    return true;
+}
+
+
+VOID
+PoolDeinit(
+    VOID
+)
+{
+    AcquireSRWLockExclusive(&g_PoolConfigLock);
+
+    // New submissions run on their callers from now on. Threads already using the workers are waited for;
+    // their tasks keep running meanwhile.
+    InterlockedExchange(&g_PoolAvailable, FALSE);
+    while (InterlockedCompareExchange(&g_PoolUsers, 0, 0) > 0) {
+        Sleep(1);
+    }
+
+    InterlockedExchange(&g_PoolStopping, TRUE);
+
+    if (g_Workers != NULL) {
+        // Wake everyone; workers only leave once every deque is empty
+        if (g_WorkAvailable != NULL) {
+            ReleaseSemaphore(g_WorkAvailable, (LONG)g_WorkerCount, NULL);
+        }
+
+        for (DWORD i = 0; i < g_WorkerCount; i++) {
+            if (g_Workers[i].Thread != NULL) {
+                WaitForSingleObject(g_Workers[i].Thread, INFINITE);
+                CloseHandle(g_Workers[i].Thread);
+            }
+            free(g_Workers[i].Deque.Tasks);
+        }
+
+        free(g_Workers);
+        g_Workers = NULL;
+    }
+    g_WorkerCount = 0;
+
+    if (g_WorkAvailable != NULL) {
+        CloseHandle(g_WorkAvailable);
+        g_WorkAvailable = NULL;
+    }
+
+    ReleaseSRWLockExclusive(&g_PoolConfigLock);
+}
+
+
+DWORD
+PoolGetWorkerCount(
+    VOID
+)
+{
+    return g_WorkerCount;
+}
+
+
+bool
+PoolSubmit(
+    _Inout_ POOL_GROUP* Group,
+    _In_ POOL_TASK_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Begin,
+    _In_ uint64_t End
+)
+{
+    if (Begin >= End) {
+        return true;
+    }
+
+    // Tasks of the pool's own workers can always queue: the workers only stop once every deque is empty
+    bool entered = t_CurrentWorker == NULL && EnterPool();
+    if (t_CurrentWorker == NULL && !entered) {
+        for (uint64_t index = Begin; index < End; index++) {
+            Routine(Context, index);
+        }
+        return true;
+    }
+
+    POOL_TASK task = { 0 };
+    task.Routine = Routine;
+    task.Context = Context;
+    task.Group = Group;
+    task.Begin = Begin;
+    task.End = End;
+
+    InterlockedIncrement64(&Group->Pending);
+    bool queued = QueueTask(&task);
+    if (!queued) {
+        CompleteTask(Group);
+    }
+
+    if (entered) {
+        LeavePool();
+    }
+    return queued;
+}
+
+
+VOID
+PoolWait(
+    _Inout_ POOL_GROUP* Group
+)
+{
+    // Without the workers (the pool is being stopped) the tasks left are finished by them before they exit
+    bool helping = t_CurrentWorker != NULL || EnterPool();
+
+    for (;;) {
+        // Help instead of blocking a thread that could be running tasks. Only with tasks of this group:
+        // the caller may hold locks that an unrelated task would try to take again on this thread.
+        POOL_TASK task;
+        if (helping && InterlockedCompareExchange64(&Group->Pending, 0, 0) > 0 && FindGroupTask(t_CurrentWorker, Group, &task)) {
+            RunTask(&task);
+            continue;
+        }
+
+        // Only decided under the lock: the last task may still be inside CompleteTask otherwise. What is
+        // left runs on other threads; look again shortly, since it may still split off work to help with.
+        AcquireSRWLockExclusive(&Group->Lock);
+        bool finished = (Group->Pending == 0);
+        if (!finished) {
+            SleepConditionVariableSRW(&Group->Done, &Group->Lock, 1, 0);
+        }
+        ReleaseSRWLockExclusive(&Group->Lock);
+
+        if (finished) {
+            break;
+        }
+    }
+
+    if (helping && t_CurrentWorker == NULL) {
+        LeavePool();
+    }
+}
+
+
+bool
+PoolParallelFor(
+    _In_ POOL_TASK_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Count
+)
+{
+    POOL_GROUP group = { 0 };
+
+    bool result = PoolSubmit(&group, Routine, Context, 0, Count);
+    PoolWait(&group);
+    return result;
+}
+
+
+VOID
+PoolGetStats(
+    _Out_ POOL_STATS* Stats
+)
+{
+    Stats->TasksExecuted = (uint64_t)g_TasksExecuted;
+    Stats->Steals = (uint64_t)g_Steals;
+}
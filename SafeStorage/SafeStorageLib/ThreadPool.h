@@ -0,0 +1,135 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define POOL_MAX_WORKERS 64                     // Upper bound on the configurable pool size
+#define POOL_DEQUE_INITIAL_CAPACITY 64          // Tasks per worker deque before it has to grow
+
+
+/*
+ * @brief       A unit of work. Range tasks call the routine once for every index in their range.
+ */
+typedef VOID (*POOL_TASK_ROUTINE)(
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Index
+);
+
+
+// Tracks a set of submitted tasks so the submitter can wait for all of them.
+// Zero-initialize before the first submission; no cleanup is needed.
+typedef struct _POOL_GROUP {
+    volatile LONG64 Pending;                    // Tasks submitted but not finished
+    SRWLOCK Lock;                               // Held while a task completes and while PoolWait checks for the end
+    CONDITION_VARIABLE Done;                    // Signaled when Pending drops to 0
+} POOL_GROUP;
+
+
+// Counters since PoolInit
+typedef struct _POOL_STATS {
+    uint64_t TasksExecuted;                     // Routine calls
+    uint64_t Steals;                            // Tasks taken from another worker's deque
+} POOL_STATS;
+
+
+/*
+ * @brief       Starts the pool. Called from SafeStorageInit.
+ *
+ * @details     Each worker owns a deque of tasks. A worker pushes the tasks it creates (including the halves it
+ *              splits off a range task) to the bottom of its own deque and pops from the bottom, so it keeps
+ *              working on hot data. When its deque is empty it steals from the top of another worker's deque,
+ *              taking the oldest and therefore largest pieces of work. Threads outside the pool spread their
+ *              submissions over the deques round-robin; there is no central queue.
+ *
+ * @param[in]   WorkerCount     - Number of worker threads; 0 means one per processor. At most POOL_MAX_WORKERS.
+ * @param[in]   PinWorkers      - Whether to bind worker i to processor i (modulo the processor count).
+ *
+ * @return      TRUE if the workers are running; FALSE if they cannot be started or the pool is already running.
+ */
+bool
+PoolInit(
+    _In_ DWORD WorkerCount,
+    _In_ bool PinWorkers
+);
+
+
+/*
+ * @brief       Runs every queued task to completion and stops the workers. Called from SafeStorageDeinit.
+ *
+ * @details     Safe to call while other threads submit and wait: from the moment it is called, new submissions
+ *              run on the submitting thread, and it waits for the threads already using the workers. Must not
+ *              be called from a pool task.
+ */
+VOID
+PoolDeinit(
+    VOID
+);
+
+
+/*
+ * @brief       Returns the number of worker threads, or 0 if the pool is not running.
+ */
+DWORD
+PoolGetWorkerCount(
+    VOID
+);
+
+
+/*
+ * @brief       Submits a task that calls Routine(Context, i) for every i in [Begin, End).
+ *
+ * @details     Whoever runs a range task with more than one index splits off its upper half as a new task, so
+ *              idle workers can steal it, and continues with the lower half. If the pool is not running the
+ *              task runs on the calling thread before this function returns.
+ *
+ * @return      TRUE if the task was queued or run; FALSE if out of memory.
+ */
+bool
+PoolSubmit(
+    _Inout_ POOL_GROUP* Group,
+    _In_ POOL_TASK_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Begin,
+    _In_ uint64_t End
+);
+
+
+/*
+ * @brief       Waits for every task of the group. The calling thread runs the group's queued tasks while it
+ *              waits, never those of other groups, so it is safe to call from inside a task or while holding a
+ *              lock that only other groups' tasks take.
+ */
+VOID
+PoolWait(
+    _Inout_ POOL_GROUP* Group
+);
+
+
+/*
+ * @brief       Calls Routine(Context, i) for every i in [0, Count) on the pool and waits for all of them.
+ *
+ * @return      TRUE if every index was run; FALSE if out of memory.
+ */
+bool
+PoolParallelFor(
+    _In_ POOL_TASK_ROUTINE Routine,
+    _Inout_opt_ PVOID Context,
+    _In_ uint64_t Count
+);
+
+
+/*
+ * @brief       Returns the counters of the pool.
+ */
+VOID
+PoolGetStats(
+    _Out_ POOL_STATS* Stats
+);
+
+
+EXTERN_C_END;
+#endif  //_THREAD_POOL_H_
@@ -0,0 +1,341 @@
+#include "ThrottledBackend.h"
+#include "RateLimit.h"
+
+
+// An open file of the throttled backend: the inner backend's handle, and that backend in case it is reconfigured
+typedef struct _THROTTLED_HANDLE {
+    const IO_BACKEND* Inner;
+    IO_HANDLE Handle;
+} THROTTLED_HANDLE;
+
+
+// Global static variables
+static const IO_BACKEND* volatile g_Inner = NULL;
+static volatile LONG g_LatencyMicroseconds = 0;
+static volatile LONG g_JitterMicroseconds = 0;
+static volatile LONG64 g_JitterState = (LONG64)THROTTLE_JITTER_SEED;
+static RATE_LIMITER g_Bandwidth = { SRWLOCK_INIT, 0, 0, 0 };     // Unlimited until configured
+
+
+/**
+ * @brief       Returns the next value of the jitter sequence (SplitMix64). Threads share the sequence.
+ */
+static uint64_t NextRandom(void) {
+    uint64_t value = (uint64_t)InterlockedAdd64(&g_JitterState, (LONG64)0x9E3779B97F4A7C15ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+
+/**
+ * @brief       Waits for a number of microseconds. Sleep only has millisecond resolution (and usually
+ *              less), so the last THROTTLE_SPIN_MICROSECONDS are spun, yielding to other threads.
+ */
+static void WaitMicroseconds(_In_ uint64_t microseconds) {
+    LARGE_INTEGER frequency = { 0 };
+    LARGE_INTEGER now = { 0 };
+    if (microseconds == 0 || !QueryPerformanceFrequency(&frequency) || !QueryPerformanceCounter(&now)) {
+        return;
+    }
+
+    LONGLONG deadline = now.QuadPart + (LONGLONG)(microseconds * (uint64_t)frequency.QuadPart / 1000000);
+    for (;;) {
+        QueryPerformanceCounter(&now);
+        if (now.QuadPart >= deadline) {
+            break;
+        }
+
+        uint64_t remaining = (uint64_t)(deadline - now.QuadPart) * 1000000 / (uint64_t)frequency.QuadPart;
+        if (remaining > THROTTLE_SPIN_MICROSECONDS) {
+            Sleep((DWORD)((remaining - THROTTLE_SPIN_MICROSECONDS) / 1000));
+        }
+        else {
+            SwitchToThread();
+        }
+    }
+}
+
+
+/**
+ * @brief       Waits the latency of one operation, jitter included.
+ */
+static void Delay(void) {
+    uint64_t latency = (uint64_t)g_LatencyMicroseconds;
+    LONG jitter = g_JitterMicroseconds;
+    if (jitter > 0) {
+        latency += NextRandom() % ((uint64_t)jitter + 1);
+    }
+    WaitMicroseconds(latency);
+}
+
+
+/**
+ * @brief       Returns the backend that new operations are passed to.
+ */
+static const IO_BACKEND* CurrentInner(void) {
+    return g_Inner;
+}
+
+
+/**
+ * @brief       Opens a file of the inner backend after the latency.
+ */
+static IO_HANDLE ThrottledOpen(_In_z_ const char* path, _In_ IoOpenMode mode) {
+    THROTTLED_HANDLE* handle = (THROTTLED_HANDLE*)calloc(1, sizeof(THROTTLED_HANDLE));
+    if (handle == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    Delay();
+    handle->Inner = CurrentInner();
+    handle->Handle = handle->Inner->Open(path, mode);
+    if (handle->Handle == NULL) {
+        DWORD error = GetLastError();
+        free(handle);
+        SetLastError(error);
+        return NULL;
+    }
+    return (IO_HANDLE)handle;
+}
+
+
+/**
+ * @brief       Closes a file; closing costs no latency.
+ */
+static VOID ThrottledClose(_In_ IO_HANDLE handle) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    throttled->Inner->Close(throttled->Handle);
+    free(throttled);
+}
+
+
+/**
+ * @brief       Reads or writes after the latency, at the configured transfer rate.
+ */
+static bool ThrottledTransferAt(_In_ IO_HANDLE handle, _In_ uint64_t offset, _Inout_updates_bytes_(length) void* buffer, _In_ DWORD length, _In_ bool write, _Out_ DWORD* transferred) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    Delay();
+    RateLimiterAcquire(&g_Bandwidth, length, NULL);
+    return throttled->Inner->TransferAt(throttled->Handle, offset, buffer, length, write, transferred);
+}
+
+
+/**
+ * @brief       Returns the size of an open file; metadata of open files is cached, so without latency.
+ */
+static bool ThrottledGetSize(_In_ IO_HANDLE handle, _Out_ uint64_t* size) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    return throttled->Inner->GetSize(throttled->Handle, size);
+}
+
+
+/**
+ * @brief       Changes the size of an open file after the latency.
+ */
+static bool ThrottledSetSize(_In_ IO_HANDLE handle, _In_ uint64_t size) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    Delay();
+    return throttled->Inner->SetSize(throttled->Handle, size);
+}
+
+
+/**
+ * @brief       Reserves space for an open file after the latency.
+ */
+static bool ThrottledReserve(_In_ IO_HANDLE handle, _In_ uint64_t size) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    Delay();
+    return throttled->Inner->Reserve(throttled->Handle, size);
+}
+
+
+/**
+ * @brief       Returns the last write time of an open file, without latency.
+ */
+static bool ThrottledGetLastWriteTime(_In_ IO_HANDLE handle, _Out_ uint64_t* lastWriteTime) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    return throttled->Inner->GetLastWriteTime(throttled->Handle, lastWriteTime);
+}
+
+
+/**
+ * @brief       Sets the last write time of an open file, without latency.
+ */
+static bool ThrottledSetLastWriteTime(_In_ IO_HANDLE handle, _In_ uint64_t lastWriteTime) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    return throttled->Inner->SetLastWriteTime(throttled->Handle, lastWriteTime);
+}
+
+
+/**
+ * @brief       Flushes an open file after the latency.
+ */
+static bool ThrottledFlush(_In_ IO_HANDLE handle) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    Delay();
+    return throttled->Inner->Flush(throttled->Handle);
+}
+
+
+/**
+ * @brief       Turns on compression for an open file, without latency.
+ */
+static bool ThrottledSetCompression(_In_ IO_HANDLE handle) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    return throttled->Inner->SetCompression(throttled->Handle);
+}
+
+
+/**
+ * @brief       Marks an open file as sparse, without latency.
+ */
+static bool ThrottledSetSparse(_In_ IO_HANDLE handle) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    return throttled->Inner->SetSparse(throttled->Handle);
+}
+
+
+/**
+ * @brief       Lists the allocated ranges of an open file after the latency.
+ */
+static bool ThrottledQueryAllocatedRanges(_In_ IO_HANDLE handle, _In_ uint64_t fileSize, _Outptr_result_maybenull_ IO_RANGE** ranges, _Out_ DWORD* rangeCount) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    Delay();
+    return throttled->Inner->QueryAllocatedRanges(throttled->Handle, fileSize, ranges, rangeCount);
+}
+
+
+/**
+ * @brief       Maps an open file after the latency. Pages are not charged to the transfer rate.
+ */
+static bool ThrottledMapView(_In_ IO_HANDLE handle, _In_ uint64_t size, _In_ IoAccessPattern pattern, _Outptr_ const void** view) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    Delay();
+    return throttled->Inner->MapView(throttled->Handle, size, pattern, view);
+}
+
+
+/**
+ * @brief       Unmaps a view, without latency.
+ */
+static VOID ThrottledUnmapView(_In_ IO_HANDLE handle, _In_ const void* view) {
+    THROTTLED_HANDLE* throttled = (THROTTLED_HANDLE*)handle;
+    throttled->Inner->UnmapView(throttled->Handle, view);
+}
+
+
+/**
+ * @brief       Renames a file after the latency.
+ */
+static bool ThrottledReplace(_In_z_ const char* source, _In_z_ const char* destination) {
+    Delay();
+    return CurrentInner()->Replace(source, destination);
+}
+
+
+/**
+ * @brief       Deletes a file after the latency.
+ */
+static bool ThrottledDelete(_In_z_ const char* path) {
+    Delay();
+    return CurrentInner()->Delete(path);
+}
+
+
+/**
+ * @brief       Returns the attributes of a path after the latency.
+ */
+static bool ThrottledQueryInfo(_In_z_ const char* path, _Out_ IO_FILE_INFO* info) {
+    Delay();
+    return CurrentInner()->QueryInfo(path, info);
+}
+
+
+/**
+ * @brief       Lists a directory after the latency; the entries come with it.
+ */
+static bool ThrottledList(_In_z_ const char* directory, _In_ IO_ENUMERATE_CALLBACK callback, _In_opt_ void* context) {
+    Delay();
+    return CurrentInner()->List(directory, callback, context);
+}
+
+
+/**
+ * @brief       Creates a directory after the latency.
+ */
+static bool ThrottledMakeDirectory(_In_z_ const char* path) {
+    Delay();
+    return CurrentInner()->MakeDirectory(path);
+}
+
+
+/**
+ * @brief       Updates the last access time of a file after the latency.
+ */
+static bool ThrottledTouch(_In_z_ const char* path) {
+    Delay();
+    return CurrentInner()->Touch(path);
+}
+
+
+/**
+ * @brief       Flushes a file by path after the latency.
+ */
+static bool ThrottledFlushPath(_In_z_ const char* path) {
+    Delay();
+    return CurrentInner()->FlushPath(path);
+}
+
+
+// Global static variables
+static const IO_BACKEND g_ThrottledBackend = {
+    "throttled",
+    ThrottledOpen,
+    ThrottledClose,
+    ThrottledTransferAt,
+    ThrottledGetSize,
+    ThrottledSetSize,
+    ThrottledReserve,
+    ThrottledGetLastWriteTime,
+    ThrottledSetLastWriteTime,
+    ThrottledFlush,
+    ThrottledSetCompression,
+    ThrottledSetSparse,
+    ThrottledQueryAllocatedRanges,
+    ThrottledMapView,
+    ThrottledUnmapView,
+    ThrottledReplace,
+    ThrottledDelete,
+    ThrottledQueryInfo,
+    ThrottledList,
+    ThrottledMakeDirectory,
+    ThrottledTouch,
+    ThrottledFlushPath
+};
+
+
+VOID
+ThrottledBackendConfigure(
+    _In_ const IO_BACKEND* Inner,
+    _In_ uint32_t LatencyMicroseconds,
+    _In_ uint32_t JitterMicroseconds,
+    _In_ uint64_t BytesPerSecond
+)
+{
+    InterlockedExchangePointer((PVOID volatile*)&g_Inner, (PVOID)Inner);
+    InterlockedExchange(&g_LatencyMicroseconds, (LONG)min(LatencyMicroseconds, (uint32_t)MAXLONG));
+    InterlockedExchange(&g_JitterMicroseconds, (LONG)min(JitterMicroseconds, (uint32_t)MAXLONG));
+    InterlockedExchange64(&g_JitterState, (LONG64)THROTTLE_JITTER_SEED);
+    RateLimiterSetRate(&g_Bandwidth, BytesPerSecond);
+}
+
+
+const IO_BACKEND*
+ThrottledBackendGet(
+    VOID
+)
+{
+    return &g_ThrottledBackend;
+}
@@ -0,0 +1,49 @@
+#ifndef _THROTTLEDBACKEND_H_
+#define _THROTTLEDBACKEND_H_
+
+
+#include "includes.h"
+#include "IoBackend.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define THROTTLE_SPIN_MICROSECONDS 2000         // Shorter delays are waited out by spinning, longer ones mostly sleep
+#define THROTTLE_JITTER_SEED 0x5AFE5704A6EULL   // Fixed, so that runs with the same settings see the same delays
+
+
+/*
+ * @brief       Sets up the throttled backend, which makes another backend behave like a slower disk.
+ *
+ * @details     Every operation that would reach the disk (opening, reading, writing, flushing, renaming,
+ *              deleting, querying and listing) first waits LatencyMicroseconds plus a uniformly random
+ *              0 .. JitterMicroseconds. Reads and writes then also draw their bytes from a token bucket
+ *              shared by all threads, so the total transfer rate stays at BytesPerSecond.
+ *
+ *              Configure it before selecting it with IoSetBackend; the settings may be changed later.
+ *
+ * @param[in]   Inner               - The backend that performs the operations, e.g. the memory backend.
+ * @param[in]   LatencyMicroseconds - Fixed delay per operation.
+ * @param[in]   JitterMicroseconds  - Largest additional random delay per operation.
+ * @param[in]   BytesPerSecond      - Transfer rate; 0 for unlimited.
+ */
+VOID
+ThrottledBackendConfigure(
+    _In_ const IO_BACKEND* Inner,
+    _In_ uint32_t LatencyMicroseconds,
+    _In_ uint32_t JitterMicroseconds,
+    _In_ uint64_t BytesPerSecond
+);
+
+
+/*
+ * @brief       Returns the throttled backend. ThrottledBackendConfigure has to be called first.
+ */
+const IO_BACKEND*
+ThrottledBackendGet(
+    VOID
+);
+
+
+EXTERN_C_END;
+#endif  //_THROTTLEDBACKEND_H_
@@ -0,0 +1,398 @@
+#include "Tiering.h"
+#include "Commands.h"
+#include "FileIo.h"
+#include "RateLimit.h"
+#include "Striping.h"
+#include "Transfer.h"
+
+
+#define FILETIME_UNITS_PER_SECOND 10000000ULL
+#define TIERING_PROMOTING_SUFFIX "~promoting"   // Promoted copy, swapped in under g_TierLock once complete
+#define TIERING_MAX_PROMOTIONS 16               // Promotions that can run at the same time
+
+
+// Global static variables
+static SRWLOCK g_TierLock = SRWLOCK_INIT;       // Guards the configuration and every hot/cold swap
+static bool g_ColdTierEnabled = false;
+static char g_HotDirectory[MAX_PATH] = { 0 };
+static char g_ColdDirectory[MAX_PATH] = { 0 };
+static uint64_t g_ColdAfter = 0;                // FILETIME units
+static bool g_CompressCold = false;
+static RATE_LIMITER g_MigrationLimiter;
+static HANDLE g_MigratorThread = NULL;
+static HANDLE g_MigratorStop = NULL;
+static char g_Promoting[TIERING_MAX_PROMOTIONS][MAX_PATH] = { 0 };  // Hot paths being promoted; "" is a free slot
+static CONDITION_VARIABLE g_PromotionDone = CONDITION_VARIABLE_INIT;  // Signaled under g_TierLock when a slot frees up
+
+
+/**
+ * @brief       Maps a hot-tier path to the same relative path under the cold root.
+ *              Must be called with g_TierLock held.
+ *
+ * @return      TRUE if the path lies in the hot tier and the cold path fits; otherwise, FALSE.
+ */
+static bool ColdPathFor(_In_z_ const char* hotPath, _Out_writes_z_(MAX_PATH) char* coldPath) {
+    size_t hotLength = strlen(g_HotDirectory);
+    coldPath[0] = '\0';
+
+    if (_strnicmp(hotPath, g_HotDirectory, hotLength) != 0 || hotPath[hotLength] != '\\') {
+        return false;
+    }
+
+    return SUCCEEDED(StringCchPrintfA(coldPath, MAX_PATH, "%s%s", g_ColdDirectory, hotPath + hotLength));
+}
+
+
+/**
+ * @brief       Finds the g_Promoting slot holding a path ("" finds a free slot).
+ *              Must be called with g_TierLock held.
+ *
+ * @return      The index of the slot, or -1 if there is none.
+ */
+static int FindPromotion(_In_z_ const char* hotPath) {
+    for (int i = 0; i < TIERING_MAX_PROMOTIONS; i++) {
+        if (_stricmp(g_Promoting[i], hotPath) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * @brief       Creates the directory that will contain the given file.
+ */
+static bool CreateParentDirectory(_In_z_ const char* filePath) {
+    char parent[MAX_PATH];
+    if (FAILED(StringCchCopyA(parent, MAX_PATH, filePath))) {
+        return false;
+    }
+
+    char* lastSeparator = strrchr(parent, '\\');
+    if (lastSeparator == NULL) {
+        return true;
+    }
+    *lastSeparator = '\0';
+    return IoCreateDirectories(parent);
+}
+
+
+/**
+ * @brief       Copies a hot submission into <cold path>~partial within the I/O budget.
+ *              The copy keeps the hot file's last write time so that its manifest stays valid.
+ *              Migration always flushes the copy, whatever the durability mode, because the hot
+ *              copy is deleted afterwards.
+ *
+ * @return      TRUE if the complete copy is on disk; FALSE on error or when the migrator is stopping.
+ */
+static bool CopyToColdTier(_In_z_ const char* hotPath, _In_z_ const char* partialPath, _In_ const IO_FILE_INFO* hotInfo) {
+    uint64_t size = hotInfo->Size;
+
+    SS_FILE* source = StripingOpenFile(hotPath, IO_OPEN_READ);
+    if (source == NULL) {
+        return false;
+    }
+
+    SS_FILE* destination = IoOpenFile(partialPath, IO_OPEN_CREATE);
+    if (destination == NULL) {
+        IoCloseFile(source);
+        return false;
+    }
+
+    // Compressed files are allocated as they are written; only plain copies are preallocated
+    bool result = g_CompressCold ? IoSetCompression(destination) : IoPreallocate(destination, size);
+    BYTE* buffer = (BYTE*)malloc(CHUNK_SIZE);
+    result = result && (buffer != NULL);
+
+    for (uint64_t offset = 0; result && offset < size; offset += CHUNK_SIZE) {
+        DWORD length = (DWORD)min((uint64_t)CHUNK_SIZE, size - offset);
+        DWORD bytesRead = 0;
+
+        // Each chunk is read once and written once
+        result = RateLimiterAcquire(&g_MigrationLimiter, 2ULL * length, g_MigratorStop) &&
+                 IoReadAt(source, offset, buffer, length, &bytesRead) && bytesRead == length &&
+                 IoWriteAt(destination, offset, buffer, length);
+    }
+
+    result = result && IoSetLastWriteTime(destination, hotInfo->LastWriteTime) && IoFlushFile(destination);
+
+    free(buffer);
+    IoCloseFile(destination);
+    IoCloseFile(source);
+    return result;
+}
+
+
+/**
+ * @brief       Moves one submission to the cold tier. The hot copy is only deleted if it has not been
+ *              overwritten while the cold copy was being made; otherwise the cold copy is dropped.
+ *              Stores publish through TieringReplaceFile, so none can land between the check and the delete.
+ */
+static void MigrateSubmission(_In_z_ const char* hotPath, _In_ const IO_FILE_INFO* hotInfo) {
+    char coldPath[MAX_PATH];
+    char partialPath[MAX_PATH];
+
+    AcquireSRWLockShared(&g_TierLock);
+    bool mapped = ColdPathFor(hotPath, coldPath);
+    ReleaseSRWLockShared(&g_TierLock);
+
+    if (!mapped || FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", coldPath, TRANSFER_PARTIAL_SUFFIX)) ||
+        !CreateParentDirectory(coldPath)) {
+        return;
+    }
+
+    if (!CopyToColdTier(hotPath, partialPath, hotInfo) || !IoReplaceFile(partialPath, coldPath)) {
+        IoDeleteFile(partialPath);
+        return;
+    }
+
+    AcquireSRWLockExclusive(&g_TierLock);
+    IO_FILE_INFO currentInfo = { 0 };
+    if (IoQueryFileInfo(hotPath, &currentInfo) &&
+        currentInfo.Size == hotInfo->Size &&
+        currentInfo.LastWriteTime == hotInfo->LastWriteTime &&
+        StripingDeleteFile(hotPath)) {
+        printf("Moved %s to the cold tier.\n", hotPath);
+    }
+    else {
+        IoDeleteFile(coldPath);
+    }
+    ReleaseSRWLockExclusive(&g_TierLock);
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of the migrator. Skips in-progress and internal files ('~')
+ *              and migrates submissions that have not been accessed for the configured time.
+ */
+static IoEnumerateAction MigrateIfCold(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    UNREFERENCED_PARAMETER(context);
+
+    if (WaitForSingleObject(g_MigratorStop, 0) == WAIT_OBJECT_0) {
+        return IO_ENUMERATE_STOP;
+    }
+
+    if (strchr(name, '~') != NULL) {
+        return IO_ENUMERATE_SKIP;
+    }
+
+    if (info->IsDirectory) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    uint64_t nowTime = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    if (nowTime > info->LastAccessTime && nowTime - info->LastAccessTime >= g_ColdAfter) {
+        MigrateSubmission(path, info);
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Migrator thread. Walks the hot tier once per TIERING_SCAN_INTERVAL_MS at background
+ *              (low CPU and I/O) priority until the stop event is signaled.
+ */
+static DWORD WINAPI MigratorThreadProc(_In_ LPVOID parameter) {
+    UNREFERENCED_PARAMETER(parameter);
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+    char usersDirectory[MAX_PATH];
+    if (FAILED(StringCchPrintfA(usersDirectory, MAX_PATH, "%s\\users", g_HotDirectory))) {
+        return 1;
+    }
+
+    do {
+        IoEnumerateFiles(usersDirectory, true, MigrateIfCold, NULL);
+    } while (WaitForSingleObject(g_MigratorStop, TIERING_SCAN_INTERVAL_MS) == WAIT_TIMEOUT);
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return 0;
+}
+
+
+bool
+TieringStart(
+    _In_z_ const char* HotDirectory,
+    _In_z_ const char* ColdDirectory,
+    _In_ uint32_t ColdAfterSeconds,
+    _In_ uint64_t BytesPerSecond,
+    _In_ bool Compress
+)
+{
+    TieringStop();
+
+    char coldUsersDirectory[MAX_PATH];
+    if (FAILED(StringCchPrintfA(coldUsersDirectory, MAX_PATH, "%s\\users", ColdDirectory)) ||
+        !IoCreateDirectories(coldUsersDirectory)) {
+        printf("Failed to create the cold tier directory: %lu\n", GetLastError());
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_TierLock);
+    StringCchCopyA(g_HotDirectory, MAX_PATH, HotDirectory);
+    StringCchCopyA(g_ColdDirectory, MAX_PATH, ColdDirectory);
+    g_ColdAfter = (uint64_t)ColdAfterSeconds * FILETIME_UNITS_PER_SECOND;
+    g_CompressCold = Compress;
+    g_ColdTierEnabled = true;
+    ReleaseSRWLockExclusive(&g_TierLock);
+
+    RateLimiterInit(&g_MigrationLimiter, BytesPerSecond);
+
+    g_MigratorStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (g_MigratorStop == NULL) {
+        return false;
+    }
+
+    g_MigratorThread = CreateThread(NULL, 0, MigratorThreadProc, NULL, 0, NULL);
+    if (g_MigratorThread == NULL) {
+        printf("Failed to start the cold tier migrator: %lu\n", GetLastError());
+        CloseHandle(g_MigratorStop);
+        g_MigratorStop = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+
+VOID
+TieringStop(
+    VOID
+)
+{
+    if (g_MigratorThread != NULL) {
+        SetEvent(g_MigratorStop);
+        WaitForSingleObject(g_MigratorThread, INFINITE);
+        CloseHandle(g_MigratorThread);
+        g_MigratorThread = NULL;
+    }
+
+    if (g_MigratorStop != NULL) {
+        CloseHandle(g_MigratorStop);
+        g_MigratorStop = NULL;
+    }
+}
+
+
+NTSTATUS
+TieringEnsureHot(
+    _In_z_ const char* SubmissionPath
+)
+{
+    IO_FILE_INFO info = { 0 };
+    char coldPath[MAX_PATH];
+    char promotingPath[MAX_PATH];
+    NTSTATUS status = STATUS_SUCCESS;
+    int slot = -1;
+
+    // Only claiming the submission and swapping it in happen under the lock; the copy itself runs without it
+    AcquireSRWLockExclusive(&g_TierLock);
+    while (g_ColdTierEnabled && !IoQueryFileInfo(SubmissionPath, &info) && ColdPathFor(SubmissionPath, coldPath)) {
+        if (!IoQueryFileInfo(coldPath, &info)) {
+            status = STATUS_OBJECT_NAME_NOT_FOUND;
+            break;
+        }
+
+        if (FindPromotion(SubmissionPath) < 0 && (slot = FindPromotion("")) >= 0) {
+            StringCchCopyA(g_Promoting[slot], MAX_PATH, SubmissionPath);
+            break;
+        }
+
+        // Someone else is promoting this submission, or too many promotions run at once: wait and look again
+        SleepConditionVariableSRW(&g_PromotionDone, &g_TierLock, INFINITE, 0);
+    }
+    ReleaseSRWLockExclusive(&g_TierLock);
+
+    if (slot < 0) {
+        return status;
+    }
+
+    if (FAILED(StringCchPrintfA(promotingPath, MAX_PATH, "%s%s", SubmissionPath, TIERING_PROMOTING_SUFFIX))) {
+        status = STATUS_BUFFER_OVERFLOW;
+    }
+    else {
+        status = TransferFile(coldPath, promotingPath, NULL, TRANSFER_FLAG_SPARSE | TRANSFER_FLAG_STRIPED);
+    }
+
+    AcquireSRWLockExclusive(&g_TierLock);
+    if (NT_SUCCESS(status)) {
+        if (IoQueryFileInfo(SubmissionPath, &info)) {
+            // Overwritten while being promoted: the new file wins and its store drops the cold copy
+            StripingDeleteFile(promotingPath);
+        }
+        else if (StripingReplaceFile(promotingPath, SubmissionPath)) {
+            IoDeleteFile(coldPath);
+            printf("Promoted %s from the cold tier.\n", SubmissionPath);
+        }
+        else {
+            StripingDeleteFile(promotingPath);
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+    g_Promoting[slot][0] = '\0';
+    WakeAllConditionVariable(&g_PromotionDone);
+    ReleaseSRWLockExclusive(&g_TierLock);
+
+    return status;
+}
+
+
+VOID
+TieringRecordAccess(
+    _In_z_ const char* SubmissionPath
+)
+{
+    AcquireSRWLockShared(&g_TierLock);
+    if (g_ColdTierEnabled) {
+        IoTouchFile(SubmissionPath);
+    }
+    ReleaseSRWLockShared(&g_TierLock);
+}
+
+
+VOID
+TieringDiscardCold(
+    _In_z_ const char* SubmissionPath
+)
+{
+    char coldPath[MAX_PATH];
+
+    AcquireSRWLockExclusive(&g_TierLock);
+    if (g_ColdTierEnabled && ColdPathFor(SubmissionPath, coldPath)) {
+        IoDeleteFile(coldPath);
+    }
+    ReleaseSRWLockExclusive(&g_TierLock);
+}
+
+
+bool
+TieringReplaceFile(
+    _In_z_ const char* PartialPath,
+    _In_z_ const char* DestinationPath
+)
+{
+    // Publishes only exclude the migrator's check-and-delete and the swap of a promotion, not each other
+    AcquireSRWLockShared(&g_TierLock);
+    bool result = StripingReplaceFile(PartialPath, DestinationPath);
+    ReleaseSRWLockShared(&g_TierLock);
+
+    return result;
+}
+
+
+bool
+TieringGetColdPath(
+    _In_z_ const char* SubmissionPath,
+    _Out_writes_z_(MAX_PATH) char* ColdPath
+)
+{
+    AcquireSRWLockShared(&g_TierLock);
+    bool result = g_ColdTierEnabled && ColdPathFor(SubmissionPath, ColdPath);
+    ReleaseSRWLockShared(&g_TierLock);
+
+    return result;
+}
@@ -0,0 +1,112 @@
+#ifndef _TIERING_H_
+#define _TIERING_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define TIERING_SCAN_INTERVAL_MS 60000          // How often the migrator looks for cold submissions
+
+
+/*
+ * @brief       Enables the cold tier and (re)starts the background migrator.
+ *
+ * @details     Submissions live under <HotDirectory>\\users. The migrator periodically walks that tree and moves
+ *              every submission whose last access is older than ColdAfterSeconds to the same relative path
+ *              under <ColdDirectory>\\users, reading and writing no more than BytesPerSecond. With Compress set
+ *              the cold copies are NTFS-compressed.
+ *
+ * @param[in]   HotDirectory        - The application directory (%APPDIR%).
+ * @param[in]   ColdDirectory       - Root of the cold tier. Created if missing.
+ * @param[in]   ColdAfterSeconds    - Idle time after which a submission is considered cold.
+ * @param[in]   BytesPerSecond      - I/O budget of the migrator; 0 means unlimited.
+ * @param[in]   Compress            - Whether to compress cold copies.
+ *
+ * @return      TRUE if the cold tier is usable and the migrator is running; otherwise, FALSE.
+ */
+bool
+TieringStart(
+    _In_z_ const char* HotDirectory,
+    _In_z_ const char* ColdDirectory,
+    _In_ uint32_t ColdAfterSeconds,
+    _In_ uint64_t BytesPerSecond,
+    _In_ bool Compress
+);
+
+
+/*
+ * @brief       Stops the migrator. A migration in progress is abandoned and its partial copy removed.
+ *              Submissions already in the cold tier stay there and can still be promoted.
+ */
+VOID
+TieringStop(
+    VOID
+);
+
+
+/*
+ * @brief       Makes sure a submission is in the hot tier before it is read.
+ *
+ * @details     If the hot file is missing but a cold copy exists, the cold copy is copied back next to the hot
+ *              path without holding the tier lock, then renamed over it and removed from the cold tier under
+ *              the lock. Callers promoting the same submission wait for the first one. If the submission is
+ *              stored again meanwhile, the promoted copy is dropped.
+ *
+ * @param[in]   SubmissionPath  - Hot-tier path of the submission.
+ *
+ * @return      STATUS_SUCCESS if the submission is (now) in the hot tier, STATUS_OBJECT_NAME_NOT_FOUND if it
+ *              exists in neither tier, or the failure status of the promotion.
+ */
+NTSTATUS
+TieringEnsureHot(
+    _In_z_ const char* SubmissionPath
+);
+
+
+/*
+ * @brief       Records an access to a hot submission so the migrator keeps it hot.
+ */
+VOID
+TieringRecordAccess(
+    _In_z_ const char* SubmissionPath
+);
+
+
+/*
+ * @brief       Removes the cold copy of a submission that has just been overwritten in the hot tier.
+ */
+VOID
+TieringDiscardCold(
+    _In_z_ const char* SubmissionPath
+);
+
+
+/*
+ * @brief       Publishes a finished copy over its destination (see StripingReplaceFile).
+ *
+ * @details     The rename runs under the tier lock, so that it cannot land between the migrator checking that
+ *              a hot submission is unchanged and deleting it. Must not be called with the tier lock held.
+ */
+bool
+TieringReplaceFile(
+    _In_z_ const char* PartialPath,
+    _In_z_ const char* DestinationPath
+);
+
+
+/*
+ * @brief       Returns where the cold copy of a submission would be.
+ *
+ * @return      TRUE if the cold tier is enabled; otherwise, FALSE.
+ */
+bool
+TieringGetColdPath(
+    _In_z_ const char* SubmissionPath,
+    _Out_writes_z_(MAX_PATH) char* ColdPath
+);
+
+
+EXTERN_C_END;
+#endif  //_TIERING_H_
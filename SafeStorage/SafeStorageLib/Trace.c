@@ -0,0 +1,197 @@
+#include "Trace.h"
+#include <ctype.h>
+
+
+// Global static variables
+static SRWLOCK g_TraceLock = SRWLOCK_INIT;      // Guards everything below
+static HANDLE g_TraceFile = INVALID_HANDLE_VALUE;
+static volatile LONG g_TraceRecording = FALSE;  // Read without the lock by every command
+static LARGE_INTEGER g_TraceFrequency = { 0 };
+static LARGE_INTEGER g_TraceOrigin = { 0 };     // Performance counter at the start of the recording
+static uint32_t g_TraceSession = 0;
+static TRACE_RECORD g_TraceBuffer[TRACE_BUFFER_RECORDS];
+static DWORD g_TraceBuffered = 0;
+
+
+/**
+ * @brief       Microseconds from the start of the recording to now.
+ */
+static uint64_t TraceNow(VOID) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // Whole seconds first, so that long recordings do not overflow
+    uint64_t ticks = (uint64_t)(now.QuadPart - g_TraceOrigin.QuadPart);
+    uint64_t frequency = (uint64_t)g_TraceFrequency.QuadPart;
+    return ticks / frequency * 1000000ULL + ticks % frequency * 1000000ULL / frequency;
+}
+
+
+/**
+ * @brief       Writes the buffered records to the trace file. Called with g_TraceLock held exclusively.
+ */
+static bool FlushTraceBuffer(VOID) {
+    DWORD size = g_TraceBuffered * (DWORD)sizeof(TRACE_RECORD);
+    DWORD written = 0;
+
+    g_TraceBuffered = 0;
+    if (size == 0) {
+        return true;
+    }
+    if (!WriteFile(g_TraceFile, g_TraceBuffer, size, &written, NULL) || written != size) {
+        printf("Failed to write the command trace: %lu\n", GetLastError());
+        return false;
+    }
+    return true;
+}
+
+
+bool
+TraceStart(
+    _In_z_ const char* Path
+)
+{
+    AcquireSRWLockExclusive(&g_TraceLock);
+
+    if (g_TraceFile != INVALID_HANDLE_VALUE) {
+        ReleaseSRWLockExclusive(&g_TraceLock);
+        return false;
+    }
+
+    HANDLE file = CreateFileA(Path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        ReleaseSRWLockExclusive(&g_TraceLock);
+        return false;
+    }
+
+    TRACE_HEADER header = { 0 };
+    FILETIME now;
+    DWORD written = 0;
+    GetSystemTimeAsFileTime(&now);
+    header.Magic = TRACE_MAGIC;
+    header.Version = TRACE_VERSION;
+    header.RecordSize = sizeof(TRACE_RECORD);
+    header.StartTime = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    if (!WriteFile(file, &header, sizeof(header), &written, NULL) || written != sizeof(header)) {
+        DWORD error = GetLastError();
+        CloseHandle(file);
+        DeleteFileA(Path);
+        ReleaseSRWLockExclusive(&g_TraceLock);
+        SetLastError(error);
+        return false;
+    }
+
+    QueryPerformanceFrequency(&g_TraceFrequency);
+    QueryPerformanceCounter(&g_TraceOrigin);
+    g_TraceFile = file;
+    g_TraceSession = 0;
+    g_TraceBuffered = 0;
+    InterlockedExchange(&g_TraceRecording, TRUE);
+
+    ReleaseSRWLockExclusive(&g_TraceLock);
+    return true;
+}
+
+
+VOID
+TraceStop(
+    VOID
+)
+{
+    AcquireSRWLockExclusive(&g_TraceLock);
+
+    if (g_TraceFile != INVALID_HANDLE_VALUE) {
+        InterlockedExchange(&g_TraceRecording, FALSE);
+        FlushTraceBuffer();
+        CloseHandle(g_TraceFile);
+        g_TraceFile = INVALID_HANDLE_VALUE;
+    }
+
+    ReleaseSRWLockExclusive(&g_TraceLock);
+}
+
+
+bool
+TraceIsRecording(
+    VOID
+)
+{
+    return InterlockedCompareExchange(&g_TraceRecording, FALSE, FALSE) != FALSE;
+}
+
+
+VOID
+TraceBegin(
+    _In_ TRACE_OPERATION Operation,
+    _In_reads_opt_(NameLength) const char* Name,
+    _In_ uint16_t NameLength,
+    _In_ uint16_t ArgumentLength,
+    _Out_ TRACE_RECORD* Record
+)
+{
+    memset(Record, 0, sizeof(*Record));
+    Record->Operation = TRACE_OP_NONE;
+    if (!TraceIsRecording()) {
+        return;
+    }
+
+    // The caller's arguments are not validated yet
+    Record->Operation = (uint16_t)Operation;
+    Record->NameLength = NameLength;
+    Record->ArgumentLength = ArgumentLength;
+    Record->Target = (Name != NULL) ? TraceHashName(Name, NameLength) : 0;
+    Record->ThreadId = GetCurrentThreadId();
+    Record->StartMicroseconds = TraceNow();
+}
+
+
+VOID
+TraceEnd(
+    _Inout_ TRACE_RECORD* Record,
+    _In_ NTSTATUS Status
+)
+{
+    if (Record->Operation == TRACE_OP_NONE) {
+        return;
+    }
+
+    // Before waiting for the lock, which is not part of the command
+    uint64_t end = TraceNow();
+
+    AcquireSRWLockExclusive(&g_TraceLock);
+
+    // A command that outlived its recording is dropped
+    if (g_TraceFile == INVALID_HANDLE_VALUE) {
+        ReleaseSRWLockExclusive(&g_TraceLock);
+        return;
+    }
+
+    if (Record->Operation == TRACE_OP_LOGIN && NT_SUCCESS(Status)) {
+        g_TraceSession++;
+    }
+    Record->DurationMicroseconds = end - Record->StartMicroseconds;
+    Record->Status = Status;
+    Record->Session = g_TraceSession;
+
+    g_TraceBuffer[g_TraceBuffered++] = *Record;
+    if (g_TraceBuffered == TRACE_BUFFER_RECORDS) {
+        FlushTraceBuffer();
+    }
+
+    ReleaseSRWLockExclusive(&g_TraceLock);
+}
+
+
+uint64_t
+TraceHashName(
+    _In_reads_(Length) const char* Name,
+    _In_ size_t Length
+)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < Length && Name[i] != '\0'; i++) {
+        hash = (hash ^ (BYTE)tolower((BYTE)Name[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,142 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define TRACE_MAGIC 0x52545353                  // "SSTR"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_RECORDS 256                // Records collected in memory before they are written out
+
+
+// The command a trace record describes
+typedef enum _TRACE_OPERATION {
+    TRACE_OP_REGISTER = 0,
+    TRACE_OP_LOGIN,
+    TRACE_OP_LOGOUT,
+    TRACE_OP_STORE,                             // A file
+    TRACE_OP_STORE_STREAM,                      // A read routine or a handle (the CLI's "store -")
+    TRACE_OP_RETRIEVE,
+    TRACE_OP_RETRIEVE_DELTA,
+    TRACE_OP_RETRIEVE_VERSION,
+    TRACE_OP_SNAPSHOT,
+    TRACE_OP_RETRIEVE_SNAPSHOT,
+    TRACE_OP_STORE_TREE,
+    TRACE_OP_STORE_FILES,
+    TRACE_OP_RETRIEVE_TREE,
+    TRACE_OP_USAGE,
+    TRACE_OP_COUNT,
+    TRACE_OP_NONE = 0xFFFF                      // A command begun while no trace was being recorded
+} TRACE_OPERATION;
+
+
+// Start of a trace file, followed by TRACE_RECORDs in the order the commands returned
+typedef struct _TRACE_HEADER {
+    uint32_t Magic;                             // TRACE_MAGIC
+    uint32_t Version;                           // TRACE_VERSION
+    uint32_t RecordSize;                        // sizeof(TRACE_RECORD)
+    uint32_t Reserved;
+    uint64_t StartTime;                         // FILETIME at which the recording started
+} TRACE_HEADER;
+
+
+// One command. Names and paths are not recorded, only their lengths and a hash that tells them apart.
+typedef struct _TRACE_RECORD {
+    uint64_t StartMicroseconds;                 // When the command was called, since the recording started
+    uint64_t DurationMicroseconds;
+    uint64_t Target;                            // TraceHashName of the user (register, login), submission or prefix
+    uint64_t Bytes;                             // Stored by a store command
+    uint32_t Session;                           // Logins since the recording started, the command's own included
+    uint32_t Count;                             // Files of a bulk command; version or snapshot of a retrieve or snapshot
+    int32_t Status;                             // NTSTATUS returned
+    uint32_t ThreadId;                          // Caller's thread, so that concurrent commands can be told apart
+    uint16_t Operation;                         // TRACE_OPERATION
+    uint16_t NameLength;                        // Length of the user, submission or prefix argument
+    uint16_t ArgumentLength;                    // Length of the password or path argument
+    uint16_t Reserved;
+} TRACE_RECORD;
+
+
+/*
+ * @brief       Starts recording every command to a new trace file.
+ *
+ * @details     The file is written through the operating system directly, whichever I/O backend is selected,
+ *              so that recording does not add to the I/O being traced. Records are collected in memory and
+ *              written TRACE_BUFFER_RECORDS at a time; the rest are written when the recording stops.
+ *
+ * @param[in]   Path            - The trace file; replaced if it exists.
+ *
+ * @return      FALSE if a trace is already being recorded or the file cannot be created.
+ */
+bool
+TraceStart(
+    _In_z_ const char* Path
+);
+
+
+/*
+ * @brief       Writes the records still in memory and closes the trace file. Does nothing if no trace is
+ *              being recorded.
+ */
+VOID
+TraceStop(
+    VOID
+);
+
+
+/*
+ * @brief       Returns TRUE while a trace is being recorded.
+ */
+bool
+TraceIsRecording(
+    VOID
+);
+
+
+/*
+ * @brief       Starts the record of a command: zeroes it, hashes the name and takes the start time. Costs one
+ *              check if no trace is being recorded.
+ *
+ * @param[in]   Operation       - The command.
+ * @param[in]   Name            - The user, submission or prefix argument; NULL if the command has none.
+ * @param[in]   NameLength      - The length of Name.
+ * @param[in]   ArgumentLength  - The length of the password or path argument.
+ * @param[out]  Record          - Receives the record; its Operation is TRACE_OP_NONE if nothing is recorded.
+ */
+VOID
+TraceBegin(
+    _In_ TRACE_OPERATION Operation,
+    _In_reads_opt_(NameLength) const char* Name,
+    _In_ uint16_t NameLength,
+    _In_ uint16_t ArgumentLength,
+    _Out_ TRACE_RECORD* Record
+);
+
+
+/*
+ * @brief       Completes the record of a command with its duration and status and appends it to the trace.
+ *              The caller fills Bytes and Count beforehand. A successful login starts a new session.
+ */
+VOID
+TraceEnd(
+    _Inout_ TRACE_RECORD* Record,
+    _In_ NTSTATUS Status
+);
+
+
+/*
+ * @brief       Hashes a name case-insensitively (FNV-1a), the way the file systems compare names. Stops at a
+ *              NULL character, so that a length larger than the caller's string is harmless.
+ */
+uint64_t
+TraceHashName(
+    _In_reads_(Length) const char* Name,
+    _In_ size_t Length
+);
+
+
+EXTERN_C_END;
+#endif  //_TRACE_H_
@@ -0,0 +1,1014 @@
+#include "Transfer.h"
+#include "Autotune.h"
+#include "Checkpoint.h"
+#include "Commands.h"
+#include "Durability.h"
+#include "FileIo.h"
+#include "Manifest.h"
+#include "Scheduler.h"
+#include "Striping.h"
+#include "ThreadPool.h"
+#include "Tiering.h"
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+
+// Shared by all chunk tasks of one transfer
+typedef struct _TRANSFER_CONTEXT {
+    SS_FILE* Source;
+    SS_FILE* Destination;
+    uint64_t FileSize;
+    uint64_t ChunkCount;
+    DWORD ChunkSize;
+    SS_CHECKPOINT* Checkpoint;                  // NULL unless the transfer is resumable
+    SS_MANIFEST* Manifest;                      // NULL unless block checksums are recorded
+    SCHEDULER_QUEUE* Queue;                     // Every chunk I/O waits for its turn here
+    volatile LONG Failed;                       // Set by the first chunk that fails; the others are skipped
+    volatile LONG64 RewrittenChunks;            // Delta transfers: chunks that differed and were written
+    IO_RANGE* AllocatedRanges;                  // Sparse transfers: data ranges of the source, ascending
+    DWORD AllocatedRangeCount;
+    bool SkipHoles;                             // Chunks outside AllocatedRanges are holes and are not copied
+    bool DetectZeros;                           // All-zero chunks are not written
+    BYTE ZeroChunkHash[HASH_LENGTH];            // Checksum of ChunkSize zero bytes, for the manifest of skipped chunks
+    volatile LONG64 SkippedChunks;              // Sparse transfers: chunks left as holes
+    volatile LONG64 BytesRead;                  // What the transfer moved, for the tuner
+    uint64_t BatchFirst;                        // Chunks [BatchFirst, BatchEnd) are copied by the current batch
+    uint64_t BatchEnd;
+    DWORD SpanChunks;                           // Chunks per I/O in the current batch
+    DWORD Depth;                                // Lanes of the current batch
+} TRANSFER_CONTEXT;
+
+
+// A chunk buffer of a streamed transfer
+typedef struct _STREAM_SLOT {
+    BYTE* Buffer;                               // CHUNK_SIZE bytes
+    uint64_t Chunk;                             // The chunk it holds
+    DWORD Length;
+} STREAM_SLOT;
+
+
+// Shared by the reader and the chunk tasks of one streamed transfer
+typedef struct _STREAM_CONTEXT {
+    SS_FILE* Destination;
+    SS_MANIFEST* Manifest;                      // NULL unless block checksums are recorded
+    SCHEDULER_QUEUE* Queue;
+    bool DetectZeros;                           // All-zero chunks are not written
+    volatile LONG Failed;                       // Set by the first chunk that fails; the reader then stops
+    volatile LONG64 SkippedChunks;
+    STREAM_SLOT Slots[TRANSFER_STREAM_BUFFERS];
+    DWORD FreeSlots[TRANSFER_STREAM_BUFFERS];   // Stack of the slots not being written
+    DWORD FreeCount;
+    SRWLOCK Lock;                               // Guards FreeSlots
+    CONDITION_VARIABLE SlotFreed;
+} STREAM_CONTEXT;
+
+
+/**
+ * @brief       Returns TRUE if every byte of the buffer is zero. Scans 64 bytes per iteration with SSE2.
+ */
+static bool IsZeroBuffer(_In_reads_bytes_(length) const BYTE* buffer, _In_ DWORD length) {
+    DWORD i = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    for (; i + 64 <= length; i += 64) {
+        __m128i any = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(buffer + i)), _mm_loadu_si128((const __m128i*)(buffer + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(buffer + i + 32)), _mm_loadu_si128((const __m128i*)(buffer + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        if (buffer[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Returns TRUE if [offset, offset + length) does not overlap any allocated range of the source.
+ */
+static bool IsHole(_In_ const TRANSFER_CONTEXT* transfer, _In_ uint64_t offset, _In_ DWORD length) {
+    if (!transfer->SkipHoles) {
+        return false;
+    }
+
+    // First range that ends after offset
+    DWORD low = 0;
+    DWORD high = transfer->AllocatedRangeCount;
+    while (low < high) {
+        DWORD middle = low + (high - low) / 2;
+        const IO_RANGE* range = &transfer->AllocatedRanges[middle];
+        if (range->Offset + range->Length <= offset) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return low == transfer->AllocatedRangeCount || transfer->AllocatedRanges[low].Offset >= offset + length;
+}
+
+
+/**
+ * @brief       Checksum of a chunk of zeros. Only the last chunk of a file can be shorter than ChunkSize.
+ */
+static bool HashZeroChunk(_In_ const TRANSFER_CONTEXT* transfer, _In_ DWORD length, _Out_writes_bytes_all_(HASH_LENGTH) BYTE* hash) {
+    if (length == transfer->ChunkSize) {
+        memcpy(hash, transfer->ZeroChunkHash, HASH_LENGTH);
+        return true;
+    }
+
+    BYTE* zeros = (BYTE*)calloc(1, length);
+    bool result = (zeros != NULL) && ManifestHashBlock(zeros, length, hash);
+    free(zeros);
+    return result;
+}
+
+
+/**
+ * @brief       Copies one chunk from its offset in the source to the same offset in the destination.
+ *              The I/O is admitted by the scheduler, so concurrent transfers share the disk fairly.
+ */
+static void TransferChunk(_Inout_ TRANSFER_CONTEXT* transfer, _In_ uint64_t chunk) {
+    if (transfer->Failed) {
+        return;
+    }
+
+    uint64_t offset = chunk * transfer->ChunkSize;
+    DWORD length = (DWORD)min((uint64_t)transfer->ChunkSize, transfer->FileSize - offset);
+    DWORD bytesRead = 0;
+
+    // Already copied by an earlier, interrupted transfer; only its checksum may still be needed
+    bool resumed = transfer->Checkpoint != NULL && CheckpointIsChunkDone(transfer->Checkpoint, chunk);
+    if (resumed && transfer->Manifest == NULL) {
+        return;
+    }
+
+    // A hole of the source is neither read nor written: the sized, sparse destination already reads as zeros there
+    bool zero = IsHole(transfer, offset, length);
+    if (zero) {
+        if (transfer->Manifest != NULL && !HashZeroChunk(transfer, length, transfer->Manifest->BlockHashes[chunk])) {
+            InterlockedExchange(&transfer->Failed, TRUE);
+            return;
+        }
+        if (transfer->Checkpoint != NULL && !resumed) {
+            CheckpointMarkChunkDone(transfer->Checkpoint, chunk, transfer->Destination);
+        }
+        InterlockedIncrement64(&transfer->SkippedChunks);
+        return;
+    }
+
+    BYTE* buffer = (BYTE*)malloc(length);
+    if (buffer == NULL) {
+        InterlockedExchange(&transfer->Failed, TRUE);
+        return;
+    }
+
+    SchedulerAcquire(transfer->Queue, length);
+    bool result = false;
+    if (resumed) {
+        result = IoReadAt(transfer->Destination, offset, buffer, length, &bytesRead) && bytesRead == length;
+    }
+    else {
+        result = IoReadAt(transfer->Source, offset, buffer, length, &bytesRead) && bytesRead == length;
+        zero = result && transfer->DetectZeros && IsZeroBuffer(buffer, length);
+        result = result && (zero || IoWriteAt(transfer->Destination, offset, buffer, length));
+    }
+    SchedulerRelease();
+
+    if (!result) {
+        printf("Failed to copy chunk %llu: %lu\n", chunk, GetLastError());
+    }
+    else {
+        InterlockedAdd64(&transfer->BytesRead, length);
+        if (zero) {
+            InterlockedIncrement64(&transfer->SkippedChunks);
+        }
+    }
+
+    // Chunks and manifest blocks have the same size, so the chunk index is the block index
+    if (result && transfer->Manifest != NULL &&
+        !(zero ? HashZeroChunk(transfer, length, transfer->Manifest->BlockHashes[chunk]) :
+                 ManifestHashBlock(buffer, length, transfer->Manifest->BlockHashes[chunk]))) {
+        printf("Failed to checksum chunk %llu\n", chunk);
+        result = false;
+    }
+
+    if (!result) {
+        InterlockedExchange(&transfer->Failed, TRUE);
+    }
+    else if (transfer->Checkpoint != NULL && !resumed) {
+        CheckpointMarkChunkDone(transfer->Checkpoint, chunk, transfer->Destination);
+    }
+
+    free(buffer);
+}
+
+
+/**
+ * @brief       Copies consecutive chunks with a single read and, unless some of them are all zeros, a single
+ *              write. Spans touching a hole of the source or a chunk of a resumed transfer are copied chunk by
+ *              chunk, since those chunks are not read from the source.
+ */
+static void TransferSpan(_Inout_ TRANSFER_CONTEXT* transfer, _In_ uint64_t first, _In_ DWORD count) {
+    uint64_t offset = first * transfer->ChunkSize;
+    DWORD length = (DWORD)min((uint64_t)count * transfer->ChunkSize, transfer->FileSize - offset);
+
+    bool whole = count > 1;
+    for (DWORD i = 0; whole && i < count; i++) {
+        uint64_t chunkOffset = offset + (uint64_t)i * transfer->ChunkSize;
+        whole = !IsHole(transfer, chunkOffset, (DWORD)min((uint64_t)transfer->ChunkSize, transfer->FileSize - chunkOffset)) &&
+                (transfer->Checkpoint == NULL || !CheckpointIsChunkDone(transfer->Checkpoint, first + i));
+    }
+    if (!whole) {
+        for (DWORD i = 0; i < count; i++) {
+            TransferChunk(transfer, first + i);
+        }
+        return;
+    }
+
+    if (transfer->Failed) {
+        return;
+    }
+
+    BYTE* buffer = (BYTE*)malloc(length);
+    if (buffer == NULL) {
+        InterlockedExchange(&transfer->Failed, TRUE);
+        return;
+    }
+
+    bool zero[AUTOTUNE_MAX_SPAN_CHUNKS] = { 0 };
+    DWORD bytesRead = 0;
+
+    SchedulerAcquire(transfer->Queue, length);
+    bool result = IoReadAt(transfer->Source, offset, buffer, length, &bytesRead) && bytesRead == length;
+
+    // Write every run of chunks that are not all zeros; without zero detection that is the whole span
+    DWORD runStart = 0;
+    for (DWORD i = 0; result && i <= count; i++) {
+        if (i < count) {
+            DWORD chunkOffset = i * transfer->ChunkSize;
+            zero[i] = transfer->DetectZeros && IsZeroBuffer(buffer + chunkOffset, min(transfer->ChunkSize, length - chunkOffset));
+            if (!zero[i]) {
+                continue;
+            }
+        }
+        if (i > runStart) {
+            DWORD runOffset = runStart * transfer->ChunkSize;
+            result = IoWriteAt(transfer->Destination, offset + runOffset, buffer + runOffset, min(i * transfer->ChunkSize, length) - runOffset);
+        }
+        runStart = i + 1;
+    }
+    SchedulerRelease();
+
+    if (!result) {
+        printf("Failed to copy chunks %llu to %llu: %lu\n", first, first + count - 1, GetLastError());
+        InterlockedExchange(&transfer->Failed, TRUE);
+        free(buffer);
+        return;
+    }
+    InterlockedAdd64(&transfer->BytesRead, length);
+
+    for (DWORD i = 0; result && i < count; i++) {
+        DWORD chunkOffset = i * transfer->ChunkSize;
+        DWORD chunkLength = min(transfer->ChunkSize, length - chunkOffset);
+        if (zero[i]) {
+            InterlockedIncrement64(&transfer->SkippedChunks);
+        }
+
+        if (transfer->Manifest != NULL &&
+            !(zero[i] ? HashZeroChunk(transfer, chunkLength, transfer->Manifest->BlockHashes[first + i]) :
+                        ManifestHashBlock(buffer + chunkOffset, chunkLength, transfer->Manifest->BlockHashes[first + i]))) {
+            printf("Failed to checksum chunk %llu\n", first + i);
+            InterlockedExchange(&transfer->Failed, TRUE);
+            result = false;
+        }
+        else if (transfer->Checkpoint != NULL) {
+            CheckpointMarkChunkDone(transfer->Checkpoint, first + i, transfer->Destination);
+        }
+    }
+
+    free(buffer);
+}
+
+
+/**
+ * @brief       Thread pool routine. Lane i of a batch copies its spans i, i + Depth, i + 2 * Depth and so on,
+ *              so that the transfer has at most Depth I/Os in flight and they stay close together in the file.
+ */
+static VOID TransferLane(_Inout_opt_ PVOID context, _In_ uint64_t lane) {
+    TRANSFER_CONTEXT* transfer = (TRANSFER_CONTEXT*)context;
+    uint64_t stride = (uint64_t)transfer->SpanChunks * transfer->Depth;
+
+    for (uint64_t first = transfer->BatchFirst + lane * transfer->SpanChunks;
+         first < transfer->BatchEnd && !transfer->Failed; first += stride) {
+        TransferSpan(transfer, first, (DWORD)min((uint64_t)transfer->SpanChunks, transfer->BatchEnd - first));
+    }
+}
+
+
+/**
+ * @brief       Thread pool routine of a delta transfer. Checksums one chunk of the existing destination
+ *              and, only if it differs from the source's recorded checksum, copies the chunk over it.
+ */
+static VOID TransferDeltaChunk(_Inout_opt_ PVOID context, _In_ uint64_t chunk) {
+    TRANSFER_CONTEXT* transfer = (TRANSFER_CONTEXT*)context;
+    if (transfer->Failed) {
+        return;
+    }
+
+    uint64_t offset = chunk * transfer->ChunkSize;
+    DWORD length = (DWORD)min((uint64_t)transfer->ChunkSize, transfer->FileSize - offset);
+    DWORD bytesRead = 0;
+    BYTE hash[HASH_LENGTH];
+
+    BYTE* buffer = (BYTE*)malloc(length);
+    if (buffer == NULL) {
+        InterlockedExchange(&transfer->Failed, TRUE);
+        return;
+    }
+
+    SchedulerAcquire(transfer->Queue, length);
+    bool result = IoReadAt(transfer->Destination, offset, buffer, length, &bytesRead) && bytesRead == length &&
+                  ManifestHashBlock(buffer, length, hash);
+    SchedulerRelease();
+
+    if (result && memcmp(hash, transfer->Manifest->BlockHashes[chunk], HASH_LENGTH) != 0) {
+        SchedulerAcquire(transfer->Queue, 2 * length);
+        result = IoReadAt(transfer->Source, offset, buffer, length, &bytesRead) && bytesRead == length &&
+                 IoWriteAt(transfer->Destination, offset, buffer, length);
+        SchedulerRelease();
+
+        InterlockedIncrement64(&transfer->RewrittenChunks);
+    }
+
+    if (!result) {
+        printf("Failed to update chunk %llu: %lu\n", chunk, GetLastError());
+        InterlockedExchange(&transfer->Failed, TRUE);
+    }
+
+    free(buffer);
+}
+
+
+/**
+ * @brief       Copies the chunks in batches on the library's work-stealing pool, one task per lane, with the
+ *              I/O size and depth the tuner picks for each batch (see AutotuneBegin).
+ *
+ * @return      TRUE if every chunk was copied; otherwise, FALSE.
+ */
+static bool RunChunkWorkers(_Inout_ TRANSFER_CONTEXT* transfer, _In_z_ const char* sourcePath, _In_z_ const char* destinationPath) {
+    // Deeper than the pool or the scheduler would only queue lanes behind each other
+    AUTOTUNE_SESSION tuning;
+    AutotuneBegin(sourcePath, destinationPath, transfer->FileSize, min(PoolGetWorkerCount(), SCHEDULER_MAX_IN_FLIGHT), &tuning);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    bool queued = true;
+    transfer->BatchEnd = 0;
+    while (queued && !transfer->Failed && transfer->BatchEnd < transfer->ChunkCount) {
+        AUTOTUNE_SETTINGS settings;
+        uint64_t batchBytes = AutotuneNextBatch(&tuning, &settings);
+        uint64_t spanBytes = (uint64_t)settings.SpanChunks * transfer->ChunkSize;
+
+        transfer->SpanChunks = settings.SpanChunks;
+        transfer->Depth = settings.Depth;
+        transfer->BatchFirst = transfer->BatchEnd;
+        transfer->BatchEnd = (batchBytes == UINT64_MAX) ? transfer->ChunkCount :
+            min(transfer->BatchFirst + (batchBytes + spanBytes - 1) / spanBytes * settings.SpanChunks, transfer->ChunkCount);
+
+        LONG64 bytesBefore = transfer->BytesRead;
+        LARGE_INTEGER start;
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&start);
+        queued = PoolParallelFor(TransferLane, transfer, settings.Depth);
+        QueryPerformanceCounter(&end);
+
+        AutotuneEndBatch(&tuning, (uint64_t)(transfer->BytesRead - bytesBefore),
+                         (uint64_t)(end.QuadPart - start.QuadPart) * 1000000ULL / (uint64_t)frequency.QuadPart);
+    }
+
+    if (!queued) {
+        printf("Failed to queue the transfer chunks.\n");
+    }
+
+    AutotuneEnd(&tuning, queued && !transfer->Failed);
+    return queued && !transfer->Failed;
+}
+
+
+/**
+ * @brief       Reopens the partial file of an interrupted transfer of the same source, if its checkpoint
+ *              is still valid. On success the transfer's Destination and Checkpoint are set.
+ */
+static void ResumeFromCheckpoint(_Inout_ TRANSFER_CONTEXT* transfer, _In_z_ const char* partialPath, _In_z_ const char* checkpointPath, _In_ uint64_t sourceLastWriteTime) {
+    SS_CHECKPOINT* checkpoint = CheckpointLoad(checkpointPath, transfer->FileSize, sourceLastWriteTime, transfer->ChunkSize);
+    if (checkpoint == NULL) {
+        return;
+    }
+
+    uint64_t partialSize = 0;
+    SS_FILE* partial = StripingOpenFile(partialPath, IO_OPEN_WRITE);
+    if (partial == NULL || !IoGetFileSize(partial, &partialSize) || partialSize != transfer->FileSize) {
+        IoCloseFile(partial);
+        CheckpointClose(checkpoint);
+        return;
+    }
+
+    printf("Resuming transfer: %llu of %llu chunks already copied.\n", CheckpointCountDone(checkpoint), transfer->ChunkCount);
+    transfer->Destination = partial;
+    transfer->Checkpoint = checkpoint;
+}
+
+
+/**
+ * @brief       Brings an existing destination up to date with the source by rewriting only the chunks whose
+ *              checksums differ from the source's manifest, then truncating or extending it to the source size.
+ *
+ * @return      FALSE if a delta transfer is not possible (no valid manifest or no existing destination) and
+ *              nothing was touched; otherwise, TRUE with the outcome in *status.
+ */
+static bool TransferDelta(_In_z_ const char* sourcePath, _In_z_ const char* destinationPath, _In_opt_z_ const char* owner, _Out_ NTSTATUS* status) {
+    char manifestPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(manifestPath, MAX_PATH, "%s%s", sourcePath, MANIFEST_SUFFIX))) {
+        return false;
+    }
+
+    TRANSFER_CONTEXT transfer = { 0 };
+    uint64_t sourceLastWriteTime = 0;
+
+    transfer.Manifest = ManifestRead(manifestPath);
+    transfer.Source = (transfer.Manifest != NULL) ? StripingOpenFile(sourcePath, IO_OPEN_READ) : NULL;
+
+    // The manifest has to describe the source as it is now
+    if (transfer.Source == NULL ||
+        !IoGetFileSize(transfer.Source, &transfer.FileSize) || !IoGetLastWriteTime(transfer.Source, &sourceLastWriteTime) ||
+        !ManifestMatchesFile(transfer.Manifest, transfer.FileSize, sourceLastWriteTime) ||
+        transfer.Manifest->BlockSize > MANIFEST_BLOCK_SIZE ||
+        (transfer.Destination = IoOpenFile(destinationPath, IO_OPEN_WRITE)) == NULL) {
+        IoCloseFile(transfer.Source);
+        ManifestFree(transfer.Manifest);
+        return false;
+    }
+
+    transfer.ChunkSize = transfer.Manifest->BlockSize;
+    transfer.ChunkCount = transfer.Manifest->BlockCount;
+
+    // Resize first: a truncated tail needs no checksum and an extension reads as zeros until written
+    bool result = IoSetFileSize(transfer.Destination, transfer.FileSize);
+    if (result) {
+        transfer.Queue = SchedulerOpenQueue(owner, SchedulerClassForSize(transfer.FileSize));
+        result = (transfer.Queue != NULL) &&
+                 PoolParallelFor(TransferDeltaChunk, &transfer, transfer.ChunkCount) && !transfer.Failed &&
+                 IoSetLastWriteTime(transfer.Destination, sourceLastWriteTime);
+        SchedulerCloseQueue(transfer.Queue);
+    }
+
+    IoCloseFile(transfer.Destination);
+    IoCloseFile(transfer.Source);
+    ManifestFree(transfer.Manifest);
+
+    result = result && DurabilityCommitFile(destinationPath);
+    if (!result) {
+        printf("Failed to update the destination file: %lu\n", GetLastError());
+        *status = STATUS_UNSUCCESSFUL;
+        return true;
+    }
+
+    printf("Delta transfer: %llu of %llu blocks rewritten.\n", (uint64_t)transfer.RewrittenChunks, transfer.ChunkCount);
+    *status = STATUS_SUCCESS;
+    return true;
+}
+
+
+/**
+ * @brief       Checksums the blocks of a file and compares them with a manifest, stopping at the first difference.
+ */
+static bool MatchesManifest(_In_ SS_FILE* file, _In_ uint64_t fileSize, _In_ const SS_MANIFEST* manifest) {
+    BYTE* buffer = (BYTE*)malloc(manifest->BlockSize);
+    bool matches = buffer != NULL;
+
+    for (uint64_t block = 0; matches && block < manifest->BlockCount; block++) {
+        uint64_t offset = block * manifest->BlockSize;
+        DWORD length = (DWORD)min((uint64_t)manifest->BlockSize, fileSize - offset);
+        DWORD bytesRead = 0;
+        BYTE hash[HASH_LENGTH];
+
+        matches = IoReadAt(file, offset, buffer, length, &bytesRead) && bytesRead == length &&
+                  ManifestHashBlock(buffer, length, hash) &&
+                  memcmp(hash, manifest->BlockHashes[block], HASH_LENGTH) == 0;
+    }
+
+    free(buffer);
+    return matches;
+}
+
+
+/**
+ * @brief       Takes a free chunk buffer, waiting for a chunk task to finish with one if necessary.
+ */
+static DWORD AcquireStreamSlot(_Inout_ STREAM_CONTEXT* stream) {
+    AcquireSRWLockExclusive(&stream->Lock);
+    while (stream->FreeCount == 0) {
+        SleepConditionVariableSRW(&stream->SlotFreed, &stream->Lock, INFINITE, 0);
+    }
+    DWORD slot = stream->FreeSlots[--stream->FreeCount];
+    ReleaseSRWLockExclusive(&stream->Lock);
+    return slot;
+}
+
+
+/**
+ * @brief       Returns a chunk buffer to the reader.
+ */
+static void ReleaseStreamSlot(_Inout_ STREAM_CONTEXT* stream, _In_ DWORD slot) {
+    AcquireSRWLockExclusive(&stream->Lock);
+    stream->FreeSlots[stream->FreeCount++] = slot;
+    ReleaseSRWLockExclusive(&stream->Lock);
+    WakeConditionVariable(&stream->SlotFreed);
+}
+
+
+/**
+ * @brief       Thread pool routine of a streamed transfer. Writes the chunk held by one slot at its offset,
+ *              checksums it and hands the slot back to the reader.
+ */
+static VOID TransferStreamChunk(_Inout_opt_ PVOID context, _In_ uint64_t index) {
+    STREAM_CONTEXT* stream = (STREAM_CONTEXT*)context;
+    const STREAM_SLOT* slot = &stream->Slots[index];
+
+    if (!stream->Failed) {
+        // The destination was sized sparse, so an all-zero chunk that is not written reads as zeros
+        bool zero = stream->DetectZeros && IsZeroBuffer(slot->Buffer, slot->Length);
+        bool result = true;
+        if (zero) {
+            InterlockedIncrement64(&stream->SkippedChunks);
+        }
+        else {
+            SchedulerAcquire(stream->Queue, slot->Length);
+            result = IoWriteAt(stream->Destination, slot->Chunk * CHUNK_SIZE, slot->Buffer, slot->Length);
+            SchedulerRelease();
+            if (!result) {
+                printf("Failed to write chunk %llu: %lu\n", slot->Chunk, GetLastError());
+            }
+        }
+
+        if (result && stream->Manifest != NULL &&
+            !ManifestHashBlock(slot->Buffer, slot->Length, stream->Manifest->BlockHashes[slot->Chunk])) {
+            printf("Failed to checksum chunk %llu\n", slot->Chunk);
+            result = false;
+        }
+
+        if (!result) {
+            InterlockedExchange(&stream->Failed, TRUE);
+        }
+    }
+
+    ReleaseStreamSlot(stream, (DWORD)index);
+}
+
+
+/**
+ * @brief       Reads from the stream until the buffer is full or the stream ends; pipes return what they have.
+ */
+static bool ReadStreamChunk(_In_ TRANSFER_READ_ROUTINE readRoutine, _Inout_opt_ PVOID context, _Out_writes_bytes_to_(CHUNK_SIZE, *length) BYTE* buffer, _Out_ DWORD* length, _Out_ bool* ended) {
+    *length = 0;
+    *ended = false;
+
+    while (*length < CHUNK_SIZE) {
+        DWORD bytesRead = 0;
+        if (!readRoutine(context, buffer + *length, CHUNK_SIZE - *length, &bytesRead)) {
+            return false;
+        }
+        if (bytesRead == 0) {
+            *ended = true;
+            break;
+        }
+        *length += min(bytesRead, CHUNK_SIZE - *length);
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Reads a stream chunk by chunk and queues every chunk for writing, growing the destination's
+ *              reservation ahead of the writes. Waits for the queued chunks before returning.
+ *
+ * @return      STATUS_SUCCESS with the length of the stream in *size, or the failure status.
+ */
+static NTSTATUS PumpStream(_Inout_ STREAM_CONTEXT* stream, _In_ TRANSFER_READ_ROUTINE readRoutine, _Inout_opt_ PVOID context, _In_ uint64_t maxSize, _Out_ uint64_t* size) {
+    POOL_GROUP group = { 0 };
+    NTSTATUS status = STATUS_SUCCESS;
+    uint64_t reserved = 0;
+    bool ended = false;
+    *size = 0;
+
+    while (!ended && !stream->Failed) {
+        DWORD slot = AcquireStreamSlot(stream);
+        DWORD length = 0;
+        if (!ReadStreamChunk(readRoutine, context, stream->Slots[slot].Buffer, &length, &ended)) {
+            printf("Failed to read the source stream: %lu\n", GetLastError());
+            status = STATUS_UNSUCCESSFUL;
+        }
+        else if (*size + length > maxSize) {
+            printf("The source stream exceeds the maximum allowed size.\n");
+            status = STATUS_FILE_TOO_LARGE;
+        }
+        else if (*size + length > reserved) {
+            // Sparse destinations are only sized: reserving would allocate the zero chunks that are skipped
+            reserved = min(max(2 * reserved, (uint64_t)TRANSFER_STREAM_INITIAL_RESERVE), maxSize);
+            if (!(stream->DetectZeros ? IoSetFileSize(stream->Destination, reserved) : IoPreallocate(stream->Destination, reserved))) {
+                printf("Failed to size the destination file: %lu\n", GetLastError());
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+
+        if (!NT_SUCCESS(status) || length == 0) {
+            ReleaseStreamSlot(stream, slot);
+            break;
+        }
+
+        stream->Slots[slot].Chunk = *size / CHUNK_SIZE;
+        stream->Slots[slot].Length = length;
+        *size += length;
+        if (!PoolSubmit(&group, TransferStreamChunk, stream, slot, (uint64_t)slot + 1)) {
+            printf("Failed to queue a chunk of the stream.\n");
+            ReleaseStreamSlot(stream, slot);
+            status = STATUS_NO_MEMORY;
+            break;
+        }
+    }
+
+    PoolWait(&group);
+    if (NT_SUCCESS(status) && stream->Failed) {
+        status = STATUS_UNSUCCESSFUL;
+    }
+    return status;
+}
+
+
+NTSTATUS
+TransferFile(
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath,
+    _In_opt_z_ const char* Owner,
+    _In_ DWORD Flags
+)
+{
+    char partialPath[MAX_PATH];
+    char checkpointPath[MAX_PATH];
+    char manifestPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", DestinationPath, TRANSFER_PARTIAL_SUFFIX)) ||
+        FAILED(StringCchPrintfA(checkpointPath, MAX_PATH, "%s%s", DestinationPath, CHECKPOINT_SUFFIX)) ||
+        ((Flags & TRANSFER_FLAG_MANIFEST) != 0 &&
+         FAILED(StringCchPrintfA(manifestPath, MAX_PATH, "%s%s", DestinationPath, MANIFEST_SUFFIX)))) {
+        printf("Failed to construct the temporary destination path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    // Falls back to a full copy whenever only changed blocks cannot be identified
+    NTSTATUS deltaStatus = STATUS_UNSUCCESSFUL;
+    if ((Flags & TRANSFER_FLAG_DELTA) != 0 && TransferDelta(SourcePath, DestinationPath, Owner, &deltaStatus)) {
+        return deltaStatus;
+    }
+
+    TRANSFER_CONTEXT transfer = { 0 };
+    transfer.ChunkSize = CHUNK_SIZE;
+
+    transfer.Source = StripingOpenFile(SourcePath, IO_OPEN_READ);
+    if (transfer.Source == NULL) {
+        DWORD error = GetLastError();
+        printf("Failed to open the source file: %lu\n", error);
+        return (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) ? STATUS_OBJECT_NAME_NOT_FOUND : STATUS_UNSUCCESSFUL;
+    }
+
+    uint64_t sourceLastWriteTime = 0;
+    if (!IoGetFileSize(transfer.Source, &transfer.FileSize) || !IoGetLastWriteTime(transfer.Source, &sourceLastWriteTime)) {
+        printf("Failed to query the source file: %lu\n", GetLastError());
+        IoCloseFile(transfer.Source);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (transfer.FileSize > (uint64_t)MAX_FILE_SIZE) {
+        printf("The source file exceeds the maximum allowed size.\n");
+        IoCloseFile(transfer.Source);
+        return STATUS_FILE_TOO_LARGE;
+    }
+    transfer.ChunkCount = (transfer.FileSize + transfer.ChunkSize - 1) / transfer.ChunkSize;
+
+    if ((Flags & TRANSFER_FLAG_MANIFEST) != 0) {
+        transfer.Manifest = ManifestCreate(transfer.FileSize, MANIFEST_BLOCK_SIZE);
+        if (transfer.Manifest == NULL) {
+            IoCloseFile(transfer.Source);
+            return STATUS_NO_MEMORY;
+        }
+        transfer.Manifest->LastWriteTime = sourceLastWriteTime;
+    }
+
+    // Without the allocated ranges the source is copied as if it were dense
+    bool sparseDestination = false;
+    if ((Flags & (TRANSFER_FLAG_SPARSE | TRANSFER_FLAG_DETECT_ZEROS)) != 0 && transfer.ChunkCount > 0) {
+        transfer.DetectZeros = (Flags & TRANSFER_FLAG_DETECT_ZEROS) != 0;
+        transfer.SkipHoles = (Flags & TRANSFER_FLAG_SPARSE) != 0 &&
+            IoQueryAllocatedRanges(transfer.Source, transfer.FileSize, &transfer.AllocatedRanges, &transfer.AllocatedRangeCount);
+
+        uint64_t allocated = 0;
+        for (DWORD i = 0; i < transfer.AllocatedRangeCount; i++) {
+            allocated += transfer.AllocatedRanges[i].Length;
+        }
+        sparseDestination = transfer.DetectZeros || (transfer.SkipHoles && allocated < transfer.FileSize);
+
+        BYTE* zeros = sparseDestination ? (BYTE*)calloc(1, transfer.ChunkSize) : NULL;
+        if (zeros != NULL) {
+            ManifestHashBlock(zeros, transfer.ChunkSize, transfer.ZeroChunkHash);
+        }
+        else {
+            // Nothing to skip (or no memory to checksum the holes with)
+            transfer.SkipHoles = false;
+            transfer.DetectZeros = false;
+            sparseDestination = false;
+        }
+        free(zeros);
+    }
+
+    bool resumable = (Flags & TRANSFER_FLAG_RESUMABLE) != 0 && transfer.ChunkCount > 0;
+    if (resumable) {
+        ResumeFromCheckpoint(&transfer, partialPath, checkpointPath, sourceLastWriteTime);
+    }
+
+    bool copied = true;
+    if (transfer.Destination == NULL) {
+        // Reserve the final size up front so out-of-order writes never extend or fragment the file
+        transfer.Destination = StripingCreateFile(partialPath, DestinationPath, (Flags & TRANSFER_FLAG_STRIPED) != 0);
+        if (transfer.Destination == NULL) {
+            printf("Failed to create the temporary destination file: %lu\n", GetLastError());
+            ManifestFree(transfer.Manifest);
+            free(transfer.AllocatedRanges);
+            IoCloseFile(transfer.Source);
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        // Preallocating would fill the holes. Skipped chunks read as zeros even if the file
+        // system cannot make the destination sparse; they just take disk space then.
+        if (sparseDestination) {
+            IoSetSparse(transfer.Destination);
+            copied = IoSetFileSize(transfer.Destination, transfer.FileSize);
+        }
+        else {
+            copied = IoPreallocate(transfer.Destination, transfer.FileSize);
+        }
+        if (!copied) {
+            printf("Failed to size the destination file: %lu\n", GetLastError());
+        }
+        else if (resumable) {
+            // Without a checkpoint the transfer still works, it just cannot be resumed
+            transfer.Checkpoint = CheckpointCreate(checkpointPath, transfer.FileSize, sourceLastWriteTime, transfer.ChunkSize);
+        }
+    }
+
+    if (copied) {
+        transfer.Queue = SchedulerOpenQueue(Owner, SchedulerClassForSize(transfer.FileSize));
+        copied = (transfer.Queue != NULL) &&
+                 RunChunkWorkers(&transfer, SourcePath, DestinationPath) && IoSetLastWriteTime(transfer.Destination, sourceLastWriteTime);
+        SchedulerCloseQueue(transfer.Queue);
+    }
+
+    // Keep the partial file and an up-to-date checkpoint so the next attempt can resume
+    bool keepPartial = false;
+    if (!copied && transfer.Checkpoint != NULL) {
+        keepPartial = CheckpointPersist(transfer.Checkpoint, transfer.Destination);
+    }
+
+    CheckpointClose(transfer.Checkpoint);
+    IoCloseFile(transfer.Destination);
+    IoCloseFile(transfer.Source);
+    free(transfer.AllocatedRanges);
+
+    if (copied && transfer.SkippedChunks > 0) {
+        printf("Sparse transfer: %llu of %llu chunks left as holes.\n", (uint64_t)transfer.SkippedChunks, transfer.ChunkCount);
+    }
+
+    if (keepPartial) {
+        printf("Transfer interrupted; the next attempt will resume from the checkpoint.\n");
+        ManifestFree(transfer.Manifest);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // Make the new contents durable before they become visible under the final name
+    if (!copied || !DurabilityCommitFile(partialPath) || !TieringReplaceFile(partialPath, DestinationPath)) {
+        printf("Failed to publish the destination file: %lu\n", GetLastError());
+        StripingDeleteFile(partialPath);
+        if (resumable) {
+            IoDeleteFile(checkpointPath);
+        }
+        ManifestFree(transfer.Manifest);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // Published right after the data; should this fail, the old manifest no longer matches the
+    // submission's size and last write time and is treated as stale rather than as corruption
+    if (transfer.Manifest != NULL) {
+        ManifestWrite(transfer.Manifest, manifestPath);
+        ManifestFree(transfer.Manifest);
+    }
+
+    // Published; a leftover checkpoint without its partial file would be ignored, but clean it up
+    if (resumable) {
+        IoDeleteFile(checkpointPath);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+TransferBuffer(
+    _In_reads_bytes_(Size) const void* Buffer,
+    _In_ uint64_t Size,
+    _In_ uint64_t LastWriteTime,
+    _In_z_ const char* DestinationPath
+)
+{
+    char partialPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", DestinationPath, TRANSFER_PARTIAL_SUFFIX))) {
+        printf("Failed to construct the temporary destination path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    SS_FILE* destination = StripingCreateFile(partialPath, DestinationPath, false);
+    if (destination == NULL) {
+        printf("Failed to create the temporary destination file: %lu\n", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    bool written = IoPreallocate(destination, Size);
+    for (uint64_t offset = 0; written && offset < Size; ) {
+        DWORD length = (DWORD)min(Size - offset, (uint64_t)TRANSFER_BUFFER_WRITE_SIZE);
+        written = IoWriteAt(destination, offset, (const BYTE*)Buffer + offset, length);
+        offset += length;
+    }
+    written = written && IoSetLastWriteTime(destination, LastWriteTime);
+    IoCloseFile(destination);
+
+    // Make the new contents durable before they become visible under the final name
+    if (!written || !DurabilityCommitFile(partialPath) || !TieringReplaceFile(partialPath, DestinationPath)) {
+        printf("Failed to publish the destination file: %lu\n", GetLastError());
+        StripingDeleteFile(partialPath);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+TransferStream(
+    _In_ TRANSFER_READ_ROUTINE ReadRoutine,
+    _Inout_opt_ PVOID Context,
+    _In_z_ const char* DestinationPath,
+    _In_opt_z_ const char* Owner,
+    _In_ DWORD Flags,
+    _In_ uint64_t MaxSize
+)
+{
+    char partialPath[MAX_PATH];
+    char manifestPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", DestinationPath, TRANSFER_PARTIAL_SUFFIX)) ||
+        ((Flags & TRANSFER_FLAG_MANIFEST) != 0 &&
+         FAILED(StringCchPrintfA(manifestPath, MAX_PATH, "%s%s", DestinationPath, MANIFEST_SUFFIX)))) {
+        printf("Failed to construct the temporary destination path.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    STREAM_CONTEXT* stream = (STREAM_CONTEXT*)calloc(1, sizeof(STREAM_CONTEXT));
+    if (stream == NULL) {
+        return STATUS_NO_MEMORY;
+    }
+    InitializeSRWLock(&stream->Lock);
+    InitializeConditionVariable(&stream->SlotFreed);
+    stream->DetectZeros = (Flags & TRANSFER_FLAG_DETECT_ZEROS) != 0;
+
+    NTSTATUS status = STATUS_SUCCESS;
+    for (DWORD i = 0; i < TRANSFER_STREAM_BUFFERS; i++) {
+        stream->Slots[i].Buffer = (BYTE*)malloc(CHUNK_SIZE);
+        stream->FreeSlots[stream->FreeCount++] = i;
+        if (stream->Slots[i].Buffer == NULL) {
+            status = STATUS_NO_MEMORY;
+        }
+    }
+
+    // The length is not known up front: checksums are collected for the largest stream accepted and trimmed at the end
+    MaxSize = min(MaxSize, (uint64_t)MAX_FILE_SIZE);
+    if ((Flags & TRANSFER_FLAG_MANIFEST) != 0 && NT_SUCCESS(status) &&
+        (stream->Manifest = ManifestCreate(MaxSize, MANIFEST_BLOCK_SIZE)) == NULL) {
+        status = STATUS_NO_MEMORY;
+    }
+
+    if (NT_SUCCESS(status)) {
+        stream->Destination = StripingCreateFile(partialPath, DestinationPath, (Flags & TRANSFER_FLAG_STRIPED) != 0);
+        if (stream->Destination == NULL) {
+            printf("Failed to create the temporary destination file: %lu\n", GetLastError());
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    uint64_t size = 0;
+    uint64_t lastWriteTime = 0;
+    if (NT_SUCCESS(status)) {
+        if (stream->DetectZeros) {
+            IoSetSparse(stream->Destination);
+        }
+
+        // A stream of unknown length is scheduled like any large transfer
+        stream->Queue = SchedulerOpenQueue(Owner, SCHEDULER_CLASS_BULK);
+        status = (stream->Queue == NULL) ? STATUS_NO_MEMORY : PumpStream(stream, ReadRoutine, Context, MaxSize, &size);
+        SchedulerCloseQueue(stream->Queue);
+
+        FILETIME now = { 0 };
+        GetSystemTimeAsFileTime(&now);
+        lastWriteTime = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+        if (NT_SUCCESS(status) &&
+            (!IoSetFileSize(stream->Destination, size) || !IoSetLastWriteTime(stream->Destination, lastWriteTime))) {
+            printf("Failed to finish the destination file: %lu\n", GetLastError());
+            status = STATUS_UNSUCCESSFUL;
+        }
+        IoCloseFile(stream->Destination);
+
+        // Make the new contents durable before they become visible under the final name
+        if (NT_SUCCESS(status) && (!DurabilityCommitFile(partialPath) || !TieringReplaceFile(partialPath, DestinationPath))) {
+            printf("Failed to publish the destination file: %lu\n", GetLastError());
+            status = STATUS_UNSUCCESSFUL;
+        }
+        if (!NT_SUCCESS(status)) {
+            StripingDeleteFile(partialPath);
+        }
+    }
+
+    if (NT_SUCCESS(status) && stream->SkippedChunks > 0) {
+        printf("Sparse transfer: %llu of %llu chunks left as holes.\n", (uint64_t)stream->SkippedChunks, (size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+
+    // Published right after the data, as by TransferFile
+    if (NT_SUCCESS(status) && stream->Manifest != NULL) {
+        stream->Manifest->FileSize = size;
+        stream->Manifest->BlockCount = (size + MANIFEST_BLOCK_SIZE - 1) / MANIFEST_BLOCK_SIZE;
+        stream->Manifest->LastWriteTime = lastWriteTime;
+        ManifestWrite(stream->Manifest, manifestPath);
+    }
+
+    ManifestFree(stream->Manifest);
+    for (DWORD i = 0; i < TRANSFER_STREAM_BUFFERS; i++) {
+        free(stream->Slots[i].Buffer);
+    }
+    free(stream);
+    return status;
+}
+
+
+bool
+TransferIsUpToDate(
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath
+)
+{
+    char manifestPath[MAX_PATH];
+    if (FAILED(StringCchPrintfA(manifestPath, MAX_PATH, "%s%s", DestinationPath, MANIFEST_SUFFIX))) {
+        return false;
+    }
+
+    SS_MANIFEST* manifest = ManifestRead(manifestPath);
+    if (manifest == NULL) {
+        return false;
+    }
+
+    SS_FILE* destination = StripingOpenFile(DestinationPath, IO_OPEN_READ);
+    SS_FILE* source = (destination != NULL) ? StripingOpenFile(SourcePath, IO_OPEN_READ) : NULL;
+    uint64_t destinationSize = 0;
+    uint64_t destinationLastWriteTime = 0;
+    uint64_t sourceSize = 0;
+    uint64_t sourceLastWriteTime = 0;
+
+    bool upToDate = source != NULL &&
+        IoGetFileSize(destination, &destinationSize) && IoGetLastWriteTime(destination, &destinationLastWriteTime) &&
+        ManifestMatchesFile(manifest, destinationSize, destinationLastWriteTime) && manifest->BlockSize <= MANIFEST_BLOCK_SIZE &&
+        IoGetFileSize(source, &sourceSize) && IoGetLastWriteTime(source, &sourceLastWriteTime) &&
+        sourceSize == destinationSize;
+
+    // The destination keeps the source's last write time, so an untouched source needs no checksums
+    if (upToDate && sourceLastWriteTime != destinationLastWriteTime) {
+        upToDate = MatchesManifest(source, sourceSize, manifest);
+    }
+
+    IoCloseFile(source);
+    IoCloseFile(destination);
+    ManifestFree(manifest);
+    return upToDate;
+}
@@ -0,0 +1,186 @@
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define TRANSFER_PARTIAL_SUFFIX "~partial"      // In-progress copy, published by renaming over the destination
+#define TRANSFER_BUFFER_WRITE_SIZE (64 * 1024 * 1024)   // Largest single write of TransferBuffer
+#define TRANSFER_STREAM_BUFFERS 32              // Chunks a streamed transfer may read ahead of its writes
+#define TRANSFER_STREAM_INITIAL_RESERVE (1024 * 1024)   // First reservation of a streamed destination; doubled as it grows
+
+
+// TransferFile flags
+#define TRANSFER_FLAG_RESUMABLE 0x1             // Keep a checkpoint so an interrupted transfer can resume
+#define TRANSFER_FLAG_MANIFEST 0x2              // Record block checksums in DestinationPath + MANIFEST_SUFFIX
+#define TRANSFER_FLAG_DELTA 0x4                 // Update an existing destination in place, rewriting only changed blocks
+#define TRANSFER_FLAG_SPARSE 0x8                // Skip the holes of a sparse source and recreate them in the destination
+#define TRANSFER_FLAG_DETECT_ZEROS 0x10         // Also leave all-zero chunks of the source as holes (implies a sparse destination)
+#define TRANSFER_FLAG_STRIPED 0x20              // Stripe the destination over the configured data roots (see Striping.h)
+
+
+/*
+ * @brief       Copies SourcePath to DestinationPath in CHUNK_SIZE chunks using a pool of workers.
+ *
+ * @details     The copy is written to DestinationPath + TRANSFER_PARTIAL_SUFFIX, which is preallocated at
+ *              the final size before any chunk is written. The chunks are then copied by tasks on the library's
+ *              work-stealing pool (see ThreadPool.h), each chunk at its own offset. A task reads and writes one or
+ *              more consecutive chunks at once, and the number of tasks and chunks per I/O are picked by the
+ *              tuner for the devices of the two files (see AutotuneBegin). Once every chunk is
+ *              written the file is made durable
+ *              (see DurabilityCommitFile) and atomically renamed over DestinationPath, so readers only
+ *              ever see the previous file or the complete new one.
+ *
+ *              With TRANSFER_FLAG_RESUMABLE a bitmap of completed chunks is kept in
+ *              DestinationPath + CHECKPOINT_SUFFIX together with the source's size and last write time.
+ *              If the transfer fails, the partial file and its checkpoint are left in place; a later
+ *              transfer of the same, unmodified source to the same destination only copies the chunks
+ *              that are missing.
+ *
+ *              With TRANSFER_FLAG_MANIFEST the workers also checksum every block they copy and the checksums
+ *              are published in DestinationPath + MANIFEST_SUFFIX right after the destination itself.
+ *
+ *              With TRANSFER_FLAG_DELTA, if the destination exists and SourcePath + MANIFEST_SUFFIX matches the
+ *              source, the destination is instead updated in place: its blocks are checksummed in parallel and
+ *              only the ones that differ from the manifest are copied, after which it is truncated or extended
+ *              to the source size. This is not atomic; an interrupted delta transfer leaves a mix of old and
+ *              new blocks that the next one repairs. Without a usable manifest a full copy is made.
+ *
+ *              With TRANSFER_FLAG_SPARSE the allocated ranges of the source are queried first. If the source has
+ *              holes, the destination is created sparse and sized rather than preallocated, and chunks lying
+ *              entirely in a hole are neither read nor written, so a mostly empty file transfers in time
+ *              proportional to its data. With TRANSFER_FLAG_DETECT_ZEROS the destination is always sparse and
+ *              chunks that read as all zeros are not written either.
+ *
+ *              With TRANSFER_FLAG_STRIPED and data roots configured, the destination is striped over the roots
+ *              (see StripingConfigure). Consecutive chunks then belong to different stripes, so the concurrent
+ *              chunk tasks keep every root busy. A striped source is read from all of its stripes the same way.
+ *
+ *              Like CopyFile, the destination keeps the source's last write time.
+ *
+ *              Chunk I/O goes through the scheduler queue of Owner (see Scheduler.h): transfers of up to
+ *              SCHEDULER_INTERACTIVE_LIMIT bytes are interactive and overtake larger, bulk ones, and users
+ *              share the chunk I/O slots of each class equally.
+ *
+ * @param[in]   SourcePath      - The file to copy. Must not exceed MAX_FILE_SIZE.
+ * @param[in]   DestinationPath - The file to create or replace.
+ * @param[in]   Owner           - The user the transfer is done for; NULL for internal transfers.
+ * @param[in]   Flags           - Zero or more TRANSFER_FLAG_* values.
+ *
+ * @return      STATUS_SUCCESS, STATUS_OBJECT_NAME_NOT_FOUND if the source does not exist,
+ *              STATUS_FILE_TOO_LARGE, STATUS_NO_MEMORY or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS
+TransferFile(
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath,
+    _In_opt_z_ const char* Owner,
+    _In_ DWORD Flags
+);
+
+
+
+/*
+ * @brief       Writes a file from memory, e.g. a cached submission, with the same guarantees as TransferFile.
+ *
+ * @details     The data is written to DestinationPath + TRANSFER_PARTIAL_SUFFIX in a few large writes, made
+ *              durable and atomically renamed over DestinationPath.
+ *
+ * @param[in]   Buffer          - The contents of the file.
+ * @param[in]   Size            - Size of Buffer in bytes.
+ * @param[in]   LastWriteTime   - Last write time to give the destination, in FILETIME units.
+ * @param[in]   DestinationPath - The file to create or replace.
+ *
+ * @return      STATUS_SUCCESS, STATUS_BUFFER_OVERFLOW or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS
+TransferBuffer(
+    _In_reads_bytes_(Size) const void* Buffer,
+    _In_ uint64_t Size,
+    _In_ uint64_t LastWriteTime,
+    _In_z_ const char* DestinationPath
+);
+
+
+
+/*
+ * @brief       Supplies the data of a streamed transfer.
+ *
+ * @param[in]   Context         - The context given to TransferStream.
+ * @param[out]  Buffer          - Receives the next bytes of the stream.
+ * @param[in]   Length          - Size of Buffer. Fewer bytes may be returned.
+ * @param[out]  BytesRead       - Receives the number of bytes returned; 0 at the end of the stream.
+ *
+ * @return      FALSE if the stream failed.
+ */
+typedef bool (*TRANSFER_READ_ROUTINE)(
+    _Inout_opt_ PVOID Context,
+    _Out_writes_bytes_to_(Length, *BytesRead) void* Buffer,
+    _In_ DWORD Length,
+    _Out_ DWORD* BytesRead
+);
+
+
+/*
+ * @brief       Writes a stream of unknown length (a pipe, standard input, data generated on the fly) to
+ *              DestinationPath, with the same guarantees as TransferFile.
+ *
+ * @details     The calling thread reads the stream into a set of TRANSFER_STREAM_BUFFERS chunk buffers and
+ *              hands every full chunk to the library's pool, which writes it at its offset through the scheduler
+ *              queue of Owner while the next chunks are being read. Reading stops while every buffer is still
+ *              being written, so memory use does not depend on the length of the stream. The destination is
+ *              reserved in doubling steps ahead of the writes and cut to the final size at the end of the stream,
+ *              then made durable and atomically renamed over DestinationPath.
+ *
+ *              Flags may contain TRANSFER_FLAG_MANIFEST, TRANSFER_FLAG_STRIPED and TRANSFER_FLAG_DETECT_ZEROS, with
+ *              the same meaning as for TransferFile; a stream cannot be read twice, so it cannot be resumed either.
+ *              The destination and its manifest get the time the stream ended as their last write time.
+ *
+ *              Must not be called from a pool task.
+ *
+ * @param[in]   ReadRoutine     - Returns the next bytes of the stream.
+ * @param[in]   Context         - Passed to ReadRoutine.
+ * @param[in]   DestinationPath - The file to create or replace.
+ * @param[in]   Owner           - The user the transfer is done for; NULL for internal transfers.
+ * @param[in]   Flags           - Zero or more of the TRANSFER_FLAG_* values above.
+ * @param[in]   MaxSize         - Largest stream accepted, e.g. what is left of a quota. At most MAX_FILE_SIZE.
+ *
+ * @return      STATUS_SUCCESS, STATUS_FILE_TOO_LARGE if the stream exceeds MaxSize, STATUS_NO_MEMORY or
+ *              STATUS_UNSUCCESSFUL (also if ReadRoutine fails). Nothing is published unless the whole stream was
+ *              written.
+ */
+NTSTATUS
+TransferStream(
+    _In_ TRANSFER_READ_ROUTINE ReadRoutine,
+    _Inout_opt_ PVOID Context,
+    _In_z_ const char* DestinationPath,
+    _In_opt_z_ const char* Owner,
+    _In_ DWORD Flags,
+    _In_ uint64_t MaxSize
+);
+
+
+
+/*
+ * @brief       Returns TRUE if DestinationPath, as stored by TransferFile with TRANSFER_FLAG_MANIFEST, already
+ *              holds the contents of SourcePath, so that storing it again would change nothing.
+ *
+ * @details     The destination's manifest has to describe the destination as it is now. If the source also
+ *              has the size and last write time the destination was given, it is taken as unchanged without
+ *              being read; otherwise every block of the source is checksummed and compared with the manifest,
+ *              stopping at the first difference. Saves that rewrite a file with the same contents are
+ *              recognized that way.
+ *
+ * @return      FALSE if the contents differ or cannot be compared (no destination, no usable manifest, I/O error).
+ */
+bool
+TransferIsUpToDate(
+    _In_z_ const char* SourcePath,
+    _In_z_ const char* DestinationPath
+);
+
+EXTERN_C_END;
+#endif  //_TRANSFER_H_
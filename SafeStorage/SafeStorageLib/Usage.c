@@ -0,0 +1,543 @@
+#include "Usage.h"
+#include "Durability.h"
+#include "FileIo.h"
+#include "Segments.h"
+#include "Tiering.h"
+#include "Versions.h"
+#include <strsafe.h>
+
+
+#define USAGE_MAGIC 0x53555353                  // "SSUS"
+#define USAGE_VERSION 2
+#define USAGE_VERSION_NO_HISTORY 1              // Did not count the blocks of older versions; recounted when loaded
+
+
+// Start of the usage file
+typedef struct _USAGE_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t RecordSize;
+    uint32_t Reserved;
+} USAGE_HEADER;
+
+
+// One user in the usage file, at a fixed position that never changes
+typedef struct _USAGE_RECORD {
+    char Username[USERNAME_MAX_LENGTH + 1];
+    uint64_t Bytes;
+    uint64_t Objects;
+    uint64_t QuotaBytes;                        // 0 if unlimited
+    uint64_t QuotaObjects;                      // 0 if unlimited
+} USAGE_RECORD;
+
+
+// A user in memory: the record as written, plus the growth held by stores in progress
+typedef struct _USAGE_ENTRY {
+    USAGE_RECORD Record;
+    int64_t PendingBytes;
+    int64_t PendingObjects;
+} USAGE_ENTRY;
+
+
+// Totals of a directory walk, see CountUser
+typedef struct _USAGE_COUNT {
+    const char* HotDirectory;                   // Set while walking the cold tier: files still hot are counted there
+    size_t RootLength;                          // Length of the directory being walked
+    uint64_t Bytes;
+    uint64_t Objects;
+} USAGE_COUNT;
+
+
+// Global static variables
+static SRWLOCK g_UsageLock = SRWLOCK_INIT;      // Guards everything below
+static char g_UsageAppDirectory[MAX_PATH] = { 0 };
+static USAGE_ENTRY* g_UsageEntries = NULL;
+static DWORD g_UsageCount = 0;
+static DWORD g_UsageCapacity = 0;
+static bool g_UsageLoaded = false;
+static uint64_t g_UsageGeneration = 0;         // Incremented by every UsageReset
+
+
+/**
+ * @brief       Builds the path of the usage file.
+ */
+static bool UsageFilePath(_Out_writes_z_(MAX_PATH) char* path) {
+    return SUCCEEDED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", g_UsageAppDirectory, USAGE_FILE_NAME));
+}
+
+
+/**
+ * @brief       Makes room for one more entry. Called with the lock held exclusively.
+ */
+static bool GrowTableLocked(void) {
+    if (g_UsageCount < g_UsageCapacity) {
+        return true;
+    }
+
+    DWORD capacity = (g_UsageCapacity == 0) ? USAGE_INITIAL_CAPACITY : g_UsageCapacity * 2;
+    USAGE_ENTRY* entries = (USAGE_ENTRY*)realloc(g_UsageEntries, (size_t)capacity * sizeof(USAGE_ENTRY));
+    if (entries == NULL) {
+        return false;
+    }
+
+    g_UsageEntries = entries;
+    g_UsageCapacity = capacity;
+    return true;
+}
+
+
+/**
+ * @brief       Writes the record of one entry at its position in the usage file, creating the file if needed.
+ *              Called with the lock held.
+ */
+static bool WriteRecordLocked(_In_ DWORD index) {
+    char path[MAX_PATH];
+    if (!UsageFilePath(path)) {
+        return false;
+    }
+
+    SS_FILE* file = IoOpenFile(path, IO_OPEN_ALWAYS);
+    if (file == NULL) {
+        return false;
+    }
+
+    USAGE_HEADER header = { USAGE_MAGIC, USAGE_VERSION, sizeof(USAGE_RECORD), 0 };
+    bool result = IoWriteAt(file, 0, &header, sizeof(header)) &&
+                  IoWriteAt(file, sizeof(USAGE_HEADER) + (uint64_t)index * sizeof(USAGE_RECORD), &g_UsageEntries[index].Record, sizeof(USAGE_RECORD));
+    IoCloseFile(file);
+    return result;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of CountEntry. Adds up the blocks kept for older versions, which take
+ *              space but are not submissions.
+ */
+static IoEnumerateAction CountBlock(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    UNREFERENCED_PARAMETER(path);
+    USAGE_COUNT* count = (USAGE_COUNT*)context;
+
+    // Partial blocks of an interrupted freeze are left to garbage collection
+    if (!info->IsDirectory && strchr(name, '~') == NULL) {
+        count->Bytes += info->Size;
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of CountUser. Adds up the submissions of a directory, skipping
+ *              internal files and directories ('~') other than the block store of the hot tier.
+ */
+static IoEnumerateAction CountEntry(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    USAGE_COUNT* count = (USAGE_COUNT*)context;
+
+    if (strchr(name, '~') != NULL) {
+        if (info->IsDirectory && count->HotDirectory == NULL && strcmp(name, VERSIONS_BLOCKS_DIRECTORY) == 0) {
+            IoEnumerateFiles(path, true, CountBlock, count);
+        }
+        return IO_ENUMERATE_SKIP;
+    }
+    if (info->IsDirectory) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    // A submission being promoted or migrated exists in both tiers for a moment; count it once
+    char hotPath[MAX_PATH];
+    IO_FILE_INFO hotInfo = { 0 };
+    if (count->HotDirectory != NULL &&
+        SUCCEEDED(StringCchPrintfA(hotPath, MAX_PATH, "%s%s", count->HotDirectory, path + count->RootLength)) &&
+        IoQueryFileInfo(hotPath, &hotInfo)) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    // Every stripe of a striped submission has its full size, so the first one tells it
+    count->Bytes += info->Size;
+    count->Objects++;
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Counts the submissions of a user by walking the user's directory in both tiers, and adds those
+ *              kept in segments. The blocks of older versions count towards the bytes only.
+ */
+static void CountUser(_In_z_ const char* username, _Out_ USAGE_RECORD* record) {
+    char userDirectory[MAX_PATH];
+    char coldDirectory[MAX_PATH];
+    USAGE_COUNT count = { 0 };
+
+    if (SUCCEEDED(StringCchPrintfA(userDirectory, MAX_PATH, "%s\\users\\%s", g_UsageAppDirectory, username))) {
+        count.RootLength = strlen(userDirectory);
+        IoEnumerateFiles(userDirectory, true, CountEntry, &count);
+
+        if (TieringGetColdPath(userDirectory, coldDirectory)) {
+            count.HotDirectory = userDirectory;
+            count.RootLength = strlen(coldDirectory);
+            IoEnumerateFiles(coldDirectory, true, CountEntry, &count);
+        }
+    }
+
+    uint64_t segmentBytes = 0;
+    uint64_t segmentObjects = 0;
+    SegmentsCountUser(username, &segmentBytes, &segmentObjects);
+
+    memset(record, 0, sizeof(*record));
+    StringCchCopyA(record->Username, sizeof(record->Username), username);
+    record->Bytes = count.Bytes + segmentBytes;
+    record->Objects = count.Objects + segmentObjects;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of LoadTableLocked. Counts the submissions of every user directory.
+ */
+static IoEnumerateAction CountUserDirectory(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    UNREFERENCED_PARAMETER(path);
+    UNREFERENCED_PARAMETER(context);
+
+    if (!info->IsDirectory || strchr(name, '~') != NULL || strlen(name) > USERNAME_MAX_LENGTH) {
+        return IO_ENUMERATE_SKIP;
+    }
+    if (!GrowTableLocked()) {
+        return IO_ENUMERATE_STOP;
+    }
+
+    USAGE_ENTRY* entry = &g_UsageEntries[g_UsageCount];
+    memset(entry, 0, sizeof(*entry));
+    CountUser(name, &entry->Record);
+    if (WriteRecordLocked(g_UsageCount)) {
+        g_UsageCount++;
+    }
+    return IO_ENUMERATE_SKIP;
+}
+
+
+/**
+ * @brief       Loads the usage file into the table, once. If there is no usable file (the first start since
+ *              usage is accounted), every user directory is counted instead and the file is written from the
+ *              counts. Called with the lock held exclusively.
+ */
+static bool LoadTableLocked(void) {
+    if (g_UsageLoaded) {
+        return true;
+    }
+
+    char path[MAX_PATH];
+    if (!UsageFilePath(path)) {
+        return false;
+    }
+
+    char* contents = NULL;
+    size_t length = 0;
+    if (IoReadFileContents(path, &contents, &length) && length >= sizeof(USAGE_HEADER)) {
+        const USAGE_HEADER* header = (const USAGE_HEADER*)contents;
+        bool known = (header->Version == USAGE_VERSION || header->Version == USAGE_VERSION_NO_HISTORY);
+        if (header->Magic == USAGE_MAGIC && known && header->RecordSize == sizeof(USAGE_RECORD)) {
+            bool recount = (header->Version == USAGE_VERSION_NO_HISTORY);
+            size_t count = (length - sizeof(USAGE_HEADER)) / sizeof(USAGE_RECORD);
+            for (size_t i = 0; i < count; i++) {
+                if (!GrowTableLocked()) {
+                    free(contents);
+                    g_UsageCount = 0;
+                    return false;
+                }
+
+                USAGE_ENTRY* entry = &g_UsageEntries[g_UsageCount++];
+                memset(entry, 0, sizeof(*entry));
+                memcpy(&entry->Record, contents + sizeof(USAGE_HEADER) + i * sizeof(USAGE_RECORD), sizeof(USAGE_RECORD));
+                entry->Record.Username[USERNAME_MAX_LENGTH] = '\0';
+
+                // Counted again with the blocks of older versions; the quotas are kept
+                if (recount) {
+                    USAGE_RECORD counted;
+                    CountUser(entry->Record.Username, &counted);
+                    entry->Record.Bytes = counted.Bytes;
+                    entry->Record.Objects = counted.Objects;
+                    WriteRecordLocked(g_UsageCount - 1);
+                }
+            }
+        }
+    }
+    free(contents);
+
+    if (g_UsageCount == 0) {
+        char usersDirectory[MAX_PATH];
+        if (SUCCEEDED(StringCchPrintfA(usersDirectory, MAX_PATH, "%s\\users", g_UsageAppDirectory))) {
+            IoEnumerateFiles(usersDirectory, false, CountUserDirectory, NULL);
+        }
+    }
+
+    g_UsageLoaded = true;
+    return true;
+}
+
+
+/**
+ * @brief       Returns the index of a user's entry, if the user has one. Called with the table loaded and the
+ *              lock held, shared or exclusively.
+ */
+static bool LookupEntryLocked(_In_z_ const char* username, _Out_ DWORD* index) {
+    // User directories are not case-sensitive, so neither is the accounting
+    for (DWORD i = 0; i < g_UsageCount; i++) {
+        if (_stricmp(g_UsageEntries[i].Record.Username, username) == 0) {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief       Returns the index of a user's entry, counting the user and adding the entry if there is none.
+ *              Only stores and quotas add entries. Called with the lock held exclusively.
+ */
+static bool FindEntryLocked(_In_z_ const char* username, _Out_ DWORD* index) {
+    if (!LoadTableLocked()) {
+        return false;
+    }
+    if (LookupEntryLocked(username, index)) {
+        return true;
+    }
+
+    if (strlen(username) > USERNAME_MAX_LENGTH || !GrowTableLocked()) {
+        return false;
+    }
+
+    USAGE_ENTRY* entry = &g_UsageEntries[g_UsageCount];
+    memset(entry, 0, sizeof(*entry));
+    CountUser(username, &entry->Record);
+    if (!WriteRecordLocked(g_UsageCount)) {
+        return false;
+    }
+
+    *index = g_UsageCount++;
+    return true;
+}
+
+
+/**
+ * @brief       Applies a signed change to a counter without letting it drop below zero.
+ */
+static uint64_t AddClamped(_In_ uint64_t value, _In_ int64_t change) {
+    if (change < 0 && (uint64_t)(-change) > value) {
+        return 0;
+    }
+    return value + (uint64_t)change;
+}
+
+
+/**
+ * @brief       Commits the usage file according to the durability mode, outside the lock.
+ */
+static void CommitUsageFile(void) {
+    char path[MAX_PATH];
+    if (UsageFilePath(path)) {
+        DurabilityCommitFile(path);
+    }
+}
+
+
+VOID
+UsageInit(
+    _In_z_ const char* AppDirectory
+)
+{
+    AcquireSRWLockExclusive(&g_UsageLock);
+    StringCchCopyA(g_UsageAppDirectory, MAX_PATH, AppDirectory);
+    ReleaseSRWLockExclusive(&g_UsageLock);
+
+    UsageReset();
+}
+
+
+VOID
+UsageReset(
+    VOID
+)
+{
+    AcquireSRWLockExclusive(&g_UsageLock);
+    free(g_UsageEntries);
+    g_UsageEntries = NULL;
+    g_UsageCount = 0;
+    g_UsageCapacity = 0;
+    g_UsageLoaded = false;
+    g_UsageGeneration++;
+    ReleaseSRWLockExclusive(&g_UsageLock);
+}
+
+
+NTSTATUS
+UsageReserve(
+    _In_z_ const char* Username,
+    _In_ int64_t Bytes,
+    _In_ int64_t Objects,
+    _Out_ USAGE_RESERVATION* Reservation
+)
+{
+    memset(Reservation, 0, sizeof(*Reservation));
+
+    AcquireSRWLockExclusive(&g_UsageLock);
+    DWORD index = 0;
+    if (!FindEntryLocked(Username, &index)) {
+        ReleaseSRWLockExclusive(&g_UsageLock);
+        printf("Failed to read the usage of %s: %lu\n", Username, GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    USAGE_ENTRY* entry = &g_UsageEntries[index];
+    uint64_t bytes = AddClamped(entry->Record.Bytes, entry->PendingBytes);
+    uint64_t objects = AddClamped(entry->Record.Objects, entry->PendingObjects);
+    uint64_t newBytes = AddClamped(bytes, Bytes);
+    uint64_t newObjects = AddClamped(objects, Objects);
+
+    if ((Bytes > 0 && entry->Record.QuotaBytes != 0 && newBytes > entry->Record.QuotaBytes) ||
+        (Objects > 0 && entry->Record.QuotaObjects != 0 && newObjects > entry->Record.QuotaObjects)) {
+        ReleaseSRWLockExclusive(&g_UsageLock);
+        printf("The quota of %s would be exceeded.\n", Username);
+        return STATUS_QUOTA_EXCEEDED;
+    }
+
+    entry->PendingBytes += Bytes;
+    entry->PendingObjects += Objects;
+
+    Reservation->Index = index;
+    Reservation->Generation = g_UsageGeneration;
+    Reservation->Bytes = Bytes;
+    Reservation->Objects = Objects;
+    Reservation->Headroom = (entry->Record.QuotaBytes == 0) ? UINT64_MAX :
+                            (entry->Record.QuotaBytes > newBytes) ? entry->Record.QuotaBytes - newBytes : 0;
+    ReleaseSRWLockExclusive(&g_UsageLock);
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+UsageCommit(
+    _Inout_ USAGE_RESERVATION* Reservation,
+    _In_ bool Stored,
+    _In_ int64_t Bytes,
+    _In_ int64_t Objects
+)
+{
+    bool written = false;
+
+    AcquireSRWLockExclusive(&g_UsageLock);
+    if (Reservation->Generation == g_UsageGeneration && Reservation->Index < g_UsageCount) {
+        USAGE_ENTRY* entry = &g_UsageEntries[Reservation->Index];
+        entry->PendingBytes -= Reservation->Bytes;
+        entry->PendingObjects -= Reservation->Objects;
+
+        if (Stored) {
+            entry->Record.Bytes = AddClamped(entry->Record.Bytes, Bytes);
+            entry->Record.Objects = AddClamped(entry->Record.Objects, Objects);
+            written = WriteRecordLocked(Reservation->Index);
+            if (!written) {
+                printf("Failed to record the usage of %s: %lu\n", entry->Record.Username, GetLastError());
+            }
+        }
+    }
+    ReleaseSRWLockExclusive(&g_UsageLock);
+
+    if (written) {
+        CommitUsageFile();
+    }
+    memset(Reservation, 0, sizeof(*Reservation));
+}
+
+
+NTSTATUS
+UsageGet(
+    _In_z_ const char* Username,
+    _Out_ SafeStorageUsage* Usage
+)
+{
+    memset(Usage, 0, sizeof(*Usage));
+
+    // A lookup only reads the table; the lock is taken exclusively just to load it the first time
+    for (;;) {
+        AcquireSRWLockShared(&g_UsageLock);
+        if (g_UsageLoaded) {
+            break;
+        }
+        ReleaseSRWLockShared(&g_UsageLock);
+
+        AcquireSRWLockExclusive(&g_UsageLock);
+        bool loaded = LoadTableLocked();
+        ReleaseSRWLockExclusive(&g_UsageLock);
+        if (!loaded) {
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    DWORD index = 0;
+    bool found = LookupEntryLocked(Username, &index);
+    if (found) {
+        const USAGE_RECORD* record = &g_UsageEntries[index].Record;
+        StringCchCopyA(Usage->Username, sizeof(Usage->Username), record->Username);
+        Usage->Bytes = record->Bytes;
+        Usage->Objects = record->Objects;
+        Usage->QuotaBytes = record->QuotaBytes;
+        Usage->QuotaObjects = record->QuotaObjects;
+    }
+    ReleaseSRWLockShared(&g_UsageLock);
+    return found ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+
+bool
+UsageSetQuota(
+    _In_z_ const char* Username,
+    _In_ uint64_t QuotaBytes,
+    _In_ uint64_t QuotaObjects
+)
+{
+    AcquireSRWLockExclusive(&g_UsageLock);
+    DWORD index = 0;
+    bool result = FindEntryLocked(Username, &index);
+    if (result) {
+        g_UsageEntries[index].Record.QuotaBytes = QuotaBytes;
+        g_UsageEntries[index].Record.QuotaObjects = QuotaObjects;
+        result = WriteRecordLocked(index);
+    }
+    ReleaseSRWLockExclusive(&g_UsageLock);
+
+    if (result) {
+        CommitUsageFile();
+    }
+    return result;
+}
+
+
+bool
+UsageGetReport(
+    _Out_ SafeStorageUsageReport* Report
+)
+{
+    memset(Report, 0, sizeof(*Report));
+
+    AcquireSRWLockExclusive(&g_UsageLock);
+    bool result = LoadTableLocked();
+    if (result && g_UsageCount > 0) {
+        Report->Users = (SafeStorageUsage*)calloc(g_UsageCount, sizeof(SafeStorageUsage));
+        result = Report->Users != NULL;
+    }
+
+    for (DWORD i = 0; result && i < g_UsageCount; i++) {
+        const USAGE_RECORD* record = &g_UsageEntries[i].Record;
+        SafeStorageUsage* usage = &Report->Users[i];
+        StringCchCopyA(usage->Username, sizeof(usage->Username), record->Username);
+        usage->Bytes = record->Bytes;
+        usage->Objects = record->Objects;
+        usage->QuotaBytes = record->QuotaBytes;
+        usage->QuotaObjects = record->QuotaObjects;
+
+        Report->UserCount++;
+        Report->TotalBytes += record->Bytes;
+        Report->TotalObjects += record->Objects;
+    }
+    ReleaseSRWLockExclusive(&g_UsageLock);
+
+    return result;
+}
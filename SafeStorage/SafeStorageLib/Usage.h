@@ -0,0 +1,123 @@
+#ifndef _USAGE_H_
+#define _USAGE_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define USAGE_FILE_NAME "usage.dat"             // %APPDIR%\usage.dat: one fixed-size record per user
+#define USAGE_INITIAL_CAPACITY 64               // Users the table holds before it has to grow
+
+
+// Growth of a user's usage held by UsageReserve until the store is finished
+typedef struct _USAGE_RESERVATION {
+    DWORD Index;                                // Record of the user
+    uint64_t Generation;                        // Table the reservation was made in; stale after UsageReset
+    int64_t Bytes;
+    int64_t Objects;
+    uint64_t Headroom;                          // Bytes the user may grow by beyond Bytes; UINT64_MAX without a quota
+} USAGE_RESERVATION;
+
+
+/*
+ * @brief       Sets the application directory whose users are accounted. Called from SafeStorageInit.
+ */
+VOID
+UsageInit(
+    _In_z_ const char* AppDirectory
+);
+
+
+/*
+ * @brief       Forgets the loaded table, so that the next call loads it again, e.g. from another I/O backend.
+ *              Reservations made before are dropped when they are committed.
+ */
+VOID
+UsageReset(
+    VOID
+);
+
+
+/*
+ * @brief       Checks a store against the user's quota before any bytes are copied and holds the growth it
+ *              causes until UsageCommit.
+ *
+ * @details     The table is loaded from USAGE_FILE_NAME on first use. A user without a record (one who stored
+ *              submissions before usage was accounted) is counted once by walking the user's directory, and in
+ *              the cold tier, and the result is recorded. After that, usage only changes through UsageCommit.
+ *
+ *              Growth still held by other stores counts against the quota, so concurrent stores cannot exceed it
+ *              together. Shrinking stores always pass.
+ *
+ * @param[in]   Username        - The user who stores.
+ * @param[in]   Bytes           - How much the store grows the user's usage; negative if it shrinks it.
+ * @param[in]   Objects         - 1 for a new submission, otherwise 0.
+ * @param[out]  Reservation     - Receives the reservation, to be passed to UsageCommit.
+ *
+ * @return      STATUS_SUCCESS, STATUS_QUOTA_EXCEEDED, or STATUS_UNSUCCESSFUL if the usage cannot be read.
+ */
+NTSTATUS
+UsageReserve(
+    _In_z_ const char* Username,
+    _In_ int64_t Bytes,
+    _In_ int64_t Objects,
+    _Out_ USAGE_RESERVATION* Reservation
+);
+
+
+/*
+ * @brief       Releases a reservation and, if the store was published, applies the change it actually made
+ *              (a stream only knows its size at the end) and writes the user's record.
+ *
+ * @details     The record is written in place and made durable according to the durability mode. It is smaller
+ *              than a sector, so it is never torn.
+ */
+VOID
+UsageCommit(
+    _Inout_ USAGE_RESERVATION* Reservation,
+    _In_ bool Stored,
+    _In_ int64_t Bytes,
+    _In_ int64_t Objects
+);
+
+
+/*
+ * @brief       Returns the usage and quota of a user. Only reads: a user is added by the first store or quota
+ *              (see UsageReserve), so one who has neither is STATUS_NOT_FOUND.
+ */
+NTSTATUS
+UsageGet(
+    _In_z_ const char* Username,
+    _Out_ SafeStorageUsage* Usage
+);
+
+
+/*
+ * @brief       Sets the quota of a user; 0 means unlimited. Stored submissions are not affected, even if they
+ *              exceed the new quota; only stores that would grow the usage further fail.
+ */
+bool
+UsageSetQuota(
+    _In_z_ const char* Username,
+    _In_ uint64_t QuotaBytes,
+    _In_ uint64_t QuotaObjects
+);
+
+
+/*
+ * @brief       Returns the usage of every user in the table, from memory.
+ *
+ * @return      FALSE if out of memory or the usage cannot be read. On success, Report->Users is allocated with
+ *              malloc (NULL if there are no users).
+ */
+bool
+UsageGetReport(
+    _Out_ SafeStorageUsageReport* Report
+);
+
+
+EXTERN_C_END;
+#endif  //_USAGE_H_
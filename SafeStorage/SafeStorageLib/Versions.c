@@ -0,0 +1,1054 @@
+#include "Versions.h"
+#include "Commands.h"
+#include "Durability.h"
+#include "FileIo.h"
+#include "Manifest.h"
+#include "Scheduler.h"
+#include "Striping.h"
+#include "ThreadPool.h"
+#include "Tiering.h"
+#include "Transfer.h"
+#include "Usage.h"
+
+
+#define FILETIME_UNITS_PER_DAY (24ULL * 60 * 60 * 10000000ULL)
+#define SNAPSHOT_LINE_MAX (16 + MAX_PATH)
+#define SNAPSHOT_ATTEMPTS 3                     // Collections of a snapshot before pruning running alongside wins
+
+
+// Shared by the block tasks of one freeze or restore
+typedef struct _VERSION_CONTEXT {
+    const char* UserDirectory;
+    SS_MANIFEST* Manifest;
+    SS_FILE* Submission;                        // Freeze: the current contents. Restore: the same, if they are the version restored
+    SS_FILE* Destination;                       // Restore only
+    bool ComputeHashes;                         // Freeze without an up-to-date record: every block is read and checksummed
+    bool SkipZeroBlocks;                        // Restore into a sparse destination: all-zero blocks are left as holes
+    BYTE ZeroBlockHash[HASH_LENGTH];            // Checksum of a full block of zeros
+    SCHEDULER_QUEUE* Queue;                     // Every block I/O waits for its turn here
+    volatile LONG Failed;                       // Set by the first block that fails; the others are skipped
+    volatile LONG Corrupt;                      // Restore: a block was missing or did not match its checksum
+    volatile LONG64 StoredBlocks;               // Freeze: blocks added to the block store
+    volatile LONG64 StoredBytes;                // Freeze: their size, accounted to the user like submissions
+    uint64_t Headroom;                          // Freeze: what is left of the user's quota for StoredBytes
+    volatile LONG QuotaExceeded;                // Freeze: a block did not fit in Headroom
+} VERSION_CONTEXT;
+
+
+// A numbered file (version record or snapshot) as listed by ListNumberedFile
+typedef struct _VERSION_ENTRY {
+    uint32_t Number;
+    uint64_t RecordedTime;                      // Last write time of the file, FILETIME units
+} VERSION_ENTRY;
+
+
+typedef struct _VERSION_LIST {
+    VERSION_ENTRY* Entries;
+    size_t Count;
+    size_t Capacity;
+    bool Failed;                                // Out of memory; the list is incomplete
+} VERSION_LIST;
+
+
+// Collects the versions of one submission that are referenced by snapshots
+typedef struct _PIN_SEARCH {
+    const char* SubmissionName;
+    VERSION_LIST* Pinned;
+} PIN_SEARCH;
+
+
+// Checksums of every block referenced by the versions of a user
+typedef struct _HASH_SET {
+    BYTE (*Hashes)[HASH_LENGTH];
+    size_t Count;
+    size_t Capacity;
+    bool Failed;                                // A record could not be read or out of memory; nothing may be deleted
+    uint64_t DeletedBytes;                      // Size of the blocks DeleteUnreferencedBlock removed
+} HASH_SET;
+
+
+// State of VersionsSnapshot while it walks the submissions of a user
+typedef struct _SNAPSHOT_WRITER {
+    const char* UserDirectory;
+    const char* Owner;
+    IO_TEXT Text;                               // The snapshot, written out once complete
+    size_t RootLength;                          // Length of the directory being listed; names are relative to it
+    bool ColdPass;                              // Listing the cold tier: submissions also in the hot tier are done
+    bool Failed;
+} SNAPSHOT_WRITER;
+
+
+// Global static variables
+static SRWLOCK g_VersionsLock = SRWLOCK_INIT;   // Shared while blocks are added or read; exclusive while anything is removed
+static uint32_t g_MaxVersions = 0;
+static uint64_t g_MaxVersionAge = 0;            // FILETIME units
+
+
+/**
+ * @brief       Parses the name of a version record or snapshot ("1", "2", ...). Partial files do not parse.
+ */
+static bool ParseNumber(_In_z_ const char* name, _Out_ uint32_t* number) {
+    char* end = NULL;
+    unsigned long value = strtoul(name, &end, 10);
+
+    *number = (uint32_t)value;
+    return name[0] >= '0' && name[0] <= '9' && *end == '\0' && value != 0 && value <= MAXDWORD;
+}
+
+
+/**
+ * @brief       Parses the name of a block file (the hex checksum of its contents).
+ */
+static bool ParseHash(_In_z_ const char* name, _Out_writes_bytes_all_(HASH_LENGTH) BYTE* hash) {
+    if (strlen(name) != 2 * HASH_LENGTH) {
+        return false;
+    }
+
+    for (size_t i = 0; i < HASH_LENGTH; i++) {
+        unsigned int value = 0;
+        if (!isxdigit((unsigned char)name[2 * i]) || !isxdigit((unsigned char)name[2 * i + 1]) ||
+            sscanf_s(name + 2 * i, "%2x", &value) != 1) {
+            return false;
+        }
+        hash[i] = (BYTE)value;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Path of the block with the given checksum: <user>\~blocks\<first byte>\<checksum>.
+ *              The first level keeps directories small.
+ */
+static bool BlockPath(_In_z_ const char* userDirectory, _In_reads_bytes_(HASH_LENGTH) const BYTE* hash, _Out_writes_z_(MAX_PATH) char* blockPath) {
+    char hex[HASH_HEX_LENGTH];
+    for (size_t i = 0; i < HASH_LENGTH; i++) {
+        sprintf_s(hex + 2 * i, 3, "%02x", hash[i]);
+    }
+
+    return SUCCEEDED(StringCchPrintfA(blockPath, MAX_PATH, "%s\\%s\\%.2s\\%s", userDirectory, VERSIONS_BLOCKS_DIRECTORY, hex, hex));
+}
+
+
+/**
+ * @brief       Returns the user a user directory belongs to: its last path component.
+ */
+static const char* DirectoryOwner(_In_z_ const char* userDirectory) {
+    const char* separator = strrchr(userDirectory, '\\');
+    return (separator != NULL) ? separator + 1 : userDirectory;
+}
+
+
+/**
+ * @brief       Directory holding the version records of a submission.
+ */
+static bool VersionDirectoryPath(_In_z_ const char* userDirectory, _In_z_ const char* submissionName, _Out_writes_z_(MAX_PATH) char* directory) {
+    return SUCCEEDED(StringCchPrintfA(directory, MAX_PATH, "%s\\%s\\%s", userDirectory, VERSIONS_DIRECTORY, submissionName));
+}
+
+
+/**
+ * @brief       Path of one version record: a manifest of the version's blocks.
+ */
+static bool VersionRecordPath(_In_z_ const char* userDirectory, _In_z_ const char* submissionName, _In_ uint32_t version, _Out_writes_z_(MAX_PATH) char* recordPath) {
+    return SUCCEEDED(StringCchPrintfA(recordPath, MAX_PATH, "%s\\%s\\%s\\%lu", userDirectory, VERSIONS_DIRECTORY, submissionName, version));
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Keeps the highest number among the numbered files of a directory.
+ */
+static IoEnumerateAction FindLatest(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    UNREFERENCED_PARAMETER(path);
+
+    uint32_t* latest = (uint32_t*)context;
+    uint32_t number = 0;
+    if (!info->IsDirectory && ParseNumber(name, &number) && number > *latest) {
+        *latest = number;
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Finds the highest numbered file (version record or snapshot) in a directory.
+ *
+ * @return      TRUE with *latest set (0 if the directory is empty or missing); FALSE if it cannot be listed.
+ */
+static bool LatestNumber(_In_z_ const char* directory, _Out_ uint32_t* latest) {
+    *latest = 0;
+    if (IoEnumerateFiles(directory, false, FindLatest, latest)) {
+        return true;
+    }
+
+    DWORD error = GetLastError();
+    return error == ERROR_PATH_NOT_FOUND || error == ERROR_FILE_NOT_FOUND;
+}
+
+
+/**
+ * @brief       Appends a number to a version list.
+ */
+static bool AddToList(_Inout_ VERSION_LIST* list, _In_ uint32_t number, _In_ uint64_t recordedTime) {
+    if (list->Count == list->Capacity) {
+        size_t capacity = (list->Capacity == 0) ? 16 : 2 * list->Capacity;
+        VERSION_ENTRY* entries = (VERSION_ENTRY*)realloc(list->Entries, capacity * sizeof(VERSION_ENTRY));
+        if (entries == NULL) {
+            list->Failed = true;
+            return false;
+        }
+        list->Entries = entries;
+        list->Capacity = capacity;
+    }
+
+    list->Entries[list->Count].Number = number;
+    list->Entries[list->Count].RecordedTime = recordedTime;
+    list->Count++;
+    return true;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Lists the numbered files of a directory.
+ */
+static IoEnumerateAction ListNumberedFile(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    UNREFERENCED_PARAMETER(path);
+
+    uint32_t number = 0;
+    if (info->IsDirectory || !ParseNumber(name, &number)) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+    return AddToList((VERSION_LIST*)context, number, info->LastWriteTime) ? IO_ENUMERATE_CONTINUE : IO_ENUMERATE_STOP;
+}
+
+
+static int CompareVersionsNewestFirst(_In_ const void* left, _In_ const void* right) {
+    uint32_t leftNumber = ((const VERSION_ENTRY*)left)->Number;
+    uint32_t rightNumber = ((const VERSION_ENTRY*)right)->Number;
+    return (leftNumber < rightNumber) - (leftNumber > rightNumber);
+}
+
+
+static bool ListContains(_In_ const VERSION_LIST* list, _In_ uint32_t number) {
+    for (size_t i = 0; i < list->Count; i++) {
+        if (list->Entries[i].Number == number) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief       Looks up the version of a submission in one snapshot file.
+ */
+static bool FindInSnapshot(_In_z_ const char* snapshotPath, _In_z_ const char* submissionName, _Out_ uint32_t* version) {
+    char* contents = NULL;
+    *version = 0;
+    if (!IoReadFileContents(snapshotPath, &contents, NULL)) {
+        return false;
+    }
+
+    char* cursor = contents;
+    char* line = NULL;
+    bool found = false;
+    while (!found && (line = IoTextNextLine(&cursor)) != NULL) {
+        // "<version> <submission>"; submission names may contain spaces but not line breaks
+        char* name = strchr(line, ' ');
+        if (name != NULL) {
+            *name++ = '\0';
+            found = strcmp(name, submissionName) == 0 && ParseNumber(line, version);
+        }
+    }
+
+    free(contents);
+    return found;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Adds the version a snapshot froze of one submission to the pinned list.
+ */
+static IoEnumerateAction CollectPinnedVersion(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    PIN_SEARCH* search = (PIN_SEARCH*)context;
+    uint32_t number = 0;
+    uint32_t version = 0;
+
+    if (info->IsDirectory || !ParseNumber(name, &number) || !FindInSnapshot(path, search->SubmissionName, &version)) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+    return AddToList(search->Pinned, version, 0) ? IO_ENUMERATE_CONTINUE : IO_ENUMERATE_STOP;
+}
+
+
+/**
+ * @brief       Finds the current contents of a submission: the hot file or, if it was migrated, its cold copy.
+ *
+ * @return      TRUE with the path and attributes; FALSE if the submission does not exist.
+ */
+static bool LocateCurrent(_In_z_ const char* submissionPath, _Out_writes_z_(MAX_PATH) char* currentPath, _Out_ IO_FILE_INFO* info) {
+    if (IoQueryFileInfo(submissionPath, info)) {
+        return SUCCEEDED(StringCchCopyA(currentPath, MAX_PATH, submissionPath));
+    }
+
+    return TieringGetColdPath(submissionPath, currentPath) && IoQueryFileInfo(currentPath, info);
+}
+
+
+/**
+ * @brief       Reads the newest version record of a submission if it describes the given contents.
+ *
+ * @return      TRUE with *latest set to the newest version (0 if none) and *record to it or NULL if it is out
+ *              of date; FALSE if the records cannot be listed.
+ */
+static bool ReadCurrentRecord(_In_z_ const char* userDirectory, _In_z_ const char* submissionName, _In_ const IO_FILE_INFO* current, _Out_ uint32_t* latest, _Out_ SS_MANIFEST** record) {
+    char versionDirectory[MAX_PATH];
+    char recordPath[MAX_PATH];
+
+    *record = NULL;
+    if (!VersionDirectoryPath(userDirectory, submissionName, versionDirectory) || !LatestNumber(versionDirectory, latest)) {
+        *latest = 0;
+        return false;
+    }
+
+    if (*latest != 0 && VersionRecordPath(userDirectory, submissionName, *latest, recordPath)) {
+        *record = ManifestRead(recordPath);
+        if (*record != NULL && !ManifestMatchesFile(*record, current->Size, current->LastWriteTime)) {
+            ManifestFree(*record);
+            *record = NULL;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Writes one block to the block store through a partial file that is renamed into place.
+ *              The partial name includes the block index, since identical blocks of one file may be
+ *              stored by several tasks at once.
+ */
+static bool StoreBlock(_In_z_ const char* blockPath, _In_ uint64_t block, _In_reads_bytes_(length) const BYTE* data, _In_ DWORD length) {
+    char parent[MAX_PATH];
+    char partialPath[MAX_PATH];
+    if (FAILED(StringCchCopyA(parent, MAX_PATH, blockPath)) ||
+        FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s%llu", blockPath, TRANSFER_PARTIAL_SUFFIX, block))) {
+        return false;
+    }
+    *strrchr(parent, '\\') = '\0';
+
+    SS_FILE* file = IoCreateDirectories(parent) ? IoOpenFile(partialPath, IO_OPEN_CREATE) : NULL;
+    if (file == NULL) {
+        return false;
+    }
+
+    bool result = IoWriteAt(file, 0, data, length);
+    IoCloseFile(file);
+
+    result = result && DurabilityCommitFile(partialPath) && IoReplaceFile(partialPath, blockPath);
+    if (!result) {
+        IoDeleteFile(partialPath);
+    }
+    return result;
+}
+
+
+/**
+ * @brief       Thread pool routine of a freeze. Makes sure one block of the current contents is in the
+ *              block store, reading it only if it is not there yet (or its checksum is not known).
+ */
+static VOID FreezeBlock(_Inout_opt_ PVOID context, _In_ uint64_t block) {
+    VERSION_CONTEXT* freeze = (VERSION_CONTEXT*)context;
+    if (freeze->Failed) {
+        return;
+    }
+
+    SS_MANIFEST* manifest = freeze->Manifest;
+    uint64_t offset = block * manifest->BlockSize;
+    DWORD length = (DWORD)min((uint64_t)manifest->BlockSize, manifest->FileSize - offset);
+    char blockPath[MAX_PATH];
+    IO_FILE_INFO blockInfo = { 0 };
+
+    // Shared with an older version or with another block of this one
+    if (!freeze->ComputeHashes &&
+        BlockPath(freeze->UserDirectory, manifest->BlockHashes[block], blockPath) && IoQueryFileInfo(blockPath, &blockInfo)) {
+        return;
+    }
+
+    BYTE hash[HASH_LENGTH];
+    DWORD bytesRead = 0;
+    BYTE* buffer = (BYTE*)malloc(length);
+    if (buffer == NULL) {
+        InterlockedExchange(&freeze->Failed, TRUE);
+        return;
+    }
+
+    SchedulerAcquire(freeze->Queue, length);
+    bool result = IoReadAt(freeze->Submission, offset, buffer, length, &bytesRead) && bytesRead == length &&
+                  ManifestHashBlock(buffer, length, hash);
+    SchedulerRelease();
+
+    if (result && freeze->ComputeHashes) {
+        memcpy(manifest->BlockHashes[block], hash, HASH_LENGTH);
+    }
+    else if (result && memcmp(hash, manifest->BlockHashes[block], HASH_LENGTH) != 0) {
+        // Preserving the damaged data under the good checksum would hide the damage; restoring the
+        // version reports the block instead. It must not keep the submission from being overwritten.
+        printf("Block %llu of the current version is corrupt and cannot be preserved.\n", block);
+        free(buffer);
+        return;
+    }
+
+    result = result && BlockPath(freeze->UserDirectory, hash, blockPath);
+    if (result && !IoQueryFileInfo(blockPath, &blockInfo)) {
+        // Older versions count against the quota like submissions do
+        if ((uint64_t)InterlockedAdd64(&freeze->StoredBytes, length) > freeze->Headroom) {
+            InterlockedAdd64(&freeze->StoredBytes, -(LONG64)length);
+            InterlockedExchange(&freeze->QuotaExceeded, TRUE);
+            InterlockedExchange(&freeze->Failed, TRUE);
+            free(buffer);
+            return;
+        }
+
+        SchedulerAcquire(freeze->Queue, length);
+        result = StoreBlock(blockPath, block, buffer, length);
+        SchedulerRelease();
+
+        if (result) {
+            InterlockedIncrement64(&freeze->StoredBlocks);
+        }
+        else {
+            InterlockedAdd64(&freeze->StoredBytes, -(LONG64)length);
+        }
+    }
+
+    if (!result) {
+        printf("Failed to preserve block %llu: %lu\n", block, GetLastError());
+        InterlockedExchange(&freeze->Failed, TRUE);
+    }
+
+    free(buffer);
+}
+
+
+/**
+ * @brief       Implements VersionsFreezeCurrent. Must be called with g_VersionsLock held.
+ */
+static NTSTATUS FreezeLocked(_In_z_ const char* userDirectory, _In_z_ const char* submissionName, _In_opt_z_ const char* owner) {
+    char submissionPath[MAX_PATH];
+    char currentPath[MAX_PATH];
+    char versionDirectory[MAX_PATH];
+    char recordPath[MAX_PATH];
+    IO_FILE_INFO current = { 0 };
+
+    if (FAILED(StringCchPrintfA(submissionPath, MAX_PATH, "%s\\%s", userDirectory, submissionName)) ||
+        !VersionDirectoryPath(userDirectory, submissionName, versionDirectory)) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // A new submission has nothing to preserve
+    if (!LocateCurrent(submissionPath, currentPath, &current)) {
+        return STATUS_SUCCESS;
+    }
+
+    // The blocks added are only known as they are stored; they may take what is left of the quota
+    USAGE_RESERVATION reservation = { 0 };
+    NTSTATUS status = UsageReserve(DirectoryOwner(userDirectory), 0, 0, &reservation);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    VERSION_CONTEXT freeze = { 0 };
+    freeze.UserDirectory = userDirectory;
+    freeze.Headroom = reservation.Headroom;
+
+    uint32_t latest = 0;
+    bool result = ReadCurrentRecord(userDirectory, submissionName, &current, &latest, &freeze.Manifest);
+
+    // Stored before versioning, or its record was never written: it becomes a version of its own
+    if (result && freeze.Manifest == NULL) {
+        freeze.ComputeHashes = true;
+        freeze.Manifest = ManifestCreate(current.Size, MANIFEST_BLOCK_SIZE);
+        result = (freeze.Manifest != NULL);
+        if (result) {
+            freeze.Manifest->LastWriteTime = current.LastWriteTime;
+        }
+    }
+
+    if (result) {
+        freeze.Submission = StripingOpenFile(currentPath, IO_OPEN_READ);
+        freeze.Queue = SchedulerOpenQueue(owner, SchedulerClassForSize(current.Size));
+        result = (freeze.Submission != NULL) && (freeze.Queue != NULL) &&
+                 PoolParallelFor(FreezeBlock, &freeze, freeze.Manifest->BlockCount) && !freeze.Failed;
+        SchedulerCloseQueue(freeze.Queue);
+        IoCloseFile(freeze.Submission);
+    }
+
+    if (result && freeze.ComputeHashes) {
+        result = VersionRecordPath(userDirectory, submissionName, latest + 1, recordPath) &&
+                 IoCreateDirectories(versionDirectory) && ManifestWrite(freeze.Manifest, recordPath);
+    }
+
+    ManifestFree(freeze.Manifest);
+
+    // Blocks stored by a freeze that failed stay until garbage collection deletes them, so they count as well
+    UsageCommit(&reservation, freeze.StoredBytes > 0, freeze.StoredBytes, 0);
+
+    if (freeze.QuotaExceeded) {
+        printf("The quota of %s leaves no room to preserve the current version of the submission.\n", DirectoryOwner(userDirectory));
+        return STATUS_QUOTA_EXCEEDED;
+    }
+    if (!result) {
+        printf("Failed to preserve the current version of the submission.\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+    if (freeze.StoredBlocks > 0) {
+        printf("Preserved %llu changed blocks of the previous version.\n", (uint64_t)freeze.StoredBlocks);
+    }
+    return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief       Applies the retention policy to the versions older than the one just recorded.
+ *              Must be called with g_VersionsLock held exclusively.
+ *
+ * @param       versions        The older versions; sorted newest first on return.
+ * @return      TRUE if any version was removed.
+ */
+static bool PruneVersions(_In_z_ const char* userDirectory, _In_z_ const char* submissionName, _Inout_ VERSION_LIST* versions) {
+    if (g_MaxVersions == 0 && g_MaxVersionAge == 0) {
+        return false;
+    }
+
+    // Without a complete list of pinned versions nothing is pruned
+    char snapshotDirectory[MAX_PATH];
+    IO_FILE_INFO snapshotInfo = { 0 };
+    VERSION_LIST pinned = { 0 };
+    PIN_SEARCH search = { submissionName, &pinned };
+    if (FAILED(StringCchPrintfA(snapshotDirectory, MAX_PATH, "%s\\%s", userDirectory, VERSIONS_SNAPSHOTS_DIRECTORY)) ||
+        (IoQueryFileInfo(snapshotDirectory, &snapshotInfo) && !IoEnumerateFiles(snapshotDirectory, false, CollectPinnedVersion, &search))) {
+        free(pinned.Entries);
+        return false;
+    }
+
+    FILETIME now = { 0 };
+    GetSystemTimeAsFileTime(&now);
+    uint64_t nowTime = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+    qsort(versions->Entries, versions->Count, sizeof(VERSION_ENTRY), CompareVersionsNewestFirst);
+
+    bool pruned = false;
+    for (size_t i = 0; i < versions->Count; i++) {
+        const VERSION_ENTRY* entry = &versions->Entries[i];
+        char recordPath[MAX_PATH];
+
+        // Entry i is the (i + 2)-th newest version, counting the one just recorded
+        bool tooMany = g_MaxVersions != 0 && i + 2 > g_MaxVersions;
+        bool tooOld = g_MaxVersionAge != 0 && nowTime > entry->RecordedTime && nowTime - entry->RecordedTime > g_MaxVersionAge;
+
+        if ((tooMany || tooOld) && !ListContains(&pinned, entry->Number) &&
+            VersionRecordPath(userDirectory, submissionName, entry->Number, recordPath) && IoDeleteFile(recordPath)) {
+            pruned = true;
+        }
+    }
+
+    free(pinned.Entries);
+    return pruned;
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Adds the block checksums of one version record to the set.
+ */
+static IoEnumerateAction CollectRecordHashes(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    HASH_SET* set = (HASH_SET*)context;
+    uint32_t number = 0;
+
+    if (info->IsDirectory || !ParseNumber(name, &number)) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    SS_MANIFEST* record = ManifestRead(path);
+    if (record == NULL) {
+        set->Failed = true;
+        return IO_ENUMERATE_STOP;
+    }
+
+    if (set->Count + record->BlockCount > set->Capacity) {
+        size_t capacity = max(2 * set->Capacity, set->Count + (size_t)record->BlockCount);
+        BYTE (*hashes)[HASH_LENGTH] = (BYTE (*)[HASH_LENGTH])realloc(set->Hashes, capacity * HASH_LENGTH);
+        if (hashes == NULL) {
+            ManifestFree(record);
+            set->Failed = true;
+            return IO_ENUMERATE_STOP;
+        }
+        set->Hashes = hashes;
+        set->Capacity = capacity;
+    }
+
+    memcpy(set->Hashes[set->Count], record->BlockHashes, (size_t)record->BlockCount * HASH_LENGTH);
+    set->Count += (size_t)record->BlockCount;
+    ManifestFree(record);
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+static int CompareHashes(_In_ const void* left, _In_ const void* right) {
+    return memcmp(left, right, HASH_LENGTH);
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Deletes block files no version refers to, and partial
+ *              blocks left behind by an interrupted freeze.
+ */
+static IoEnumerateAction DeleteUnreferencedBlock(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    HASH_SET* set = (HASH_SET*)context;
+    BYTE hash[HASH_LENGTH];
+
+    if (info->IsDirectory) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    // Partial blocks were never accounted; the others were, by the freeze that stored them
+    if (!ParseHash(name, hash)) {
+        IoDeleteFile(path);
+    }
+    else if (bsearch(hash, set->Hashes, set->Count, HASH_LENGTH, CompareHashes) == NULL && IoDeleteFile(path)) {
+        set->DeletedBytes += info->Size;
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Deletes the blocks of a user that no remaining version refers to, and gives their size back
+ *              to the user's usage. Must be called with g_VersionsLock held exclusively.
+ */
+static void CollectGarbage(_In_z_ const char* userDirectory) {
+    char versionsDirectory[MAX_PATH];
+    char blocksDirectory[MAX_PATH];
+    if (FAILED(StringCchPrintfA(versionsDirectory, MAX_PATH, "%s\\%s", userDirectory, VERSIONS_DIRECTORY)) ||
+        FAILED(StringCchPrintfA(blocksDirectory, MAX_PATH, "%s\\%s", userDirectory, VERSIONS_BLOCKS_DIRECTORY))) {
+        return;
+    }
+
+    HASH_SET set = { 0 };
+    if (IoEnumerateFiles(versionsDirectory, true, CollectRecordHashes, &set) && !set.Failed) {
+        qsort(set.Hashes, set.Count, HASH_LENGTH, CompareHashes);
+        IoEnumerateFiles(blocksDirectory, true, DeleteUnreferencedBlock, &set);
+    }
+    free(set.Hashes);
+
+    USAGE_RESERVATION reservation = { 0 };
+    if (set.DeletedBytes > 0 && NT_SUCCESS(UsageReserve(DirectoryOwner(userDirectory), -(int64_t)set.DeletedBytes, 0, &reservation))) {
+        UsageCommit(&reservation, true, -(int64_t)set.DeletedBytes, 0);
+    }
+}
+
+
+/**
+ * @brief       Thread pool routine of a restore. Reads one block of the version, verifies it against the
+ *              version's checksum and writes it at its offset in the destination.
+ */
+static VOID RestoreBlock(_Inout_opt_ PVOID context, _In_ uint64_t block) {
+    VERSION_CONTEXT* restore = (VERSION_CONTEXT*)context;
+    if (restore->Failed) {
+        return;
+    }
+
+    SS_MANIFEST* manifest = restore->Manifest;
+    uint64_t offset = block * manifest->BlockSize;
+    DWORD length = (DWORD)min((uint64_t)manifest->BlockSize, manifest->FileSize - offset);
+    char blockPath[MAX_PATH];
+    BYTE hash[HASH_LENGTH];
+    DWORD bytesRead = 0;
+
+    if (restore->SkipZeroBlocks && length == manifest->BlockSize &&
+        memcmp(manifest->BlockHashes[block], restore->ZeroBlockHash, HASH_LENGTH) == 0) {
+        return;
+    }
+
+    BYTE* buffer = (BYTE*)malloc(length);
+    if (buffer == NULL) {
+        InterlockedExchange(&restore->Failed, TRUE);
+        return;
+    }
+
+    SS_FILE* blockFile = BlockPath(restore->UserDirectory, manifest->BlockHashes[block], blockPath) ?
+        IoOpenFile(blockPath, IO_OPEN_READ) : NULL;
+
+    SchedulerAcquire(restore->Queue, 2 * length);
+    bool intact = blockFile != NULL &&
+                  IoReadAt(blockFile, 0, buffer, length, &bytesRead) && bytesRead == length &&
+                  ManifestHashBlock(buffer, length, hash) && memcmp(hash, manifest->BlockHashes[block], HASH_LENGTH) == 0;
+
+    // Blocks of the current version only reach the block store when it is about to be overwritten
+    if (!intact && restore->Submission != NULL) {
+        intact = IoReadAt(restore->Submission, offset, buffer, length, &bytesRead) && bytesRead == length &&
+                 ManifestHashBlock(buffer, length, hash) && memcmp(hash, manifest->BlockHashes[block], HASH_LENGTH) == 0;
+    }
+
+    bool result = intact && IoWriteAt(restore->Destination, offset, buffer, length);
+    SchedulerRelease();
+
+    IoCloseFile(blockFile);
+    if (!intact) {
+        printf("Block %llu of the version is missing or corrupt.\n", block);
+        InterlockedExchange(&restore->Corrupt, TRUE);
+    }
+    if (!result) {
+        InterlockedExchange(&restore->Failed, TRUE);
+    }
+
+    free(buffer);
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback of VersionsSnapshot. Writes the current version of one submission,
+ *              recording it first if the submission has no up-to-date version record.
+ */
+static IoEnumerateAction SnapshotSubmission(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    SNAPSHOT_WRITER* writer = (SNAPSHOT_WRITER*)context;
+    char submissionPath[MAX_PATH];
+    IO_FILE_INFO hotInfo = { 0 };
+
+    // Version records, blocks and snapshots are not submissions; other directories hold nested submissions
+    if (info->IsDirectory) {
+        return (strchr(name, '~') != NULL) ? IO_ENUMERATE_SKIP : IO_ENUMERATE_CONTINUE;
+    }
+
+    // Nested submissions are named by their path relative to the user directory, e.g. "project\\main.c"
+    const char* submissionName = path + writer->RootLength + 1;
+    if (strchr(name, '~') != NULL ||
+        FAILED(StringCchPrintfA(submissionPath, MAX_PATH, "%s\\%s", writer->UserDirectory, submissionName))) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    if (writer->ColdPass && IoQueryFileInfo(submissionPath, &hotInfo)) {
+        return IO_ENUMERATE_CONTINUE;
+    }
+
+    char currentPath[MAX_PATH];
+    IO_FILE_INFO current = { 0 };
+    SS_MANIFEST* record = NULL;
+    uint32_t latest = 0;
+
+    // Shared, like VersionsFreezeCurrent: stores and restores of other submissions go on meanwhile
+    AcquireSRWLockShared(&g_VersionsLock);
+    bool recorded = LocateCurrent(submissionPath, currentPath, &current) &&
+                    ReadCurrentRecord(writer->UserDirectory, submissionName, &current, &latest, &record) && record != NULL;
+
+    // Usually already recorded by the store; otherwise recording it reads the submission once
+    if (!recorded) {
+        recorded = NT_SUCCESS(FreezeLocked(writer->UserDirectory, submissionName, writer->Owner)) &&
+                   LocateCurrent(submissionPath, currentPath, &current) &&
+                   ReadCurrentRecord(writer->UserDirectory, submissionName, &current, &latest, &record) && record != NULL;
+    }
+    ReleaseSRWLockShared(&g_VersionsLock);
+    ManifestFree(record);
+
+    if (!recorded || !IoTextAppend(&writer->Text, "%lu %s\n", latest, submissionName)) {
+        writer->Failed = true;
+        return IO_ENUMERATE_STOP;
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Checks that every version listed by a snapshot still has its record, i.e. that none was pruned
+ *              after it was collected. Must be called with g_VersionsLock held exclusively.
+ */
+static bool SnapshotVersionsExist(_In_z_ const char* userDirectory, _In_ const IO_TEXT* text) {
+    if (text->Data == NULL) {
+        return true;
+    }
+
+    char* contents = _strdup(text->Data);
+    if (contents == NULL) {
+        return false;
+    }
+
+    char* cursor = contents;
+    char* line = NULL;
+    bool result = true;
+    while (result && (line = IoTextNextLine(&cursor)) != NULL) {
+        char* name = strchr(line, ' ');
+        char recordPath[MAX_PATH];
+        IO_FILE_INFO info = { 0 };
+        uint32_t version = 0;
+
+        result = (name != NULL);
+        if (result) {
+            *name++ = '\0';
+            result = ParseNumber(line, &version) && VersionRecordPath(userDirectory, name, version, recordPath) &&
+                     IoQueryFileInfo(recordPath, &info);
+        }
+    }
+
+    free(contents);
+    return result;
+}
+
+
+VOID
+VersionsSetRetention(
+    _In_ uint32_t MaxVersions,
+    _In_ uint32_t MaxAgeDays
+)
+{
+    AcquireSRWLockExclusive(&g_VersionsLock);
+    g_MaxVersions = MaxVersions;
+    g_MaxVersionAge = MaxAgeDays * FILETIME_UNITS_PER_DAY;
+    ReleaseSRWLockExclusive(&g_VersionsLock);
+}
+
+
+NTSTATUS
+VersionsFreezeCurrent(
+    _In_z_ const char* UserDirectory,
+    _In_z_ const char* SubmissionName,
+    _In_opt_z_ const char* Owner
+)
+{
+    // Shared: freezes only add blocks, and garbage collection cannot run in between
+    AcquireSRWLockShared(&g_VersionsLock);
+    NTSTATUS status = FreezeLocked(UserDirectory, SubmissionName, Owner);
+    ReleaseSRWLockShared(&g_VersionsLock);
+
+    return status;
+}
+
+
+bool
+VersionsRecordCurrent(
+    _In_z_ const char* UserDirectory,
+    _In_z_ const char* SubmissionName,
+    _Out_ uint32_t* Version
+)
+{
+    char submissionPath[MAX_PATH];
+    char manifestPath[MAX_PATH];
+    char versionDirectory[MAX_PATH];
+    char recordPath[MAX_PATH];
+    IO_FILE_INFO current = { 0 };
+
+    *Version = 0;
+    if (FAILED(StringCchPrintfA(submissionPath, MAX_PATH, "%s\\%s", UserDirectory, SubmissionName)) ||
+        FAILED(StringCchPrintfA(manifestPath, MAX_PATH, "%s%s", submissionPath, MANIFEST_SUFFIX)) ||
+        !VersionDirectoryPath(UserDirectory, SubmissionName, versionDirectory)) {
+        return false;
+    }
+
+    // The store's manifest has exactly the block checksums of the new version
+    SS_MANIFEST* manifest = ManifestRead(manifestPath);
+    if (manifest == NULL || !IoQueryFileInfo(submissionPath, &current) ||
+        !ManifestMatchesFile(manifest, current.Size, current.LastWriteTime)) {
+        ManifestFree(manifest);
+        return false;
+    }
+
+    AcquireSRWLockExclusive(&g_VersionsLock);
+
+    VERSION_LIST versions = { 0 };
+    uint32_t latest = 0;
+    bool result = LatestNumber(versionDirectory, &latest) &&
+                  (IoEnumerateFiles(versionDirectory, false, ListNumberedFile, &versions) || latest == 0) && !versions.Failed &&
+                  VersionRecordPath(UserDirectory, SubmissionName, latest + 1, recordPath) &&
+                  IoCreateDirectories(versionDirectory) && ManifestWrite(manifest, recordPath);
+
+    if (result) {
+        *Version = latest + 1;
+        if (PruneVersions(UserDirectory, SubmissionName, &versions)) {
+            CollectGarbage(UserDirectory);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&g_VersionsLock);
+
+    free(versions.Entries);
+    ManifestFree(manifest);
+    return result;
+}
+
+
+NTSTATUS
+VersionsRestore(
+    _In_z_ const char* UserDirectory,
+    _In_z_ const char* SubmissionName,
+    _In_ uint32_t Version,
+    _In_z_ const char* DestinationPath,
+    _In_opt_z_ const char* Owner
+)
+{
+    char recordPath[MAX_PATH];
+    char submissionPath[MAX_PATH];
+    char partialPath[MAX_PATH];
+    if (!VersionRecordPath(UserDirectory, SubmissionName, Version, recordPath) ||
+        FAILED(StringCchPrintfA(submissionPath, MAX_PATH, "%s\\%s", UserDirectory, SubmissionName)) ||
+        FAILED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", DestinationPath, TRANSFER_PARTIAL_SUFFIX))) {
+        printf("Failed to construct the version paths.\n");
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    VERSION_CONTEXT restore = { 0 };
+    restore.UserDirectory = UserDirectory;
+
+    // Shared: the version and its blocks cannot be pruned while they are read
+    AcquireSRWLockShared(&g_VersionsLock);
+
+    restore.Manifest = ManifestRead(recordPath);
+    if (restore.Manifest == NULL) {
+        ReleaseSRWLockShared(&g_VersionsLock);
+        printf("Version %lu of the submission does not exist.\n", Version);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    // Used for the blocks that are not in the block store, if the version is the current contents
+    uint64_t fileSize = 0;
+    uint64_t lastWriteTime = 0;
+    restore.Submission = StripingOpenFile(submissionPath, IO_OPEN_READ);
+    if (restore.Submission != NULL &&
+        (!IoGetFileSize(restore.Submission, &fileSize) || !IoGetLastWriteTime(restore.Submission, &lastWriteTime) ||
+         !ManifestMatchesFile(restore.Manifest, fileSize, lastWriteTime))) {
+        IoCloseFile(restore.Submission);
+        restore.Submission = NULL;
+    }
+
+    // Blocks of zeros (the holes of a sparse submission) become holes again instead of being read and written
+    BYTE* zeros = (BYTE*)calloc(1, restore.Manifest->BlockSize);
+    if (zeros != NULL && ManifestHashBlock(zeros, restore.Manifest->BlockSize, restore.ZeroBlockHash)) {
+        for (uint64_t block = 0; block + 1 < restore.Manifest->BlockCount && !restore.SkipZeroBlocks; block++) {
+            restore.SkipZeroBlocks = memcmp(restore.Manifest->BlockHashes[block], restore.ZeroBlockHash, HASH_LENGTH) == 0;
+        }
+    }
+    free(zeros);
+
+    restore.Destination = IoOpenFile(partialPath, IO_OPEN_CREATE);
+    bool result = (restore.Destination != NULL);
+    if (result && restore.SkipZeroBlocks) {
+        IoSetSparse(restore.Destination);
+        result = IoSetFileSize(restore.Destination, restore.Manifest->FileSize);
+    }
+    else if (result) {
+        result = IoPreallocate(restore.Destination, restore.Manifest->FileSize);
+    }
+    if (result) {
+        restore.Queue = SchedulerOpenQueue(Owner, SchedulerClassForSize(restore.Manifest->FileSize));
+        result = (restore.Queue != NULL) &&
+                 PoolParallelFor(RestoreBlock, &restore, restore.Manifest->BlockCount) && !restore.Failed &&
+                 IoSetLastWriteTime(restore.Destination, restore.Manifest->LastWriteTime);
+        SchedulerCloseQueue(restore.Queue);
+    }
+
+    IoCloseFile(restore.Destination);
+    IoCloseFile(restore.Submission);
+    ReleaseSRWLockShared(&g_VersionsLock);
+    ManifestFree(restore.Manifest);
+
+    if (!result || !DurabilityCommitFile(partialPath) || !IoReplaceFile(partialPath, DestinationPath)) {
+        printf("Failed to restore version %lu: %lu\n", Version, GetLastError());
+        IoDeleteFile(partialPath);
+        return restore.Corrupt ? STATUS_DATA_ERROR : STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+VersionsSnapshot(
+    _In_z_ const char* UserDirectory,
+    _In_opt_z_ const char* Owner,
+    _Out_ uint32_t* SnapshotId
+)
+{
+    char snapshotDirectory[MAX_PATH];
+    char snapshotPath[MAX_PATH];
+    char partialPath[MAX_PATH];
+    char coldDirectory[MAX_PATH];
+    uint32_t latest = 0;
+
+    *SnapshotId = 0;
+    if (FAILED(StringCchPrintfA(snapshotDirectory, MAX_PATH, "%s\\%s", UserDirectory, VERSIONS_SNAPSHOTS_DIRECTORY))) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    SNAPSHOT_WRITER writer = { 0 };
+    bool result = false;
+    bool pinned = false;
+
+    for (int attempt = 0; !pinned && attempt < SNAPSHOT_ATTEMPTS; attempt++) {
+        IoTextFree(&writer.Text);
+        memset(&writer, 0, sizeof(writer));
+        writer.UserDirectory = UserDirectory;
+        writer.Owner = Owner;
+
+        // Collected without the exclusive lock; recording a submission may read all of it
+        writer.RootLength = strlen(UserDirectory);
+        IoEnumerateFiles(UserDirectory, true, SnapshotSubmission, &writer);
+        if (!writer.Failed && TieringGetColdPath(UserDirectory, coldDirectory)) {
+            // Submissions migrated to the cold tier only exist there
+            writer.ColdPass = true;
+            writer.RootLength = strlen(coldDirectory);
+            IoEnumerateFiles(coldDirectory, true, SnapshotSubmission, &writer);
+        }
+        if (writer.Failed) {
+            break;
+        }
+
+        // Exclusive only to allocate the number and pin the versions; one pruned since it was collected means
+        // the submission was stored again, so the collection is repeated
+        AcquireSRWLockExclusive(&g_VersionsLock);
+        pinned = SnapshotVersionsExist(UserDirectory, &writer.Text);
+        if (pinned) {
+            result = LatestNumber(snapshotDirectory, &latest) &&
+                     SUCCEEDED(StringCchPrintfA(snapshotPath, MAX_PATH, "%s\\%lu", snapshotDirectory, latest + 1)) &&
+                     SUCCEEDED(StringCchPrintfA(partialPath, MAX_PATH, "%s%s", snapshotPath, TRANSFER_PARTIAL_SUFFIX)) &&
+                     IoCreateDirectories(snapshotDirectory) &&
+                     IoWriteFileContents(partialPath, writer.Text.Data, writer.Text.Length) &&
+                     DurabilityCommitFile(partialPath) && IoReplaceFile(partialPath, snapshotPath);
+            if (!result) {
+                IoDeleteFile(partialPath);
+            }
+        }
+        ReleaseSRWLockExclusive(&g_VersionsLock);
+    }
+    IoTextFree(&writer.Text);
+
+    if (!result) {
+        printf("Failed to create the snapshot: %lu\n", GetLastError());
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    *SnapshotId = latest + 1;
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+VersionsResolveSnapshot(
+    _In_z_ const char* UserDirectory,
+    _In_ uint32_t SnapshotId,
+    _In_z_ const char* SubmissionName,
+    _Out_ uint32_t* Version
+)
+{
+    char snapshotPath[MAX_PATH];
+    *Version = 0;
+    if (FAILED(StringCchPrintfA(snapshotPath, MAX_PATH, "%s\\%s\\%lu", UserDirectory, VERSIONS_SNAPSHOTS_DIRECTORY, SnapshotId))) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    AcquireSRWLockShared(&g_VersionsLock);
+    bool found = FindInSnapshot(snapshotPath, SubmissionName, Version);
+    ReleaseSRWLockShared(&g_VersionsLock);
+
+    if (!found) {
+        printf("Snapshot %lu does not exist or does not contain the submission.\n", SnapshotId);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,129 @@
+#ifndef _VERSIONS_H_
+#define _VERSIONS_H_
+
+
+#include "includes.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define VERSIONS_DIRECTORY "~versions"          // <user>\~versions\<submission>\<version>: block checksums of each version
+#define VERSIONS_BLOCKS_DIRECTORY "~blocks"     // <user>\~blocks\<xx>\<checksum>: content-addressed blocks of older versions
+#define VERSIONS_SNAPSHOTS_DIRECTORY "~snapshots"   // <user>\~snapshots\<id>: "<version> <submission>" lines
+
+
+/*
+ * @brief       Sets the retention policy applied whenever a new version is recorded.
+ *
+ * @details     The current version of a submission and every version referenced by a snapshot are always kept.
+ *
+ * @param[in]   MaxVersions     - Versions to keep per submission, the current one included; 0 means unlimited.
+ * @param[in]   MaxAgeDays      - Versions recorded longer ago than this are pruned; 0 means unlimited.
+ */
+VOID
+VersionsSetRetention(
+    _In_ uint32_t MaxVersions,
+    _In_ uint32_t MaxAgeDays
+);
+
+
+/*
+ * @brief       Makes sure the current version of a submission can still be restored after the submission is
+ *              overwritten. Called right before a store.
+ *
+ * @details     Versions share blocks: only the current version lives in the submission file itself, the blocks
+ *              of older versions live once each in the user's block store, named by their SHA-256 checksum.
+ *              Blocks are copied into the block store lazily, here, and only those not already there, so
+ *              storing a slightly modified file adds just the blocks that changed. A submission stored before
+ *              versioning existed gets its first version recorded here. The blocks added count towards the
+ *              usage of the user (see UsageReserve) and are given back when garbage collection deletes them.
+ *
+ * @param[in]   UserDirectory   - %APPDIR%\\users\\<user>.
+ * @param[in]   SubmissionName  - Null-terminated submission name.
+ * @param[in]   Owner           - User whose scheduler queue the block I/O is charged to.
+ *
+ * @return      STATUS_SUCCESS if the current version is preserved or there is no current version,
+ *              STATUS_QUOTA_EXCEEDED if its blocks do not fit in the user's quota, or STATUS_UNSUCCESSFUL.
+ */
+NTSTATUS
+VersionsFreezeCurrent(
+    _In_z_ const char* UserDirectory,
+    _In_z_ const char* SubmissionName,
+    _In_opt_z_ const char* Owner
+);
+
+
+/*
+ * @brief       Records the submission as just stored (with its manifest) as a new version and applies the
+ *              retention policy. Blocks no longer referenced by any version are deleted.
+ *
+ * @param[out]  Version         - Number of the new version.
+ *
+ * @return      TRUE if the version was recorded; otherwise, FALSE.
+ */
+bool
+VersionsRecordCurrent(
+    _In_z_ const char* UserDirectory,
+    _In_z_ const char* SubmissionName,
+    _Out_ uint32_t* Version
+);
+
+
+/*
+ * @brief       Reassembles a version of a submission into DestinationPath.
+ *
+ * @details     Blocks are read from the block store in parallel and verified against the version's checksums;
+ *              blocks of the current version that were never frozen are read from the submission file. The
+ *              result is written to DestinationPath + TRANSFER_PARTIAL_SUFFIX and renamed over DestinationPath
+ *              once complete.
+ *
+ * @return      STATUS_SUCCESS, STATUS_OBJECT_NAME_NOT_FOUND if the version does not exist (or was pruned),
+ *              STATUS_DATA_ERROR if a block is missing or corrupt, or another failure status.
+ */
+NTSTATUS
+VersionsRestore(
+    _In_z_ const char* UserDirectory,
+    _In_z_ const char* SubmissionName,
+    _In_ uint32_t Version,
+    _In_z_ const char* DestinationPath,
+    _In_opt_z_ const char* Owner
+);
+
+
+/*
+ * @brief       Freezes the current version of every submission of the user.
+ *
+ * @details     Only version numbers are written; no data is copied. The versions referenced by a snapshot
+ *              are exempt from retention, and their blocks are preserved by VersionsFreezeCurrent when the
+ *              submissions are later overwritten. Submissions are collected (and recorded if needed) under
+ *              the shared lock; the exclusive lock is only taken to allocate the snapshot number and pin the
+ *              versions. If a collected version was pruned meanwhile, the collection is repeated.
+ *
+ * @param[out]  SnapshotId      - Identifier of the new snapshot, starting at 1.
+ *
+ * @return      STATUS_SUCCESS or the failure status.
+ */
+NTSTATUS
+VersionsSnapshot(
+    _In_z_ const char* UserDirectory,
+    _In_opt_z_ const char* Owner,
+    _Out_ uint32_t* SnapshotId
+);
+
+
+/*
+ * @brief       Looks up which version of a submission a snapshot froze.
+ *
+ * @return      STATUS_SUCCESS, or STATUS_OBJECT_NAME_NOT_FOUND if the snapshot or the submission in it does not exist.
+ */
+NTSTATUS
+VersionsResolveSnapshot(
+    _In_z_ const char* UserDirectory,
+    _In_ uint32_t SnapshotId,
+    _In_z_ const char* SubmissionName,
+    _Out_ uint32_t* Version
+);
+
+
+EXTERN_C_END;
+#endif  //_VERSIONS_H_
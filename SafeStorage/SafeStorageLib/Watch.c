@@ -0,0 +1,509 @@
+#include "Watch.h"
+#include "FileIo.h"
+#include <ctype.h>
+
+
+// A changed file waiting for its batch
+typedef struct _WATCH_ENTRY {
+    struct _WATCH_ENTRY* Next;
+    bool Added;                                 // Created or renamed into the tree, so a directory's files are new too
+    char RelativePath[MAX_PATH];
+} WATCH_ENTRY;
+
+
+// Files changed since the last batch. Only the watch thread touches it.
+typedef struct _WATCH_PENDING {
+    WATCH_ENTRY* Buckets[WATCH_PENDING_BUCKETS];
+    DWORD Count;
+    uint64_t FirstChange;                       // GetTickCount64 of the oldest change not yet stored
+    uint64_t LastChange;
+} WATCH_PENDING;
+
+
+// Global static variables
+static char g_WatchRoot[MAX_PATH] = { 0 };      // Absolute, without a trailing separator
+static DWORD g_WatchDebounce = WATCH_DEFAULT_DEBOUNCE_MILLISECONDS;
+static WATCH_BATCH_ROUTINE g_WatchRoutine = NULL;
+static PVOID g_WatchContext = NULL;
+static HANDLE g_WatchThread = NULL;
+static HANDLE g_WatchStop = NULL;
+static HANDLE g_WatchDirectory = INVALID_HANDLE_VALUE;
+static OVERLAPPED g_WatchOverlapped = { 0 };
+static BYTE* g_WatchBuffer = NULL;
+static WATCH_PENDING g_Pending = { 0 };
+static SRWLOCK g_WatchStatsLock = SRWLOCK_INIT;     // Guards g_WatchStats
+static SafeStorageWatchStats g_WatchStats = { 0 };
+
+
+/**
+ * @brief       Case-insensitive FNV-1a hash of a relative path; NTFS names differing only in case are the same file.
+ */
+static DWORD HashPath(_In_z_ const char* path) {
+    DWORD hash = 2166136261u;
+    for (const char* c = path; *c != '\0'; c++) {
+        hash = (hash ^ (BYTE)tolower((BYTE)*c)) * 16777619u;
+    }
+    return hash % WATCH_PENDING_BUCKETS;
+}
+
+
+/**
+ * @brief       Returns the link that points to the pending entry of a path, or to the NULL ending its bucket.
+ */
+static WATCH_ENTRY** FindPending(_In_z_ const char* relativePath) {
+    WATCH_ENTRY** link = &g_Pending.Buckets[HashPath(relativePath)];
+    while (*link != NULL && _stricmp((*link)->RelativePath, relativePath) != 0) {
+        link = &(*link)->Next;
+    }
+    return link;
+}
+
+
+/**
+ * @brief       Adds a path to the pending set, unless it is there already or names an internal file.
+ */
+static void AddPending(_In_z_ const char* relativePath, _In_ bool added) {
+    if (strchr(relativePath, '~') != NULL) {
+        return;
+    }
+
+    WATCH_ENTRY** link = FindPending(relativePath);
+    if (*link != NULL) {
+        (*link)->Added = (*link)->Added || added;
+        return;
+    }
+
+    WATCH_ENTRY* entry = (WATCH_ENTRY*)calloc(1, sizeof(WATCH_ENTRY));
+    if (entry == NULL || FAILED(StringCchCopyA(entry->RelativePath, MAX_PATH, relativePath))) {
+        printf("Failed to queue a changed file: %s\n", relativePath);
+        free(entry);
+        return;
+    }
+
+    entry->Added = added;
+    *link = entry;
+    g_Pending.Count++;
+}
+
+
+/**
+ * @brief       Drops a path from the pending set, if it is there.
+ */
+static void RemovePending(_In_z_ const char* relativePath) {
+    WATCH_ENTRY** link = FindPending(relativePath);
+    WATCH_ENTRY* entry = *link;
+    if (entry != NULL) {
+        *link = entry->Next;
+        g_Pending.Count--;
+        free(entry);
+    }
+}
+
+
+/**
+ * @brief       Empties the pending set.
+ */
+static void ClearPending(void) {
+    for (DWORD i = 0; i < WATCH_PENDING_BUCKETS; i++) {
+        while (g_Pending.Buckets[i] != NULL) {
+            WATCH_ENTRY* entry = g_Pending.Buckets[i];
+            g_Pending.Buckets[i] = entry->Next;
+            free(entry);
+        }
+    }
+    g_Pending.Count = 0;
+}
+
+
+/**
+ * @brief       Restarts the debounce period; the first change after a batch also starts the maximum delay.
+ */
+static void NoteChange(void) {
+    g_Pending.LastChange = GetTickCount64();
+    if (g_Pending.FirstChange == 0) {
+        g_Pending.FirstChange = g_Pending.LastChange;
+    }
+}
+
+
+/**
+ * @brief       Returns how long to wait before the pending files are due: INFINITE if there are none, 0 if they
+ *              are due now.
+ */
+static DWORD NextBatchDelay(void) {
+    if (g_Pending.Count == 0) {
+        return INFINITE;
+    }
+
+    uint64_t due = min(g_Pending.LastChange + g_WatchDebounce, g_Pending.FirstChange + (uint64_t)g_WatchDebounce * WATCH_MAX_DELAY_FACTOR);
+    uint64_t now = GetTickCount64();
+    return (due <= now) ? 0 : (DWORD)min(due - now, (uint64_t)(INFINITE - 1));
+}
+
+
+/**
+ * @brief       IoEnumerateFiles callback. Adds every file of a tree to the pending set, skipping internal directories.
+ */
+static IoEnumerateAction QueueTreeEntry(_In_z_ const char* path, _In_z_ const char* name, _In_ const IO_FILE_INFO* info, _In_opt_ void* context) {
+    UNREFERENCED_PARAMETER(context);
+
+    if (info->IsDirectory) {
+        return (strchr(name, '~') != NULL) ? IO_ENUMERATE_SKIP : IO_ENUMERATE_CONTINUE;
+    }
+
+    size_t rootLength = strlen(g_WatchRoot);
+    if (_strnicmp(path, g_WatchRoot, rootLength) == 0 && path[rootLength] == '\\') {
+        AddPending(path + rootLength + 1, true);
+    }
+    return IO_ENUMERATE_CONTINUE;
+}
+
+
+/**
+ * @brief       Adds the records of a completed ReadDirectoryChangesW to the pending set.
+ */
+static void QueueChanges(_In_ DWORD bytes) {
+    uint64_t events = 0;
+    DWORD offset = 0;
+
+    while (offset + sizeof(FILE_NOTIFY_INFORMATION) <= bytes) {
+        const FILE_NOTIFY_INFORMATION* record = (const FILE_NOTIFY_INFORMATION*)(g_WatchBuffer + offset);
+        char relativePath[MAX_PATH];
+
+        // Names are reported in UTF-16; the rest of the library uses the ANSI code page
+        int length = WideCharToMultiByte(CP_ACP, 0, record->FileName, (int)(record->FileNameLength / sizeof(WCHAR)),
+                                         relativePath, MAX_PATH - 1, NULL, NULL);
+        if (length > 0) {
+            relativePath[length] = '\0';
+            if (record->Action == FILE_ACTION_REMOVED || record->Action == FILE_ACTION_RENAMED_OLD_NAME) {
+                RemovePending(relativePath);
+            }
+            else {
+                AddPending(relativePath, record->Action != FILE_ACTION_MODIFIED);
+            }
+        }
+
+        events++;
+        if (record->NextEntryOffset == 0) {
+            break;
+        }
+        offset += record->NextEntryOffset;
+    }
+
+    NoteChange();
+
+    AcquireSRWLockExclusive(&g_WatchStatsLock);
+    g_WatchStats.Events += events;
+    ReleaseSRWLockExclusive(&g_WatchStatsLock);
+}
+
+
+/**
+ * @brief       Queues every file of the tree, for when notifications were lost.
+ */
+static void QueueTree(void) {
+    IoEnumerateFiles(g_WatchRoot, true, QueueTreeEntry, NULL);
+    NoteChange();
+
+    AcquireSRWLockExclusive(&g_WatchStatsLock);
+    g_WatchStats.Overflows++;
+    ReleaseSRWLockExclusive(&g_WatchStatsLock);
+}
+
+
+/**
+ * @brief       Asks for the next change records of the tree. They arrive by signaling g_WatchOverlapped.hEvent.
+ */
+static bool IssueRead(void) {
+    ResetEvent(g_WatchOverlapped.hEvent);
+    return ReadDirectoryChangesW(g_WatchDirectory, g_WatchBuffer, WATCH_BUFFER_SIZE, TRUE,
+                                 FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                 FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                 NULL, &g_WatchOverlapped, NULL) != FALSE;
+}
+
+
+/**
+ * @brief       Handles a completed read and issues the next one.
+ *
+ * @return      FALSE if the tree can no longer be watched (e.g. it was deleted).
+ */
+static bool CompleteRead(void) {
+    DWORD bytes = 0;
+    BOOL completed = GetOverlappedResult(g_WatchDirectory, &g_WatchOverlapped, &bytes, FALSE);
+
+    // A read that returns nothing means the records did not fit the buffer and were discarded
+    if (completed && bytes > 0) {
+        QueueChanges(bytes);
+    }
+    else if (completed || GetLastError() == ERROR_NOTIFY_ENUM_DIR) {
+        QueueTree();
+    }
+    else {
+        printf("Stopped watching %s: %lu\n", g_WatchRoot, GetLastError());
+        return false;
+    }
+
+    if (!IssueRead()) {
+        printf("Stopped watching %s: %lu\n", g_WatchRoot, GetLastError());
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief       Cancels the outstanding read and waits for it, keeping whatever it had already collected.
+ */
+static void CancelRead(void) {
+    DWORD bytes = 0;
+    CancelIoEx(g_WatchDirectory, &g_WatchOverlapped);
+    if (GetOverlappedResult(g_WatchDirectory, &g_WatchOverlapped, &bytes, TRUE) && bytes > 0) {
+        QueueChanges(bytes);
+    }
+}
+
+
+/**
+ * @brief       Replaces the directories that were added to the tree by the files in them and drops paths that
+ *              no longer exist. Other directories only changed because their entries did, which report themselves.
+ */
+static void ExpandPending(void) {
+    WATCH_ENTRY* directories = NULL;
+    char path[MAX_PATH];
+
+    for (DWORD i = 0; i < WATCH_PENDING_BUCKETS; i++) {
+        WATCH_ENTRY** link = &g_Pending.Buckets[i];
+        while (*link != NULL) {
+            WATCH_ENTRY* entry = *link;
+            IO_FILE_INFO info = { 0 };
+            bool exists = SUCCEEDED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", g_WatchRoot, entry->RelativePath)) &&
+                          IoQueryFileInfo(path, &info);
+            if (exists && !info.IsDirectory) {
+                link = &entry->Next;
+                continue;
+            }
+
+            *link = entry->Next;
+            g_Pending.Count--;
+            if (exists && entry->Added) {
+                entry->Next = directories;
+                directories = entry;
+            }
+            else {
+                free(entry);
+            }
+        }
+    }
+
+    // Enumerated only now, so that the files of a directory changed in several ways are listed once
+    while (directories != NULL) {
+        WATCH_ENTRY* directory = directories;
+        directories = directory->Next;
+        if (SUCCEEDED(StringCchPrintfA(path, MAX_PATH, "%s\\%s", g_WatchRoot, directory->RelativePath))) {
+            IoEnumerateFiles(path, true, QueueTreeEntry, NULL);
+        }
+        free(directory);
+    }
+}
+
+
+/**
+ * @brief       Hands the pending files to the batch routine as one batch and empties the set.
+ */
+static void RunBatch(void) {
+    ExpandPending();
+    if (g_Pending.Count == 0) {
+        g_Pending.FirstChange = 0;
+        return;
+    }
+
+    const char** relativePaths = (const char**)malloc(g_Pending.Count * sizeof(const char*));
+    if (relativePaths == NULL) {
+        // Try again after another debounce period
+        printf("Failed to store %lu changed files: out of memory\n", g_Pending.Count);
+        g_Pending.FirstChange = 0;
+        NoteChange();
+        return;
+    }
+
+    DWORD count = 0;
+    for (DWORD i = 0; i < WATCH_PENDING_BUCKETS; i++) {
+        for (WATCH_ENTRY* entry = g_Pending.Buckets[i]; entry != NULL; entry = entry->Next) {
+            relativePaths[count++] = entry->RelativePath;
+        }
+    }
+
+    WATCH_BATCH_RESULT result = { 0 };
+    g_WatchRoutine(g_WatchRoot, relativePaths, count, g_WatchContext, &result);
+    free((void*)relativePaths);
+    ClearPending();
+    g_Pending.FirstChange = 0;
+
+    AcquireSRWLockExclusive(&g_WatchStatsLock);
+    g_WatchStats.Batches++;
+    g_WatchStats.FilesStored += result.Stored;
+    g_WatchStats.FilesUnchanged += result.Unchanged;
+    g_WatchStats.FilesFailed += result.Failed;
+    ReleaseSRWLockExclusive(&g_WatchStatsLock);
+}
+
+
+/**
+ * @brief       Watch thread. Collects change records and runs a batch whenever the pending files are due,
+ *              until the stop event is signaled; then runs a last batch.
+ */
+static DWORD WINAPI WatchThreadProc(_In_ LPVOID parameter) {
+    UNREFERENCED_PARAMETER(parameter);
+
+    HANDLE events[2] = { g_WatchStop, g_WatchOverlapped.hEvent };
+    bool reading = true;
+    for (;;) {
+        DWORD delay = NextBatchDelay();
+        if (delay == 0) {
+            RunBatch();
+            continue;
+        }
+
+        DWORD wait = WaitForMultipleObjects(reading ? 2 : 1, events, FALSE, delay);
+        if (wait == WAIT_OBJECT_0 + 1) {
+            reading = CompleteRead();
+        }
+        else if (wait != WAIT_TIMEOUT) {
+            break;
+        }
+    }
+
+    if (reading) {
+        CancelRead();
+    }
+    RunBatch();
+    return 0;
+}
+
+
+/**
+ * @brief       Closes the handles and frees the buffer of the watch. No read may be outstanding.
+ */
+static void CloseWatch(void) {
+    if (g_WatchDirectory != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_WatchDirectory);
+        g_WatchDirectory = INVALID_HANDLE_VALUE;
+    }
+
+    if (g_WatchOverlapped.hEvent != NULL) {
+        CloseHandle(g_WatchOverlapped.hEvent);
+    }
+    memset(&g_WatchOverlapped, 0, sizeof(g_WatchOverlapped));
+
+    if (g_WatchStop != NULL) {
+        CloseHandle(g_WatchStop);
+        g_WatchStop = NULL;
+    }
+
+    free(g_WatchBuffer);
+    g_WatchBuffer = NULL;
+    ClearPending();
+    memset(&g_Pending, 0, sizeof(g_Pending));
+}
+
+
+bool
+WatchStart(
+    _In_z_ const char* Directory,
+    _In_ DWORD DebounceMilliseconds,
+    _In_ WATCH_BATCH_ROUTINE Routine,
+    _Inout_opt_ PVOID Context
+)
+{
+    if (g_WatchThread != NULL) {
+        SetLastError(ERROR_BUSY);
+        return false;
+    }
+
+    char fullPath[MAX_PATH];
+    DWORD length = GetFullPathNameA(Directory, MAX_PATH, fullPath, NULL);
+    if (length == 0 || length >= MAX_PATH || FAILED(StringCchCopyA(g_WatchRoot, MAX_PATH, fullPath))) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return false;
+    }
+    for (size_t end = strlen(g_WatchRoot); end > 0 && g_WatchRoot[end - 1] == '\\'; end--) {
+        g_WatchRoot[end - 1] = '\0';
+    }
+
+    g_WatchDebounce = (DebounceMilliseconds != 0) ? DebounceMilliseconds : WATCH_DEFAULT_DEBOUNCE_MILLISECONDS;
+    g_WatchRoutine = Routine;
+    g_WatchContext = Context;
+
+    AcquireSRWLockExclusive(&g_WatchStatsLock);
+    memset(&g_WatchStats, 0, sizeof(g_WatchStats));
+    ReleaseSRWLockExclusive(&g_WatchStatsLock);
+
+    // Deletes and renames inside the tree must keep working while it is watched
+    g_WatchDirectory = CreateFileA(fullPath, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    g_WatchBuffer = (BYTE*)malloc(WATCH_BUFFER_SIZE);   // malloc's alignment satisfies the DWORD alignment required
+    g_WatchOverlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    g_WatchStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (g_WatchDirectory == INVALID_HANDLE_VALUE || g_WatchBuffer == NULL || g_WatchOverlapped.hEvent == NULL || g_WatchStop == NULL) {
+        DWORD error = GetLastError();
+        CloseWatch();
+        SetLastError(error);
+        return false;
+    }
+
+    // Issued before returning, so that changes made right after WatchStart are seen
+    if (!IssueRead()) {
+        DWORD error = GetLastError();
+        CloseWatch();
+        SetLastError(error);
+        return false;
+    }
+
+    g_WatchThread = CreateThread(NULL, 0, WatchThreadProc, NULL, 0, NULL);
+    if (g_WatchThread == NULL) {
+        DWORD error = GetLastError();
+        CancelRead();
+        CloseWatch();
+        SetLastError(error);
+        return false;
+    }
+
+    return true;
+}
+
+
+VOID
+WatchStop(
+    VOID
+)
+{
+    if (g_WatchThread != NULL) {
+        SetEvent(g_WatchStop);
+        WaitForSingleObject(g_WatchThread, INFINITE);
+        CloseHandle(g_WatchThread);
+        g_WatchThread = NULL;
+    }
+
+    CloseWatch();
+}
+
+
+bool
+WatchIsRunning(
+    VOID
+)
+{
+    return g_WatchThread != NULL;
+}
+
+
+VOID
+WatchGetStats(
+    _Out_ SafeStorageWatchStats* Stats
+)
+{
+    AcquireSRWLockShared(&g_WatchStatsLock);
+    *Stats = g_WatchStats;
+    ReleaseSRWLockShared(&g_WatchStatsLock);
+}
@@ -0,0 +1,106 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+
+#include "includes.h"
+#include "Commands.h"
+#include <stdbool.h>
+EXTERN_C_START;
+
+
+#define WATCH_DEFAULT_DEBOUNCE_MILLISECONDS 500
+#define WATCH_BUFFER_SIZE (64 * 1024)           // Change records per read; the largest size that also works on shares
+#define WATCH_PENDING_BUCKETS 1024              // Hash buckets of the set of changed files
+#define WATCH_MAX_DELAY_FACTOR 10               // A tree that never goes quiet is still synced every 10 debounce periods
+
+
+// Outcome of one batch, reported by the batch routine
+typedef struct _WATCH_BATCH_RESULT {
+    DWORD Stored;
+    DWORD Unchanged;                            // Identical to what is already stored, so not stored again
+    DWORD Failed;
+} WATCH_BATCH_RESULT;
+
+
+/*
+ * @brief       Stores a batch of changed files. Runs on the watch thread, one batch at a time.
+ *
+ * @param[in]   Root            - The watched directory, absolute.
+ * @param[in]   RelativePaths   - The files that changed, relative to Root, each listed once.
+ * @param[in]   Count           - The number of files.
+ * @param[in]   Context         - The context given to WatchStart.
+ * @param[out]  Result          - Receives what became of the files.
+ */
+typedef VOID (*WATCH_BATCH_ROUTINE)(
+    _In_z_ const char* Root,
+    _In_reads_(Count) const char* const* RelativePaths,
+    _In_ DWORD Count,
+    _Inout_opt_ PVOID Context,
+    _Out_ WATCH_BATCH_RESULT* Result
+);
+
+
+/*
+ * @brief       Starts watching a directory tree for changed files.
+ *
+ * @details     A thread of its own waits for ReadDirectoryChangesW notifications on the whole tree. Every
+ *              file that is created, written, resized or renamed into the tree is added to a set, so any
+ *              number of saves of the same file count once. Once no notification has arrived for
+ *              DebounceMilliseconds (or WATCH_MAX_DELAY_FACTOR debounce periods after the oldest pending
+ *              change), the set is handed to Routine as one batch. A burst of saves therefore turns into a
+ *              few batches that Routine can store in parallel.
+ *
+ *              Files removed before their batch is due are dropped from the set; directories created or renamed
+ *              into the tree are replaced by the files in them (a directory renamed in only reports itself). Names
+ *              containing '~' are reserved for internal files and ignored. If the notification buffer
+ *              overflows, the whole tree is queued.
+ *
+ *              Changes are detected on the operating system's file system, whichever I/O backend is selected.
+ *              Only one directory is watched at a time.
+ *
+ * @param[in]   Directory               - The directory to watch.
+ * @param[in]   DebounceMilliseconds    - How long the tree has to be quiet before a batch is stored.
+ * @param[in]   Routine                 - Stores each batch.
+ * @param[in]   Context                 - Passed to Routine.
+ *
+ * @return      TRUE if the watch is running; FALSE if another watch is running or the directory cannot be watched.
+ */
+bool
+WatchStart(
+    _In_z_ const char* Directory,
+    _In_ DWORD DebounceMilliseconds,
+    _In_ WATCH_BATCH_ROUTINE Routine,
+    _Inout_opt_ PVOID Context
+);
+
+
+/*
+ * @brief       Stores the changes still pending as a last batch and stops the watch. Does nothing if no
+ *              watch is running.
+ */
+VOID
+WatchStop(
+    VOID
+);
+
+
+/*
+ * @brief       Returns TRUE if a watch is running.
+ */
+bool
+WatchIsRunning(
+    VOID
+);
+
+
+/*
+ * @brief       Returns the counters of the current or last watch.
+ */
+VOID
+WatchGetStats(
+    _Out_ SafeStorageWatchStats* Stats
+);
+
+
+EXTERN_C_END;
+#endif  //_WATCH_H_
@@ -0,0 +1,969 @@
+#include "includes.h"
+#include "Commands.h"
+#include "FileIo.h"
+#include <ctype.h>
+#include <math.h>
+
+
+/*
+ * @brief       Load generator and soak test for SafeStorageLib.
+ *
+ *              Usage: SafeStorageLoadGenerator.exe [options]
+ *
+ *              --directory PATH        application directory to run in (default: the current directory)
+ *              --users N               synthetic users registered before the run (default 8)
+ *              --threads M             threads issuing operations (default 8)
+ *              --duration SECONDS      length of the run (default 60)
+ *              --operations N          stop after N operations instead
+ *              --mix R,L,S,T           relative weights of register, login, store and retrieve (default 1,4,35,60)
+ *              --min-size BYTES        smallest file stored, K/M/G suffixes allowed (default 1K)
+ *              --max-size BYTES        largest file stored (default 16M); sizes are log-uniform in between,
+ *                                      so most files are small and a few are large
+ *              --slots N               submission names per user and thread (default 16)
+ *              --seed N                seed of the random choices (default: the clock)
+ *              --backend os|memory     where the library keeps its files (default os); with memory the run
+ *                                      measures the library itself, independent of the disk
+ *              --disk-latency-us N     simulated latency per disk operation, in microseconds (default 0)
+ *              --disk-jitter-us N      largest random delay added to the latency (default 0)
+ *              --disk-mbps N           simulated disk bandwidth in MB/s (default 0: unlimited)
+ *
+ *              Every retrieved file is compared with what was stored under that name. Throughput, latency
+ *              percentiles and error counts are reported per operation. The exit code is 0 only if no
+ *              operation failed and no retrieved file differed.
+ *
+ *              The users and submissions created stay in the application directory (unless the memory backend
+ *              is used), so run it in a scratch directory on the drive under test. The library prints a line per
+ *              command to stdout; progress and the report go to stderr, so stdout can be redirected to NUL.
+ *
+ *              The library has a single login session per process. Stores and retrieves run concurrently from
+ *              all threads as the logged-in user; a register or login waits for them to drain and then switches
+ *              the session to another user, like a new client taking over.
+ */
+
+
+#define LOAD_DEFAULT_USERS 8
+#define LOAD_DEFAULT_THREADS 8
+#define LOAD_DEFAULT_DURATION_SECONDS 60
+#define LOAD_DEFAULT_SLOTS 16
+#define LOAD_DEFAULT_MIN_SIZE 1024ULL
+#define LOAD_DEFAULT_MAX_SIZE (16ULL * 1024 * 1024)
+#define LOAD_MAX_USERS (26 * 26 * 26 * 26)      // Users are told apart by four letters
+#define LOAD_MAX_THREADS 256
+#define LOAD_IO_SIZE (1024 * 1024)              // Source files are written and retrieved files compared in pieces of this size
+#define LOAD_PROGRESS_INTERVAL_MS 5000
+#define LOAD_MAX_ERROR_LINES 20                 // Errors beyond this are only counted
+#define LOAD_PASSWORD "LoadGen1@"
+
+
+typedef enum _LOAD_OPERATION
+{
+    LOAD_REGISTER = 0,
+    LOAD_LOGIN,
+    LOAD_STORE,
+    LOAD_RETRIEVE,
+    LOAD_OPERATION_COUNT
+} LOAD_OPERATION;
+
+
+typedef struct _LOAD_CONFIG
+{
+    DWORD Users;
+    DWORD Threads;
+    DWORD DurationSeconds;
+    uint64_t Operations;                        // 0: run for DurationSeconds
+    DWORD Mix[LOAD_OPERATION_COUNT];
+    uint64_t MinSize;
+    uint64_t MaxSize;
+    DWORD Slots;
+    uint64_t Seed;
+    SafeStorageIoBackend Backend;
+    SafeStorageDiskSimulation Disk;
+} LOAD_CONFIG;
+
+
+// What a thread last stored under one of its submission names of one user
+typedef struct _LOAD_SLOT
+{
+    uint64_t Seed;                              // Generates the contents; 0 if nothing was stored yet
+    uint64_t Size;
+} LOAD_SLOT;
+
+
+// Latencies and counters of one operation
+typedef struct _LOAD_SAMPLES
+{
+    double* Latencies;                          // Microseconds, successful operations only
+    size_t Count;
+    size_t Capacity;
+    uint64_t Errors;
+    uint64_t Bytes;
+} LOAD_SAMPLES;
+
+
+typedef struct _LOAD_THREAD
+{
+    DWORD Index;
+    HANDLE Handle;
+    uint64_t Random;                            // xorshift64 state
+    LOAD_SLOT* Slots;                           // Users x slots
+    LOAD_SAMPLES Samples[LOAD_OPERATION_COUNT];
+    uint64_t Mismatches;
+    BYTE* Buffer;                               // LOAD_IO_SIZE bytes
+    BYTE* Expected;                             // LOAD_IO_SIZE bytes
+    char SourcePath[MAX_PATH];
+    char RetrievedPath[MAX_PATH];
+} LOAD_THREAD;
+
+
+static const char* g_OperationNames[LOAD_OPERATION_COUNT] = { "register", "login", "store", "retrieve" };
+static LOAD_CONFIG g_Config;
+static LARGE_INTEGER g_Frequency;
+static LARGE_INTEGER g_Start;
+static char g_RunTag[5];                        // Four letters that make this run's user names unique
+static SRWLOCK g_SessionLock = SRWLOCK_INIT;    // Shared by stores and retrieves, exclusive to switch users
+static LONG g_CurrentUser = -1;                 // Index of the logged-in user; -1 if none
+static volatile LONG g_RegisteredUsers = 0;     // Users registered during the run, named after the initial ones
+static volatile LONG g_Stop = FALSE;
+static volatile LONG64 g_OperationsStarted = 0;
+static volatile LONG64 g_OperationsCompleted = 0;
+static volatile LONG64 g_Failures = 0;          // Failed operations and mismatching retrieves
+static volatile LONG g_RunningThreads = 0;
+static SRWLOCK g_ErrorLock = SRWLOCK_INIT;
+static DWORD g_ErrorLines = 0;
+
+
+static double
+MicrosecondsBetween(
+    _In_ LONGLONG Start,
+    _In_ LONGLONG End
+)
+{
+    return (double)(End - Start) * 1000000.0 / (double)g_Frequency.QuadPart;
+}
+
+
+static double
+SecondsSinceStart()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return MicrosecondsBetween(g_Start.QuadPart, now.QuadPart) / 1000000.0;
+}
+
+
+static uint64_t
+NextRandom(
+    _Inout_ uint64_t* State
+)
+{
+    uint64_t x = *State;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *State = x;
+    return x;
+}
+
+
+// splitmix64 finalizer; the contents of a file are a function of its seed and of the offset only
+static uint64_t
+MixWord(
+    _In_ uint64_t Value
+)
+{
+    Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBULL;
+    return Value ^ (Value >> 31);
+}
+
+
+static void
+GenerateContent(
+    _In_ uint64_t Seed,
+    _In_ uint64_t Offset,
+    _Out_writes_bytes_(Length) BYTE* Buffer,
+    _In_ DWORD Length
+)
+{
+    // Offset is always a multiple of LOAD_IO_SIZE, hence of 8
+    for (DWORD i = 0; i < Length; i += sizeof(uint64_t))
+    {
+        uint64_t word = MixWord(Seed + (Offset + i) / sizeof(uint64_t));
+        memcpy(Buffer + i, &word, min((DWORD)sizeof(uint64_t), Length - i));
+    }
+}
+
+
+static void
+BuildUserName(
+    _In_ DWORD User,
+    _Out_writes_(USERNAME_MAX_LENGTH + 1) char* Name
+)
+{
+    // "lg" + run tag + four letters, e.g. "lgqwerbaac"; user names must be alphabetic
+    Name[0] = 'l';
+    Name[1] = 'g';
+    memcpy(Name + 2, g_RunTag, 4);
+    for (int i = 3; i >= 0; i--)
+    {
+        Name[6 + i] = (char)('a' + User % 26);
+        User /= 26;
+    }
+    Name[10] = '\0';
+}
+
+
+static void
+ReportError(
+    _Inout_ LOAD_THREAD* Thread,
+    _In_ LOAD_OPERATION Operation,
+    _In_z_ const char* Detail,
+    _In_ NTSTATUS Status
+)
+{
+    InterlockedIncrement64(&g_Failures);
+
+    AcquireSRWLockExclusive(&g_ErrorLock);
+    if (g_ErrorLines < LOAD_MAX_ERROR_LINES)
+    {
+        fprintf(stderr, "[%7.1f s] thread %lu: %s %s (0x%08lx)\r\n",
+                SecondsSinceStart(), Thread->Index, g_OperationNames[Operation], Detail, (unsigned long)Status);
+        if (++g_ErrorLines == LOAD_MAX_ERROR_LINES)
+        {
+            fprintf(stderr, "Further errors are only counted.\r\n");
+        }
+    }
+    ReleaseSRWLockExclusive(&g_ErrorLock);
+}
+
+
+static void
+AddSample(
+    _Inout_ LOAD_SAMPLES* Samples,
+    _In_ double Microseconds,
+    _In_ uint64_t Bytes
+)
+{
+    if (Samples->Count == Samples->Capacity)
+    {
+        size_t capacity = (Samples->Capacity == 0) ? 4096 : 2 * Samples->Capacity;
+        double* latencies = (double*)realloc(Samples->Latencies, capacity * sizeof(double));
+        if (latencies == NULL)
+        {
+            // Still counted in the throughput, just not in the percentiles
+            Samples->Bytes += Bytes;
+            return;
+        }
+        Samples->Latencies = latencies;
+        Samples->Capacity = capacity;
+    }
+
+    Samples->Latencies[Samples->Count++] = Microseconds;
+    Samples->Bytes += Bytes;
+}
+
+
+// Picks a size between MinSize and MaxSize, log-uniformly
+static uint64_t
+RandomSize(
+    _Inout_ LOAD_THREAD* Thread
+)
+{
+    double fraction = (double)(NextRandom(&Thread->Random) >> 11) / (double)(1ULL << 53);
+    double size = exp(log((double)g_Config.MinSize) + fraction * (log((double)g_Config.MaxSize) - log((double)g_Config.MinSize)));
+    return min(max((uint64_t)size, g_Config.MinSize), g_Config.MaxSize);
+}
+
+
+static LOAD_OPERATION
+PickOperation(
+    _Inout_ LOAD_THREAD* Thread
+)
+{
+    DWORD total = 0;
+    for (DWORD i = 0; i < LOAD_OPERATION_COUNT; i++)
+    {
+        total += g_Config.Mix[i];
+    }
+
+    DWORD pick = (DWORD)(NextRandom(&Thread->Random) % total);
+    for (DWORD i = 0; i < LOAD_OPERATION_COUNT; i++)
+    {
+        if (pick < g_Config.Mix[i])
+        {
+            return (LOAD_OPERATION)i;
+        }
+        pick -= g_Config.Mix[i];
+    }
+    return LOAD_RETRIEVE;
+}
+
+
+static bool
+WriteSourceFile(
+    _Inout_ LOAD_THREAD* Thread,
+    _In_ uint64_t Seed,
+    _In_ uint64_t Size
+)
+{
+    // Through the library's I/O backend, so that the source exists wherever the store looks for it
+    SS_FILE* file = IoOpenFile(Thread->SourcePath, IO_OPEN_CREATE);
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    bool written = true;
+    for (uint64_t offset = 0; written && offset < Size; offset += LOAD_IO_SIZE)
+    {
+        DWORD length = (DWORD)min(Size - offset, (uint64_t)LOAD_IO_SIZE);
+        GenerateContent(Seed, offset, Thread->Buffer, length);
+        written = IoWriteAt(file, offset, Thread->Buffer, length);
+    }
+
+    IoCloseFile(file);
+    return written;
+}
+
+
+static bool
+VerifyRetrievedFile(
+    _Inout_ LOAD_THREAD* Thread,
+    _In_ const LOAD_SLOT* Slot
+)
+{
+    SS_FILE* file = IoOpenFile(Thread->RetrievedPath, IO_OPEN_READ);
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    uint64_t size = 0;
+    bool matches = IoGetFileSize(file, &size) && size == Slot->Size;
+    for (uint64_t offset = 0; matches && offset < Slot->Size; offset += LOAD_IO_SIZE)
+    {
+        DWORD length = (DWORD)min(Slot->Size - offset, (uint64_t)LOAD_IO_SIZE);
+        DWORD bytesRead = 0;
+        GenerateContent(Slot->Seed, offset, Thread->Expected, length);
+        matches = IoReadAt(file, offset, Thread->Buffer, length, &bytesRead) && bytesRead == length &&
+                  memcmp(Thread->Buffer, Thread->Expected, length) == 0;
+    }
+
+    IoCloseFile(file);
+    return matches;
+}
+
+
+// Logs out and logs in as a random user. The caller holds the session lock exclusively.
+static void
+SwitchUser(
+    _Inout_ LOAD_THREAD* Thread,
+    _In_ bool Timed
+)
+{
+    char name[USERNAME_MAX_LENGTH + 1];
+    DWORD user = (DWORD)(NextRandom(&Thread->Random) % g_Config.Users);
+    BuildUserName(user, name);
+
+    if (g_CurrentUser >= 0)
+    {
+        SafeStorageHandleLogout();
+        g_CurrentUser = -1;
+    }
+
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&start);
+    NTSTATUS status = SafeStorageHandleLogin(name, (uint16_t)strlen(name), LOAD_PASSWORD, (uint16_t)strlen(LOAD_PASSWORD));
+    QueryPerformanceCounter(&end);
+
+    if (!NT_SUCCESS(status))
+    {
+        Thread->Samples[LOAD_LOGIN].Errors++;
+        ReportError(Thread, LOAD_LOGIN, name, status);
+        return;
+    }
+
+    g_CurrentUser = (LONG)user;
+    if (Timed)
+    {
+        AddSample(&Thread->Samples[LOAD_LOGIN], MicrosecondsBetween(start.QuadPart, end.QuadPart), 0);
+    }
+}
+
+
+static void
+RunRegister(
+    _Inout_ LOAD_THREAD* Thread
+)
+{
+    char name[USERNAME_MAX_LENGTH + 1];
+    LONG user = (LONG)g_Config.Users + InterlockedIncrement(&g_RegisteredUsers) - 1;
+    if (user >= LOAD_MAX_USERS)
+    {
+        return;
+    }
+    BuildUserName((DWORD)user, name);
+
+    AcquireSRWLockExclusive(&g_SessionLock);
+
+    // Registering needs the session to be logged out
+    if (g_CurrentUser >= 0)
+    {
+        SafeStorageHandleLogout();
+        g_CurrentUser = -1;
+    }
+
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&start);
+    NTSTATUS status = SafeStorageHandleRegister(name, (uint16_t)strlen(name), LOAD_PASSWORD, (uint16_t)strlen(LOAD_PASSWORD));
+    QueryPerformanceCounter(&end);
+
+    if (NT_SUCCESS(status))
+    {
+        AddSample(&Thread->Samples[LOAD_REGISTER], MicrosecondsBetween(start.QuadPart, end.QuadPart), 0);
+    }
+    else
+    {
+        Thread->Samples[LOAD_REGISTER].Errors++;
+        ReportError(Thread, LOAD_REGISTER, name, status);
+    }
+
+    // Stores and retrieves go on as one of the initial users
+    SwitchUser(Thread, false);
+    ReleaseSRWLockExclusive(&g_SessionLock);
+}
+
+
+static void
+RunLogin(
+    _Inout_ LOAD_THREAD* Thread
+)
+{
+    AcquireSRWLockExclusive(&g_SessionLock);
+    SwitchUser(Thread, true);
+    ReleaseSRWLockExclusive(&g_SessionLock);
+}
+
+
+static void
+RunStore(
+    _Inout_ LOAD_THREAD* Thread
+)
+{
+    char name[MAX_SUBMISSION_NAME_LENGTH + 1];
+    DWORD slot = (DWORD)(NextRandom(&Thread->Random) % g_Config.Slots);
+    uint64_t size = RandomSize(Thread);
+    uint64_t seed = NextRandom(&Thread->Random) | 1;
+    sprintf_s(name, sizeof(name), "lt%lus%lu", Thread->Index, slot);
+
+    // Generated before taking the session, so that only the store itself holds up user switches
+    if (!WriteSourceFile(Thread, seed, size))
+    {
+        Thread->Samples[LOAD_STORE].Errors++;
+        ReportError(Thread, LOAD_STORE, "could not write the source file", STATUS_UNSUCCESSFUL);
+        return;
+    }
+
+    AcquireSRWLockShared(&g_SessionLock);
+    LONG user = g_CurrentUser;
+    if (user < 0)
+    {
+        ReleaseSRWLockShared(&g_SessionLock);
+        return;
+    }
+
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&start);
+    NTSTATUS status = SafeStorageHandleStore(name, (uint16_t)strlen(name), Thread->SourcePath, (uint16_t)strlen(Thread->SourcePath));
+    QueryPerformanceCounter(&end);
+    ReleaseSRWLockShared(&g_SessionLock);
+
+    LOAD_SLOT* stored = &Thread->Slots[(size_t)user * g_Config.Slots + slot];
+    if (NT_SUCCESS(status))
+    {
+        stored->Seed = seed;
+        stored->Size = size;
+        AddSample(&Thread->Samples[LOAD_STORE], MicrosecondsBetween(start.QuadPart, end.QuadPart), size);
+    }
+    else
+    {
+        // The submission may or may not have been replaced; stop checking it
+        stored->Seed = 0;
+        Thread->Samples[LOAD_STORE].Errors++;
+        ReportError(Thread, LOAD_STORE, name, status);
+    }
+}
+
+
+static void
+RunRetrieve(
+    _Inout_ LOAD_THREAD* Thread
+)
+{
+    char name[MAX_SUBMISSION_NAME_LENGTH + 1];
+    DWORD slot = (DWORD)(NextRandom(&Thread->Random) % g_Config.Slots);
+    sprintf_s(name, sizeof(name), "lt%lus%lu", Thread->Index, slot);
+
+    AcquireSRWLockShared(&g_SessionLock);
+    LONG user = g_CurrentUser;
+    LOAD_SLOT stored = { 0 };
+    if (user >= 0)
+    {
+        stored = Thread->Slots[(size_t)user * g_Config.Slots + slot];
+    }
+
+    // Nothing stored under this name yet: store it instead
+    if (stored.Seed == 0)
+    {
+        ReleaseSRWLockShared(&g_SessionLock);
+        if (user >= 0)
+        {
+            RunStore(Thread);
+        }
+        return;
+    }
+
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&start);
+    NTSTATUS status = SafeStorageHandleRetrieve(name, (uint16_t)strlen(name), Thread->RetrievedPath, (uint16_t)strlen(Thread->RetrievedPath));
+    QueryPerformanceCounter(&end);
+    ReleaseSRWLockShared(&g_SessionLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Thread->Samples[LOAD_RETRIEVE].Errors++;
+        ReportError(Thread, LOAD_RETRIEVE, name, status);
+        return;
+    }
+
+    AddSample(&Thread->Samples[LOAD_RETRIEVE], MicrosecondsBetween(start.QuadPart, end.QuadPart), stored.Size);
+    if (!VerifyRetrievedFile(Thread, &stored))
+    {
+        Thread->Mismatches++;
+        char detail[MAX_SUBMISSION_NAME_LENGTH + 32];
+        sprintf_s(detail, sizeof(detail), "%s: contents differ from what was stored", name);
+        ReportError(Thread, LOAD_RETRIEVE, detail, STATUS_DATA_ERROR);
+    }
+}
+
+
+static DWORD WINAPI
+LoadThread(
+    _In_ LPVOID Parameter
+)
+{
+    LOAD_THREAD* thread = (LOAD_THREAD*)Parameter;
+
+    while (!g_Stop)
+    {
+        if (g_Config.Operations != 0 && (uint64_t)InterlockedIncrement64(&g_OperationsStarted) > g_Config.Operations)
+        {
+            break;
+        }
+        if (g_Config.Operations == 0 && SecondsSinceStart() >= g_Config.DurationSeconds)
+        {
+            break;
+        }
+
+        switch (PickOperation(thread))
+        {
+        case LOAD_REGISTER:
+            RunRegister(thread);
+            break;
+        case LOAD_LOGIN:
+            RunLogin(thread);
+            break;
+        case LOAD_STORE:
+            RunStore(thread);
+            break;
+        default:
+            RunRetrieve(thread);
+            break;
+        }
+        InterlockedIncrement64(&g_OperationsCompleted);
+    }
+
+    InterlockedDecrement(&g_RunningThreads);
+    return 0;
+}
+
+
+static int
+CompareDoubles(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    double left = *(const double*)Left;
+    double right = *(const double*)Right;
+    return (left > right) - (left < right);
+}
+
+
+static bool
+ParseSize(
+    _In_z_ const char* Text,
+    _Out_ uint64_t* Size
+)
+{
+    char* end = NULL;
+    *Size = _strtoui64(Text, &end, 10);
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        *Size *= 1024;
+        // fall through
+    case 'M':
+        *Size *= 1024;
+        // fall through
+    case 'K':
+        *Size *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return end != Text && *end == '\0';
+}
+
+
+static bool
+ParseArguments(
+    _In_ int argc,
+    _In_reads_(argc) char* argv[],
+    _Out_ const char** Directory
+)
+{
+    *Directory = NULL;
+    g_Config.Users = LOAD_DEFAULT_USERS;
+    g_Config.Threads = LOAD_DEFAULT_THREADS;
+    g_Config.DurationSeconds = LOAD_DEFAULT_DURATION_SECONDS;
+    g_Config.Mix[LOAD_REGISTER] = 1;
+    g_Config.Mix[LOAD_LOGIN] = 4;
+    g_Config.Mix[LOAD_STORE] = 35;
+    g_Config.Mix[LOAD_RETRIEVE] = 60;
+    g_Config.MinSize = LOAD_DEFAULT_MIN_SIZE;
+    g_Config.MaxSize = LOAD_DEFAULT_MAX_SIZE;
+    g_Config.Slots = LOAD_DEFAULT_SLOTS;
+    g_Config.Seed = GetTickCount64();
+    g_Config.Backend = SS_IO_BACKEND_OS;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char* option = argv[i];
+        const char* value = argv[i + 1];
+        bool valid = true;
+
+        if (strcmp(option, "--directory") == 0)
+        {
+            *Directory = value;
+        }
+        else if (strcmp(option, "--users") == 0)
+        {
+            g_Config.Users = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(option, "--threads") == 0)
+        {
+            g_Config.Threads = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(option, "--duration") == 0)
+        {
+            g_Config.DurationSeconds = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(option, "--operations") == 0)
+        {
+            g_Config.Operations = _strtoui64(value, NULL, 10);
+        }
+        else if (strcmp(option, "--mix") == 0)
+        {
+            valid = sscanf_s(value, "%lu,%lu,%lu,%lu", &g_Config.Mix[LOAD_REGISTER], &g_Config.Mix[LOAD_LOGIN],
+                             &g_Config.Mix[LOAD_STORE], &g_Config.Mix[LOAD_RETRIEVE]) == LOAD_OPERATION_COUNT;
+        }
+        else if (strcmp(option, "--min-size") == 0)
+        {
+            valid = ParseSize(value, &g_Config.MinSize);
+        }
+        else if (strcmp(option, "--max-size") == 0)
+        {
+            valid = ParseSize(value, &g_Config.MaxSize);
+        }
+        else if (strcmp(option, "--slots") == 0)
+        {
+            g_Config.Slots = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(option, "--seed") == 0)
+        {
+            g_Config.Seed = _strtoui64(value, NULL, 10);
+        }
+        else if (strcmp(option, "--backend") == 0)
+        {
+            valid = _stricmp(value, "os") == 0 || _stricmp(value, "memory") == 0;
+            g_Config.Backend = (_stricmp(value, "memory") == 0) ? SS_IO_BACKEND_MEMORY : SS_IO_BACKEND_OS;
+        }
+        else if (strcmp(option, "--disk-latency-us") == 0)
+        {
+            g_Config.Disk.LatencyMicroseconds = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(option, "--disk-jitter-us") == 0)
+        {
+            g_Config.Disk.JitterMicroseconds = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(option, "--disk-mbps") == 0)
+        {
+            g_Config.Disk.BytesPerSecond = _strtoui64(value, NULL, 10) * 1024 * 1024;
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "Invalid option: %s %s\r\n", option, value);
+            return false;
+        }
+    }
+
+    if (argc % 2 == 0)
+    {
+        fprintf(stderr, "Missing value for %s\r\n", argv[argc - 1]);
+        return false;
+    }
+
+    DWORD mixTotal = g_Config.Mix[LOAD_REGISTER] + g_Config.Mix[LOAD_LOGIN] + g_Config.Mix[LOAD_STORE] + g_Config.Mix[LOAD_RETRIEVE];
+    if (g_Config.Users == 0 || g_Config.Users >= LOAD_MAX_USERS || g_Config.Threads == 0 || g_Config.Threads > LOAD_MAX_THREADS ||
+        (g_Config.DurationSeconds == 0 && g_Config.Operations == 0) || mixTotal == 0 || g_Config.Slots == 0 ||
+        g_Config.MinSize == 0 || g_Config.MinSize > g_Config.MaxSize || g_Config.MaxSize > (uint64_t)MAX_FILE_SIZE)
+    {
+        fprintf(stderr, "Invalid configuration.\r\n");
+        return false;
+    }
+
+    g_Config.Seed = MixWord(g_Config.Seed) | 1;
+    return true;
+}
+
+
+static bool
+RegisterUsers()
+{
+    char name[USERNAME_MAX_LENGTH + 1];
+    for (DWORD user = 0; user < g_Config.Users; user++)
+    {
+        BuildUserName(user, name);
+        NTSTATUS status = SafeStorageHandleRegister(name, (uint16_t)strlen(name), LOAD_PASSWORD, (uint16_t)strlen(LOAD_PASSWORD));
+        if (!NT_SUCCESS(status))
+        {
+            fprintf(stderr, "Failed to register %s: 0x%08lx\r\n", name, (unsigned long)status);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void
+PrintReport(
+    _In_reads_(ThreadCount) LOAD_THREAD* Threads,
+    _In_ DWORD ThreadCount,
+    _In_ double Seconds
+)
+{
+    fprintf(stderr, "\r\n%-10s %10s %8s %10s %10s %10s %10s %10s %10s %10s\r\n",
+            "operation", "count", "errors", "ops/s", "MB/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+
+    for (DWORD operation = 0; operation < LOAD_OPERATION_COUNT; operation++)
+    {
+        size_t count = 0;
+        uint64_t errors = 0;
+        uint64_t bytes = 0;
+        for (DWORD i = 0; i < ThreadCount; i++)
+        {
+            count += Threads[i].Samples[operation].Count;
+            errors += Threads[i].Samples[operation].Errors;
+            bytes += Threads[i].Samples[operation].Bytes;
+        }
+
+        double* latencies = (count > 0) ? (double*)malloc(count * sizeof(double)) : NULL;
+        if (latencies == NULL)
+        {
+            fprintf(stderr, "%-10s %10zu %8llu\r\n", g_OperationNames[operation], count, errors);
+            continue;
+        }
+
+        size_t merged = 0;
+        for (DWORD i = 0; i < ThreadCount; i++)
+        {
+            memcpy(latencies + merged, Threads[i].Samples[operation].Latencies, Threads[i].Samples[operation].Count * sizeof(double));
+            merged += Threads[i].Samples[operation].Count;
+        }
+        qsort(latencies, count, sizeof(double), CompareDoubles);
+
+        fprintf(stderr, "%-10s %10zu %8llu %10.1f %10.1f %10.2f %10.2f %10.2f %10.2f %10.2f\r\n",
+                g_OperationNames[operation], count, errors, (double)count / Seconds, (double)bytes / Seconds / (1024.0 * 1024.0),
+                latencies[count / 2] / 1000.0, latencies[(count * 90) / 100] / 1000.0, latencies[(count * 99) / 100] / 1000.0,
+                latencies[(count * 999) / 1000] / 1000.0, latencies[count - 1] / 1000.0);
+        free(latencies);
+    }
+
+    uint64_t mismatches = 0;
+    for (DWORD i = 0; i < ThreadCount; i++)
+    {
+        mismatches += Threads[i].Mismatches;
+    }
+    fprintf(stderr, "\r\n%llu operations in %.1f s (%.1f ops/s), %llu failures, %llu mismatching retrieves\r\n",
+            (uint64_t)g_OperationsCompleted, Seconds, (double)g_OperationsCompleted / Seconds, (uint64_t)g_Failures, mismatches);
+}
+
+
+// Starts the threads, prints progress until they are done and reports. Returns the exit code.
+static int
+RunLoad(
+    _Inout_updates_(ThreadCount) LOAD_THREAD* Threads,
+    _In_ DWORD ThreadCount
+)
+{
+    AcquireSRWLockExclusive(&g_SessionLock);
+    SwitchUser(&Threads[0], false);
+    ReleaseSRWLockExclusive(&g_SessionLock);
+
+    if (g_Config.Operations != 0)
+    {
+        fprintf(stderr, "Running %llu operations on %lu threads\r\n", g_Config.Operations, ThreadCount);
+    }
+    else
+    {
+        fprintf(stderr, "Running for %lu s on %lu threads\r\n", g_Config.DurationSeconds, ThreadCount);
+    }
+
+    QueryPerformanceCounter(&g_Start);
+    for (DWORD i = 0; i < ThreadCount; i++)
+    {
+        InterlockedIncrement(&g_RunningThreads);
+        Threads[i].Handle = CreateThread(NULL, 0, LoadThread, &Threads[i], 0, NULL);
+        if (Threads[i].Handle == NULL)
+        {
+            InterlockedDecrement(&g_RunningThreads);
+            InterlockedExchange(&g_Stop, TRUE);
+            fprintf(stderr, "Failed to start thread %lu: %lu\r\n", i, GetLastError());
+            break;
+        }
+    }
+
+    // Progress lines, so that a soak test shows when throughput starts to degrade
+    int64_t lastCompleted = 0;
+    while (g_RunningThreads > 0)
+    {
+        Sleep(LOAD_PROGRESS_INTERVAL_MS);
+        int64_t completed = g_OperationsCompleted;
+        fprintf(stderr, "[%7.1f s] %lld operations (%.1f ops/s), %lld failures\r\n",
+                SecondsSinceStart(), completed, (double)(completed - lastCompleted) * 1000.0 / LOAD_PROGRESS_INTERVAL_MS,
+                (int64_t)g_Failures);
+        lastCompleted = completed;
+    }
+
+    double seconds = SecondsSinceStart();
+    for (DWORD i = 0; i < ThreadCount && Threads[i].Handle != NULL; i++)
+    {
+        WaitForSingleObject(Threads[i].Handle, INFINITE);
+        CloseHandle(Threads[i].Handle);
+    }
+
+    PrintReport(Threads, ThreadCount, seconds);
+    return (g_Failures == 0 && !g_Stop) ? 0 : 1;
+}
+
+
+int CDECL
+main(
+    int argc,
+    char* argv[]
+)
+{
+    const char* directory = NULL;
+    if (!ParseArguments(argc, argv, &directory))
+    {
+        return -1;
+    }
+    if (directory != NULL && !SetCurrentDirectoryA(directory))
+    {
+        fprintf(stderr, "Cannot use %s as the application directory: %lu\r\n", directory, GetLastError());
+        return -1;
+    }
+
+    QueryPerformanceFrequency(&g_Frequency);
+    QueryPerformanceCounter(&g_Start);
+    uint64_t tag = g_Config.Seed;
+    for (int i = 0; i < 4; i++)
+    {
+        g_RunTag[i] = (char)('a' + tag % 26);
+        tag /= 26;
+    }
+
+    if (!NT_SUCCESS(SafeStorageInit()))
+    {
+        return -1;
+    }
+    if (!NT_SUCCESS(SafeStorageConfigureIoBackend(g_Config.Backend, &g_Config.Disk)))
+    {
+        SafeStorageDeinit();
+        return -1;
+    }
+
+    // The slots of the users registered during the run are never used: stores run as one of the initial users
+    bool ready = IoCreateDirectories("loadgen");
+    LOAD_THREAD* threads = ready ? (LOAD_THREAD*)calloc(g_Config.Threads, sizeof(LOAD_THREAD)) : NULL;
+    uint64_t random = g_Config.Seed;
+    for (DWORD i = 0; threads != NULL && i < g_Config.Threads; i++)
+    {
+        LOAD_THREAD* thread = &threads[i];
+        thread->Index = i;
+        thread->Random = NextRandom(&random) | 1;
+        thread->Slots = (LOAD_SLOT*)calloc((size_t)g_Config.Users * g_Config.Slots, sizeof(LOAD_SLOT));
+        thread->Buffer = (BYTE*)malloc(LOAD_IO_SIZE);
+        thread->Expected = (BYTE*)malloc(LOAD_IO_SIZE);
+        sprintf_s(thread->SourcePath, MAX_PATH, "loadgen\\source%lu", i);
+        sprintf_s(thread->RetrievedPath, MAX_PATH, "loadgen\\retrieved%lu", i);
+        ready = ready && thread->Slots != NULL && thread->Buffer != NULL && thread->Expected != NULL;
+    }
+
+    int result = -1;
+    if (threads == NULL || !ready)
+    {
+        fprintf(stderr, "Failed to set up the load generator.\r\n");
+    }
+    else
+    {
+        fprintf(stderr, "Registering %lu users (lg%s...) on the %s backend\r\n", g_Config.Users, g_RunTag,
+                (g_Config.Backend == SS_IO_BACKEND_MEMORY) ? "memory" : "os");
+        if (RegisterUsers())
+        {
+            result = RunLoad(threads, g_Config.Threads);
+        }
+    }
+
+    if (g_CurrentUser >= 0)
+    {
+        SafeStorageHandleLogout();
+    }
+    for (DWORD i = 0; threads != NULL && i < g_Config.Threads; i++)
+    {
+        IoDeleteFile(threads[i].SourcePath);
+        IoDeleteFile(threads[i].RetrievedPath);
+        for (DWORD operation = 0; operation < LOAD_OPERATION_COUNT; operation++)
+        {
+            free(threads[i].Samples[operation].Latencies);
+        }
+        free(threads[i].Slots);
+        free(threads[i].Buffer);
+        free(threads[i].Expected);
+    }
+    free(threads);
+    RemoveDirectoryA("loadgen");
+    SafeStorageDeinit();
+    return result;
+}
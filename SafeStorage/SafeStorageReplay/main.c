@@ -0,0 +1,1216 @@
+#include "includes.h"
+#include "Commands.h"
+#include "FileIo.h"
+#include "Trace.h"
+#include <ctype.h>
+
+
+/*
+ * @brief       Replays a command trace recorded with SafeStorageStartTrace against a scratch application directory.
+ *
+ *              Usage: SafeStorageReplay.exe --trace FILE --directory PATH [options]
+ *
+ *              --trace FILE            the trace to replay
+ *              --directory PATH        scratch application directory to replay into; must not have users yet
+ *              --pace original|fast    start every command as long after the start as it was recorded
+ *                                      (default), or each one as soon as the previous one allows
+ *              --preload-size BYTES    size of the submissions that are retrieved in the trace but were stored
+ *                                      before it started, K/M/G suffixes allowed (default 64K)
+ *              --backend os|memory     where the library keeps its files (default os)
+ *
+ *              A trace holds no names or contents, only their lengths, a hash that tells them apart and the sizes
+ *              stored. Users, passwords and submissions are replaced by synthetic ones of the same lengths (user
+ *              names within the valid range, submission names of at least 16 characters) and files of the recorded
+ *              sizes are generated before each store, outside the time measured. A bulk store gets the recorded
+ *              number of files, all about the same size. Users that logged in but were registered before the
+ *              recording started, and submissions retrieved but stored before it, are created first.
+ *
+ *              Commands that failed when they were recorded are skipped: their inputs cannot be reconstructed.
+ *              Snapshot identifiers are mapped to those taken in the replay; version numbers are not, so
+ *              retrieving a version stored before the recording started fails in the replay.
+ *
+ *              Commands of the same recorded thread run in order on a thread of their own, so concurrency is
+ *              reproduced. Register, login, logout and snapshot change what the others see, so they wait for
+ *              the commands started before them and hold up those started after them.
+ *
+ *              For every command, the recorded and the replayed latency percentiles and means are reported, and
+ *              how much the mean changed. With original pacing, the report also says how late the replay had to
+ *              start commands, which shows where the library could not keep up with the recorded load. The exit
+ *              code is 0 only if every command succeeded again.
+ *
+ *              The library prints a line per command to stdout; the report goes to stderr, so stdout can be
+ *              redirected to NUL.
+ */
+
+
+#define REPLAY_DEFAULT_PRELOAD_SIZE (64ULL * 1024)
+#define REPLAY_MAX_LANES 64                     // Recorded threads beyond this share threads
+#define REPLAY_MAX_NAME_LENGTH 64               // Longer submission names are shortened, so that paths still fit
+#define REPLAY_MAX_PASSWORD_LENGTH 64
+#define REPLAY_MAX_BULK_FILES 4096              // Files generated for a bulk store, at most
+#define REPLAY_IO_SIZE (1024 * 1024)            // Source files are written in pieces of this size
+#define REPLAY_SPIN_MICROSECONDS 2000           // Commands due sooner are waited for without sleeping
+
+
+typedef struct _REPLAY_CONFIG
+{
+    const char* TracePath;
+    const char* Directory;
+    bool Fast;
+    uint64_t PreloadSize;
+    SafeStorageIoBackend Backend;
+} REPLAY_CONFIG;
+
+
+// A recorded command and what became of it in the replay
+typedef struct _REPLAY_ITEM
+{
+    TRACE_RECORD Record;
+    uint64_t User;                              // Target of the login of the record's session; 0 for the first session
+    DWORD Lane;
+    NTSTATUS Status;                            // Returned by the replay
+    double Microseconds;                        // Replayed latency
+    double LateMicroseconds;                    // How long after its recorded start the replay started it
+} REPLAY_ITEM;
+
+
+// A user of the trace
+typedef struct _REPLAY_USER
+{
+    uint64_t Target;                            // 0 for the user already logged in when the recording started
+    uint16_t NameLength;
+    uint16_t PasswordLength;
+    bool Registered;                            // By the trace itself, so not before it
+} REPLAY_USER;
+
+
+// A submission or tree retrieved in the trace but stored before it
+typedef struct _REPLAY_PRELOAD
+{
+    uint64_t User;
+    uint64_t Target;
+    uint16_t NameLength;
+    uint32_t Files;                             // 0 for a single submission
+} REPLAY_PRELOAD;
+
+
+// The commands of some recorded threads, run in order by one replay thread
+typedef struct _REPLAY_LANE
+{
+    DWORD Index;
+    HANDLE Handle;
+    REPLAY_ITEM** Items;                        // Of the commands between two session changes
+    size_t Count;
+    size_t Capacity;
+    DWORD TreeFiles;                            // Files currently in TreePath
+    BYTE* Buffer;                               // REPLAY_IO_SIZE bytes
+    char SourcePath[MAX_PATH];
+    char RetrievedPath[MAX_PATH];
+    char TreePath[MAX_PATH];
+    char OutputPath[MAX_PATH];
+} REPLAY_LANE;
+
+
+// Generates the contents of a streamed store
+typedef struct _REPLAY_STREAM
+{
+    uint64_t Seed;
+    uint64_t Size;
+    uint64_t Offset;
+} REPLAY_STREAM;
+
+
+static const char* g_OperationNames[TRACE_OP_COUNT] = {
+    "register", "login", "logout", "store", "stream", "retrieve", "delta", "version",
+    "snapshot", "retrieve-snap", "store-tree", "store-files", "retrieve-tree", "usage"
+};
+static REPLAY_CONFIG g_Config;
+static LARGE_INTEGER g_Frequency;
+static LARGE_INTEGER g_Start;
+static REPLAY_ITEM* g_Items = NULL;
+static size_t g_ItemCount = 0;
+static size_t g_SkippedCount = 0;               // Failed when recorded
+static REPLAY_USER* g_Users = NULL;
+static size_t g_UserCount = 0;
+static REPLAY_PRELOAD* g_Preloads = NULL;
+static size_t g_PreloadCount = 0;
+static REPLAY_LANE g_Lanes[REPLAY_MAX_LANES];
+static DWORD g_LaneCount = 0;
+static uint32_t g_SnapshotMap[2][256];          // Recorded and replayed identifiers of the snapshots taken
+static DWORD g_SnapshotCount = 0;
+static bool g_LoggedIn = false;
+
+
+static double
+MicrosecondsBetween(
+    _In_ LONGLONG Start,
+    _In_ LONGLONG End
+)
+{
+    return (double)(End - Start) * 1000000.0 / (double)g_Frequency.QuadPart;
+}
+
+
+static double
+MicrosecondsSinceStart()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return MicrosecondsBetween(g_Start.QuadPart, now.QuadPart);
+}
+
+
+// splitmix64 finalizer; the contents of a file are a function of its seed and of the offset only
+static uint64_t
+MixWord(
+    _In_ uint64_t Value
+)
+{
+    Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBULL;
+    return Value ^ (Value >> 31);
+}
+
+
+static void
+GenerateContent(
+    _In_ uint64_t Seed,
+    _In_ uint64_t Offset,
+    _Out_writes_bytes_(Length) BYTE* Buffer,
+    _In_ DWORD Length
+)
+{
+    // Offset is always a multiple of 8
+    for (DWORD i = 0; i < Length; i += sizeof(uint64_t))
+    {
+        uint64_t word = MixWord(Seed + (Offset + i) / sizeof(uint64_t));
+        memcpy(Buffer + i, &word, min((DWORD)sizeof(uint64_t), Length - i));
+    }
+}
+
+
+static void
+BuildUserName(
+    _In_ const REPLAY_USER* User,
+    _Out_writes_(USERNAME_MAX_LENGTH + 1) char* Name
+)
+{
+    // User names must be alphabetic
+    uint16_t length = (uint16_t)min(max(User->NameLength, USERNAME_MIN_LENGTH), USERNAME_MAX_LENGTH);
+    uint64_t value = MixWord(User->Target + 0x9E3779B97F4A7C15ULL);
+    for (uint16_t i = 0; i < length; i++)
+    {
+        Name[i] = (char)('a' + value % 26);
+        value /= 26;
+    }
+    Name[length] = '\0';
+}
+
+
+static void
+BuildPassword(
+    _In_ uint16_t Length,
+    _Out_writes_(REPLAY_MAX_PASSWORD_LENGTH + 1) char* Password
+)
+{
+    // A digit, both cases and a special character, padded to the recorded length
+    uint16_t length = (uint16_t)min(max(Length, PASSWORD_MIN_LENGTH), REPLAY_MAX_PASSWORD_LENGTH);
+    memset(Password, 'x', length);
+    memcpy(Password, "Rp1@", 4);
+    Password[length] = '\0';
+}
+
+
+static void
+BuildSubmissionName(
+    _In_ uint64_t Target,
+    _In_ uint16_t Length,
+    _Out_writes_(REPLAY_MAX_NAME_LENGTH + 1) char* Name
+)
+{
+    // The hash keeps names apart; the padding keeps their recorded length
+    int written = sprintf_s(Name, REPLAY_MAX_NAME_LENGTH + 1, "%016llx", Target);
+    size_t length = min(max((size_t)Length, (size_t)written), (size_t)REPLAY_MAX_NAME_LENGTH);
+    memset(Name + written, '_', length - written);
+    Name[length] = '\0';
+}
+
+
+static REPLAY_USER*
+FindUser(
+    _In_ uint64_t Target
+)
+{
+    for (size_t i = 0; i < g_UserCount; i++)
+    {
+        if (g_Users[i].Target == Target)
+        {
+            return &g_Users[i];
+        }
+    }
+    return NULL;
+}
+
+
+static REPLAY_USER*
+AddUser(
+    _In_ uint64_t Target,
+    _In_ uint16_t NameLength,
+    _In_ uint16_t PasswordLength
+)
+{
+    REPLAY_USER* user = FindUser(Target);
+    if (user != NULL)
+    {
+        return user;
+    }
+
+    REPLAY_USER* users = (REPLAY_USER*)realloc(g_Users, (g_UserCount + 1) * sizeof(REPLAY_USER));
+    if (users == NULL)
+    {
+        return NULL;
+    }
+    g_Users = users;
+    user = &g_Users[g_UserCount++];
+    user->Target = Target;
+    user->NameLength = NameLength;
+    user->PasswordLength = PasswordLength;
+    user->Registered = false;
+    return user;
+}
+
+
+static bool
+WriteSourceFile(
+    _Inout_ REPLAY_LANE* Lane,
+    _In_z_ const char* Path,
+    _In_ uint64_t Seed,
+    _In_ uint64_t Size
+)
+{
+    // Through the library's I/O backend, so that the source exists wherever the store looks for it
+    SS_FILE* file = IoOpenFile(Path, IO_OPEN_CREATE);
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    bool written = true;
+    for (uint64_t offset = 0; written && offset < Size; offset += REPLAY_IO_SIZE)
+    {
+        DWORD length = (DWORD)min(Size - offset, (uint64_t)REPLAY_IO_SIZE);
+        GenerateContent(Seed, offset, Lane->Buffer, length);
+        written = IoWriteAt(file, offset, Lane->Buffer, length);
+    }
+
+    IoCloseFile(file);
+    return written;
+}
+
+
+// Fills the lane's tree directory with Files files adding up to Size bytes
+static bool
+WriteSourceTree(
+    _Inout_ REPLAY_LANE* Lane,
+    _In_ uint64_t Seed,
+    _In_ DWORD Files,
+    _In_ uint64_t Size
+)
+{
+    char path[MAX_PATH];
+    Files = min(max(Files, 1UL), (DWORD)REPLAY_MAX_BULK_FILES);
+
+    for (DWORD i = 0; i < Files; i++)
+    {
+        uint64_t size = Size / Files + ((i == 0) ? Size % Files : 0);
+        sprintf_s(path, MAX_PATH, "%s\\f%lu", Lane->TreePath, i);
+        if (!WriteSourceFile(Lane, path, Seed + i, size))
+        {
+            return false;
+        }
+    }
+
+    // Files left over from a larger tree would be stored too
+    for (DWORD i = Files; i < Lane->TreeFiles; i++)
+    {
+        sprintf_s(path, MAX_PATH, "%s\\f%lu", Lane->TreePath, i);
+        IoDeleteFile(path);
+    }
+    Lane->TreeFiles = Files;
+    return true;
+}
+
+
+static BOOLEAN
+ReadGeneratedStream(
+    void* Context,
+    void* Buffer,
+    uint32_t Length,
+    uint32_t* BytesRead
+)
+{
+    REPLAY_STREAM* stream = (REPLAY_STREAM*)Context;
+
+    // Whole words only, so that every piece starts at a multiple of 8
+    uint32_t length = (uint32_t)min(stream->Size - stream->Offset, (uint64_t)(Length & ~7U));
+    GenerateContent(stream->Seed, stream->Offset, (BYTE*)Buffer, length);
+    stream->Offset += length;
+    *BytesRead = length;
+    return TRUE;
+}
+
+
+static uint32_t
+MapSnapshot(
+    _In_ uint32_t Recorded
+)
+{
+    for (DWORD i = 0; i < g_SnapshotCount; i++)
+    {
+        if (g_SnapshotMap[0][i] == Recorded)
+        {
+            return g_SnapshotMap[1][i];
+        }
+    }
+
+    // Taken before the recording started
+    return Recorded;
+}
+
+
+// Replays one command and measures it. Source files are generated first, outside the time measured.
+static void
+ReplayItem(
+    _Inout_ REPLAY_LANE* Lane,
+    _Inout_ REPLAY_ITEM* Item
+)
+{
+    const TRACE_RECORD* record = &Item->Record;
+    char name[REPLAY_MAX_NAME_LENGTH + 1];
+    char userName[USERNAME_MAX_LENGTH + 1] = { 0 };
+    char password[REPLAY_MAX_PASSWORD_LENGTH + 1];
+    const char* paths[REPLAY_MAX_BULK_FILES] = { 0 };
+    char (*pathBuffer)[MAX_PATH] = NULL;
+    REPLAY_STREAM stream = { MixWord(record->Target ^ record->StartMicroseconds), record->Bytes, 0 };
+    SafeStorageBulkReport report = { 0 };
+    uint32_t snapshotId = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+    DWORD files = min(max(record->Count, 1UL), (DWORD)REPLAY_MAX_BULK_FILES);
+
+    BuildSubmissionName(record->Target, record->NameLength, name);
+    BuildPassword(record->ArgumentLength, password);
+    REPLAY_USER* user = (record->Operation == TRACE_OP_REGISTER || record->Operation == TRACE_OP_LOGIN) ? FindUser(record->Target) : NULL;
+    if (user != NULL)
+    {
+        BuildUserName(user, userName);
+    }
+
+    switch (record->Operation)
+    {
+    case TRACE_OP_STORE:
+        if (!WriteSourceFile(Lane, Lane->SourcePath, stream.Seed, record->Bytes))
+        {
+            status = STATUS_UNSUCCESSFUL;
+        }
+        break;
+    case TRACE_OP_STORE_TREE:
+    case TRACE_OP_STORE_FILES:
+        if (!WriteSourceTree(Lane, stream.Seed, files, record->Bytes))
+        {
+            status = STATUS_UNSUCCESSFUL;
+        }
+        pathBuffer = (char(*)[MAX_PATH])malloc((size_t)files * MAX_PATH);
+        for (DWORD i = 0; pathBuffer != NULL && i < files; i++)
+        {
+            sprintf_s(pathBuffer[i], MAX_PATH, "%s\\f%lu", Lane->TreePath, i);
+            paths[i] = pathBuffer[i];
+        }
+        if (pathBuffer == NULL)
+        {
+            status = STATUS_NO_MEMORY;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Item->Status = status;
+        free(pathBuffer);
+        return;
+    }
+
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&start);
+    switch (record->Operation)
+    {
+    case TRACE_OP_REGISTER:
+        status = SafeStorageHandleRegister(userName, (uint16_t)strlen(userName), password, (uint16_t)strlen(password));
+        break;
+    case TRACE_OP_LOGIN:
+        status = SafeStorageHandleLogin(userName, (uint16_t)strlen(userName), password, (uint16_t)strlen(password));
+        break;
+    case TRACE_OP_LOGOUT:
+        status = SafeStorageHandleLogout();
+        break;
+    case TRACE_OP_STORE:
+        status = SafeStorageHandleStore(name, (uint16_t)strlen(name), Lane->SourcePath, (uint16_t)strlen(Lane->SourcePath));
+        break;
+    case TRACE_OP_STORE_STREAM:
+        status = SafeStorageHandleStoreStream(name, (uint16_t)strlen(name), ReadGeneratedStream, &stream);
+        break;
+    case TRACE_OP_RETRIEVE:
+        status = SafeStorageHandleRetrieve(name, (uint16_t)strlen(name), Lane->RetrievedPath, (uint16_t)strlen(Lane->RetrievedPath));
+        break;
+    case TRACE_OP_RETRIEVE_DELTA:
+        status = SafeStorageHandleRetrieveDelta(name, (uint16_t)strlen(name), Lane->RetrievedPath, (uint16_t)strlen(Lane->RetrievedPath));
+        break;
+    case TRACE_OP_RETRIEVE_VERSION:
+        status = SafeStorageHandleRetrieveVersion(name, (uint16_t)strlen(name), Lane->RetrievedPath, (uint16_t)strlen(Lane->RetrievedPath),
+                                                  record->Count);
+        break;
+    case TRACE_OP_SNAPSHOT:
+        status = SafeStorageHandleSnapshot(&snapshotId);
+        break;
+    case TRACE_OP_RETRIEVE_SNAPSHOT:
+        status = SafeStorageHandleRetrieveSnapshot(name, (uint16_t)strlen(name), Lane->RetrievedPath, (uint16_t)strlen(Lane->RetrievedPath),
+                                                   MapSnapshot(record->Count));
+        break;
+    case TRACE_OP_STORE_TREE:
+        status = SafeStorageHandleStoreTree(name, (uint16_t)strlen(name), Lane->TreePath, (uint16_t)strlen(Lane->TreePath), &report);
+        break;
+    case TRACE_OP_STORE_FILES:
+        status = SafeStorageHandleStoreFiles(name, (uint16_t)strlen(name), paths, files, &report);
+        break;
+    case TRACE_OP_RETRIEVE_TREE:
+        status = SafeStorageHandleRetrieveTree(name, (uint16_t)strlen(name), Lane->OutputPath, (uint16_t)strlen(Lane->OutputPath), &report);
+        break;
+    default:
+        status = SafeStorageHandleUsage();
+        break;
+    }
+    QueryPerformanceCounter(&end);
+
+    Item->Status = status;
+    Item->Microseconds = MicrosecondsBetween(start.QuadPart, end.QuadPart);
+    if (record->Operation == TRACE_OP_SNAPSHOT && NT_SUCCESS(status) && g_SnapshotCount < ARRAYSIZE(g_SnapshotMap[0]))
+    {
+        g_SnapshotMap[0][g_SnapshotCount] = record->Count;
+        g_SnapshotMap[1][g_SnapshotCount++] = snapshotId;
+    }
+    if (record->Operation == TRACE_OP_LOGIN || record->Operation == TRACE_OP_LOGOUT)
+    {
+        g_LoggedIn = (record->Operation == TRACE_OP_LOGIN) ? NT_SUCCESS(status) : (g_LoggedIn && !NT_SUCCESS(status));
+    }
+
+    SafeStorageFreeBulkReport(&report);
+    free(pathBuffer);
+}
+
+
+// Waits until a command is due and replays it
+static void
+RunItem(
+    _Inout_ REPLAY_LANE* Lane,
+    _Inout_ REPLAY_ITEM* Item
+)
+{
+    double due = (double)Item->Record.StartMicroseconds;
+    double now = MicrosecondsSinceStart();
+
+    while (!g_Config.Fast && now < due)
+    {
+        if (due - now > REPLAY_SPIN_MICROSECONDS)
+        {
+            Sleep((DWORD)((due - now) / 1000.0) - 1);
+        }
+        else
+        {
+            SwitchToThread();
+        }
+        now = MicrosecondsSinceStart();
+    }
+
+    Item->LateMicroseconds = g_Config.Fast ? 0.0 : now - due;
+    ReplayItem(Lane, Item);
+}
+
+
+static DWORD WINAPI
+LaneThread(
+    _In_ LPVOID Parameter
+)
+{
+    REPLAY_LANE* lane = (REPLAY_LANE*)Parameter;
+    for (size_t i = 0; i < lane->Count; i++)
+    {
+        RunItem(lane, lane->Items[i]);
+    }
+    return 0;
+}
+
+
+static bool
+AddToLane(
+    _Inout_ REPLAY_LANE* Lane,
+    _In_ REPLAY_ITEM* Item
+)
+{
+    if (Lane->Count == Lane->Capacity)
+    {
+        size_t capacity = (Lane->Capacity == 0) ? 256 : 2 * Lane->Capacity;
+        REPLAY_ITEM** items = (REPLAY_ITEM**)realloc(Lane->Items, capacity * sizeof(REPLAY_ITEM*));
+        if (items == NULL)
+        {
+            return false;
+        }
+        Lane->Items = items;
+        Lane->Capacity = capacity;
+    }
+
+    Lane->Items[Lane->Count++] = Item;
+    return true;
+}
+
+
+// Runs the commands collected in the lanes, each lane on a thread of its own, and waits for them
+static void
+RunLanes()
+{
+    for (DWORD i = 0; i < g_LaneCount; i++)
+    {
+        if (g_Lanes[i].Count == 0)
+        {
+            continue;
+        }
+
+        // A lane whose thread cannot be started is run below, once the others are running
+        g_Lanes[i].Handle = CreateThread(NULL, 0, LaneThread, &g_Lanes[i], 0, NULL);
+        if (g_Lanes[i].Handle == NULL)
+        {
+            fprintf(stderr, "Failed to start a replay thread: %lu\r\n", GetLastError());
+        }
+    }
+
+    for (DWORD i = 0; i < g_LaneCount; i++)
+    {
+        if (g_Lanes[i].Handle != NULL)
+        {
+            WaitForSingleObject(g_Lanes[i].Handle, INFINITE);
+            CloseHandle(g_Lanes[i].Handle);
+            g_Lanes[i].Handle = NULL;
+        }
+        else if (g_Lanes[i].Count > 0)
+        {
+            LaneThread(&g_Lanes[i]);
+        }
+        g_Lanes[i].Count = 0;
+    }
+}
+
+
+static bool
+IsSessionChange(
+    _In_ uint16_t Operation
+)
+{
+    return Operation == TRACE_OP_REGISTER || Operation == TRACE_OP_LOGIN || Operation == TRACE_OP_LOGOUT ||
+           Operation == TRACE_OP_SNAPSHOT;
+}
+
+
+static void
+Replay()
+{
+    QueryPerformanceCounter(&g_Start);
+
+    for (size_t i = 0; i < g_ItemCount; i++)
+    {
+        REPLAY_ITEM* item = &g_Items[i];
+        if (!IsSessionChange(item->Record.Operation))
+        {
+            if (!AddToLane(&g_Lanes[item->Lane], item))
+            {
+                RunItem(&g_Lanes[item->Lane], item);
+            }
+            continue;
+        }
+
+        // Everything started before it is done first, everything started after it waits
+        RunLanes();
+        RunItem(&g_Lanes[item->Lane], item);
+    }
+    RunLanes();
+}
+
+
+static int
+CompareRecords(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    uint64_t left = ((const REPLAY_ITEM*)Left)->Record.StartMicroseconds;
+    uint64_t right = ((const REPLAY_ITEM*)Right)->Record.StartMicroseconds;
+    return (left > right) - (left < right);
+}
+
+
+static bool
+LoadTrace()
+{
+    FILE* file = NULL;
+    if (fopen_s(&file, g_Config.TracePath, "rb") != 0 || file == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\r\n", g_Config.TracePath);
+        return false;
+    }
+
+    TRACE_HEADER header = { 0 };
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.Magic != TRACE_MAGIC || header.Version != TRACE_VERSION ||
+        header.RecordSize != sizeof(TRACE_RECORD))
+    {
+        fprintf(stderr, "%s is not a trace this version can replay.\r\n", g_Config.TracePath);
+        fclose(file);
+        return false;
+    }
+
+    // Commands that failed when recorded are dropped right away
+    size_t capacity = 0;
+    TRACE_RECORD record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (!NT_SUCCESS(record.Status) || record.Operation >= TRACE_OP_COUNT)
+        {
+            g_SkippedCount++;
+            continue;
+        }
+
+        if (g_ItemCount == capacity)
+        {
+            capacity = (capacity == 0) ? 4096 : 2 * capacity;
+            REPLAY_ITEM* items = (REPLAY_ITEM*)realloc(g_Items, capacity * sizeof(REPLAY_ITEM));
+            if (items == NULL)
+            {
+                fprintf(stderr, "Out of memory.\r\n");
+                fclose(file);
+                return false;
+            }
+            g_Items = items;
+        }
+
+        memset(&g_Items[g_ItemCount], 0, sizeof(REPLAY_ITEM));
+        g_Items[g_ItemCount++].Record = record;
+    }
+    fclose(file);
+
+    // Recorded in the order the commands returned; replayed in the order they started
+    qsort(g_Items, g_ItemCount, sizeof(REPLAY_ITEM), CompareRecords);
+    return true;
+}
+
+
+// Adds a submission or tree of a user to an open-addressing set. Returns FALSE if it was stored already.
+static bool
+AddStored(
+    _Inout_updates_(Mask + 1) uint64_t* Keys,
+    _In_ size_t Mask,
+    _In_ uint64_t User,
+    _In_ uint64_t Target
+)
+{
+    // 0 marks a free slot
+    uint64_t key = max(MixWord(User) ^ Target, 1ULL);
+    size_t slot = (size_t)MixWord(key) & Mask;
+    while (Keys[slot] != 0)
+    {
+        if (Keys[slot] == key)
+        {
+            return false;
+        }
+        slot = (slot + 1) & Mask;
+    }
+    Keys[slot] = key;
+    return true;
+}
+
+
+// Assigns users and lanes and finds what has to exist before the replay starts
+static bool
+PrepareTrace()
+{
+    uint32_t sessions = 0;
+    for (size_t i = 0; i < g_ItemCount; i++)
+    {
+        sessions = max(sessions, g_Items[i].Record.Session);
+    }
+
+    uint64_t* sessionUsers = (uint64_t*)calloc((size_t)sessions + 1, sizeof(uint64_t));
+    size_t storedSlots = 16;
+    while (storedSlots < 2 * g_ItemCount)
+    {
+        storedSlots *= 2;
+    }
+    uint64_t* stored = (uint64_t*)calloc(storedSlots, sizeof(uint64_t));
+    DWORD threadIds[REPLAY_MAX_LANES] = { 0 };
+    bool prepared = sessionUsers != NULL && stored != NULL;
+
+    for (size_t i = 0; prepared && i < g_ItemCount; i++)
+    {
+        const TRACE_RECORD* record = &g_Items[i].Record;
+        if (record->Operation == TRACE_OP_LOGIN)
+        {
+            sessionUsers[record->Session] = record->Target;
+            prepared = AddUser(record->Target, record->NameLength, record->ArgumentLength) != NULL;
+        }
+    }
+
+    for (size_t i = 0; prepared && i < g_ItemCount; i++)
+    {
+        REPLAY_ITEM* item = &g_Items[i];
+        const TRACE_RECORD* record = &item->Record;
+        item->User = sessionUsers[record->Session];
+
+        // The first lanes go to the first threads seen; the threads after them share lanes
+        DWORD lane = 0;
+        while (lane < g_LaneCount && threadIds[lane] != record->ThreadId)
+        {
+            lane++;
+        }
+        if (lane == g_LaneCount && g_LaneCount < REPLAY_MAX_LANES)
+        {
+            threadIds[g_LaneCount++] = record->ThreadId;
+        }
+        item->Lane = (lane < REPLAY_MAX_LANES) ? lane : (record->ThreadId % REPLAY_MAX_LANES);
+
+        switch (record->Operation)
+        {
+        case TRACE_OP_REGISTER:
+        {
+            // Registered by the replay where the trace registered it, not beforehand
+            REPLAY_USER* user = AddUser(record->Target, record->NameLength, record->ArgumentLength);
+            prepared = user != NULL;
+            if (user != NULL)
+            {
+                user->Registered = true;
+            }
+            break;
+        }
+        case TRACE_OP_LOGIN:
+        case TRACE_OP_LOGOUT:
+        case TRACE_OP_SNAPSHOT:
+        case TRACE_OP_USAGE:
+            break;
+        case TRACE_OP_STORE:
+        case TRACE_OP_STORE_STREAM:
+        case TRACE_OP_STORE_TREE:
+        case TRACE_OP_STORE_FILES:
+            AddStored(stored, storedSlots - 1, item->User, record->Target);
+            break;
+        default:
+            if (AddStored(stored, storedSlots - 1, item->User, record->Target))
+            {
+                REPLAY_PRELOAD* preloads = (REPLAY_PRELOAD*)realloc(g_Preloads, (g_PreloadCount + 1) * sizeof(REPLAY_PRELOAD));
+                prepared = preloads != NULL;
+                if (preloads != NULL)
+                {
+                    g_Preloads = preloads;
+                    g_Preloads[g_PreloadCount].User = item->User;
+                    g_Preloads[g_PreloadCount].Target = record->Target;
+                    g_Preloads[g_PreloadCount].NameLength = record->NameLength;
+                    g_Preloads[g_PreloadCount++].Files = (record->Operation == TRACE_OP_RETRIEVE_TREE) ? max(record->Count, 1UL) : 0;
+                }
+            }
+            break;
+        }
+    }
+
+    // Commands of the first session ran as a user logged in before the recording started
+    for (size_t i = 0; prepared && i < g_ItemCount; i++)
+    {
+        if (g_Items[i].Record.Session == 0 && g_Items[i].Record.Operation != TRACE_OP_REGISTER)
+        {
+            prepared = AddUser(0, USERNAME_MAX_LENGTH, PASSWORD_MIN_LENGTH) != NULL;
+            break;
+        }
+    }
+
+    g_LaneCount = max(g_LaneCount, 1UL);
+    free(sessionUsers);
+    free(stored);
+    return prepared;
+}
+
+
+// Registers the users the trace did not register and stores what it retrieves without storing
+static bool
+SetUpDirectory()
+{
+    char userName[USERNAME_MAX_LENGTH + 1];
+    char password[REPLAY_MAX_PASSWORD_LENGTH + 1];
+    char name[REPLAY_MAX_NAME_LENGTH + 1];
+    REPLAY_LANE* lane = &g_Lanes[0];
+
+    for (size_t i = 0; i < g_UserCount; i++)
+    {
+        const REPLAY_USER* user = &g_Users[i];
+        BuildUserName(user, userName);
+        BuildPassword(user->PasswordLength, password);
+
+        NTSTATUS status = user->Registered ? STATUS_SUCCESS :
+            SafeStorageHandleRegister(userName, (uint16_t)strlen(userName), password, (uint16_t)strlen(password));
+        if (!NT_SUCCESS(status))
+        {
+            fprintf(stderr, "Failed to register %s: 0x%08lx\r\n", userName, (unsigned long)status);
+            return false;
+        }
+
+        bool loggedIn = false;
+        for (size_t j = 0; j < g_PreloadCount; j++)
+        {
+            const REPLAY_PRELOAD* preload = &g_Preloads[j];
+            if (preload->User != user->Target)
+            {
+                continue;
+            }
+            if (!loggedIn)
+            {
+                status = SafeStorageHandleLogin(userName, (uint16_t)strlen(userName), password, (uint16_t)strlen(password));
+                if (!NT_SUCCESS(status))
+                {
+                    fprintf(stderr, "Failed to log in as %s: 0x%08lx\r\n", userName, (unsigned long)status);
+                    return false;
+                }
+                loggedIn = true;
+            }
+
+            BuildSubmissionName(preload->Target, preload->NameLength, name);
+            SafeStorageBulkReport report = { 0 };
+            if (preload->Files == 0)
+            {
+                status = WriteSourceFile(lane, lane->SourcePath, MixWord(preload->Target), g_Config.PreloadSize) ?
+                    SafeStorageHandleStore(name, (uint16_t)strlen(name), lane->SourcePath, (uint16_t)strlen(lane->SourcePath)) :
+                    STATUS_UNSUCCESSFUL;
+            }
+            else
+            {
+                status = WriteSourceTree(lane, MixWord(preload->Target), preload->Files, g_Config.PreloadSize * preload->Files) ?
+                    SafeStorageHandleStoreTree(name, (uint16_t)strlen(name), lane->TreePath, (uint16_t)strlen(lane->TreePath), &report) :
+                    STATUS_UNSUCCESSFUL;
+                SafeStorageFreeBulkReport(&report);
+            }
+            if (!NT_SUCCESS(status))
+            {
+                fprintf(stderr, "Failed to store %s for %s: 0x%08lx\r\n", name, userName, (unsigned long)status);
+                return false;
+            }
+        }
+
+        // The user logged in when the recording started stays logged in
+        if (loggedIn && user->Target != 0)
+        {
+            SafeStorageHandleLogout();
+            loggedIn = false;
+        }
+        if (user->Target == 0 && !loggedIn)
+        {
+            status = SafeStorageHandleLogin(userName, (uint16_t)strlen(userName), password, (uint16_t)strlen(password));
+            if (!NT_SUCCESS(status))
+            {
+                fprintf(stderr, "Failed to log in as %s: 0x%08lx\r\n", userName, (unsigned long)status);
+                return false;
+            }
+        }
+        g_LoggedIn = g_LoggedIn || user->Target == 0;
+    }
+    return true;
+}
+
+
+static int
+CompareDoubles(
+    _In_ const void* Left,
+    _In_ const void* Right
+)
+{
+    double left = *(const double*)Left;
+    double right = *(const double*)Right;
+    return (left > right) - (left < right);
+}
+
+
+static void
+PrintReport(
+    _In_ double Seconds
+)
+{
+    double* recorded = (double*)malloc(max(g_ItemCount, (size_t)1) * sizeof(double));
+    double* replayed = (double*)malloc(max(g_ItemCount, (size_t)1) * sizeof(double));
+    if (recorded == NULL || replayed == NULL)
+    {
+        free(recorded);
+        free(replayed);
+        return;
+    }
+
+    fprintf(stderr, "\r\n%-13s %8s %7s %10s %10s %10s %10s %10s %10s %8s\r\n",
+            "command", "count", "failed", "rec p50", "rep p50", "rec p99", "rep p99", "rec mean", "rep mean", "change");
+
+    uint64_t failures = 0;
+    double maxLate = 0.0;
+    double totalLate = 0.0;
+    uint64_t recordedEnd = 0;
+    for (DWORD operation = 0; operation < TRACE_OP_COUNT; operation++)
+    {
+        size_t count = 0;
+        uint64_t failed = 0;
+        double recordedSum = 0.0;
+        double replayedSum = 0.0;
+        for (size_t i = 0; i < g_ItemCount; i++)
+        {
+            const REPLAY_ITEM* item = &g_Items[i];
+            if (item->Record.Operation != operation)
+            {
+                continue;
+            }
+            maxLate = max(maxLate, item->LateMicroseconds);
+            totalLate += item->LateMicroseconds;
+            recordedEnd = max(recordedEnd, item->Record.StartMicroseconds + item->Record.DurationMicroseconds);
+            if (!NT_SUCCESS(item->Status))
+            {
+                failed++;
+                continue;
+            }
+            recorded[count] = (double)item->Record.DurationMicroseconds;
+            replayed[count++] = item->Microseconds;
+            recordedSum += (double)item->Record.DurationMicroseconds;
+            replayedSum += item->Microseconds;
+        }
+
+        failures += failed;
+        if (count == 0 && failed == 0)
+        {
+            continue;
+        }
+        if (count == 0)
+        {
+            fprintf(stderr, "%-13s %8zu %7llu\r\n", g_OperationNames[operation], count, failed);
+            continue;
+        }
+
+        qsort(recorded, count, sizeof(double), CompareDoubles);
+        qsort(replayed, count, sizeof(double), CompareDoubles);
+        double recordedMean = recordedSum / (double)count;
+        double replayedMean = replayedSum / (double)count;
+        double change = (recordedMean > 0.0) ? (replayedMean - recordedMean) * 100.0 / recordedMean : 0.0;
+        fprintf(stderr, "%-13s %8zu %7llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %+7.1f%%\r\n",
+                g_OperationNames[operation], count, failed,
+                recorded[count / 2] / 1000.0, replayed[count / 2] / 1000.0,
+                recorded[(count * 99) / 100] / 1000.0, replayed[(count * 99) / 100] / 1000.0,
+                recordedMean / 1000.0, replayedMean / 1000.0, change);
+    }
+
+    fprintf(stderr, "\r\nLatencies in ms. %zu commands replayed in %.1f s (recorded: %.1f s), %llu failed; "
+            "%zu skipped because they failed when recorded.\r\n",
+            g_ItemCount, Seconds, (double)recordedEnd / 1000000.0, failures, g_SkippedCount);
+    if (!g_Config.Fast && g_ItemCount > 0)
+    {
+        fprintf(stderr, "Commands started %.3f ms late on average, %.3f ms at most.\r\n",
+                totalLate / (double)g_ItemCount / 1000.0, maxLate / 1000.0);
+    }
+
+    free(recorded);
+    free(replayed);
+}
+
+
+static bool
+ParseSize(
+    _In_z_ const char* Text,
+    _Out_ uint64_t* Size
+)
+{
+    char* end = NULL;
+    *Size = _strtoui64(Text, &end, 10);
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        *Size *= 1024;
+        // fall through
+    case 'M':
+        *Size *= 1024;
+        // fall through
+    case 'K':
+        *Size *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return end != Text && *end == '\0';
+}
+
+
+static bool
+ParseArguments(
+    _In_ int argc,
+    _In_reads_(argc) char* argv[]
+)
+{
+    g_Config.PreloadSize = REPLAY_DEFAULT_PRELOAD_SIZE;
+    g_Config.Backend = SS_IO_BACKEND_OS;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char* option = argv[i];
+        const char* value = argv[i + 1];
+        bool valid = true;
+
+        if (strcmp(option, "--trace") == 0)
+        {
+            g_Config.TracePath = value;
+        }
+        else if (strcmp(option, "--directory") == 0)
+        {
+            g_Config.Directory = value;
+        }
+        else if (strcmp(option, "--pace") == 0)
+        {
+            valid = _stricmp(value, "original") == 0 || _stricmp(value, "fast") == 0;
+            g_Config.Fast = _stricmp(value, "fast") == 0;
+        }
+        else if (strcmp(option, "--preload-size") == 0)
+        {
+            valid = ParseSize(value, &g_Config.PreloadSize) && g_Config.PreloadSize <= (uint64_t)MAX_FILE_SIZE;
+        }
+        else if (strcmp(option, "--backend") == 0)
+        {
+            valid = _stricmp(value, "os") == 0 || _stricmp(value, "memory") == 0;
+            g_Config.Backend = (_stricmp(value, "memory") == 0) ? SS_IO_BACKEND_MEMORY : SS_IO_BACKEND_OS;
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "Invalid option: %s %s\r\n", option, value);
+            return false;
+        }
+    }
+
+    if (argc % 2 == 0)
+    {
+        fprintf(stderr, "Missing value for %s\r\n", argv[argc - 1]);
+        return false;
+    }
+
+    if (g_Config.TracePath == NULL || g_Config.Directory == NULL)
+    {
+        fprintf(stderr, "Usage: SafeStorageReplay.exe --trace FILE --directory PATH [--pace original|fast] "
+                "[--preload-size BYTES] [--backend os|memory]\r\n");
+        return false;
+    }
+    return true;
+}
+
+
+int CDECL
+main(
+    int argc,
+    char* argv[]
+)
+{
+    char tracePath[MAX_PATH];
+    if (!ParseArguments(argc, argv))
+    {
+        return -1;
+    }
+
+    // The trace may be given relative to where the tool was started
+    if (GetFullPathNameA(g_Config.TracePath, MAX_PATH, tracePath, NULL) == 0)
+    {
+        return -1;
+    }
+    g_Config.TracePath = tracePath;
+
+    if (!CreateDirectoryA(g_Config.Directory, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        fprintf(stderr, "Cannot create %s: %lu\r\n", g_Config.Directory, GetLastError());
+        return -1;
+    }
+    if (!SetCurrentDirectoryA(g_Config.Directory))
+    {
+        fprintf(stderr, "Cannot use %s as the application directory: %lu\r\n", g_Config.Directory, GetLastError());
+        return -1;
+    }
+
+    if (!LoadTrace() || !PrepareTrace())
+    {
+        return -1;
+    }
+    fprintf(stderr, "Replaying %zu commands of %zu users on %lu threads (%zu skipped), %s pacing\r\n",
+            g_ItemCount, g_UserCount, g_LaneCount, g_SkippedCount, g_Config.Fast ? "fast" : "original");
+
+    QueryPerformanceFrequency(&g_Frequency);
+    if (!NT_SUCCESS(SafeStorageInit()))
+    {
+        return -1;
+    }
+    if (!NT_SUCCESS(SafeStorageConfigureIoBackend(g_Config.Backend, NULL)))
+    {
+        SafeStorageDeinit();
+        return -1;
+    }
+
+    // Synthetic users would clash with those of an earlier replay
+    IO_FILE_INFO info = { 0 };
+    bool ready = !IoQueryFileInfo("users.txt", &info) && IoCreateDirectories("replay");
+    if (!ready)
+    {
+        fprintf(stderr, "%s is not an empty scratch directory.\r\n", g_Config.Directory);
+    }
+
+    for (DWORD i = 0; ready && i < g_LaneCount; i++)
+    {
+        REPLAY_LANE* lane = &g_Lanes[i];
+        lane->Index = i;
+        lane->Buffer = (BYTE*)malloc(REPLAY_IO_SIZE);
+        sprintf_s(lane->SourcePath, MAX_PATH, "replay\\source%lu", i);
+        sprintf_s(lane->RetrievedPath, MAX_PATH, "replay\\retrieved%lu", i);
+        sprintf_s(lane->TreePath, MAX_PATH, "replay\\tree%lu", i);
+        sprintf_s(lane->OutputPath, MAX_PATH, "replay\\output%lu", i);
+        ready = lane->Buffer != NULL && IoCreateDirectories(lane->TreePath) && IoCreateDirectories(lane->OutputPath);
+    }
+
+    int result = -1;
+    if (ready && SetUpDirectory())
+    {
+        Replay();
+        PrintReport(MicrosecondsSinceStart() / 1000000.0);
+
+        result = 0;
+        for (size_t i = 0; i < g_ItemCount; i++)
+        {
+            result = NT_SUCCESS(g_Items[i].Status) ? result : 1;
+        }
+    }
+
+    if (g_LoggedIn)
+    {
+        SafeStorageHandleLogout();
+    }
+    for (DWORD i = 0; i < REPLAY_MAX_LANES; i++)
+    {
+        free(g_Lanes[i].Items);
+        free(g_Lanes[i].Buffer);
+    }
+    free(g_Items);
+    free(g_Users);
+    free(g_Preloads);
+    SafeStorageDeinit();
+    return result;
+}
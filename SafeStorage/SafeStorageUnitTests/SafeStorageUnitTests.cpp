@@ -19,6 +19,22 @@ TEST_MODULE_INITIALIZE(UserActivityTestInit)
     {
         std::filesystem::remove_all(".\\users");
     }
+    if (std::filesystem::is_directory(".\\cold"))
+    {
+        std::filesystem::remove_all(".\\cold");
+    }
+    if (std::filesystem::is_regular_file(".\\usage.dat"))
+    {
+        std::filesystem::remove(".\\usage.dat");
+    }
+    if (std::filesystem::is_directory(".\\segments"))
+    {
+        std::filesystem::remove_all(".\\segments");
+    }
+    if (std::filesystem::is_regular_file(".\\transfer_tuning.txt"))
+    {
+        std::filesystem::remove(".\\transfer_tuning.txt");
+    }
     
     Assert::IsTrue(NT_SUCCESS(SafeStorageInit()));
 };
@@ -114,5 +130,1945 @@ TEST_CLASS(UserActivityTest)
         status = SafeStorageHandleLogout();
         Assert::IsTrue(NT_SUCCESS(status));
     };
+
+    TEST_METHOD(FileOverwrite)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserC";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Project";
+        const char submissionFilePath[] = ".\\overwriteData";
+        const char retrievedFilePath[] = ".\\overwriteRetrieved";
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        //
+        // Store a multi-chunk file, then overwrite it with a smaller one.
+        // The submission must end up with exactly the second contents
+        // and no temporary file may be left behind.
+        //
+        {
+            std::ofstream first(submissionFilePath, std::ios::binary);
+            for (int i = 0; i < 5 * CHUNK_SIZE + 17; i++)
+            {
+                first.put(static_cast<char>(i % 251));
+            }
+        }
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserC\\Project") == 5 * CHUNK_SIZE + 17);
+
+        {
+            std::ofstream second(submissionFilePath, std::ios::binary | std::ios::trunc);
+            second << "second version";
+        }
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserC\\Project~partial"));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+        Assert::AreEqual(std::string("second version"), contents);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(ColdTierPromotion)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserD";
+        const char password[] = "PassWord1@";
+        const char coldDirectory[] = ".\\cold";
+
+        const char submissionName[] = "Archive";
+        const char submissionFilePath[] = ".\\coldData";
+        const char retrievedFilePath[] = ".\\coldRetrieved";
+
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary);
+            data << "rarely accessed content";
+        }
+
+        // A day-long threshold keeps the migrator itself idle during the test
+        status = SafeStorageConfigureColdTier(coldDirectory,
+                                              static_cast<uint16_t>(strlen(coldDirectory)),
+                                              24 * 60 * 60,
+                                              1024 * 1024,
+                                              FALSE);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        //
+        // Move the submission to the cold tier the way the migrator would.
+        // Retrieve must promote it back to the hot tier transparently.
+        //
+        std::filesystem::create_directories(".\\cold\\users\\UserD");
+        std::filesystem::rename(".\\users\\UserD\\Archive", ".\\cold\\users\\UserD\\Archive");
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(std::filesystem::is_regular_file(".\\users\\UserD\\Archive"));
+        Assert::IsFalse(std::filesystem::exists(".\\cold\\users\\UserD\\Archive"));
+        Assert::IsTrue(std::filesystem::file_size(retrievedFilePath) == std::filesystem::file_size(submissionFilePath));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(GroupCommitConcurrentRegister)
+    {
+        const char password[] = "PassWord1@";
+        const std::vector<std::string> usernames = { "GroupA", "GroupB", "GroupC", "GroupD",
+                                                     "GroupE", "GroupF", "GroupG", "GroupH" };
+
+        Assert::IsTrue(NT_SUCCESS(SafeStorageSetDurabilityMode(SS_DURABILITY_GROUP_COMMIT)));
+
+        //
+        // Concurrent registrations share the flushes of users.txt,
+        // but every caller must still see its own entry committed.
+        //
+        std::vector<NTSTATUS> results(usernames.size(), STATUS_UNSUCCESSFUL);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < usernames.size(); i++)
+        {
+            workers.emplace_back([&, i]() {
+                results[i] = SafeStorageHandleRegister(usernames[i].c_str(),
+                                                       static_cast<uint16_t>(usernames[i].size()),
+                                                       password,
+                                                       static_cast<uint16_t>(strlen(password)));
+            });
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+
+        Assert::IsTrue(NT_SUCCESS(SafeStorageSetDurabilityMode(SS_DURABILITY_NONE)));
+
+        for (size_t i = 0; i < usernames.size(); i++)
+        {
+            Assert::IsTrue(NT_SUCCESS(results[i]));
+            Assert::IsTrue(std::filesystem::is_directory(".\\users\\" + usernames[i]));
+        }
+    };
+
+    TEST_METHOD(ScrubberDetectsCorruption)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserE";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Checked";
+        const char submissionFilePath[] = ".\\scrubData";
+        const std::filesystem::path storedPath = ".\\users\\UserE\\Checked";
+
+        {
+            // Three manifest blocks
+            std::ofstream data(submissionFilePath, std::ios::binary);
+            data << std::string(3 * CHUNK_SIZE, 'S');
+        }
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(std::filesystem::is_regular_file(".\\users\\UserE\\Checked~manifest"));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        //
+        // Flip a byte in the middle block behind the library's back, keeping the
+        // last write time so the manifest still claims to describe the file.
+        //
+        const auto lastWriteTime = std::filesystem::last_write_time(storedPath);
+        {
+            std::fstream stored(storedPath, std::ios::binary | std::ios::in | std::ios::out);
+            stored.seekp(CHUNK_SIZE + 7);
+            stored.put('X');
+        }
+        std::filesystem::last_write_time(storedPath, lastWriteTime);
+
+        SafeStorageScrubStats before = { 0 };
+        Assert::IsTrue(NT_SUCCESS(SafeStorageGetScrubStats(&before)));
+
+        // Reconfiguring starts a pass right away
+        Assert::IsTrue(NT_SUCCESS(SafeStorageConfigureScrubber(0, 24 * 60 * 60)));
+
+        SafeStorageScrubStats after = before;
+        for (int i = 0; i < 100 && after.Passes == before.Passes; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            Assert::IsTrue(NT_SUCCESS(SafeStorageGetScrubStats(&after)));
+        }
+
+        Assert::IsTrue(after.Passes > before.Passes);
+        Assert::IsTrue(after.CorruptSubmissions >= 1);
+        Assert::IsTrue(after.CorruptBlocks >= 1);
+        Assert::IsTrue(std::filesystem::is_regular_file(".\\scrub_report.txt"));
+    };
+
+    TEST_METHOD(InteractiveRetrieveDuringBulkStore)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserF";
+        const char password[] = "PassWord1@";
+
+        const char bulkName[] = "Bulk";
+        const char bulkFilePath[] = ".\\bulkData";
+        const char smallName[] = "Small";
+        const char smallFilePath[] = ".\\smallData";
+        const char retrievedFilePath[] = ".\\smallRetrieved";
+
+        {
+            std::ofstream bulk(bulkFilePath, std::ios::binary);
+            bulk << std::string(64 * 1024 * 1024, 'B');
+
+            std::ofstream small(smallFilePath, std::ios::binary);
+            small << std::string(CHUNK_SIZE + 1, 's');
+        }
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(smallName,
+                                        static_cast<uint16_t>(strlen(smallName)),
+                                        smallFilePath,
+                                        static_cast<uint16_t>(strlen(smallFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        //
+        // The small retrieve is interactive and must be able to complete
+        // while the bulk store keeps every I/O slot busy.
+        //
+        NTSTATUS bulkStatus = STATUS_UNSUCCESSFUL;
+        std::thread bulkStore([&]() {
+            bulkStatus = SafeStorageHandleStore(bulkName,
+                                                static_cast<uint16_t>(strlen(bulkName)),
+                                                bulkFilePath,
+                                                static_cast<uint16_t>(strlen(bulkFilePath)));
+        });
+
+        status = SafeStorageHandleRetrieve(smallName,
+                                           static_cast<uint16_t>(strlen(smallName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        bulkStore.join();
+
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(NT_SUCCESS(bulkStatus));
+        Assert::IsTrue(std::filesystem::file_size(retrievedFilePath) == std::filesystem::file_size(smallFilePath));
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserF\\Bulk") == std::filesystem::file_size(bulkFilePath));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(ThreadPoolResize)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserG";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Pooled";
+        const char submissionFilePath[] = ".\\pooledData";
+        const char retrievedFilePath[] = ".\\pooledRetrieved";
+
+        std::string content;
+        for (int i = 0; i < 37 * CHUNK_SIZE / 16; i++)
+        {
+            content += "0123456789abcde" + std::string(1, static_cast<char>('a' + i % 26));
+        }
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary);
+            data << content;
+        }
+
+        Assert::IsFalse(NT_SUCCESS(SafeStorageConfigureThreadPool(1000, FALSE)));
+        Assert::IsTrue(NT_SUCCESS(SafeStorageConfigureThreadPool(2, TRUE)));
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Every chunk ran as a separate pool task and landed at its own offset
+        std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+        std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+        Assert::IsTrue(retrievedContent == content);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        Assert::IsTrue(NT_SUCCESS(SafeStorageConfigureThreadPool(0, FALSE)));
+    };
+
+    TEST_METHOD(DeltaRetrieve)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserH";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Delta";
+        const char submissionFilePath[] = ".\\deltaData";
+        const char retrievedFilePath[] = ".\\deltaRetrieved";
+
+        std::string content(4 * CHUNK_SIZE + 100, 'D');
+        content[2 * CHUNK_SIZE + 5] = 'x';
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary);
+            data << content;
+        }
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        //
+        // A stale copy: one block changed and a longer tail.
+        // The delta retrieve must fix the block and truncate the tail.
+        //
+        {
+            std::string stale = content + std::string(3 * CHUNK_SIZE, 'T');
+            stale[CHUNK_SIZE + 1] = 'y';
+            std::ofstream destination(retrievedFilePath, std::ios::binary);
+            destination << stale;
+        }
+
+        status = SafeStorageHandleRetrieveDelta(submissionName,
+                                                static_cast<uint16_t>(strlen(submissionName)),
+                                                retrievedFilePath,
+                                                static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        {
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == content);
+        }
+
+        // Without an existing destination the delta retrieve is a plain retrieve
+        std::filesystem::remove(retrievedFilePath);
+        status = SafeStorageHandleRetrieveDelta(submissionName,
+                                                static_cast<uint16_t>(strlen(submissionName)),
+                                                retrievedFilePath,
+                                                static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(std::filesystem::file_size(retrievedFilePath) == content.size());
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(VersionsAndSnapshots)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserI";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Versioned";
+        const char firstFilePath[] = ".\\versionOne";
+        const char secondFilePath[] = ".\\versionTwo";
+        const char thirdFilePath[] = ".\\versionThree";
+        const char retrievedFilePath[] = ".\\versionRetrieved";
+
+        // Each version changes one block of the previous one
+        std::string first(4 * CHUNK_SIZE + 10, 'V');
+        std::string second = first;
+        second[CHUNK_SIZE + 3] = 'w';
+        std::string third = second + "tail";
+        third[3 * CHUNK_SIZE] = 'z';
+
+        const std::pair<const char*, const std::string*> sources[] = {
+            { firstFilePath, &first }, { secondFilePath, &second }, { thirdFilePath, &third }
+        };
+        for (const auto& source : sources)
+        {
+            std::ofstream data(source.first, std::ios::binary);
+            data << *source.second;
+        }
+
+        auto readRetrieved = [&]()
+        {
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            return std::string((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+        };
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        for (const char* sourcePath : { firstFilePath, secondFilePath })
+        {
+            status = SafeStorageHandleStore(submissionName,
+                                            static_cast<uint16_t>(strlen(submissionName)),
+                                            sourcePath,
+                                            static_cast<uint16_t>(strlen(sourcePath)));
+            Assert::IsTrue(NT_SUCCESS(status));
+        }
+
+        status = SafeStorageHandleRetrieveVersion(submissionName,
+                                                  static_cast<uint16_t>(strlen(submissionName)),
+                                                  retrievedFilePath,
+                                                  static_cast<uint16_t>(strlen(retrievedFilePath)),
+                                                  1);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(readRetrieved() == first);
+
+        //
+        // The snapshot freezes version 2; a third store must not change what it returns.
+        //
+        uint32_t snapshotId = 0;
+        status = SafeStorageHandleSnapshot(&snapshotId);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(snapshotId != 0);
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        thirdFilePath,
+                                        static_cast<uint16_t>(strlen(thirdFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieveSnapshot(submissionName,
+                                                   static_cast<uint16_t>(strlen(submissionName)),
+                                                   retrievedFilePath,
+                                                   static_cast<uint16_t>(strlen(retrievedFilePath)),
+                                                   snapshotId);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(readRetrieved() == second);
+
+        status = SafeStorageHandleRetrieveVersion(submissionName,
+                                                  static_cast<uint16_t>(strlen(submissionName)),
+                                                  retrievedFilePath,
+                                                  static_cast<uint16_t>(strlen(retrievedFilePath)),
+                                                  0);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(readRetrieved() == third);
+
+        //
+        // Keeping only the current version prunes version 1 but not version 2, which the snapshot pins.
+        //
+        Assert::IsTrue(NT_SUCCESS(SafeStorageSetRetention(1, 0)));
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        thirdFilePath,
+                                        static_cast<uint16_t>(strlen(thirdFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(NT_SUCCESS(SafeStorageSetRetention(0, 0)));
+
+        status = SafeStorageHandleRetrieveVersion(submissionName,
+                                                  static_cast<uint16_t>(strlen(submissionName)),
+                                                  retrievedFilePath,
+                                                  static_cast<uint16_t>(strlen(retrievedFilePath)),
+                                                  1);
+        Assert::IsTrue(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+        status = SafeStorageHandleRetrieveVersion(submissionName,
+                                                  static_cast<uint16_t>(strlen(submissionName)),
+                                                  retrievedFilePath,
+                                                  static_cast<uint16_t>(strlen(retrievedFilePath)),
+                                                  2);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(readRetrieved() == second);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(SparseFileTransfer)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserJ";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Sparse";
+        const char submissionFilePath[] = ".\\sparseData";
+        const char retrievedFilePath[] = ".\\sparseRetrieved";
+
+        //
+        // 64 MB logical size with two small data regions; the rest is holes.
+        //
+        const LONGLONG logicalSize = 1024LL * CHUNK_SIZE;
+        const std::string firstData(100, 'a');
+        const std::string secondData(CHUNK_SIZE + 7, 'b');
+        const LONGLONG secondOffset = 700LL * CHUNK_SIZE + 3;
+        {
+            HANDLE file = CreateFileA(submissionFilePath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            Assert::IsTrue(file != INVALID_HANDLE_VALUE);
+
+            DWORD returned = 0;
+            DWORD written = 0;
+            LARGE_INTEGER position = { 0 };
+            Assert::IsTrue(DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL) != FALSE);
+
+            position.QuadPart = logicalSize;
+            Assert::IsTrue(SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file));
+
+            position.QuadPart = 0;
+            Assert::IsTrue(SetFilePointerEx(file, position, NULL, FILE_BEGIN));
+            Assert::IsTrue(WriteFile(file, firstData.data(), static_cast<DWORD>(firstData.size()), &written, NULL) != FALSE);
+
+            position.QuadPart = secondOffset;
+            Assert::IsTrue(SetFilePointerEx(file, position, NULL, FILE_BEGIN));
+            Assert::IsTrue(WriteFile(file, secondData.data(), static_cast<DWORD>(secondData.size()), &written, NULL) != FALSE);
+            CloseHandle(file);
+        }
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Same contents, but the holes were not filled in
+        std::string expected(static_cast<size_t>(logicalSize), '\0');
+        expected.replace(0, firstData.size(), firstData);
+        expected.replace(static_cast<size_t>(secondOffset), secondData.size(), secondData);
+        {
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == expected);
+        }
+
+        Assert::IsTrue((GetFileAttributesA(retrievedFilePath) & FILE_ATTRIBUTE_SPARSE_FILE) != 0);
+        DWORD allocatedHigh = 0;
+        DWORD allocatedLow = GetCompressedFileSizeA(retrievedFilePath, &allocatedHigh);
+        Assert::IsTrue(((static_cast<ULONGLONG>(allocatedHigh) << 32) | allocatedLow) < static_cast<ULONGLONG>(logicalSize) / 4);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(DirectoryTreeStoreRetrieve)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserK";
+        const char password[] = "PassWord1@";
+
+        const char submissionPrefix[] = "project";
+        const char sourceDirectory[] = ".\\treeSource";
+        const char retrievedDirectory[] = ".\\treeRetrieved";
+
+        //
+        // Many small files over two levels of directories, plus one name reserved for internal files.
+        //
+        std::filesystem::remove_all(sourceDirectory);
+        std::filesystem::remove_all(retrievedDirectory);
+        std::filesystem::create_directories(std::string(sourceDirectory) + "\\src\\util");
+        std::filesystem::create_directories(std::string(sourceDirectory) + "\\docs");
+
+        std::vector<std::string> relativePaths;
+        for (int i = 0; i < 20; i++)
+        {
+            relativePaths.push_back("src\\file" + std::to_string(i) + ".c");
+            relativePaths.push_back("src\\util\\helper" + std::to_string(i) + ".h");
+        }
+        relativePaths.push_back("docs\\readme.txt");
+        relativePaths.push_back("top.txt");
+
+        for (const std::string& relativePath : relativePaths)
+        {
+            std::ofstream file(std::string(sourceDirectory) + "\\" + relativePath, std::ios::binary);
+            file << "contents of " << relativePath << std::string(relativePath.size() * 37, 'x');
+        }
+        {
+            std::ofstream file(std::string(sourceDirectory) + "\\src\\bad~name", std::ios::binary);
+            file << "reserved";
+        }
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Everything is stored but the reserved name, which is reported on its own
+        SafeStorageBulkReport report = { 0 };
+        status = SafeStorageHandleStoreTree(submissionPrefix,
+                                            static_cast<uint16_t>(strlen(submissionPrefix)),
+                                            sourceDirectory,
+                                            static_cast<uint16_t>(strlen(sourceDirectory)),
+                                            &report);
+        Assert::IsTrue(status == STATUS_PARTIAL_COPY);
+        Assert::AreEqual(static_cast<uint32_t>(relativePaths.size() + 1), report.ResultCount);
+        Assert::AreEqual(1u, report.FailedCount);
+        for (uint32_t i = 0; i < report.ResultCount; i++)
+        {
+            const bool reserved = strcmp(report.Results[i].RelativePath, "src\\bad~name") == 0;
+            Assert::IsTrue(reserved ? report.Results[i].Status == STATUS_OBJECT_NAME_INVALID : NT_SUCCESS(report.Results[i].Status));
+        }
+        SafeStorageFreeBulkReport(&report);
+
+        // The tree comes back as it was, without manifests or other internal files
+        status = SafeStorageHandleRetrieveTree(submissionPrefix,
+                                               static_cast<uint16_t>(strlen(submissionPrefix)),
+                                               retrievedDirectory,
+                                               static_cast<uint16_t>(strlen(retrievedDirectory)),
+                                               &report);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint32_t>(relativePaths.size()), report.ResultCount);
+        Assert::AreEqual(0u, report.FailedCount);
+        SafeStorageFreeBulkReport(&report);
+
+        for (const std::string& relativePath : relativePaths)
+        {
+            std::ifstream source(std::string(sourceDirectory) + "\\" + relativePath, std::ios::binary);
+            std::ifstream retrieved(std::string(retrievedDirectory) + "\\" + relativePath, std::ios::binary);
+            std::string sourceContent((std::istreambuf_iterator<char>(source)), std::istreambuf_iterator<char>());
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(!sourceContent.empty() && sourceContent == retrievedContent);
+        }
+
+        // Submissions of the tree can also be retrieved one by one
+        const char nestedName[] = "project/src/util/helper3.h";
+        const char nestedFilePath[] = ".\\treeHelper3";
+        status = SafeStorageHandleRetrieve(nestedName,
+                                           static_cast<uint16_t>(strlen(nestedName)),
+                                           nestedFilePath,
+                                           static_cast<uint16_t>(strlen(nestedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(StripedStoreRetrieve)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserL";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Striped";
+        const char submissionFilePath[] = ".\\stripedData";
+        const char retrievedFilePath[] = ".\\stripedRetrieved";
+
+        //
+        // Two extra data roots; with %APPDIR% every third chunk lands on the same root.
+        //
+        const std::string firstRoot = std::filesystem::absolute(".\\dataRoot1").string();
+        const std::string secondRoot = std::filesystem::absolute(".\\dataRoot2").string();
+        std::filesystem::remove_all(firstRoot);
+        std::filesystem::remove_all(secondRoot);
+        const char* dataRoots[] = { firstRoot.c_str(), secondRoot.c_str() };
+
+        status = SafeStorageConfigureDataRoots(dataRoots, 2, 0);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        auto writeSource = [&](char seed)
+        {
+            std::string content;
+            for (size_t i = 0; i < 40 * CHUNK_SIZE + 123; i++)
+            {
+                content.push_back(static_cast<char>(seed + i * 7 + i / CHUNK_SIZE));
+            }
+            std::ofstream file(submissionFilePath, std::ios::binary);
+            file << content;
+            return content;
+        };
+        auto countStripes = [&](const std::string& root)
+        {
+            size_t count = 0;
+            for (const auto& entry : std::filesystem::directory_iterator(root + "\\users\\" + username))
+            {
+                count += entry.path().filename().string().rfind(std::string(submissionName) + "~", 0) == 0 ? 1 : 0;
+            }
+            return count;
+        };
+        auto retrieveAndCompare = [&](const std::string& expected)
+        {
+            NTSTATUS result = SafeStorageHandleRetrieve(submissionName,
+                                                        static_cast<uint16_t>(strlen(submissionName)),
+                                                        retrievedFilePath,
+                                                        static_cast<uint16_t>(strlen(retrievedFilePath)));
+            Assert::IsTrue(NT_SUCCESS(result));
+
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == expected);
+        };
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        const std::string firstContent = writeSource('a');
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // The submission keeps its full size in %APPDIR%, next to its layout; each root has one stripe
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserL\\Striped") == firstContent.size());
+        Assert::IsTrue(std::filesystem::is_regular_file(".\\users\\UserL\\Striped~stripes"));
+        Assert::AreEqual(static_cast<size_t>(1), countStripes(firstRoot));
+        Assert::AreEqual(static_cast<size_t>(1), countStripes(secondRoot));
+        retrieveAndCompare(firstContent);
+
+        // Storing again replaces the stripes rather than adding to them
+        const std::string secondContent = writeSource('k');
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<size_t>(1), countStripes(firstRoot));
+        Assert::AreEqual(static_cast<size_t>(1), countStripes(secondRoot));
+        retrieveAndCompare(secondContent);
+
+        // Without data roots new stores are no longer striped, but existing submissions stay readable
+        status = SafeStorageConfigureDataRoots(nullptr, 0, 0);
+        Assert::IsTrue(NT_SUCCESS(status));
+        retrieveAndCompare(secondContent);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(CachedRetrieve)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserM";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Cached";
+        const char submissionFilePath[] = ".\\cachedData";
+        const char retrievedFilePath[] = ".\\cachedRetrieved";
+
+        status = SafeStorageConfigureCache(64 * 1024 * 1024, 0);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        auto storeContent = [&](const std::string& content)
+        {
+            {
+                std::ofstream file(submissionFilePath, std::ios::binary);
+                file << content;
+            }
+            NTSTATUS result = SafeStorageHandleStore(submissionName,
+                                                     static_cast<uint16_t>(strlen(submissionName)),
+                                                     submissionFilePath,
+                                                     static_cast<uint16_t>(strlen(submissionFilePath)));
+            Assert::IsTrue(NT_SUCCESS(result));
+        };
+        auto retrieveAndCompare = [&](const std::string& expected)
+        {
+            std::filesystem::remove(retrievedFilePath);
+            NTSTATUS result = SafeStorageHandleRetrieve(submissionName,
+                                                        static_cast<uint16_t>(strlen(submissionName)),
+                                                        retrievedFilePath,
+                                                        static_cast<uint16_t>(strlen(retrievedFilePath)));
+            Assert::IsTrue(NT_SUCCESS(result));
+
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == expected);
+        };
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        const std::string firstContent(3 * CHUNK_SIZE + 17, 'c');
+        storeContent(firstContent);
+
+        // The first retrieve reads the submission, the next ones are served from memory
+        retrieveAndCompare(firstContent);
+        retrieveAndCompare(firstContent);
+        retrieveAndCompare(firstContent);
+
+        SafeStorageCacheStats stats = { 0 };
+        status = SafeStorageGetCacheStats(&stats);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(1), stats.Misses);
+        Assert::AreEqual(static_cast<uint64_t>(2), stats.Hits);
+        Assert::AreEqual(static_cast<uint64_t>(1), stats.EntryCount);
+        Assert::AreEqual(static_cast<uint64_t>(firstContent.size()), stats.BytesCached);
+
+        // Storing again drops the cached copy
+        const std::string secondContent(CHUNK_SIZE + 5, 'd');
+        storeContent(secondContent);
+        retrieveAndCompare(secondContent);
+
+        status = SafeStorageGetCacheStats(&stats);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(2), stats.Misses);
+        Assert::AreEqual(static_cast<uint64_t>(1), stats.Invalidations);
+
+        status = SafeStorageConfigureCache(0, 0);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(MemoryBackend)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserN";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "InMemory";
+        const char submissionFilePath[] = ".\\memoryData";
+        const char retrievedFilePath[] = ".\\memoryRetrieved";
+
+        // Every disk operation of the memory backend takes 200 us
+        SafeStorageDiskSimulation simulation = { 200, 0, 0 };
+        status = SafeStorageConfigureIoBackend(SS_IO_BACKEND_MEMORY, &simulation);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // The source has to exist in the backend
+        const std::string content(5 * CHUNK_SIZE + 3, 'm');
+        Assert::IsTrue(IoWriteFileContents(submissionFilePath, content.data(), content.size()));
+
+        auto start = std::chrono::steady_clock::now();
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        char* retrieved = nullptr;
+        size_t retrievedLength = 0;
+        Assert::IsTrue(IoReadFileContents(retrievedFilePath, &retrieved, &retrievedLength));
+        const std::string retrievedContent(retrieved, retrievedLength);
+        free(retrieved);
+        Assert::IsTrue(retrievedContent == content);
+
+        // Nothing reached the disk, and the simulated latency was paid for every open, read and write
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserN"));
+        Assert::IsFalse(std::filesystem::exists(submissionFilePath));
+        Assert::IsFalse(std::filesystem::exists(retrievedFilePath));
+        Assert::IsTrue(elapsed >= std::chrono::microseconds(10 * 200));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageConfigureIoBackend(SS_IO_BACKEND_OS, nullptr);
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(WatchedDirectorySync)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserO";
+        const char password[] = "PassWord1@";
+
+        const char submissionPrefix[] = "watched";
+        const char watchedDirectory[] = ".\\watchSource";
+        const char retrievedFilePath[] = ".\\watchRetrieved";
+        const int fileCount = 50;
+        const int saveCount = 20;
+
+        std::filesystem::remove_all(watchedDirectory);
+        std::filesystem::create_directories(std::string(watchedDirectory) + "\\notes");
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageStartWatch(submissionPrefix,
+                                       static_cast<uint16_t>(strlen(submissionPrefix)),
+                                       watchedDirectory,
+                                       static_cast<uint16_t>(strlen(watchedDirectory)),
+                                       200);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Only one directory at a time
+        status = SafeStorageStartWatch(submissionPrefix,
+                                       static_cast<uint16_t>(strlen(submissionPrefix)),
+                                       watchedDirectory,
+                                       static_cast<uint16_t>(strlen(watchedDirectory)),
+                                       200);
+        Assert::IsTrue(status == STATUS_DEVICE_BUSY);
+
+        //
+        // A burst of saves: every file is rewritten many times, and a name reserved for internal files is ignored.
+        //
+        for (int save = 0; save < saveCount; save++)
+        {
+            for (int i = 0; i < fileCount; i++)
+            {
+                std::ofstream file(std::string(watchedDirectory) + "\\notes\\note" + std::to_string(i) + ".txt", std::ios::binary | std::ios::trunc);
+                file << "note " << i << " revision " << save << std::string(100 + i, 'w');
+            }
+        }
+        {
+            std::ofstream file(std::string(watchedDirectory) + "\\notes\\scratch~tmp", std::ios::binary);
+            file << "internal";
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+        // Stopping stores whatever is still pending
+        status = SafeStorageStopWatch();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // The saves were coalesced into a few batches, each file stored at least once
+        SafeStorageWatchStats stats = { 0 };
+        status = SafeStorageGetWatchStats(&stats);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(stats.Events > 0);
+        Assert::IsTrue(stats.Batches >= 1 && stats.Batches <= 10);
+        Assert::IsTrue(stats.FilesStored >= static_cast<uint64_t>(fileCount));
+        Assert::IsTrue(stats.FilesStored < static_cast<uint64_t>(fileCount * saveCount));
+        Assert::AreEqual(static_cast<uint64_t>(0), stats.FilesFailed);
+
+        // Every submission holds the last save
+        for (int i = 0; i < fileCount; i += 7)
+        {
+            const std::string submissionName = "watched\\notes\\note" + std::to_string(i) + ".txt";
+            status = SafeStorageHandleRetrieve(submissionName.c_str(),
+                                               static_cast<uint16_t>(submissionName.size()),
+                                               retrievedFilePath,
+                                               static_cast<uint16_t>(strlen(retrievedFilePath)));
+            Assert::IsTrue(NT_SUCCESS(status));
+
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == "note " + std::to_string(i) + " revision " + std::to_string(saveCount - 1) + std::string(100 + i, 'w'));
+        }
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserO\\watched\\notes\\scratch~tmp"));
+
+        //
+        // Saving a file without changing it stores nothing.
+        //
+        status = SafeStorageStartWatch(submissionPrefix,
+                                       static_cast<uint16_t>(strlen(submissionPrefix)),
+                                       watchedDirectory,
+                                       static_cast<uint16_t>(strlen(watchedDirectory)),
+                                       200);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        {
+            std::ofstream file(std::string(watchedDirectory) + "\\notes\\note3.txt", std::ios::binary | std::ios::trunc);
+            file << "note " << 3 << " revision " << (saveCount - 1) << std::string(100 + 3, 'w');
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+        status = SafeStorageStopWatch();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageGetWatchStats(&stats);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(0), stats.FilesStored);
+        Assert::AreEqual(static_cast<uint64_t>(1), stats.FilesUnchanged);
+
+        //
+        // A file changed in one block and extended is stored again with its new contents.
+        //
+        const std::string largePath = std::string(watchedDirectory) + "\\large.bin";
+        const std::string largeSubmissionName = "watched\\large.bin";
+        std::string large(3 * CHUNK_SIZE + 100, 'l');
+
+        status = SafeStorageStartWatch(submissionPrefix,
+                                       static_cast<uint16_t>(strlen(submissionPrefix)),
+                                       watchedDirectory,
+                                       static_cast<uint16_t>(strlen(watchedDirectory)),
+                                       200);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        {
+            std::ofstream file(largePath, std::ios::binary | std::ios::trunc);
+            file << large;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+        large[CHUNK_SIZE + 5] = 'x';
+        large += "tail";
+        {
+            std::ofstream file(largePath, std::ios::binary | std::ios::trunc);
+            file << large;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+        status = SafeStorageStopWatch();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageGetWatchStats(&stats);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(0), stats.FilesFailed);
+
+        status = SafeStorageHandleRetrieve(largeSubmissionName.c_str(),
+                                           static_cast<uint16_t>(largeSubmissionName.size()),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        {
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == large);
+        }
+
+        status = SafeStorageStopWatch();
+        Assert::IsTrue(status == STATUS_INVALID_DEVICE_STATE);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(SubmissionView)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserP";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Mapped";
+        const char emptySubmissionName[] = "MappedEmpty";
+        const char missingSubmissionName[] = "NotStored";
+        const char submissionFilePath[] = ".\\mappedData";
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        std::string content(3 * CHUNK_SIZE + 17, '\0');
+        for (size_t i = 0; i < content.size(); i++)
+        {
+            content[i] = static_cast<char>('a' + (i * 7) % 26);
+        }
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary | std::ios::trunc);
+            data << content;
+        }
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // The contents are readable in place, for either access pattern
+        SafeStorageView view = { 0 };
+        const SafeStorageAccessPattern patterns[] = { SS_ACCESS_SEQUENTIAL, SS_ACCESS_RANDOM };
+        for (SafeStorageAccessPattern pattern : patterns)
+        {
+            status = SafeStorageOpenView(submissionName, static_cast<uint16_t>(strlen(submissionName)), pattern, &view);
+            Assert::IsTrue(NT_SUCCESS(status));
+            Assert::AreEqual(static_cast<uint64_t>(content.size()), view.Length);
+            Assert::IsTrue(view.Data != nullptr && memcmp(view.Data, content.data(), content.size()) == 0);
+
+            SafeStorageCloseView(&view);
+            Assert::IsTrue(view.Data == nullptr && view.Reserved == nullptr);
+        }
+
+        // Once the view is closed the submission can be replaced, and a new view sees the new contents
+        content.assign(CHUNK_SIZE / 2, 'z');
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary | std::ios::trunc);
+            data << content;
+        }
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageOpenView(submissionName, static_cast<uint16_t>(strlen(submissionName)), SS_ACCESS_NORMAL, &view);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(content.size()), view.Length);
+        Assert::IsTrue(memcmp(view.Data, content.data(), content.size()) == 0);
+        SafeStorageCloseView(&view);
+
+        // An empty submission has no memory to map
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary | std::ios::trunc);
+        }
+        status = SafeStorageHandleStore(emptySubmissionName,
+                                        static_cast<uint16_t>(strlen(emptySubmissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageOpenView(emptySubmissionName, static_cast<uint16_t>(strlen(emptySubmissionName)), SS_ACCESS_NORMAL, &view);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(0), view.Length);
+        Assert::IsTrue(view.Data == nullptr);
+        SafeStorageCloseView(&view);
+
+        status = SafeStorageOpenView(missingSubmissionName, static_cast<uint16_t>(strlen(missingSubmissionName)), SS_ACCESS_NORMAL, &view);
+        Assert::IsTrue(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(StreamedStore)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserQ";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Dump";
+        const char retrievedFilePath[] = ".\\dumpRetrieved";
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Longer than the read-ahead buffers, handed out in odd-sized pieces like a pipe would
+        struct Producer
+        {
+            std::string Data;
+            size_t Offset;
+            bool FailAtEnd;
+        };
+        std::string content(40 * CHUNK_SIZE + 123, '\0');
+        for (size_t i = 0; i < content.size(); i++)
+        {
+            content[i] = static_cast<char>((i * 31 + i / CHUNK_SIZE) % 256);
+        }
+        SafeStorageReadRoutine produce = [](void* context, void* buffer, uint32_t length, uint32_t* bytesRead) -> BOOLEAN
+        {
+            Producer* producer = static_cast<Producer*>(context);
+            size_t count = producer->Data.size() - producer->Offset;
+            count = (count < length) ? count : length;
+            count = (count < 1000) ? count : 1000;
+            memcpy(buffer, producer->Data.data() + producer->Offset, count);
+            producer->Offset += count;
+            *bytesRead = static_cast<uint32_t>(count);
+            return (count == 0 && producer->FailAtEnd) ? FALSE : TRUE;
+        };
+
+        Producer producer = { content, 0, false };
+        status = SafeStorageHandleStoreStream(submissionName, static_cast<uint16_t>(strlen(submissionName)), produce, &producer);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserQ\\Dump~partial"));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        {
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string contents((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(contents == content);
+        }
+
+        // A stream that fails part way leaves the stored submission as it was
+        Producer failing = { std::string(3 * CHUNK_SIZE, 'x'), 0, true };
+        status = SafeStorageHandleStoreStream(submissionName, static_cast<uint16_t>(strlen(submissionName)), produce, &failing);
+        Assert::IsFalse(NT_SUCCESS(status));
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserQ\\Dump") == content.size());
+
+        // The read end of a pipe is stored until the writer closes it
+        HANDLE readEnd = NULL;
+        HANDLE writeEnd = NULL;
+        Assert::IsTrue(CreatePipe(&readEnd, &writeEnd, NULL, 0) != FALSE);
+        std::string piped(2 * CHUNK_SIZE + 5, 'p');
+        std::thread writer([&]()
+        {
+            DWORD written = 0;
+            WriteFile(writeEnd, piped.data(), static_cast<DWORD>(piped.size()), &written, NULL);
+            CloseHandle(writeEnd);
+        });
+        status = SafeStorageHandleStoreFromHandle(submissionName, static_cast<uint16_t>(strlen(submissionName)), readEnd);
+        writer.join();
+        CloseHandle(readEnd);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        {
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string contents((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(contents == piped);
+        }
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(UsageAndQuota)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserR";
+        const char password[] = "PassWord1@";
+
+        const char firstSubmissionName[] = "First";
+        const char secondSubmissionName[] = "Second";
+        const char thirdSubmissionName[] = "Third";
+        const char submissionFilePath[] = ".\\quotaData";
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        auto store = [&](const char* submissionName, size_t size, char fill = 'q') -> NTSTATUS
+        {
+            {
+                std::ofstream data(submissionFilePath, std::ios::binary | std::ios::trunc);
+                data << std::string(size, fill);
+            }
+            return SafeStorageHandleStore(submissionName,
+                                          static_cast<uint16_t>(strlen(submissionName)),
+                                          submissionFilePath,
+                                          static_cast<uint16_t>(strlen(submissionFilePath)));
+        };
+        auto usage = [&]() -> SafeStorageUsage
+        {
+            SafeStorageUsage current = { 0 };
+            Assert::IsTrue(NT_SUCCESS(SafeStorageGetUsage(username, static_cast<uint16_t>(strlen(username)), &current)));
+            return current;
+        };
+
+        // Nothing is recorded before the first store, and looking does not record anything
+        SafeStorageUsage none = { 0 };
+        Assert::IsTrue(SafeStorageGetUsage(username, static_cast<uint16_t>(strlen(username)), &none) == STATUS_NOT_FOUND);
+        Assert::IsTrue(SafeStorageGetUsage(username, static_cast<uint16_t>(strlen(username)), &none) == STATUS_NOT_FOUND);
+
+        // Stores add their size, overwrites only the difference plus the blocks kept of the replaced version:
+        // its three blocks are identical, so one is kept
+        Assert::IsTrue(NT_SUCCESS(store(firstSubmissionName, 3 * CHUNK_SIZE)));
+        Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), usage().Bytes);
+        Assert::AreEqual(static_cast<uint64_t>(1), usage().Objects);
+
+        Assert::IsTrue(NT_SUCCESS(store(firstSubmissionName, CHUNK_SIZE)));
+        Assert::AreEqual(static_cast<uint64_t>(2 * CHUNK_SIZE), usage().Bytes);
+        Assert::AreEqual(static_cast<uint64_t>(1), usage().Objects);
+
+        // A store beyond the quota is refused before anything is written
+        status = SafeStorageSetQuota(username, static_cast<uint16_t>(strlen(username)), 3 * CHUNK_SIZE, 2);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Nobody can change or read another user's quota
+        const char otherUsername[] = "UserA";
+        status = SafeStorageSetQuota(otherUsername, static_cast<uint16_t>(strlen(otherUsername)), 0, 0);
+        Assert::IsTrue(status == STATUS_ACCESS_DENIED);
+        status = SafeStorageGetUsage(otherUsername, static_cast<uint16_t>(strlen(otherUsername)), &none);
+        Assert::IsTrue(status == STATUS_ACCESS_DENIED);
+
+        Assert::IsTrue(store(secondSubmissionName, 2 * CHUNK_SIZE) == STATUS_QUOTA_EXCEEDED);
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserR\\Second"));
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserR\\Second~partial"));
+        Assert::AreEqual(static_cast<uint64_t>(2 * CHUNK_SIZE), usage().Bytes);
+
+        Assert::IsTrue(NT_SUCCESS(store(secondSubmissionName, CHUNK_SIZE)));
+        Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), usage().Bytes);
+        Assert::AreEqual(static_cast<uint64_t>(2), usage().Objects);
+
+        // Full in objects; and a stream is cut off once it outgrows what is left
+        Assert::IsTrue(store(thirdSubmissionName, 1) == STATUS_QUOTA_EXCEEDED);
+
+        size_t remaining = 2 * CHUNK_SIZE;
+        SafeStorageReadRoutine produce = [](void* context, void* buffer, uint32_t length, uint32_t* bytesRead) -> BOOLEAN
+        {
+            size_t* left = static_cast<size_t*>(context);
+            uint32_t count = (*left < length) ? static_cast<uint32_t>(*left) : length;
+            memset(buffer, 's', count);
+            *left -= count;
+            *bytesRead = count;
+            return TRUE;
+        };
+        status = SafeStorageHandleStoreStream(secondSubmissionName, static_cast<uint16_t>(strlen(secondSubmissionName)), produce, &remaining);
+        Assert::IsTrue(status == STATUS_QUOTA_EXCEEDED);
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserR\\Second") == CHUNK_SIZE);
+        Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), usage().Bytes);
+
+        // The replaced version needs room as well: its block is already kept the first time, not the second
+        Assert::IsTrue(NT_SUCCESS(store(firstSubmissionName, CHUNK_SIZE, 'r')));
+        Assert::IsTrue(store(firstSubmissionName, CHUNK_SIZE, 's') == STATUS_QUOTA_EXCEEDED);
+        Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), usage().Bytes);
+
+        // The report comes from the recorded usage
+        SafeStorageUsageReport report = { 0 };
+        status = SafeStorageGetUsageReport(&report);
+        Assert::IsTrue(NT_SUCCESS(status));
+        bool found = false;
+        for (uint32_t i = 0; i < report.UserCount; i++)
+        {
+            if (strcmp(report.Users[i].Username, username) == 0)
+            {
+                found = true;
+                Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), report.Users[i].Bytes);
+                Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), report.Users[i].QuotaBytes);
+            }
+        }
+        Assert::IsTrue(found && report.TotalBytes >= static_cast<uint64_t>(3 * CHUNK_SIZE));
+        SafeStorageFreeUsageReport(&report);
+
+        status = SafeStorageSetQuota(username, static_cast<uint16_t>(strlen(username)), 0, 0);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Pruned versions give their blocks back; the 'q' block is still one of Second's
+        Assert::IsTrue(NT_SUCCESS(SafeStorageSetRetention(1, 0)));
+        Assert::IsTrue(NT_SUCCESS(store(firstSubmissionName, CHUNK_SIZE, 's')));
+        Assert::IsTrue(NT_SUCCESS(SafeStorageSetRetention(0, 0)));
+        Assert::AreEqual(static_cast<uint64_t>(3 * CHUNK_SIZE), usage().Bytes);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageSetQuota(username, static_cast<uint16_t>(strlen(username)), 1, 1);
+        Assert::IsTrue(status == SS_STATUS_NOT_LOGGED_IN);
+        status = SafeStorageGetUsage(username, static_cast<uint16_t>(strlen(username)), &none);
+        Assert::IsTrue(status == SS_STATUS_NOT_LOGGED_IN);
+    };
+    TEST_METHOD(SegmentEngine)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserS";
+        const char password[] = "PassWord1@";
+
+        const char smallSubmissionName[] = "Small";
+        const char tinySubmissionName[] = "Tiny";
+        const char submissionFilePath[] = ".\\segmentData";
+        const char retrievedFilePath[] = ".\\segmentRetrieved";
+
+        auto store = [&](const char* submissionName, const std::string& content)
+        {
+            {
+                std::ofstream file(submissionFilePath, std::ios::binary | std::ios::trunc);
+                file << content;
+            }
+            NTSTATUS result = SafeStorageHandleStore(submissionName,
+                                                     static_cast<uint16_t>(strlen(submissionName)),
+                                                     submissionFilePath,
+                                                     static_cast<uint16_t>(strlen(submissionFilePath)));
+            Assert::IsTrue(NT_SUCCESS(result));
+        };
+        auto retrieveAndCompare = [&](const char* submissionName, const std::string& expected)
+        {
+            std::filesystem::remove(retrievedFilePath);
+            NTSTATUS result = SafeStorageHandleRetrieve(submissionName,
+                                                        static_cast<uint16_t>(strlen(submissionName)),
+                                                        retrievedFilePath,
+                                                        static_cast<uint16_t>(strlen(retrievedFilePath)));
+            Assert::IsTrue(NT_SUCCESS(result));
+
+            std::ifstream retrieved(retrievedFilePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == expected);
+        };
+        auto stats = [&]() -> SafeStorageSegmentStats
+        {
+            SafeStorageSegmentStats current = { 0 };
+            Assert::IsTrue(NT_SUCCESS(SafeStorageGetSegmentStats(&current)));
+            return current;
+        };
+
+        Assert::IsTrue(SafeStorageConfigureSegments(64 * 1024 * 1024) == STATUS_INVALID_PARAMETER);
+        status = SafeStorageConfigureSegments(CHUNK_SIZE);
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // A small file becomes a record in a segment instead of a file of its own
+        const std::string firstContent(1000, 'a');
+        store(smallSubmissionName, firstContent);
+        Assert::IsFalse(std::filesystem::exists(".\\users\\UserS\\Small"));
+        Assert::IsTrue(std::filesystem::exists(".\\segments\\00000000.seg"));
+        retrieveAndCompare(smallSubmissionName, firstContent);
+
+        SafeStorageSegmentStats before = stats();
+        Assert::AreEqual(static_cast<uint64_t>(1), before.Objects);
+
+        // Overwriting it leaves the old record behind as dead space
+        const std::string secondContent(3000, 'b');
+        store(smallSubmissionName, secondContent);
+        retrieveAndCompare(smallSubmissionName, secondContent);
+
+        SafeStorageSegmentStats after = stats();
+        Assert::AreEqual(static_cast<uint64_t>(1), after.Objects);
+        Assert::IsTrue(after.DeadBytes >= before.LiveBytes);
+
+        // Usage counts the submissions kept in segments
+        SafeStorageUsage usage = { 0 };
+        status = SafeStorageGetUsage(username, static_cast<uint16_t>(strlen(username)), &usage);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(secondContent.size()), usage.Bytes);
+
+        // The index survives a restart of the engine: the checkpoint plus the records appended after it
+        const std::string tinyContent(10, 't');
+        store(tinySubmissionName, tinyContent);
+
+        status = SafeStorageConfigureSegments(0);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(std::filesystem::exists(".\\segments\\index.checkpoint"));
+
+        status = SafeStorageConfigureSegments(CHUNK_SIZE);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(2), stats().Objects);
+        retrieveAndCompare(smallSubmissionName, secondContent);
+        retrieveAndCompare(tinySubmissionName, tinyContent);
+
+        // A file too large for the segments takes the submission out of them
+        const std::string largeContent(2 * CHUNK_SIZE + 3, 'l');
+        store(smallSubmissionName, largeContent);
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserS\\Small") == largeContent.size());
+        Assert::AreEqual(static_cast<uint64_t>(1), stats().Objects);
+        retrieveAndCompare(smallSubmissionName, largeContent);
+
+        // Once it is a file, small stores keep it one
+        store(smallSubmissionName, firstContent);
+        Assert::IsTrue(std::filesystem::file_size(".\\users\\UserS\\Small") == firstContent.size());
+        retrieveAndCompare(smallSubmissionName, firstContent);
+
+        status = SafeStorageConfigureSegments(0);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(static_cast<uint64_t>(0), stats().MaxObjectSize);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(CommandTrace)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserT";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Traced";
+        const char missingSubmissionName[] = "Missing";
+        const char submissionFilePath[] = ".\\traceData";
+        const char retrievedFilePath[] = ".\\traceRetrieved";
+        const char traceFilePath[] = ".\\commands.trace";
+        const std::string content(5000, 'c');
+
+        {
+            std::ofstream file(submissionFilePath, std::ios::binary | std::ios::trunc);
+            file << content;
+        }
+
+        status = SafeStorageStartTrace(traceFilePath, static_cast<uint16_t>(strlen(traceFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(SafeStorageStartTrace(traceFilePath, static_cast<uint16_t>(strlen(traceFilePath))) == STATUS_DEVICE_BUSY);
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleRetrieve(missingSubmissionName,
+                                           static_cast<uint16_t>(strlen(missingSubmissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsFalse(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageStopTrace();
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(SafeStorageStopTrace() == STATUS_INVALID_DEVICE_STATE);
+
+        // A header and one fixed-size record per command, in the order they returned
+        std::ifstream trace(traceFilePath, std::ios::binary);
+        std::string traceContent((std::istreambuf_iterator<char>(trace)), std::istreambuf_iterator<char>());
+        Assert::AreEqual(sizeof(TRACE_HEADER) + 6 * sizeof(TRACE_RECORD), traceContent.size());
+
+        TRACE_HEADER header = { 0 };
+        memcpy(&header, traceContent.data(), sizeof(header));
+        Assert::AreEqual(static_cast<uint32_t>(TRACE_MAGIC), header.Magic);
+        Assert::AreEqual(static_cast<uint32_t>(sizeof(TRACE_RECORD)), header.RecordSize);
+
+        std::vector<TRACE_RECORD> records(6);
+        memcpy(records.data(), traceContent.data() + sizeof(header), records.size() * sizeof(TRACE_RECORD));
+
+        const uint16_t operations[] = { TRACE_OP_REGISTER, TRACE_OP_LOGIN, TRACE_OP_STORE, TRACE_OP_RETRIEVE, TRACE_OP_RETRIEVE, TRACE_OP_LOGOUT };
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            Assert::IsTrue(operations[i] == records[i].Operation);
+            Assert::IsTrue(i == 0 || records[i].StartMicroseconds >= records[i - 1].StartMicroseconds);
+        }
+
+        // Names are hashed, sizes and sessions kept
+        Assert::AreEqual(static_cast<uint32_t>(0), records[0].Session);
+        Assert::AreEqual(static_cast<uint32_t>(1), records[1].Session);
+        Assert::AreEqual(records[0].Target, records[1].Target);
+        Assert::IsTrue(records[1].ArgumentLength == strlen(password));
+        Assert::AreEqual(static_cast<uint64_t>(content.size()), records[2].Bytes);
+        Assert::AreEqual(records[2].Target, records[3].Target);
+        Assert::AreNotEqual(records[3].Target, records[4].Target);
+        Assert::IsTrue(NT_SUCCESS(records[3].Status));
+        Assert::IsFalse(NT_SUCCESS(records[4].Status));
+        Assert::IsTrue(traceContent.find(username) == std::string::npos);
+        Assert::IsTrue(traceContent.find(submissionName) == std::string::npos);
+    };
+
+    TEST_METHOD(TransferTuning)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserU";
+        const char password[] = "PassWord1@";
+
+        const char submissionName[] = "Tuned";
+        const char untunedSubmissionName[] = "Untuned";
+        const char submissionFilePath[] = ".\\tuningData";
+        const char retrievedFilePath[] = ".\\tuningRetrieved";
+
+        // Large enough to probe
+        std::string content(40 * 1024 * 1024, '\0');
+        for (size_t i = 0; i < content.size(); i++)
+        {
+            content[i] = static_cast<char>(i % 251);
+        }
+        {
+            std::ofstream file(submissionFilePath, std::ios::binary | std::ios::trunc);
+            file << content;
+        }
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        SafeStorageTransferTuningStats before = { 0 };
+        Assert::IsTrue(NT_SUCCESS(SafeStorageConfigureTransferTuning(TRUE)));
+        Assert::IsTrue(NT_SUCCESS(SafeStorageGetTransferTuningStats(&before)));
+
+        status = SafeStorageHandleStore(submissionName,
+                                        static_cast<uint16_t>(strlen(submissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // The store probed and remembered what it found for its volumes
+        SafeStorageTransferTuningStats after = { 0 };
+        Assert::IsTrue(NT_SUCCESS(SafeStorageGetTransferTuningStats(&after)));
+        Assert::IsTrue(after.TunedTransfers >= before.TunedTransfers + 1);
+        Assert::IsTrue(after.ProbeBatches >= before.ProbeBatches + 2);
+        Assert::IsTrue(after.Devices >= 1);
+        Assert::IsTrue(after.LastSpanSize >= CHUNK_SIZE && after.LastSpanSize <= AUTOTUNE_MAX_SPAN_CHUNKS * CHUNK_SIZE);
+        Assert::IsTrue(after.LastSpanSize % CHUNK_SIZE == 0);
+        Assert::IsTrue(after.LastDepth >= 1);
+        Assert::IsTrue(std::filesystem::is_regular_file(".\\transfer_tuning.txt"));
+
+        // Whatever the settings, the copy is exact
+        status = SafeStorageHandleRetrieve(submissionName,
+                                           static_cast<uint16_t>(strlen(submissionName)),
+                                           retrievedFilePath,
+                                           static_cast<uint16_t>(strlen(retrievedFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        {
+            std::ifstream file(retrievedFilePath, std::ios::binary);
+            std::string retrieved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrieved == content);
+        }
+
+        // Without tuning nothing is probed
+        Assert::IsTrue(NT_SUCCESS(SafeStorageConfigureTransferTuning(FALSE)));
+        Assert::IsTrue(NT_SUCCESS(SafeStorageGetTransferTuningStats(&before)));
+        status = SafeStorageHandleStore(untunedSubmissionName,
+                                        static_cast<uint16_t>(strlen(untunedSubmissionName)),
+                                        submissionFilePath,
+                                        static_cast<uint16_t>(strlen(submissionFilePath)));
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::IsTrue(NT_SUCCESS(SafeStorageGetTransferTuningStats(&after)));
+        Assert::AreEqual(before.TunedTransfers, after.TunedTransfers);
+        Assert::AreEqual(before.ProbeBatches, after.ProbeBatches);
+        Assert::IsTrue(NT_SUCCESS(SafeStorageConfigureTransferTuning(TRUE)));
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+
+    TEST_METHOD(BulkStoreOverExistingTree)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserV";
+        const char password[] = "PassWord1@";
+
+        const char submissionPrefix[] = "restored";
+        const char sourceDirectory[] = ".\\restoreSource";
+        const char retrievedDirectory[] = ".\\restoreRetrieved";
+
+        // Files of several chunks, so that freezing their current versions runs on the pool too
+        std::filesystem::remove_all(sourceDirectory);
+        std::filesystem::remove_all(retrievedDirectory);
+        std::filesystem::create_directories(std::string(sourceDirectory) + "\\nested");
+
+        std::vector<std::string> relativePaths;
+        for (int i = 0; i < 16; i++)
+        {
+            relativePaths.push_back("file" + std::to_string(i) + ".bin");
+            relativePaths.push_back("nested\\file" + std::to_string(i) + ".bin");
+        }
+
+        auto writeTree = [&](char fill)
+        {
+            for (const std::string& relativePath : relativePaths)
+            {
+                std::ofstream file(std::string(sourceDirectory) + "\\" + relativePath, std::ios::binary | std::ios::trunc);
+                file << relativePath << std::string(3 * CHUNK_SIZE + 100, fill);
+            }
+        };
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Storing the tree again over itself with new contents freezes every current version while
+        // sibling files are being stored on the same pool
+        for (char fill : { 'a', 'b', 'c' })
+        {
+            writeTree(fill);
+
+            SafeStorageBulkReport report = { 0 };
+            status = SafeStorageHandleStoreTree(submissionPrefix,
+                                                static_cast<uint16_t>(strlen(submissionPrefix)),
+                                                sourceDirectory,
+                                                static_cast<uint16_t>(strlen(sourceDirectory)),
+                                                &report);
+            Assert::IsTrue(NT_SUCCESS(status));
+            Assert::AreEqual(static_cast<uint32_t>(relativePaths.size()), report.ResultCount);
+            Assert::AreEqual(0u, report.FailedCount);
+            SafeStorageFreeBulkReport(&report);
+        }
+
+        SafeStorageBulkReport report = { 0 };
+        status = SafeStorageHandleRetrieveTree(submissionPrefix,
+                                               static_cast<uint16_t>(strlen(submissionPrefix)),
+                                               retrievedDirectory,
+                                               static_cast<uint16_t>(strlen(retrievedDirectory)),
+                                               &report);
+        Assert::IsTrue(NT_SUCCESS(status));
+        Assert::AreEqual(0u, report.FailedCount);
+        SafeStorageFreeBulkReport(&report);
+
+        for (const std::string& relativePath : relativePaths)
+        {
+            std::ifstream retrieved(std::string(retrievedDirectory) + "\\" + relativePath, std::ios::binary);
+            std::string retrievedContent((std::istreambuf_iterator<char>(retrieved)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(retrievedContent == relativePath + std::string(3 * CHUNK_SIZE + 100, 'c'));
+        }
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
+    TEST_METHOD(ResumeFromCheckpoint)
+    {
+        NTSTATUS status = STATUS_UNSUCCESSFUL;
+        const char username[] = "UserW";
+        const char password[] = "PassWord1@";
+
+        const char submissionFilePath[] = ".\\resumeData";
+        const uint64_t chunkCount = 4;
+
+        // Every chunk of the source is different, so a chunk copied to the wrong place shows
+        std::string content;
+        for (uint64_t chunk = 0; chunk < chunkCount; chunk++)
+        {
+            content += std::string(CHUNK_SIZE, static_cast<char>('a' + chunk));
+        }
+        {
+            std::ofstream data(submissionFilePath, std::ios::binary | std::ios::trunc);
+            data << content;
+        }
+
+        IO_FILE_INFO source = { 0 };
+        Assert::IsTrue(IoQueryFileInfo(submissionFilePath, &source));
+
+        status = SafeStorageHandleRegister(username,
+                                           static_cast<uint16_t>(strlen(username)),
+                                           password,
+                                           static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        status = SafeStorageHandleLogin(username,
+                                        static_cast<uint16_t>(strlen(username)),
+                                        password,
+                                        static_cast<uint16_t>(strlen(password)));
+        Assert::IsTrue(NT_SUCCESS(status));
+
+        // Leaves what an interrupted store would: a partial file of the full size that starts with the two chunks
+        // in doneContent, and a checkpoint that records them as copied
+        auto interrupt = [&](const char* submissionName, uint64_t checkpointSize, uint64_t checkpointTime, const std::string& doneContent)
+        {
+            const std::string submissionPath = std::string(".\\users\\UserW\\") + submissionName;
+            const std::string partialPath = submissionPath + "~partial";
+            const std::string checkpointPath = submissionPath + CHECKPOINT_SUFFIX;
+            {
+                std::ofstream partial(partialPath, std::ios::binary | std::ios::trunc);
+                partial << doneContent << std::string((chunkCount - 2) * CHUNK_SIZE, 'x');
+            }
+
+            SS_FILE* partial = IoOpenFile(partialPath.c_str(), IO_OPEN_WRITE);
+            Assert::IsNotNull(partial);
+            SS_CHECKPOINT* checkpoint = CheckpointCreate(checkpointPath.c_str(), checkpointSize, checkpointTime, CHUNK_SIZE);
+            Assert::IsNotNull(checkpoint);
+            CheckpointMarkChunkDone(checkpoint, 0, partial);
+            CheckpointMarkChunkDone(checkpoint, 1, partial);
+            Assert::IsTrue(CheckpointPersist(checkpoint, partial));
+            CheckpointClose(checkpoint);
+            IoCloseFile(partial);
+        };
+        auto storeAndCompare = [&](const char* submissionName)
+        {
+            NTSTATUS result = SafeStorageHandleStore(submissionName,
+                                                     static_cast<uint16_t>(strlen(submissionName)),
+                                                     submissionFilePath,
+                                                     static_cast<uint16_t>(strlen(submissionFilePath)));
+            Assert::IsTrue(NT_SUCCESS(result));
+
+            const std::string submissionPath = std::string(".\\users\\UserW\\") + submissionName;
+            std::ifstream stored(submissionPath, std::ios::binary);
+            std::string storedContent((std::istreambuf_iterator<char>(stored)), std::istreambuf_iterator<char>());
+            Assert::IsTrue(storedContent == content);
+            Assert::IsFalse(std::filesystem::exists(submissionPath + "~partial"));
+            Assert::IsFalse(std::filesystem::exists(submissionPath + CHECKPOINT_SUFFIX));
+        };
+
+        // The same source again: the chunks recorded are kept, the others copied
+        const char resumedSubmissionName[] = "Resumed";
+        interrupt(resumedSubmissionName, source.Size, source.LastWriteTime, content.substr(0, 2 * CHUNK_SIZE));
+        storeAndCompare(resumedSubmissionName);
+
+        // A checkpoint of a source with another size or last write time is discarded, and so are the
+        // chunks it records: they would otherwise end up in the submission
+        const char otherSizeSubmissionName[] = "OtherSize";
+        interrupt(otherSizeSubmissionName, source.Size + 1, source.LastWriteTime, std::string(2 * CHUNK_SIZE, 'z'));
+        storeAndCompare(otherSizeSubmissionName);
+
+        const char otherTimeSubmissionName[] = "OtherTime";
+        interrupt(otherTimeSubmissionName, source.Size, source.LastWriteTime + 1, std::string(2 * CHUNK_SIZE, 'z'));
+        storeAndCompare(otherTimeSubmissionName);
+
+        status = SafeStorageHandleLogout();
+        Assert::IsTrue(NT_SUCCESS(status));
+    };
 };
 };
\ No newline at end of file
@@ -5,14 +5,23 @@
 extern "C"
 {
     #include "includes.h"
+    #include "Autotune.h"
+    #include "Checkpoint.h"
     #include "Commands.h"
+    #include "FileIo.h"
+    #include "Trace.h"
 };
 
 #include "CppUnitTest.h"
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
 
 
 #endif  // _TEST_INCLUDES_HPP_